@@ -0,0 +1,513 @@
+﻿// Блочное сжатие текстур на CPU: BC1 (DXT1), BC3 (DXT5) и BC7 (только режим 6 - одна пара конечных
+// точек RGBA с 4-битными индексами; этого достаточно для фотографий и плавной альфы).
+// Конечные точки ищутся по главной оси цветов блока и уточняются методом наименьших квадратов,
+// индексы выбираются точным перебором палитры (SSE2 - для 4 точек блока за раз).
+// Изображение делится на полосы блоков, которые сжимаются параллельно.
+//
+// Декодеры нужны утилите для оценки качества (PSNR), OpenGL1 их не использует.
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define BC_SIMD_SSE2
+#include <emmintrin.h>
+#endif
+
+enum BlockFormat {
+    BLOCK_BC1, // RGB, 8 байт на блок 4x4 (0.5 байта на тексель)
+    BLOCK_BC3, // RGBA: BC1 для цвета + 8 байт альфы, 16 байт на блок
+    BLOCK_BC7  // RGBA, 16 байт на блок, заметно точнее BC1/BC3
+};
+
+inline int blockBytes(BlockFormat format) {
+    return format == BLOCK_BC1 ? 8 : 16;
+}
+
+inline const char* blockFormatName(BlockFormat format) {
+    return format == BLOCK_BC1 ? "bc1" : (format == BLOCK_BC3 ? "bc3" : "bc7");
+}
+
+// Переключатель SSE2 для сравнения в замерах (без SSE2 всегда скалярный путь)
+inline bool& blockCompressionSimd() {
+    static bool enabled = true;
+    return enabled;
+}
+
+// Блок 4x4 в RGBA8. За краем изображения повторяются крайние пиксели (уровни меньше 4x4).
+inline void fetchBlock(const uint8_t* pixels, int width, int height, int channels, int bx, int by, uint8_t out[64]) {
+    for (int y = 0; y < 4; ++y) {
+        int sy = std::min(by * 4 + y, height - 1);
+        for (int x = 0; x < 4; ++x) {
+            int sx = std::min(bx * 4 + x, width - 1);
+            const uint8_t* p = pixels + ((size_t)sy * width + sx) * channels;
+            uint8_t* o = out + (y * 4 + x) * 4;
+            if (channels >= 3) { o[0] = p[0]; o[1] = p[1]; o[2] = p[2]; }
+            else { o[0] = o[1] = o[2] = p[0]; }
+            o[3] = (channels == 4) ? p[3] : (channels == 2 ? p[1] : 255);
+        }
+    }
+}
+
+// Главная ось распределения точек блока: ковариационная матрица + степенной метод
+inline void principalAxis(const float points[16][4], int dims, float mean[4], float axis[4]) {
+    for (int c = 0; c < 4; ++c) mean[c] = 0.0f;
+    for (int i = 0; i < 16; ++i)
+        for (int c = 0; c < dims; ++c) mean[c] += points[i][c];
+    for (int c = 0; c < dims; ++c) mean[c] /= 16.0f;
+
+    float cov[4][4] = {};
+    for (int i = 0; i < 16; ++i) {
+        float d[4] = {};
+        for (int c = 0; c < dims; ++c) d[c] = points[i][c] - mean[c];
+        for (int a = 0; a < dims; ++a)
+            for (int b = 0; b < dims; ++b) cov[a][b] += d[a] * d[b];
+    }
+
+    float v[4] = { 1.0f, 1.0f, 1.0f, 1.0f };
+    for (int iteration = 0; iteration < 8; ++iteration) {
+        float next[4] = {};
+        for (int a = 0; a < dims; ++a)
+            for (int b = 0; b < dims; ++b) next[a] += cov[a][b] * v[b];
+        float length = 0.0f;
+        for (int c = 0; c < dims; ++c) length += next[c] * next[c];
+        if (length < 1e-12f) break; // Все точки совпадают - ось не важна
+        length = 1.0f / std::sqrt(length);
+        for (int c = 0; c < dims; ++c) v[c] = next[c] * length;
+    }
+    float length = 0.0f;
+    for (int c = 0; c < dims; ++c) length += v[c] * v[c];
+    length = 1.0f / std::sqrt(length);
+    for (int c = 0; c < 4; ++c) axis[c] = (c < dims) ? v[c] * length : 0.0f;
+}
+
+// Индекс ближайшего к каждой точке элемента палитры (palette - SoA: 4 канала по count элементов).
+// Возвращает суммарную квадратичную ошибку.
+inline float selectNearest(const float points[16][4], int dims, const float palette[4][16], int count, uint8_t indices[16]) {
+    float total = 0.0f;
+#if defined(BC_SIMD_SSE2)
+    if (blockCompressionSimd()) {
+        // 4 точки за раз: после транспонирования в регистре один канал четырех точек, поэтому элемент
+        // палитры сравнивается сразу с четырьмя без горизонтальной свертки (у BC1 всего 4 элемента).
+        // Порядок операций тот же, что в скалярном цикле, - индексы и ошибка совпадают побитно.
+        for (int i = 0; i < 16; i += 4) {
+            __m128 channel[4] = { _mm_loadu_ps(points[i]), _mm_loadu_ps(points[i + 1]), _mm_loadu_ps(points[i + 2]), _mm_loadu_ps(points[i + 3]) };
+            _MM_TRANSPOSE4_PS(channel[0], channel[1], channel[2], channel[3]);
+            __m128 best = _mm_set1_ps(3.4e38f);
+            __m128i bestIndex = _mm_setzero_si128();
+            for (int e = 0; e < count; ++e) {
+                __m128 distance = _mm_setzero_ps();
+                for (int c = 0; c < dims; ++c) {
+                    __m128 d = _mm_sub_ps(_mm_set1_ps(palette[c][e]), channel[c]);
+                    distance = _mm_add_ps(distance, _mm_mul_ps(d, d));
+                }
+                // Строго меньше: при равенстве остается меньший индекс, как в скалярном пути
+                __m128i closer = _mm_castps_si128(_mm_cmplt_ps(distance, best));
+                best = _mm_min_ps(distance, best);
+                bestIndex = _mm_or_si128(_mm_and_si128(closer, _mm_set1_epi32(e)), _mm_andnot_si128(closer, bestIndex));
+            }
+            float distances[4];
+            int32_t entries[4];
+            _mm_storeu_ps(distances, best);
+            _mm_storeu_si128((__m128i*)entries, bestIndex);
+            for (int l = 0; l < 4; ++l) {
+                indices[i + l] = (uint8_t)entries[l];
+                total += distances[l];
+            }
+        }
+        return total;
+    }
+#endif
+    for (int i = 0; i < 16; ++i) {
+        float best = 3.4e38f;
+        int bestIndex = 0;
+        for (int e = 0; e < count; ++e) {
+            float distance = 0.0f;
+            for (int c = 0; c < dims; ++c) {
+                float d = palette[c][e] - points[i][c];
+                distance += d * d;
+            }
+            if (distance < best) { best = distance; bestIndex = e; }
+        }
+        indices[i] = (uint8_t)bestIndex;
+        total += best;
+    }
+    return total;
+}
+
+// Конечные точки по методу наименьших квадратов для заданных весов (вес 1 - полностью вторая точка)
+inline bool leastSquaresEndpoints(const float points[16][4], int dims, const float weights[16], float e0[4], float e1[4]) {
+    float aa = 0.0f, ab = 0.0f, bb = 0.0f, ax[4] = {}, bx[4] = {};
+    for (int i = 0; i < 16; ++i) {
+        float b = weights[i], a = 1.0f - b;
+        aa += a * a; ab += a * b; bb += b * b;
+        for (int c = 0; c < dims; ++c) { ax[c] += a * points[i][c]; bx[c] += b * points[i][c]; }
+    }
+    float det = aa * bb - ab * ab;
+    if (std::fabs(det) < 1e-6f) return false; // Все точки с одним весом - система вырождена
+    float inv = 1.0f / det;
+    for (int c = 0; c < dims; ++c) {
+        e0[c] = std::min(std::max((ax[c] * bb - bx[c] * ab) * inv, 0.0f), 255.0f);
+        e1[c] = std::min(std::max((bx[c] * aa - ax[c] * ab) * inv, 0.0f), 255.0f);
+    }
+    return true;
+}
+
+// --- BC1 ---
+
+inline uint16_t packRGB565(const float color[3]) {
+    int r = (int)std::lround(std::min(std::max(color[0], 0.0f), 255.0f) * 31.0f / 255.0f);
+    int g = (int)std::lround(std::min(std::max(color[1], 0.0f), 255.0f) * 63.0f / 255.0f);
+    int b = (int)std::lround(std::min(std::max(color[2], 0.0f), 255.0f) * 31.0f / 255.0f);
+    return (uint16_t)((r << 11) | (g << 5) | b);
+}
+
+inline void unpackRGB565(uint16_t packed, int rgb[3]) {
+    int r = (packed >> 11) & 31, g = (packed >> 5) & 63, b = packed & 31;
+    rgb[0] = (r << 3) | (r >> 2);
+    rgb[1] = (g << 2) | (g >> 4);
+    rgb[2] = (b << 3) | (b >> 2);
+}
+
+// Палитра BC1 в 4-цветном режиме: c0, c1, 2/3 c0 + 1/3 c1, 1/3 c0 + 2/3 c1
+inline void bc1Palette(uint16_t c0, uint16_t c1, float palette[4][16]) {
+    int a[3], b[3];
+    unpackRGB565(c0, a);
+    unpackRGB565(c1, b);
+    for (int c = 0; c < 3; ++c) {
+        palette[c][0] = (float)a[c];
+        palette[c][1] = (float)b[c];
+        palette[c][2] = (float)((2 * a[c] + b[c]) / 3);
+        palette[c][3] = (float)((a[c] + 2 * b[c]) / 3);
+    }
+}
+
+inline float bc1Evaluate(const float points[16][4], uint16_t c0, uint16_t c1, uint8_t indices[16]) {
+    float palette[4][16];
+    bc1Palette(c0, c1, palette);
+    return selectNearest(points, 3, palette, 4, indices);
+}
+
+// Цветовой блок BC1 (8 байт). Всегда 4-цветный режим (c0 > c1), поэтому подходит и для BC3.
+inline void encodeBC1Block(const uint8_t rgba[64], uint8_t out[8]) {
+    float points[16][4];
+    for (int i = 0; i < 16; ++i)
+        for (int c = 0; c < 4; ++c) points[i][c] = rgba[i * 4 + c];
+
+    float mean[4], axis[4];
+    principalAxis(points, 3, mean, axis);
+    float tMin = 3.4e38f, tMax = -3.4e38f;
+    for (int i = 0; i < 16; ++i) {
+        float t = (points[i][0] - mean[0]) * axis[0] + (points[i][1] - mean[1]) * axis[1] + (points[i][2] - mean[2]) * axis[2];
+        tMin = std::min(tMin, t);
+        tMax = std::max(tMax, t);
+    }
+    // Небольшой отступ внутрь: крайние точки редко бывают точно на концах отрезка
+    float inset = (tMax - tMin) / 16.0f;
+    float e0[4], e1[4];
+    for (int c = 0; c < 3; ++c) {
+        e0[c] = mean[c] + axis[c] * (tMax - inset);
+        e1[c] = mean[c] + axis[c] * (tMin + inset);
+    }
+
+    uint16_t c0 = packRGB565(e0), c1 = packRGB565(e1);
+    uint8_t indices[16], candidate[16];
+    float error = bc1Evaluate(points, c0, c1, indices);
+
+    // Уточнение: веса индексов 0, 1, 2, 3 -> доля второй точки 0, 1, 1/3, 2/3
+    static const float weightOf[4] = { 0.0f, 1.0f, 1.0f / 3.0f, 2.0f / 3.0f };
+    for (int iteration = 0; iteration < 2 && error > 0.0f; ++iteration) {
+        float weights[16];
+        for (int i = 0; i < 16; ++i) weights[i] = weightOf[indices[i]];
+        if (!leastSquaresEndpoints(points, 3, weights, e0, e1)) break;
+        uint16_t n0 = packRGB565(e0), n1 = packRGB565(e1);
+        float candidateError = bc1Evaluate(points, n0, n1, candidate);
+        if (candidateError >= error) break;
+        c0 = n0; c1 = n1; error = candidateError;
+        memcpy(indices, candidate, 16);
+    }
+
+    // 4-цветный режим требует c0 > c1; при перестановке индексы 0<->1 и 2<->3
+    if (c0 < c1) {
+        std::swap(c0, c1);
+        for (int i = 0; i < 16; ++i) indices[i] ^= 1;
+    }
+    else if (c0 == c1) {
+        memset(indices, 0, 16);
+    }
+
+    uint32_t bits = 0;
+    for (int i = 0; i < 16; ++i) bits |= (uint32_t)indices[i] << (i * 2);
+    out[0] = (uint8_t)(c0 & 0xFF); out[1] = (uint8_t)(c0 >> 8);
+    out[2] = (uint8_t)(c1 & 0xFF); out[3] = (uint8_t)(c1 >> 8);
+    for (int i = 0; i < 4; ++i) out[4 + i] = (uint8_t)(bits >> (i * 8));
+}
+
+// --- BC3 ---
+
+// Блок альфы BC3/BC4 (8 байт): a0 = максимум, a1 = минимум, 8-уровневый режим
+inline void encodeAlphaBlock(const uint8_t rgba[64], uint8_t out[8]) {
+    int a0 = 0, a1 = 255;
+    for (int i = 0; i < 16; ++i) {
+        a0 = std::max(a0, (int)rgba[i * 4 + 3]);
+        a1 = std::min(a1, (int)rgba[i * 4 + 3]);
+    }
+    uint64_t bits = 0;
+    if (a0 > a1) {
+        int palette[8] = { a0, a1 };
+        for (int k = 1; k < 7; ++k) palette[k + 1] = ((7 - k) * a0 + k * a1) / 7;
+        for (int i = 0; i < 16; ++i) {
+            int alpha = rgba[i * 4 + 3], best = 0;
+            for (int k = 1; k < 8; ++k) {
+                if (std::abs(palette[k] - alpha) < std::abs(palette[best] - alpha)) best = k;
+            }
+            bits |= (uint64_t)best << (i * 3);
+        }
+    }
+    out[0] = (uint8_t)a0;
+    out[1] = (uint8_t)a1;
+    for (int i = 0; i < 6; ++i) out[2 + i] = (uint8_t)(bits >> (i * 8));
+}
+
+inline void encodeBC3Block(const uint8_t rgba[64], uint8_t out[16]) {
+    encodeAlphaBlock(rgba, out);
+    encodeBC1Block(rgba, out + 8);
+}
+
+// --- BC7 (режим 6) ---
+
+static const int BC7_WEIGHTS4[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+// Квантование конечной точки в 7 бит + общий p-бит: выбирается p-бит с меньшей ошибкой.
+// У непрозрачного блока (opaque) p-бит всегда 1, а альфа - 127: только так обе точки дают альфу ровно 255,
+// иначе p-бит, выгодный для RGB, оставил бы альфу 254.
+inline void bc7QuantizeEndpoint(const float endpoint[4], int quantized[4], int& pbit, bool opaque) {
+    float bestError = 3.4e38f;
+    for (int p = opaque ? 1 : 0; p < 2; ++p) {
+        int q[4];
+        float error = 0.0f;
+        for (int c = 0; c < 4; ++c) {
+            q[c] = (opaque && c == 3) ? 127 : std::min(std::max((int)std::lround((endpoint[c] - p) * 0.5f), 0), 127);
+            float d = (float)((q[c] << 1) | p) - endpoint[c];
+            error += d * d;
+        }
+        if (error < bestError) {
+            bestError = error;
+            pbit = p;
+            memcpy(quantized, q, sizeof(q));
+        }
+    }
+}
+
+inline float bc7Evaluate(const float points[16][4], const int q0[4], int p0, const int q1[4], int p1, uint8_t indices[16]) {
+    float palette[4][16];
+    for (int c = 0; c < 4; ++c) {
+        int v0 = (q0[c] << 1) | p0, v1 = (q1[c] << 1) | p1;
+        for (int k = 0; k < 16; ++k) {
+            palette[c][k] = (float)(((64 - BC7_WEIGHTS4[k]) * v0 + BC7_WEIGHTS4[k] * v1 + 32) >> 6);
+        }
+    }
+    return selectNearest(points, 4, palette, 16, indices);
+}
+
+// Запись битов младшими вперед
+struct BitWriter {
+    uint8_t* out;
+    int position = 0;
+    void write(uint32_t value, int count) {
+        for (int i = 0; i < count; ++i, ++position) {
+            if ((value >> i) & 1) out[position >> 3] |= (uint8_t)(1 << (position & 7));
+        }
+    }
+};
+
+inline void encodeBC7Block(const uint8_t rgba[64], uint8_t out[16]) {
+    float points[16][4];
+    bool opaque = true;
+    for (int i = 0; i < 16; ++i) {
+        for (int c = 0; c < 4; ++c) points[i][c] = rgba[i * 4 + c];
+        opaque = opaque && rgba[i * 4 + 3] == 255;
+    }
+
+    float mean[4], axis[4];
+    principalAxis(points, 4, mean, axis);
+    float tMin = 3.4e38f, tMax = -3.4e38f;
+    for (int i = 0; i < 16; ++i) {
+        float t = 0.0f;
+        for (int c = 0; c < 4; ++c) t += (points[i][c] - mean[c]) * axis[c];
+        tMin = std::min(tMin, t);
+        tMax = std::max(tMax, t);
+    }
+    float e0[4], e1[4];
+    for (int c = 0; c < 4; ++c) {
+        e0[c] = std::min(std::max(mean[c] + axis[c] * tMin, 0.0f), 255.0f);
+        e1[c] = std::min(std::max(mean[c] + axis[c] * tMax, 0.0f), 255.0f);
+    }
+
+    int q0[4], q1[4], p0 = 0, p1 = 0;
+    bc7QuantizeEndpoint(e0, q0, p0, opaque);
+    bc7QuantizeEndpoint(e1, q1, p1, opaque);
+    uint8_t indices[16], candidate[16];
+    float error = bc7Evaluate(points, q0, p0, q1, p1, indices);
+
+    for (int iteration = 0; iteration < 2 && error > 0.0f; ++iteration) {
+        float weights[16];
+        for (int i = 0; i < 16; ++i) weights[i] = BC7_WEIGHTS4[indices[i]] / 64.0f;
+        if (!leastSquaresEndpoints(points, 4, weights, e0, e1)) break;
+        int n0[4], n1[4], np0 = 0, np1 = 0;
+        bc7QuantizeEndpoint(e0, n0, np0, opaque);
+        bc7QuantizeEndpoint(e1, n1, np1, opaque);
+        float candidateError = bc7Evaluate(points, n0, np0, n1, np1, candidate);
+        if (candidateError >= error) break;
+        memcpy(q0, n0, sizeof(q0)); memcpy(q1, n1, sizeof(q1));
+        p0 = np0; p1 = np1; error = candidateError;
+        memcpy(indices, candidate, 16);
+    }
+
+    // Старший бит индекса первого пикселя не хранится и должен быть 0 - иначе меняем точки местами
+    if (indices[0] & 8) {
+        std::swap(q0, q1);
+        std::swap(p0, p1);
+        for (int i = 0; i < 16; ++i) indices[i] = (uint8_t)(15 - indices[i]);
+    }
+
+    memset(out, 0, 16);
+    BitWriter writer = { out };
+    writer.write(1u << 6, 7); // Режим 6
+    for (int c = 0; c < 4; ++c) {
+        writer.write((uint32_t)q0[c], 7);
+        writer.write((uint32_t)q1[c], 7);
+    }
+    writer.write((uint32_t)p0, 1);
+    writer.write((uint32_t)p1, 1);
+    writer.write(indices[0], 3);
+    for (int i = 1; i < 16; ++i) writer.write(indices[i], 4);
+}
+
+// --- Декодеры (для оценки качества) ---
+
+inline void decodeBC1Block(const uint8_t in[8], uint8_t rgba[64], bool forceFourColor = false) {
+    uint16_t c0 = (uint16_t)(in[0] | (in[1] << 8)), c1 = (uint16_t)(in[2] | (in[3] << 8));
+    int a[3], b[3], palette[4][4];
+    unpackRGB565(c0, a);
+    unpackRGB565(c1, b);
+    bool fourColor = forceFourColor || c0 > c1;
+    for (int c = 0; c < 3; ++c) {
+        palette[0][c] = a[c];
+        palette[1][c] = b[c];
+        palette[2][c] = fourColor ? (2 * a[c] + b[c]) / 3 : (a[c] + b[c]) / 2;
+        palette[3][c] = fourColor ? (a[c] + 2 * b[c]) / 3 : 0;
+    }
+    palette[0][3] = palette[1][3] = palette[2][3] = 255;
+    palette[3][3] = fourColor ? 255 : 0;
+    uint32_t bits = in[4] | (in[5] << 8) | (in[6] << 16) | ((uint32_t)in[7] << 24);
+    for (int i = 0; i < 16; ++i) {
+        int index = (bits >> (i * 2)) & 3;
+        for (int c = 0; c < 4; ++c) rgba[i * 4 + c] = (uint8_t)palette[index][c];
+    }
+}
+
+inline void decodeBC3Block(const uint8_t in[16], uint8_t rgba[64]) {
+    decodeBC1Block(in + 8, rgba, true);
+    int a0 = in[0], a1 = in[1], palette[8] = { a0, a1 };
+    if (a0 > a1) {
+        for (int k = 1; k < 7; ++k) palette[k + 1] = ((7 - k) * a0 + k * a1) / 7;
+    }
+    else {
+        for (int k = 1; k < 5; ++k) palette[k + 1] = ((5 - k) * a0 + k * a1) / 5;
+        palette[6] = 0;
+        palette[7] = 255;
+    }
+    uint64_t bits = 0;
+    for (int i = 0; i < 6; ++i) bits |= (uint64_t)in[2 + i] << (i * 8);
+    for (int i = 0; i < 16; ++i) rgba[i * 4 + 3] = (uint8_t)palette[(bits >> (i * 3)) & 7];
+}
+
+// Только режим 6 (другие режимы этот кодировщик не создает); чужой блок декодируется в пурпурный
+inline void decodeBC7Block(const uint8_t in[16], uint8_t rgba[64]) {
+    auto read = [in](int& position, int count) {
+        uint32_t value = 0;
+        for (int i = 0; i < count; ++i, ++position) value |= (uint32_t)((in[position >> 3] >> (position & 7)) & 1) << i;
+        return value;
+    };
+    int position = 0;
+    if (read(position, 7) != (1u << 6)) {
+        for (int i = 0; i < 16; ++i) { rgba[i * 4] = 255; rgba[i * 4 + 1] = 0; rgba[i * 4 + 2] = 255; rgba[i * 4 + 3] = 255; }
+        return;
+    }
+    int q[2][4];
+    for (int c = 0; c < 4; ++c) {
+        q[0][c] = (int)read(position, 7);
+        q[1][c] = (int)read(position, 7);
+    }
+    int p0 = (int)read(position, 1), p1 = (int)read(position, 1);
+    for (int i = 0; i < 16; ++i) {
+        int index = (int)read(position, i == 0 ? 3 : 4);
+        for (int c = 0; c < 4; ++c) {
+            int v0 = (q[0][c] << 1) | p0, v1 = (q[1][c] << 1) | p1;
+            rgba[i * 4 + c] = (uint8_t)(((64 - BC7_WEIGHTS4[index]) * v0 + BC7_WEIGHTS4[index] * v1 + 32) >> 6);
+        }
+    }
+}
+
+// --- Изображение целиком ---
+
+// Сжимает изображение в blocksX * blocksY блоков (строки блоков подряд), полосы блоков - в threadCount потоках
+inline std::vector<uint8_t> compressImage(BlockFormat format, const uint8_t* pixels, int width, int height, int channels, int threadCount) {
+    const int blocksX = (width + 3) / 4, blocksY = (height + 3) / 4;
+    const int bytes = blockBytes(format);
+    std::vector<uint8_t> out((size_t)blocksX * blocksY * bytes);
+
+    auto compressRows = [&](int firstRow, int lastRow) {
+        uint8_t block[64];
+        for (int by = firstRow; by < lastRow; ++by) {
+            for (int bx = 0; bx < blocksX; ++bx) {
+                fetchBlock(pixels, width, height, channels, bx, by, block);
+                uint8_t* dst = &out[((size_t)by * blocksX + bx) * bytes];
+                if (format == BLOCK_BC1) encodeBC1Block(block, dst);
+                else if (format == BLOCK_BC3) encodeBC3Block(block, dst);
+                else encodeBC7Block(block, dst);
+            }
+        }
+    };
+
+    threadCount = std::max(1, std::min(threadCount, blocksY));
+    if (threadCount == 1) {
+        compressRows(0, blocksY);
+        return out;
+    }
+    std::vector<std::thread> workers;
+    int rowsPerThread = (blocksY + threadCount - 1) / threadCount;
+    for (int first = 0; first < blocksY; first += rowsPerThread) {
+        workers.emplace_back(compressRows, first, std::min(first + rowsPerThread, blocksY));
+    }
+    for (std::thread& worker : workers) worker.join();
+    return out;
+}
+
+// Обратное преобразование в RGBA8 (width x height)
+inline std::vector<uint8_t> decompressImage(BlockFormat format, const uint8_t* blocks, int width, int height) {
+    const int blocksX = (width + 3) / 4, blocksY = (height + 3) / 4;
+    const int bytes = blockBytes(format);
+    std::vector<uint8_t> rgba((size_t)width * height * 4);
+    uint8_t block[64];
+    for (int by = 0; by < blocksY; ++by) {
+        for (int bx = 0; bx < blocksX; ++bx) {
+            const uint8_t* src = blocks + ((size_t)by * blocksX + bx) * bytes;
+            if (format == BLOCK_BC1) decodeBC1Block(src, block);
+            else if (format == BLOCK_BC3) decodeBC3Block(src, block);
+            else decodeBC7Block(src, block);
+            for (int y = 0; y < 4 && by * 4 + y < height; ++y) {
+                for (int x = 0; x < 4 && bx * 4 + x < width; ++x) {
+                    memcpy(&rgba[(((size_t)by * 4 + y) * width + bx * 4 + x) * 4], &block[(y * 4 + x) * 4], 4);
+                }
+            }
+        }
+    }
+    return rgba;
+}
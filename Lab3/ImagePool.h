@@ -0,0 +1,134 @@
+﻿// Пул памяти для stb_image: подключается до stb_image.h через STBI_MALLOC / STBI_REALLOC / STBI_FREE.
+// Освобожденные блоки не возвращаются в кучу, а достаются следующим декодированиям (наименьший
+// подходящий по размеру, но не больше чем вдвое), поэтому после первых изображений декодер больше не вызывает malloc.
+// Счетчики показывают, сколько запросов пришло и сколько из них дошло до кучи.
+//
+//   #include "ImagePool.h"
+//   #define STBI_MALLOC(size) imagePoolAlloc(size)
+//   #define STBI_REALLOC(p, size) imagePoolRealloc(p, size)
+//   #define STBI_FREE(p) imagePoolFree(p)
+//   #include "stb_image.h"
+#pragma once
+
+#include <cstdlib>
+#include <cstring>
+#include <cstddef>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+const size_t IMAGE_POOL_MAX_BYTES = 512u << 20; // Сверх этого освобожденные блоки уходят обратно в кучу
+const size_t IMAGE_POOL_MIN_BLOCK = 64;
+const size_t IMAGE_POOL_MAX_SLACK = 2; // Блок отдается запросу, только если он не больше чем в столько раз
+
+// Заголовок перед данными блока; 16 байт сохраняют выравнивание malloc
+struct ImagePoolBlock {
+    size_t capacity;
+    size_t reserved;
+};
+
+struct ImagePoolStats {
+    size_t requests;        // Вызовы STBI_MALLOC / STBI_REALLOC
+    size_t heapAllocations; // Из них обращений к malloc
+    size_t pooledBytes;     // Сейчас лежит в пуле
+};
+
+struct ImagePool {
+    std::mutex mutex;
+    std::vector<ImagePoolBlock*> freeBlocks;
+    size_t pooledBytes = 0;
+    bool enabled = true;
+    std::atomic<size_t> requests{ 0 };
+    std::atomic<size_t> heapAllocations{ 0 };
+
+    ~ImagePool() {
+        for (ImagePoolBlock* block : freeBlocks) free(block);
+    }
+};
+
+inline ImagePool& imagePool() {
+    static ImagePool pool;
+    return pool;
+}
+
+inline void* imagePoolAlloc(size_t size) {
+    ImagePool& pool = imagePool();
+    pool.requests.fetch_add(1, std::memory_order_relaxed);
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        if (pool.enabled) {
+            // Наименьший подходящий блок, но не крупнее запроса более чем в IMAGE_POOL_MAX_SLACK раз: иначе мелкий
+            // запрос забрал бы буфер целого изображения, и следующему изображению пришлось бы снова идти в malloc
+            const size_t limit = (size < IMAGE_POOL_MIN_BLOCK ? IMAGE_POOL_MIN_BLOCK : size) * IMAGE_POOL_MAX_SLACK;
+            size_t best = pool.freeBlocks.size();
+            for (size_t i = 0; i < pool.freeBlocks.size(); ++i) {
+                size_t capacity = pool.freeBlocks[i]->capacity;
+                if (capacity >= size && capacity <= limit && (best == pool.freeBlocks.size() || capacity < pool.freeBlocks[best]->capacity)) best = i;
+            }
+            if (best != pool.freeBlocks.size()) {
+                ImagePoolBlock* block = pool.freeBlocks[best];
+                pool.freeBlocks[best] = pool.freeBlocks.back();
+                pool.freeBlocks.pop_back();
+                pool.pooledBytes -= block->capacity;
+                return block + 1;
+            }
+        }
+    }
+    size_t capacity = size < IMAGE_POOL_MIN_BLOCK ? IMAGE_POOL_MIN_BLOCK : size;
+    ImagePoolBlock* block = (ImagePoolBlock*)malloc(sizeof(ImagePoolBlock) + capacity);
+    if (!block) return nullptr;
+    pool.heapAllocations.fetch_add(1, std::memory_order_relaxed);
+    block->capacity = capacity;
+    return block + 1;
+}
+
+inline void imagePoolFree(void* p) {
+    if (!p) return;
+    ImagePool& pool = imagePool();
+    ImagePoolBlock* block = (ImagePoolBlock*)p - 1;
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        if (pool.enabled && pool.pooledBytes + block->capacity <= IMAGE_POOL_MAX_BYTES) {
+            pool.freeBlocks.push_back(block);
+            pool.pooledBytes += block->capacity;
+            return;
+        }
+    }
+    free(block);
+}
+
+inline void* imagePoolRealloc(void* p, size_t size) {
+    if (!p) return imagePoolAlloc(size);
+    ImagePoolBlock* block = (ImagePoolBlock*)p - 1;
+    if (block->capacity >= size) {
+        imagePool().requests.fetch_add(1, std::memory_order_relaxed);
+        return p;
+    }
+    void* grown = imagePoolAlloc(size);
+    if (!grown) return nullptr;
+    memcpy(grown, p, block->capacity);
+    imagePoolFree(p);
+    return grown;
+}
+
+// Возвращает в кучу все блоки пула (например, когда текстуры загружены)
+inline void imagePoolTrim() {
+    ImagePool& pool = imagePool();
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    for (ImagePoolBlock* block : pool.freeBlocks) free(block);
+    pool.freeBlocks.clear();
+    pool.pooledBytes = 0;
+}
+
+// Выключенный пул пропускает все запросы в кучу - для сравнения в замерах
+inline void imagePoolSetEnabled(bool enabled) {
+    if (!enabled) imagePoolTrim();
+    std::lock_guard<std::mutex> lock(imagePool().mutex);
+    imagePool().enabled = enabled;
+}
+
+inline ImagePoolStats imagePoolStats() {
+    ImagePool& pool = imagePool();
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    return { pool.requests.load(std::memory_order_relaxed), pool.heapAllocations.load(std::memory_order_relaxed), pool.pooledBytes };
+}
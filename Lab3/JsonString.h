@@ -0,0 +1,25 @@
+﻿// Строковое значение JSON для отчетов OpenGL1 и TextureCooker (--bench-output, --bench*, --selftest).
+#pragma once
+
+#include <cstdio>
+#include <string>
+
+// Значение в кавычках: пути Windows и строки драйвера могут содержать '\' и '"', управляющие символы - в виде \u00XX
+inline std::string jsonString(const std::string& value) {
+    std::string out = "\"";
+    for (char c : value) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        }
+        else if ((unsigned char)c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", (unsigned char)c);
+            out += escaped;
+        }
+        else {
+            out += c;
+        }
+    }
+    return out + "\"";
+}
@@ -1,16 +1,58 @@
 ﻿#define STB_IMAGE_IMPLEMENTATION 
+#define STBI_JPEG_THREADS
+#define STBI_FAST_INFLATE
+#include "ImagePool.h"
+#define STBI_MALLOC(size) imagePoolAlloc(size) // Рабочая память декодера переиспользуется между изображениями
+#define STBI_REALLOC(p, size) imagePoolRealloc(p, size)
+#define STBI_FREE(p) imagePoolFree(p)
 #include "stb_image.h"         
+#include "TextureContainer.h"
+#include "JsonString.h"
 
 #include <iostream>
 #include <vector>
-#include <string> 
+#include <string>
 #include <cmath>
+#include <chrono>
+#include <fstream>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <sstream>
+#include <thread>
+#include <cstdint>
+#include <cstddef>
+#include <climits>
+#include <filesystem>
+#include <atomic>
+#include <deque>
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 
+// Безоконный (headless) режим: контекст EGL без поверхности (Mesa llvmpipe и т.п.)
+#if defined(__linux__)
+#define HEADLESS_EGL_SUPPORTED
+#define EGL_NO_X11 // Не тянем заголовки X11 - дисплей не нужен
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+// SIMD-генератор сетки поверхности: SSE2 - базовый уровень на x86, AVX2+FMA выбирается во время выполнения
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define MESH_SIMD_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define TARGET_AVX2
+#else
+#define TARGET_AVX2 __attribute__((target("avx2,fma")))
+#endif
+#endif
+
 using namespace std;
 
 // В программе реализована следующая интерактивность:
@@ -18,6 +60,42 @@ using namespace std;
 //  Поворот камеры на стрелочки ВВЕРХ/ВНИЗ/ВЛЕВО/ВПРАВО
 //  Вращение поверхности на F
 //  Изменение коэффициента смешивания текстур: Q / E
+//  Переключение адаптивной тесселяции: T
+//  Отсечение патчей по пирамиде видимости: C, по нормалям (задние грани): B
+//
+// Параметры командной строки:
+//  --headless           рендер без окна в FBO (EGL surfaceless / pbuffer)
+//  --frames N           число кадров в безоконном режиме (по умолчанию 1)
+//  --output DIR         каталог для сохранения кадров (PPM); без него кадры не пишутся
+//  --size WxH           размер кадра в безоконном режиме
+//  --bench N            замер N кадров по фиксированной траектории камеры (VSync выключен), отчет в JSON
+//  --bench-output FILE  файл для JSON-отчета (по умолчанию - стандартный вывод)
+//  --grid N             размер сетки поверхности NxN (по умолчанию GRID_SIZE)
+//  --bench-mesh N       сравнить скалярный и параллельный SIMD генератор сетки NxN (без OpenGL), отчет в JSON
+//  --vertex-format F    формат VBO: float (32 байта на вершину), packed (8 байт: half-высота + октаэдрическая нормаль)
+//                       или procedural (VBO нет, вершина целиком вычисляется в шейдере по gl_VertexID)
+//  --displacement M     analytic (по умолчанию): тесселяционный шейдер вычисляет высоту и нормаль поверхности
+//                       в каждой новой вершине, поэтому достаточно грубой сетки (например, --grid 8);
+//                       interpolated: вершины патча только линейно интерполируются, как раньше
+//  --tess M             fixed (по умолчанию): уровни TESS_LEVEL_INNER/OUTER для всех патчей;
+//                       adaptive: уровень каждого ребра по его длине на экране в пикселях
+//  --tess-pixels P      желаемая длина ребра треугольника на экране для адаптивной тесселяции
+//  --cull on|off        отсечение невидимых патчей в TCS до тесселяции (по умолчанию on)
+//  --backface-cull      дополнительно отсекать патчи, все нормали которых смотрят от камеры
+//  --terrain SIZE       вместо поверхности рисовать ландшафт SIZE x SIZE единиц из чанков с LOD (CDLOD);
+//                       параметры сетки, формата вершин и тесселяции в этом режиме не используются
+//  --instances N        поле из N экземпляров поверхности, рисуется за один вызов (по умолчанию 1)
+//  --gpu-culling on|off  on (по умолчанию): экземпляры отсекаются compute-шейдером и рисуются одним
+//                       glMultiDrawElementsIndirect (нужен GL 4.3); off: один glDrawElementsInstanced без отсечения
+//  --state-cache on|off  пропускать привязки программы, VAO, текстур и буферов, которые уже действуют (по умолчанию on);
+//                       число вызовов до и после кэша - в отчете --bench (gl_state_calls)
+//  --shader-cache on|off  кэш двоичных программ в каталоге shader_cache (по умолчанию on)
+//  --textures async|sync  декодирование текстур в фоновых потоках с заглушкой до готовности (по умолчанию async)
+//  --cooked-textures on|off  брать готовые мип-уровни из .ctex рядом с изображением (по умолчанию on; см. TextureCooker)
+//  --texture-dir DIR    каталог с cat.jpg и amogus.png (и их .ctex); без него файлы ищутся в рабочем каталоге,
+//                       затем рядом с исполняемым файлом
+//  --texture-io mmap|stdio  mmap: файл изображения отображается в память и декодируется прямо из нее (по умолчанию);
+//                       stdio: stbi_load читает файл через FILE* маленькими порциями
 
 // --- Глобальные настройки ---
 
@@ -31,10 +109,66 @@ const int GRID_SIZE = 63; // 64x64 patches
 const float PLANE_SIZE = 4.0f; // Размер квадратной плоскости (от -PLANE_SIZE/2 до +PLANE_SIZE/2)
 const float SIN_AMPLITUDE = 0.2f; // Амплитуда синусоиды
 const float SIN_FREQUENCY = glm::pi<float>() * 2.0f; // Частота синусоиды
+// Поверхность не выходит за |z| <= этой границы: ее используют и отсечение патчей, и отсечение экземпляров
+const float SURFACE_CULL_Z_BOUND = SIN_AMPLITUDE;
+int g_gridSize = GRID_SIZE; // Фактический размер сетки (--grid)
+const float INSTANCE_SPACING = PLANE_SIZE * 1.25f; // Шаг сетки экземпляров поверхности
+int g_instanceCount = 1; // --instances
+bool g_gpuCulling = true; // --gpu-culling
+int g_benchMeshGridSize = 0; // --bench-mesh: 0 - обычный режим
+
+// Формат вершин поверхности
+enum VertexFormat {
+    VERTEX_FORMAT_FLOAT,  // pos (3) + normal (3) + texcoord (2) во float - 32 байта
+    VERTEX_FORMAT_PACKED, // нормаль (2 x snorm16, октаэдрическая) + высота (half) - 8 байт; x, y, u, v из gl_VertexID
+    VERTEX_FORMAT_PROCEDURAL // VBO нет: позиция, текстурные координаты и нормаль вычисляются из gl_VertexID
+};
+VertexFormat g_vertexFormat = VERTEX_FORMAT_FLOAT;
+bool g_analyticDisplacement = true; // Аналитическое смещение вершин в TES (--displacement)
 
 // Параметры тесселяции
 const float TESS_LEVEL_INNER = (float)GRID_SIZE / 4.0f; // Уровень внутренней тесселяции
 const float TESS_LEVEL_OUTER = (float)GRID_SIZE / 4.0f; // Уровень внешней тесселяции
+const float TESS_TARGET_PIXELS = 8.0f; // Желаемая длина ребра в пикселях для адаптивной тесселяции
+bool g_adaptiveTess = false; // Адаптивная тесселяция по размеру ребер на экране (--tess, клавиша T)
+float g_tessTargetPixels = TESS_TARGET_PIXELS;
+GLint g_maxTessLevel = 64; // Уточняется по GL_MAX_TESS_GEN_LEVEL
+
+// Отсечение патчей в TCS (уровни тесселяции 0 - патч отбрасывается до тесселятора)
+const int PATCH_COUNTER_RING = 3; // Счетчик читается с задержкой в 2 кадра, чтобы не ждать GPU
+bool g_cullPatches = true; // По пирамиде видимости (--cull, клавиша C)
+bool g_backfaceCullPatches = false; // По конусу нормалей (--backface-cull, клавиша B)
+bool g_patchCounterSupported = false; // Атомарные счетчики в TCS (GL 4.2 / ARB_shader_atomic_counters)
+bool g_memoryBarrierSupported = false; // glMemoryBarrier (GL 4.2 / ARB_shader_image_load_store)
+GLuint g_patchCounterBuffers[PATCH_COUNTER_RING] = {};
+GLint64 g_culledPatches = -1; // Отсечено патчей в последнем прочитанном кадре (-1 - нет данных)
+unsigned int g_frameIndex = 0;
+
+// Параметры ландшафта (--terrain): квадродерево чанков с непрерывным LOD
+const int TERRAIN_CHUNK_GRID = 32; // Клеток на сторону чанка (четное - сетка делится на 4 квадранта)
+const int TERRAIN_MAX_LODS = 16;
+const float TERRAIN_LEAF_SIZE = 16.0f; // Желаемый размер чанка самого детального уровня
+const float TERRAIN_LOD_RANGE_FACTOR = 3.0f; // Дальность уровня = размер его чанка * фактор
+const float TERRAIN_MORPH_START = 0.7f; // Доля диапазона уровня, с которой начинается геоморфинг
+const float TERRAIN_SIN_AMPLITUDE = 6.0f;
+const float TERRAIN_SIN_FREQUENCY = glm::two_pi<float>() / 80.0f; // Период волн 80 единиц
+const float TERRAIN_TEXTURE_TILE = 8.0f; // Размер повторения текстуры в единицах
+const glm::vec3 TERRAIN_SPECULAR = glm::vec3(0.2f); // Матовее поверхности: свет почти направленный
+const float TERRAIN_SHININESS = 32.0f;
+const float TERRAIN_CAMERA_HEIGHT = 20.0f;
+const float TERRAIN_CAMERA_SPEED = 40.0f;
+const float TERRAIN_NEAR_PLANE = 0.5f;
+const float CAMERA_NEAR_PLANE = 0.1f;
+const float CAMERA_FAR_PLANE = 100.0f;
+float g_terrainSize = 0.0f; // 0 - обычная поверхность
+
+// Кэш двоичных шейдерных программ (glGetProgramBinary / glProgramBinary)
+const char* SHADER_CACHE_DIR = "shader_cache";
+const uint32_t SHADER_CACHE_MAGIC = 0x42505347; // "GSPB"
+bool g_shaderCache = true; // --shader-cache
+
+// Кэш состояния GL: повторные привязки того же объекта не доходят до драйвера
+bool g_renderStateCache = true; // --state-cache
 
 // Параметры освещения (Блинн-Фонг)
 const glm::vec3 LIGHT_POS = glm::vec3(3.0f, 3.0f, 3.0f);
@@ -45,10 +179,17 @@ const glm::vec3 MATERIAL_SPECULAR = glm::vec3(0.9f, 0.9f, 0.9f); // Цвет б
 const float MATERIAL_SHININESS = 1.0f; // Экспонента блеска 
 
 // Параметры текстур
-const std::string TEXTURE_PATH_1 = "C:\\Users\\UTAI Jr\\source\\repos\\OpenGL1\\OpenGL1\\cat.jpg"; // Путь к первой текстуре
-const std::string TEXTURE_PATH_2 = "C:\\Users\\UTAI Jr\\source\\repos\\OpenGL1\\OpenGL1\\amogus.png"; // Путь к второй текстуре
+const char* TEXTURE_FILE_1 = "cat.jpg"; // Первая текстура
+const char* TEXTURE_FILE_2 = "amogus.png"; // Вторая текстура
+std::string g_textureDir; // --texture-dir; пусто - рабочий каталог, затем каталог исполняемого файла
+std::string g_texturePath1, g_texturePath2; // Пути к текстурам после resolveTexturePath
 float g_blendFactor = 0.0f; // Коэффициент смешивания текстур
 float g_blendFactorChangeSpeed = 0.5f; // Скорость изменения коэффициента смешивания
+const size_t TEXTURE_STAGING_SIZE = 32u << 20; // Кольцевой PBO для загрузки текстур (больше - напрямую)
+bool g_asyncTextures = true; // --textures
+bool g_cookedTextures = true; // --cooked-textures
+bool g_mappedTextureIO = true; // --texture-io
+GLuint g_texturePbo = 0; // Синхронная загрузка: PBO, в который декодируется изображение
 
 // Параметры преобразований модели
 glm::vec3 g_modelTranslation = glm::vec3(0.0f, 0.0f, 0.0f); // Смещение модели
@@ -78,41 +219,77 @@ float sensitivity = 80.0f; // Чувствительность поворота
 bool g_rotate = false;
 float g_objectRotationSpeedRad = glm::radians(45.0f); // Скорость вращения объекта (радиан в секунду)
 
+// Размер кадра (в оконном режиме обновляется из GLFW каждый кадр)
+int g_framebufferWidth = WINDOW_WIDTH;
+int g_framebufferHeight = WINDOW_HEIGHT;
+
+// Параметры безоконного режима
+const int HEADLESS_SAMPLES = 4; // MSAA, как и у окна
+const float HEADLESS_FRAME_TIME = 1.0f / 60.0f; // Фиксированный шаг времени - кадры детерминированы
+bool g_headless = false;
+int g_headlessFrames = 1;
+std::string g_headlessOutputDir; // Пусто - кадры не сохраняются
+
+// Параметры замера производительности (--bench)
+const int BENCH_WARMUP_FRAMES = 10; // Кадры прогрева, не входят в статистику
+const int BENCH_QUERY_LATENCY = 4; // Глубина кольца запросов: результаты читаются с задержкой, без остановки конвейера
+const float BENCH_CAMERA_RADIUS = 7.0f; // Радиус облета поверхности
+int g_benchFrames = 0; // 0 - обычный режим
+std::string g_benchOutputPath; // Пусто - отчет в стандартный вывод
+
 
 // --- Структура для объекта OpenGL ---
 GLFWwindow* g_window = nullptr;
 
+// Контекст и FBO безоконного режима
+#ifdef HEADLESS_EGL_SUPPORTED
+EGLDisplay g_eglDisplay = EGL_NO_DISPLAY;
+EGLContext g_eglContext = EGL_NO_CONTEXT;
+EGLSurface g_eglSurface = EGL_NO_SURFACE; // Используется только если нет EGL_KHR_surfaceless_context
+#endif
+
+struct OffscreenTarget {
+    GLuint fbo = 0, colorRbo = 0, depthRbo = 0; // Мультисемпловый буфер, в который рисует draw()
+    GLuint resolveFbo = 0, resolveRbo = 0; // Одновыборочная копия для glReadPixels
+    int width = 0, height = 0;
+};
+
+OffscreenTarget g_offscreen;
+
 struct Object {
     GLuint vbo = 0, ibo = 0, vao = 0;
     GLsizei indexCount = 0;
     GLuint shaderProgram = 0;
     GLuint texture1 = 0; // ID текстуры 1
     GLuint texture2 = 0; // ID текстуры 2
-
-    // Uniform locations
-    GLint u_Model = -1;
-    GLint u_NormalMatrix = -1;
-    GLint u_VP = -1; // View * Projection matrix
-    GLint u_LightPos = -1;
-    GLint u_ViewPos = -1;
-
-    GLint u_AmbientColor = -1;
-    // GLint u_DiffuseColor = -1; // Удалено, так как диффузный цвет теперь из текстур
-    GLint u_SpecularColor = -1;
-    GLint u_Shininess = -1;
-    GLint u_LightColor = -1;
-
-    GLint u_TessLevelInner = -1;
-    GLint u_TessLevelOuter = -1;
-
-    // Новые Uniform locations для текстур и смешивания
-    GLint u_Texture1 = -1;
-    GLint u_Texture2 = -1;
-    GLint u_BlendFactor = -1;
+    // Параметры шейдера передаются uniform-блоками (см. "Uniform-буферы"), отдельных location нет
 };
 
 Object g_object;
 
+// --- Сцена: экземпляры поверхности ---
+// Все экземпляры рисуются за один вызов по общей сетке патчей. Атрибуты экземпляра лежат
+// в отдельном VBO с делителем 1 и проходят через VS в TCS/TES: экземпляр ставится поверх модельной матрицы,
+// worldPos = смещение + масштаб * (u_model * p). Масштаб равномерный, поэтому матрица нормалей общая.
+// Пара текстур экземпляра - два слоя массива материалов, поэтому разные пары не разбивают вызов.
+// Тот же буфер читает compute-шейдер отсечения как SSBO, поэтому структура выровнена по std430 (32 байта).
+struct SurfaceInstance {
+    glm::vec4 offsetScale; // xyz - смещение в мировом пространстве, w - масштаб
+    float blendOffset; // Прибавляется к g_blendFactor (Q / E), сумма ограничивается [0, 1]
+    GLuint layers[2]; // Слои массива материалов для первой и второй текстуры смешивания
+    float padding;
+};
+
+static_assert(sizeof(SurfaceInstance) == 32, "std430 layout");
+
+struct Scene {
+    std::vector<SurfaceInstance> instances;
+    GLuint instanceVbo = 0;
+    float extent = 0.0f; // Расстояние от центра до самого дальнего экземпляра по X или Y
+};
+
+Scene g_scene;
+
 
 // --- Функции компиляции шейдеров ---
 GLuint createShader(const GLchar* code, GLenum type) {
@@ -128,7 +305,7 @@ GLuint createShader(const GLchar* code, GLenum type) {
         if (len > 1) {
             std::vector<char> log(len);
             glGetShaderInfoLog(id, len, NULL, log.data());
-            cerr << "Shader compile error (" << (type == GL_VERTEX_SHADER ? "Vertex" : (type == GL_FRAGMENT_SHADER ? "Fragment" : (type == GL_TESS_CONTROL_SHADER ? "Tess Control" : (type == GL_TESS_EVALUATION_SHADER ? "Tess Eval" : "Unknown")))) << "):" << endl << log.data() << endl;
+            cerr << "Shader compile error (" << (type == GL_VERTEX_SHADER ? "Vertex" : (type == GL_FRAGMENT_SHADER ? "Fragment" : (type == GL_TESS_CONTROL_SHADER ? "Tess Control" : (type == GL_TESS_EVALUATION_SHADER ? "Tess Eval" : (type == GL_COMPUTE_SHADER ? "Compute" : "Unknown"))))) << "):" << endl << log.data() << endl;
         }
         else {
             cerr << "Shader compile error: No info log available." << endl;
@@ -139,20 +316,24 @@ GLuint createShader(const GLchar* code, GLenum type) {
     return id;
 }
 
-GLuint createProgram(GLuint vS, GLuint tcS, GLuint teS, GLuint fS) {
+// Нулевые стадии пропускаются: compute-программа собирается как createProgram(0, 0, 0, 0, cS)
+GLuint createProgram(GLuint vS, GLuint tcS, GLuint teS, GLuint fS, GLuint cS = 0) {
     GLuint id = glCreateProgram();
-    glAttachShader(id, vS);
+    if (g_shaderCache) {
+        glProgramParameteri(id, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE); // До линковки
+    }
+    if (vS) glAttachShader(id, vS);
     if (tcS) glAttachShader(id, tcS);
     if (teS) glAttachShader(id, teS);
-    glAttachShader(id, fS);
+    if (fS) glAttachShader(id, fS);
+    if (cS) glAttachShader(id, cS);
     glLinkProgram(id);
 
-    glDetachShader(id, vS);
-    glDeleteShader(vS);
+    if (vS) { glDetachShader(id, vS); glDeleteShader(vS); }
     if (tcS) { glDetachShader(id, tcS); glDeleteShader(tcS); }
     if (teS) { glDetachShader(id, teS); glDeleteShader(teS); }
-    glDetachShader(id, fS);
-    glDeleteShader(fS);
+    if (fS) { glDetachShader(id, fS); glDeleteShader(fS); }
+    if (cS) { glDetachShader(id, cS); glDeleteShader(cS); }
 
 
     GLint linked;
@@ -168,132 +349,1592 @@ GLuint createProgram(GLuint vS, GLuint tcS, GLuint teS, GLuint fS) {
         else {
             cerr << "Program link error: No info log available." << endl;
         }
-        glDeleteProgram(id);
-        return 0;
+        glDeleteProgram(id);
+        return 0;
+    }
+    return id;
+}
+
+// --- Кэш двоичных программ ---
+// Ключ - хэш текста всех стадий вместе с GL_VENDOR/GL_RENDERER/GL_VERSION: двоичный формат драйвера
+// не переносится между драйверами и их версиями. Файл: заголовок ShaderCacheHeader + данные программы.
+
+// Тексты стадий программы после подстановки #define (пустая строка - стадии нет).
+// Если задан compute, остальные стадии не используются.
+struct ProgramSources {
+    std::string vertex, tessControl, tessEval, fragment;
+    std::string compute;
+};
+
+struct ShaderCacheHeader {
+    uint32_t magic;
+    uint32_t binaryFormat;
+    uint64_t key;
+    uint64_t size;
+};
+
+// 64-битный FNV-1a
+static uint64_t fnv1a64(const std::string& data, uint64_t hash = 14695981039346656037ull) {
+    for (unsigned char c : data) {
+        hash ^= c;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static uint64_t programCacheKey(const ProgramSources& sources) {
+    uint64_t hash = 14695981039346656037ull;
+    for (GLenum name : { GL_VENDOR, GL_RENDERER, GL_VERSION }) {
+        const GLubyte* value = glGetString(name);
+        hash = fnv1a64(value ? (const char*)value : "", hash);
+        hash = fnv1a64(std::string(1, '\0'), hash); // Разделитель, чтобы "ab"+"c" != "a"+"bc"
+    }
+    for (const std::string* source : { &sources.vertex, &sources.tessControl, &sources.tessEval, &sources.fragment, &sources.compute }) {
+        hash = fnv1a64(*source, hash);
+        hash = fnv1a64(std::string(1, '\0'), hash);
+    }
+    return hash;
+}
+
+static std::string programCachePath(uint64_t key) {
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.bin", (unsigned long long)key);
+    return std::string(SHADER_CACHE_DIR) + "/" + name;
+}
+
+static bool programBinarySupported() {
+    static bool reported = false;
+    GLint formats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+    if (formats <= 0 && !reported) {
+        cout << "Shader cache: driver exposes no program binary formats, cache disabled" << endl;
+        reported = true;
+    }
+    return formats > 0;
+}
+
+// Возвращает 0, если файла нет, он испорчен или драйвер отверг двоичный код (в двух последних случаях файл удаляется,
+// и программа, собранная из исходников, сохранится на его место)
+static GLuint loadCachedProgram(uint64_t key) {
+    const std::string path = programCachePath(key);
+    std::ifstream file(path, std::ios::binary);
+    if (!file) return 0;
+    auto discard = [&](const char* reason) {
+        cerr << "Shader cache: " << reason << " '" << path << "', removing it" << endl;
+        file.close(); // Открытый файл в Windows не удалить
+        std::error_code ec;
+        std::filesystem::remove(path, ec);
+        return (GLuint)0;
+    };
+
+    ShaderCacheHeader header = {};
+    if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) || header.magic != SHADER_CACHE_MAGIC || header.key != key || header.size == 0) {
+        return discard("invalid file");
+    }
+    std::vector<char> binary((size_t)header.size);
+    if (!file.read(binary.data(), (std::streamsize)binary.size())) {
+        return discard("truncated file");
+    }
+    file.close();
+
+    GLuint id = glCreateProgram();
+    glProgramBinary(id, header.binaryFormat, binary.data(), (GLsizei)binary.size());
+    GLint linked = GL_FALSE;
+    glGetProgramiv(id, GL_LINK_STATUS, &linked);
+    if (!linked) {
+        // Обновился драйвер с тем же GL_VERSION или файл испорчен - пересобираем из исходников
+        cout << "Shader cache: binary rejected by the driver, recompiling" << endl;
+        glDeleteProgram(id);
+        // Отвергнутый формат дает GL_INVALID_ENUM; без сброса его приняли бы за ошибку следующие проверки glGetError.
+        // Число чтений ограничено: при потере контекста glGetError возвращает GL_CONTEXT_LOST бесконечно
+        for (int i = 0; i < 16 && glGetError() != GL_NO_ERROR; ++i) {}
+        std::error_code ec;
+        std::filesystem::remove(path, ec);
+        return 0;
+    }
+    return id;
+}
+
+static void saveProgramBinary(GLuint program, uint64_t key) {
+    GLint length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0) return;
+
+    std::vector<char> binary(length);
+    GLenum binaryFormat = 0;
+    glGetProgramBinary(program, length, &length, &binaryFormat, binary.data());
+    if (glGetError() != GL_NO_ERROR || length <= 0) {
+        cerr << "Shader cache: glGetProgramBinary failed" << endl;
+        return;
+    }
+
+    std::error_code ec;
+    std::filesystem::create_directories(SHADER_CACHE_DIR, ec);
+    // Пишем во временный файл и переименовываем: параллельно запущенная копия не прочитает половину файла
+    const std::string path = programCachePath(key);
+    const std::string tempPath = path + ".tmp";
+    {
+        std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+        ShaderCacheHeader header = { SHADER_CACHE_MAGIC, binaryFormat, key, (uint64_t)length };
+        if (!file || !file.write(reinterpret_cast<const char*>(&header), sizeof(header)) || !file.write(binary.data(), length)) {
+            cerr << "Shader cache: failed to write '" << tempPath << "'" << endl;
+            return;
+        }
+    }
+    std::filesystem::rename(tempPath, path, ec);
+    if (ec) {
+        cerr << "Shader cache: failed to store '" << path << "': " << ec.message() << endl;
+        std::filesystem::remove(tempPath, ec);
+    }
+}
+
+// Собирает программу из исходников или берет готовую из кэша. name - для сообщений о времени сборки.
+GLuint buildProgram(const ProgramSources& sources, const char* name) {
+    auto start = chrono::steady_clock::now();
+    const bool useCache = g_shaderCache && programBinarySupported();
+    const uint64_t key = useCache ? programCacheKey(sources) : 0;
+
+    GLuint id = useCache ? loadCachedProgram(key) : 0;
+    const bool fromCache = id != 0;
+    if (!fromCache && !sources.compute.empty()) {
+        GLuint cS = createShader(sources.compute.c_str(), GL_COMPUTE_SHADER);
+        if (cS == 0) return 0;
+        id = createProgram(0, 0, 0, 0, cS);
+        if (id != 0 && useCache) {
+            saveProgramBinary(id, key);
+        }
+    }
+    else if (!fromCache) {
+        GLuint vS = createShader(sources.vertex.c_str(), GL_VERTEX_SHADER);
+        GLuint tcS = sources.tessControl.empty() ? 0 : createShader(sources.tessControl.c_str(), GL_TESS_CONTROL_SHADER);
+        GLuint teS = sources.tessEval.empty() ? 0 : createShader(sources.tessEval.c_str(), GL_TESS_EVALUATION_SHADER);
+        GLuint fS = createShader(sources.fragment.c_str(), GL_FRAGMENT_SHADER);
+
+        if (vS == 0 || fS == 0 || (!sources.tessControl.empty() && tcS == 0) || (!sources.tessEval.empty() && teS == 0)) {
+            if (vS) glDeleteShader(vS);
+            if (tcS) glDeleteShader(tcS);
+            if (teS) glDeleteShader(teS);
+            if (fS) glDeleteShader(fS);
+            return 0;
+        }
+        id = createProgram(vS, tcS, teS, fS);
+        if (id != 0 && useCache) {
+            saveProgramBinary(id, key);
+        }
+    }
+
+    double ms = chrono::duration<double, std::milli>(chrono::steady_clock::now() - start).count();
+    if (id != 0) {
+        cout << "Shader program '" << name << "' " << (fromCache ? "loaded from cache" : "compiled from source") << " in " << ms << " ms" << endl;
+    }
+    return id;
+}
+
+// --- Кэш состояния GL ---
+// Кадр запрашивает привязки через эти функции, а они вызывают GL, только если привязка действительно меняется.
+// Поэтому кадр не отвязывает ресурсы в конце: следующий кадр привязывает то же самое, и вызовов нет вовсе.
+// Код вне кадра (создание ресурсов, загрузка текстур) привязывает объекты напрямую и после этого вызывает
+// invalidateRenderState() - все записи становятся неизвестными, и следующие привязки выполняются заново.
+// Счетчики: requested - вызовов GL без кэша, issued - сколько из них выполнено.
+const int RENDER_STATE_TEXTURE_UNITS = 4;
+const int RENDER_STATE_BUFFER_SLOTS = 4; // Индексные точки привязки на каждую цель
+const GLuint RENDER_STATE_UNKNOWN = ~0u;
+
+// Цели текстур, привязки которых отслеживаются (у каждого юнита - своя привязка на каждую цель)
+enum RenderStateTextureTarget {
+    STATE_TEXTURE_2D,
+    STATE_TEXTURE_2D_ARRAY,
+    STATE_TEXTURE_TARGET_COUNT
+};
+
+// Цели буферов, привязки которых отслеживаются
+enum RenderStateBufferTarget {
+    STATE_BUFFER_UNIFORM,
+    STATE_BUFFER_ATOMIC_COUNTER,
+    STATE_BUFFER_SHADER_STORAGE,
+    STATE_BUFFER_DRAW_INDIRECT,
+    STATE_BUFFER_TARGET_COUNT
+};
+
+struct IndexedBufferBinding {
+    GLuint buffer = RENDER_STATE_UNKNOWN;
+    GLintptr offset = 0;
+    GLsizeiptr size = 0; // 0 - весь буфер (glBindBufferBase)
+};
+
+struct RenderState {
+    GLuint program = RENDER_STATE_UNKNOWN;
+    GLuint vao = RENDER_STATE_UNKNOWN;
+    GLuint activeUnit = RENDER_STATE_UNKNOWN;
+    GLuint textures[RENDER_STATE_TEXTURE_UNITS][STATE_TEXTURE_TARGET_COUNT];
+    GLuint buffers[STATE_BUFFER_TARGET_COUNT];
+    IndexedBufferBinding indexed[STATE_BUFFER_TARGET_COUNT][RENDER_STATE_BUFFER_SLOTS];
+    uint64_t requested = 0, issued = 0;
+
+    RenderState() {
+        for (auto& unit : textures)
+            for (GLuint& texture : unit) texture = RENDER_STATE_UNKNOWN;
+        for (GLuint& buffer : buffers) buffer = RENDER_STATE_UNKNOWN;
+    }
+};
+
+RenderState g_renderState;
+
+static RenderStateBufferTarget renderStateTarget(GLenum target) {
+    switch (target) {
+    case GL_UNIFORM_BUFFER: return STATE_BUFFER_UNIFORM;
+    case GL_ATOMIC_COUNTER_BUFFER: return STATE_BUFFER_ATOMIC_COUNTER;
+    case GL_SHADER_STORAGE_BUFFER: return STATE_BUFFER_SHADER_STORAGE;
+    case GL_DRAW_INDIRECT_BUFFER: return STATE_BUFFER_DRAW_INDIRECT;
+    default: return STATE_BUFFER_TARGET_COUNT;
+    }
+}
+
+// Счетчики сохраняются
+void invalidateRenderState() {
+    RenderState fresh;
+    fresh.requested = g_renderState.requested;
+    fresh.issued = g_renderState.issued;
+    g_renderState = fresh;
+}
+
+// Учитывает запрос; true - вызов нужно выполнить
+static bool renderStateChanged(bool changed) {
+    ++g_renderState.requested;
+    if (changed || !g_renderStateCache) {
+        ++g_renderState.issued;
+        return true;
+    }
+    return false;
+}
+
+void useProgram(GLuint program) {
+    if (renderStateChanged(g_renderState.program != program)) {
+        glUseProgram(program);
+        g_renderState.program = program;
+    }
+}
+
+void bindVertexArray(GLuint vao) {
+    if (renderStateChanged(g_renderState.vao != vao)) {
+        glBindVertexArray(vao);
+        g_renderState.vao = vao;
+    }
+}
+
+// Привязка GL_TEXTURE_2D или GL_TEXTURE_2D_ARRAY к юниту; активный юнит переключается, только если текстуру
+// действительно нужно сменить
+void bindTexture(GLuint unit, GLenum target, GLuint texture) {
+    RenderState& state = g_renderState;
+    GLuint& bound = state.textures[unit][target == GL_TEXTURE_2D_ARRAY ? STATE_TEXTURE_2D_ARRAY : STATE_TEXTURE_2D];
+    const bool changed = bound != texture;
+    if (renderStateChanged(changed && state.activeUnit != unit)) {
+        glActiveTexture(GL_TEXTURE0 + unit);
+        state.activeUnit = unit;
+    }
+    if (renderStateChanged(changed)) {
+        glBindTexture(target, texture);
+        bound = texture;
+    }
+}
+
+void bindBuffer(GLenum target, GLuint buffer) {
+    const RenderStateBufferTarget slot = renderStateTarget(target);
+    if (renderStateChanged(slot == STATE_BUFFER_TARGET_COUNT || g_renderState.buffers[slot] != buffer)) {
+        glBindBuffer(target, buffer);
+        if (slot != STATE_BUFFER_TARGET_COUNT) g_renderState.buffers[slot] = buffer;
+    }
+}
+
+// size 0 - glBindBufferBase. Выполненный вызов меняет и общую точку привязки цели, пропущенный - нет,
+// поэтому перед glBufferSubData и т.п. буфер привязывается еще и через bindBuffer (обычно этот вызов пропускается).
+void bindBufferRange(GLenum target, GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size) {
+    const RenderStateBufferTarget slot = renderStateTarget(target);
+    const bool tracked = slot != STATE_BUFFER_TARGET_COUNT && index < (GLuint)RENDER_STATE_BUFFER_SLOTS;
+    bool changed = !tracked;
+    if (tracked) {
+        const IndexedBufferBinding& binding = g_renderState.indexed[slot][index];
+        changed = binding.buffer != buffer || binding.offset != offset || binding.size != size;
+    }
+    if (renderStateChanged(changed)) {
+        if (size == 0) glBindBufferBase(target, index, buffer);
+        else glBindBufferRange(target, index, buffer, offset, size);
+        if (tracked) {
+            g_renderState.buffers[slot] = buffer;
+            g_renderState.indexed[slot][index] = { buffer, offset, size };
+        }
+    }
+}
+
+void bindBufferBase(GLenum target, GLuint index, GLuint buffer) {
+    bindBufferRange(target, index, buffer, 0, 0);
+}
+
+
+// --- Функция загрузки текстуры ---
+// Общие параметры фильтрации для привязанной текстуры с мипмапами
+void setTextureSampling(GLenum target, const std::string& path) {
+    // Установка параметров текстуры
+    // Трилинейная фильтрация (GL_LINEAR_MIPMAP_LINEAR)
+    glTexParameteri(target, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(target, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR); // Трилинейная для минимизации
+    glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_LINEAR); // Билинейная для увеличения
+
+    // Анизотропная фильтрация (если поддерживается)
+    if (glewIsSupported("GL_EXT_texture_filter_anisotropic")) {
+        GLfloat maxAnisotropy;
+        glGetFloatv(GL_MAX_TEXTURE_MAX_ANISOTROPY_EXT, &maxAnisotropy);
+        glTexParameterf(target, GL_TEXTURE_MAX_ANISOTROPY_EXT, maxAnisotropy);
+        cout << "Anisotropic filtering enabled for '" << path << "' with max level: " << maxAnisotropy << endl;
+    }
+    else {
+        cout << "Anisotropic filtering not supported." << endl;
+    }
+}
+
+// Создает текстуру с мипмапами и общими параметрами фильтрации. pixels - указатель в памяти клиента
+// или смещение, если привязан GL_PIXEL_UNPACK_BUFFER.
+GLuint createTexture2D(const void* pixels, int width, int height, int nrComponents, const std::string& path) {
+    // Внутренний формат с явным размером: слой массива материалов копируется из такой текстуры glCopyImageSubData
+    GLenum format, internalFormat;
+    if (nrComponents == 1) {
+        format = GL_RED;
+        internalFormat = GL_R8;
+    }
+    else if (nrComponents == 3) {
+        format = GL_RGB;
+        internalFormat = GL_RGB8;
+    }
+    else if (nrComponents == 4) {
+        format = GL_RGBA;
+        internalFormat = GL_RGBA8;
+    }
+    else {
+        cerr << "Error loading texture '" << path << "': Unsupported number of components (" << nrComponents << ")" << endl;
+        return 0;
+    }
+
+    GLuint textureID;
+    glGenTextures(1, &textureID);
+    glBindTexture(GL_TEXTURE_2D, textureID);
+    glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, format, GL_UNSIGNED_BYTE, pixels);
+    glGenerateMipmap(GL_TEXTURE_2D); // Генерация мипмапов
+    setTextureSampling(GL_TEXTURE_2D, path);
+
+    glBindTexture(GL_TEXTURE_2D, 0); // Отвязываем текстуру
+    return textureID;
+}
+
+// Путь к приготовленной версии текстуры: то же имя с расширением .ctex
+std::string cookedTexturePath(const std::string& path) {
+    size_t dot = path.find_last_of('.');
+    size_t separator = path.find_last_of("/\\");
+    if (dot == std::string::npos || (separator != std::string::npos && dot < separator)) return path + COOKED_TEXTURE_EXTENSION;
+    return path.substr(0, dot) + COOKED_TEXTURE_EXTENSION;
+}
+
+// Поддерживает ли драйвер блочный формат из .ctex (BC1/BC3 - S3TC, BC7 - BPTC)
+bool compressedFormatSupported(uint32_t internalFormat) {
+    if (internalFormat == COOKED_GL_COMPRESSED_RGBA_BPTC_UNORM) return GLEW_VERSION_4_2 || GLEW_ARB_texture_compression_bptc;
+    return GLEW_EXT_texture_compression_s3tc;
+}
+
+// Имя формата уровней .ctex для сообщений
+const char* cookedFormatName(uint32_t internalFormat) {
+    switch (internalFormat) {
+    case COOKED_GL_COMPRESSED_RGB_S3TC_DXT1: return "BC1";
+    case COOKED_GL_COMPRESSED_RGBA_S3TC_DXT5: return "BC3";
+    case COOKED_GL_COMPRESSED_RGBA_BPTC_UNORM: return "BC7";
+    default: return "RGBA8";
+    }
+}
+
+// Открытый контейнер .ctex: заголовок и таблица уровней проверены, данные уровней читаются прямо из отображения
+struct CookedTexture {
+    MappedFile file;
+    CookedTextureHeader header = {};
+    std::vector<CookedTextureLevel> levels;
+    bool compressed = false;
+};
+
+// Открывает .ctex: файл отображается в память, уровни потом передаются в GL как есть - без декодирования
+// и glGenerateMipmap. Сжатые уровни - через glCompressedTex*, без распаковки на CPU.
+// false - файла нет, он поврежден или сжатый формат не поддерживается (тогда декодируется исходное изображение).
+bool openCookedTexture(const std::string& path, CookedTexture& texture) {
+    auto start = chrono::steady_clock::now();
+    MappedFile& file = texture.file;
+    if (!file.open(path.c_str())) return false;
+    if (const char* error = validateCookedTexture(file.data, file.size)) {
+        cerr << "Invalid cooked texture '" << path << "': " << error << endl;
+        file.close();
+        return false;
+    }
+
+    CookedTextureHeader& header = texture.header;
+    memcpy(&header, file.data, sizeof(header));
+    texture.levels.resize(header.levelCount);
+    memcpy(texture.levels.data(), file.data + sizeof(header), texture.levels.size() * sizeof(CookedTextureLevel));
+    texture.compressed = (header.flags & COOKED_TEXTURE_COMPRESSED) != 0;
+    if (texture.compressed && !compressedFormatSupported(header.internalFormat)) {
+        cerr << "Cooked texture '" << path << "' uses an unsupported compressed format 0x" << std::hex << header.internalFormat << std::dec << endl;
+        file.close();
+        return false;
+    }
+    uint64_t dataSize = 0;
+    for (const CookedTextureLevel& level : texture.levels) dataSize += level.size;
+
+    double ms = chrono::duration<double, std::milli>(chrono::steady_clock::now() - start).count();
+    cout << "Cooked texture opened: '" << path << "' (" << header.width << "x" << header.height << ", " << header.channels
+        << " channels, " << header.levelCount << " levels, ";
+    if (texture.compressed) {
+        // Для сравнения - объем той же цепочки в RGBA8
+        cout << cookedFormatName(header.internalFormat) << " " << dataSize / (1024.0 * 1024.0) << " MB vs " << header.width * (double)header.height * 4 * 4 / 3 / (1024.0 * 1024.0) << " MB RGBA8";
+    }
+    else {
+        cout << dataSize / (1024.0 * 1024.0) << " MB";
+    }
+    cout << ") in " << ms << " ms" << endl;
+    return true;
+}
+
+// 2D-текстура из открытого .ctex - для слоя материала, размер или формат которого не совпадает с массивом
+GLuint createCookedTexture2D(const CookedTexture& texture, const std::string& path) {
+    const CookedTextureHeader& header = texture.header;
+    const std::vector<CookedTextureLevel>& levels = texture.levels;
+    const bool compressed = texture.compressed;
+    const unsigned char* data = texture.file.data;
+
+    GLuint textureID;
+    glGenTextures(1, &textureID);
+    glBindTexture(GL_TEXTURE_2D, textureID);
+    if (GLEW_VERSION_4_2 || GLEW_ARB_texture_storage) {
+        // Неизменяемое хранилище: драйверу не нужно проверять полноту мип-цепочки при каждом использовании
+        glTexStorage2D(GL_TEXTURE_2D, header.levelCount, header.internalFormat, header.width, header.height);
+        for (GLint i = 0; i < (GLint)levels.size(); ++i) {
+            if (compressed) {
+                glCompressedTexSubImage2D(GL_TEXTURE_2D, i, 0, 0, levels[i].width, levels[i].height, header.internalFormat, (GLsizei)levels[i].size, data + levels[i].offset);
+            }
+            else {
+                glTexSubImage2D(GL_TEXTURE_2D, i, 0, 0, levels[i].width, levels[i].height, header.format, header.type, data + levels[i].offset);
+            }
+        }
+    }
+    else {
+        for (GLint i = 0; i < (GLint)levels.size(); ++i) {
+            if (compressed) {
+                glCompressedTexImage2D(GL_TEXTURE_2D, i, header.internalFormat, levels[i].width, levels[i].height, 0, (GLsizei)levels[i].size, data + levels[i].offset);
+            }
+            else {
+                glTexImage2D(GL_TEXTURE_2D, i, header.internalFormat, levels[i].width, levels[i].height, 0, header.format, header.type, data + levels[i].offset);
+            }
+        }
+    }
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, header.levelCount - 1);
+    setTextureSampling(GL_TEXTURE_2D, path);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    return textureID;
+}
+
+
+// Сколько каналов просить у stb_image: изображения с любым числом каналов расширяются до RGBA прямо в декодере,
+// тем же проходом, который пишет строки снизу вверх. Драйверы все равно хранят RGB8 по 4 байта на тексель и иначе
+// переупаковывают изображение при каждой загрузке, строки RGBA всегда выровнены по 4 байта (GL_UNPACK_ALIGNMENT
+// по умолчанию), а раскладка совпадает с .ctex от TextureCooker - все пути загрузки дают одну и ту же текстуру RGBA8.
+// Число каналов в файле заранее знать не нужно, поэтому заголовок не разбирается отдельно (stbi_info).
+const int TEXTURE_CHANNELS = 4;
+
+// Декодирует файл изображения. При --texture-io mmap файл отображается в память и stb_image читает
+// его как буфер: без копирования в свой 128-байтный буфер и без fread на каждую порцию. Если отобразить
+// не удалось (или файл больше 2 ГБ), используется stbi_load - он же сообщит причину ошибки.
+// ioMs - время открытия и отображения файла; -1, если файл читался через stdio (чтение перемешано с декодированием).
+// channels - число каналов в возвращенных пикселях (TEXTURE_CHANNELS), а не в файле.
+static unsigned char* decodeImageFile(const std::string& path, int* width, int* height, int* channels, double* ioMs) {
+    *ioMs = -1.0;
+    int fileChannels = 0;
+    unsigned char* pixels;
+    MappedFile file;
+    auto mapStart = chrono::steady_clock::now();
+    if (g_mappedTextureIO && file.open(path.c_str()) && file.size <= (size_t)INT_MAX) {
+        *ioMs = chrono::duration<double, std::milli>(chrono::steady_clock::now() - mapStart).count();
+        pixels = stbi_load_from_memory(file.data, (int)file.size, width, height, &fileChannels, TEXTURE_CHANNELS);
+    }
+    else {
+        pixels = stbi_load(path.c_str(), width, height, &fileChannels, TEXTURE_CHANNELS);
+    }
+    *channels = TEXTURE_CHANNELS;
+    return pixels;
+}
+
+// Синхронная загрузка из отображенного файла: размер изображения известен из заголовка (stbi_info),
+// поэтому stb_image пишет строки прямо в отображенный PBO (stbi_load_from_memory_into) - без своего
+// буфера результата и без копии перед glTexImage2D. Рабочая память декодера берется из ImagePool.
+// Возвращает false, если файл не отобразился - тогда загрузка идет через stdio.
+static bool loadTextureFromMapping(const std::string& path, GLuint& textureID) {
+    textureID = 0;
+    auto start = chrono::steady_clock::now();
+    MappedFile file;
+    if (!file.open(path.c_str()) || file.size > (size_t)INT_MAX) return false;
+    double ioMs = chrono::duration<double, std::milli>(chrono::steady_clock::now() - start).count();
+    ImagePoolStats poolBefore = imagePoolStats();
+
+    int width, height, fileComponents;
+    if (!stbi_info_from_memory(file.data, (int)file.size, &width, &height, &fileComponents)) {
+        cerr << "Texture failed to load at path: " << path << endl;
+        cerr << "STB Error: " << stbi_failure_reason() << endl;
+        return true;
+    }
+    const int nrComponents = TEXTURE_CHANNELS;
+    const size_t size = (size_t)width * height * nrComponents;
+    if (g_texturePbo == 0) glGenBuffers(1, &g_texturePbo);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, g_texturePbo);
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+    unsigned char* pixels = (unsigned char*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    bool decoded = pixels && stbi_load_from_memory_into(file.data, (int)file.size, pixels, size, &width, &height, &fileComponents, nrComponents);
+    const char* error = decoded ? nullptr : pixels ? stbi_failure_reason() : "failed to map the pixel buffer";
+    if (pixels && glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER) == GL_FALSE && decoded) {
+        decoded = false;
+        error = "pixel buffer contents were lost";
+    }
+    double decodeMs = chrono::duration<double, std::milli>(chrono::steady_clock::now() - start).count() - ioMs;
+    if (decoded) {
+        textureID = createTexture2D((const void*)0, width, height, nrComponents, path);
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    if (!decoded) {
+        cerr << "Texture failed to load at path: " << path << endl;
+        cerr << "STB Error: " << error << endl;
+    }
+    else if (textureID != 0) {
+        cout << "Texture loaded successfully: '" << path << "' (" << width << "x" << height << ", " << nrComponents
+            << " channels, decoded into PBO in " << decodeMs << " ms, file mapped in " << ioMs << " ms, "
+            << imagePoolStats().heapAllocations - poolBefore.heapAllocations << " heap allocations)" << endl;
+    }
+    return true;
+}
+
+// Синхронная загрузка (--textures sync): декодирование и загрузка в потоке OpenGL
+GLuint loadTexture(const std::string& path) {
+    int width, height, nrComponents;
+    // Указываем stb_image, что нужно перевернуть изображение по вертикали при загрузке
+    // т.к. OpenGL ожидает координату 0.0 по оси Y внизу текстуры, а изображения обычно имеют 0.0 наверху.
+    stbi_set_flip_vertically_on_load(true);
+    GLuint textureID;
+    if (g_mappedTextureIO && loadTextureFromMapping(path, textureID)) return textureID;
+
+    auto decodeStart = chrono::steady_clock::now();
+    int fileComponents;
+    unsigned char* data = stbi_load(path.c_str(), &width, &height, &fileComponents, TEXTURE_CHANNELS);
+    nrComponents = TEXTURE_CHANNELS;
+    double decodeMs = chrono::duration<double, std::milli>(chrono::steady_clock::now() - decodeStart).count();
+    if (!data) {
+        cerr << "Texture failed to load at path: " << path << endl;
+        cerr << "STB Error: " << stbi_failure_reason() << endl;
+        return 0;
+    }
+
+    textureID = createTexture2D(data, width, height, nrComponents, path);
+    stbi_image_free(data); // Освобождаем память изображения
+    if (textureID != 0) {
+        cout << "Texture loaded successfully: '" << path << "' (" << width << "x" << height << ", " << nrComponents
+            << " channels, decoded in " << decodeMs << " ms)" << endl;
+    }
+    return textureID;
+}
+
+// --- Асинхронная загрузка текстур ---
+// Декодирование идет в пуле рабочих потоков; готовые изображения передаются потоку OpenGL через
+// lock-free очередь и загружаются через PBO (при GL 4.4 / ARB_buffer_storage - постоянно отображенный
+// кольцевой буфер с fence на каждую загрузку). До готовности текстуры вместо нее используется заглушка,
+// поэтому запуск ограничен самым долгим декодированием, а не суммой всех.
+
+struct TextureRequest {
+    std::string path;
+    GLuint* target; // Куда записать ID готовой текстуры (до этого там заглушка)
+};
+
+// Результат декодирования - узел очереди
+struct DecodedImage {
+    size_t request = 0;
+    unsigned char* pixels = nullptr; // nullptr - ошибка декодирования (текст в error)
+    int width = 0, height = 0, channels = 0;
+    double decodeMs = 0.0; // Вместе с ioMs
+    double ioMs = -1.0;
+    std::string error;
+    DecodedImage* next = nullptr;
+};
+
+// Lock-free очередь "много производителей - один потребитель": производители добавляют узел в голову
+// списка через CAS, потребитель забирает весь список одним exchange и разворачивает его в порядок прихода.
+struct DecodedImageQueue {
+    std::atomic<DecodedImage*> head{ nullptr };
+
+    void push(DecodedImage* node) {
+        DecodedImage* current = head.load(std::memory_order_relaxed);
+        do {
+            node->next = current;
+        } while (!head.compare_exchange_weak(current, node, std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    DecodedImage* popAll() {
+        DecodedImage* list = head.exchange(nullptr, std::memory_order_acquire);
+        DecodedImage* ordered = nullptr;
+        while (list) {
+            DecodedImage* next = list->next;
+            list->next = ordered;
+            ordered = list;
+            list = next;
+        }
+        return ordered;
+    }
+};
+
+// Занятый участок кольцевого PBO: переиспользовать можно только после срабатывания fence
+struct StagingRegion {
+    size_t offset, size;
+    GLsync fence;
+};
+
+struct TextureStreamer {
+    std::vector<TextureRequest> requests;
+    std::atomic<size_t> nextRequest{ 0 };
+    std::vector<std::thread> workers;
+    DecodedImageQueue ready;
+    size_t pending = 0; // Запрошено, но еще не загружено в GL
+    size_t loaded = 0;
+
+    GLuint placeholder = 0;
+    GLuint pbo = 0;
+    unsigned char* mapped = nullptr; // Постоянное отображение (только при persistent)
+    bool persistent = false;
+    size_t stagingHead = 0;
+    std::deque<StagingRegion> inFlight;
+
+    chrono::steady_clock::time_point start;
+    double decodeMsTotal = 0.0, uploadMs = 0.0;
+    ImagePoolStats poolAtStart{};
+};
+
+TextureStreamer g_textureStreamer;
+
+// Шахматная заглушка 8x8 (без мипмапов - фильтр GL_NEAREST)
+static GLuint createPlaceholderTexture() {
+    unsigned char pixels[8 * 8 * 4];
+    for (int y = 0; y < 8; ++y) {
+        for (int x = 0; x < 8; ++x) {
+            unsigned char v = ((x + y) & 1) ? 200 : 90;
+            unsigned char* p = &pixels[(y * 8 + x) * 4];
+            p[0] = v; p[1] = v; p[2] = v; p[3] = 255;
+        }
+    }
+    GLuint id;
+    glGenTextures(1, &id);
+    glBindTexture(GL_TEXTURE_2D, id);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 8, 8, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    return id;
+}
+
+static void textureDecodeWorker() {
+    TextureStreamer& streamer = g_textureStreamer;
+    for (;;) {
+        size_t index = streamer.nextRequest.fetch_add(1, std::memory_order_relaxed);
+        if (index >= streamer.requests.size()) break;
+
+        DecodedImage* image = new DecodedImage();
+        image->request = index;
+        auto decodeStart = chrono::steady_clock::now();
+        image->pixels = decodeImageFile(streamer.requests[index].path, &image->width, &image->height, &image->channels, &image->ioMs);
+        image->decodeMs = chrono::duration<double, std::milli>(chrono::steady_clock::now() - decodeStart).count();
+        if (!image->pixels) {
+            image->error = stbi_failure_reason();
+        }
+        streamer.ready.push(image);
+    }
+}
+
+int defaultThreadCount();
+
+// Запускает декодирование; ID текстур в запросах сразу указывают на заглушку
+void startTextureLoads(const std::vector<TextureRequest>& requests) {
+    TextureStreamer& streamer = g_textureStreamer;
+    streamer.start = chrono::steady_clock::now();
+    streamer.poolAtStart = imagePoolStats();
+    if (streamer.placeholder == 0) {
+        streamer.placeholder = createPlaceholderTexture();
+    }
+    if (streamer.pbo == 0) {
+        glGenBuffers(1, &streamer.pbo);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, streamer.pbo);
+        streamer.persistent = GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage;
+        if (streamer.persistent) {
+            const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+            glBufferStorage(GL_PIXEL_UNPACK_BUFFER, TEXTURE_STAGING_SIZE, NULL, flags);
+            streamer.mapped = (unsigned char*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, TEXTURE_STAGING_SIZE, flags);
+            if (!streamer.mapped) {
+                // Буфер с неизменяемым хранилищем уже не пересоздать через glBufferData - заводим новый
+                cerr << "Failed to map the texture staging buffer persistently, falling back to orphaned PBO uploads" << endl;
+                glDeleteBuffers(1, &streamer.pbo);
+                glGenBuffers(1, &streamer.pbo);
+                streamer.persistent = false;
+            }
+        }
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    }
+
+    stbi_set_flip_vertically_on_load(true); // Глобальный флаг stb_image: задаем до запуска потоков
+    size_t first = streamer.requests.size();
+    for (const TextureRequest& request : requests) {
+        *request.target = streamer.placeholder;
+        streamer.requests.push_back(request);
+        ++streamer.pending;
+    }
+    if (streamer.requests.size() == first) return;
+
+    const size_t threadCount = std::min<size_t>(defaultThreadCount(), streamer.requests.size() - first);
+    // Каждый поток декодирования сам запускает потоки для JPEG (STBI_JPEG_THREADS): делим ядра между ними,
+    // чтобы всего потоков было не больше ядер. Счетчик в stb_image общий - задаем до запуска потоков, как и флип
+    stbi_set_jpeg_thread_count(std::max(1, defaultThreadCount() / (int)threadCount));
+    for (size_t i = 0; i < threadCount; ++i) {
+        streamer.workers.emplace_back(textureDecodeWorker);
+    }
+}
+
+// Участок кольцевого PBO под size байт; ждет GPU, только если участок еще читается прошлой загрузкой
+static size_t allocateStaging(size_t size) {
+    TextureStreamer& streamer = g_textureStreamer;
+    if (streamer.stagingHead + size > TEXTURE_STAGING_SIZE) {
+        streamer.stagingHead = 0;
+    }
+    size_t offset = streamer.stagingHead;
+    for (auto it = streamer.inFlight.begin(); it != streamer.inFlight.end();) {
+        if (it->offset < offset + size && offset < it->offset + it->size) {
+            while (glClientWaitSync(it->fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000ull) == GL_TIMEOUT_EXPIRED) {}
+            glDeleteSync(it->fence);
+            it = streamer.inFlight.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+    streamer.stagingHead = (offset + size + 255) & ~(size_t)255; // Выравнивание следующего участка
+    return offset;
+}
+
+static GLuint uploadDecodedImage(const DecodedImage& image, const std::string& path) {
+    TextureStreamer& streamer = g_textureStreamer;
+    const size_t size = (size_t)image.width * image.height * image.channels;
+
+    GLuint id = 0;
+    if (streamer.persistent && size <= TEXTURE_STAGING_SIZE) {
+        size_t offset = allocateStaging(size);
+        memcpy(streamer.mapped + offset, image.pixels, size); // Отображение когерентное - сброс не нужен
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, streamer.pbo);
+        id = createTexture2D((const void*)offset, image.width, image.height, image.channels, path);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        streamer.inFlight.push_back({ offset, size, glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0) });
+    }
+    else {
+        // Без buffer storage: "сиротим" старое хранилище, драйвер не ждет прошлую загрузку
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, streamer.pbo);
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+        void* dst = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+        if (dst) {
+            memcpy(dst, image.pixels, size);
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+            id = createTexture2D((const void*)0, image.width, image.height, image.channels, path);
+        }
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        if (!dst) {
+            id = createTexture2D(image.pixels, image.width, image.height, image.channels, path);
+        }
+    }
+    return id;
+}
+
+// Загружает в GL все уже декодированные изображения. Вызывается потоком OpenGL каждый кадр.
+void pumpTextureUploads() {
+    TextureStreamer& streamer = g_textureStreamer;
+    if (streamer.pending == 0) return;
+
+    DecodedImage* image = streamer.ready.popAll();
+    if (image) invalidateRenderState(); // Загрузка ниже привязывает текстуры в обход кэша состояния
+    while (image) {
+        const TextureRequest& request = streamer.requests[image->request];
+        streamer.decodeMsTotal += image->decodeMs;
+        if (image->pixels) {
+            auto uploadStart = chrono::steady_clock::now();
+            GLuint id = uploadDecodedImage(*image, request.path);
+            streamer.uploadMs += chrono::duration<double, std::milli>(chrono::steady_clock::now() - uploadStart).count();
+            stbi_image_free(image->pixels);
+            if (id != 0) {
+                *request.target = id;
+                ++streamer.loaded;
+                cout << "Texture loaded successfully: '" << request.path << "' (" << image->width << "x" << image->height << ", "
+                    << image->channels << " channels, decoded in " << image->decodeMs << " ms";
+                if (image->ioMs >= 0.0) cout << ", file mapped in " << image->ioMs << " ms";
+                cout << ")" << endl;
+            }
+        }
+        else {
+            cerr << "Texture failed to load at path: " << request.path << endl;
+            cerr << "STB Error: " << image->error << endl;
+        }
+        --streamer.pending;
+
+        DecodedImage* next = image->next;
+        delete image;
+        image = next;
+    }
+
+    if (streamer.pending == 0) {
+        for (std::thread& worker : streamer.workers) worker.join();
+        streamer.workers.clear();
+        double totalMs = chrono::duration<double, std::milli>(chrono::steady_clock::now() - streamer.start).count();
+        ImagePoolStats pool = imagePoolStats();
+        cout << "Textures: " << streamer.loaded << " of " << streamer.requests.size() << " ready in " << totalMs << " ms (decode " << streamer.decodeMsTotal
+            << " ms summed over threads, upload " << streamer.uploadMs << " ms, " << (streamer.persistent ? "persistent PBO" : "orphaned PBO") << ", "
+            << pool.heapAllocations - streamer.poolAtStart.heapAllocations << " of " << pool.requests - streamer.poolAtStart.requests
+            << " decoder allocations from the heap)" << endl;
+        imagePoolTrim(); // Больше декодировать нечего - возвращаем память пула
+    }
+}
+
+// Ждет все запрошенные текстуры (безоконный режим и замеры - кадры должны быть детерминированы)
+void finishTextureLoads() {
+    while (g_textureStreamer.pending > 0) {
+        pumpTextureUploads();
+        if (g_textureStreamer.pending > 0) std::this_thread::sleep_for(chrono::milliseconds(1));
+    }
+}
+
+void destroyTextureStreamer() {
+    TextureStreamer& streamer = g_textureStreamer;
+    for (std::thread& worker : streamer.workers) worker.join();
+    streamer.workers.clear();
+    for (DecodedImage* image = streamer.ready.popAll(); image;) {
+        DecodedImage* next = image->next;
+        stbi_image_free(image->pixels);
+        delete image;
+        image = next;
+    }
+    streamer.pending = 0;
+    for (const StagingRegion& region : streamer.inFlight) glDeleteSync(region.fence);
+    streamer.inFlight.clear();
+    if (streamer.pbo != 0) {
+        if (streamer.mapped) {
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, streamer.pbo);
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+            streamer.mapped = nullptr;
+        }
+        glDeleteBuffers(1, &streamer.pbo);
+        streamer.pbo = 0;
+    }
+    if (streamer.placeholder != 0) {
+        glDeleteTextures(1, &streamer.placeholder);
+        streamer.placeholder = 0;
+    }
+}
+
+
+
+// --- Материалы: массив текстур ---
+// Все текстуры поверхности лежат в слоях одного GL_TEXTURE_2D_ARRAY, а пару слоев для смешивания выбирает
+// атрибут экземпляра. Поэтому экземпляры с разными парами текстур рисуются одним вызовом, без привязки
+// текстур и отдельного draw на каждую пару. Слой получает общий размер массива (наибольший из исходных):
+//  - если все слои из .ctex одного формата и размера, массив создается в этом формате (сжатые остаются
+//    сжатыми), и уровни из отображенного файла загружаются прямо в слои;
+//  - иначе массив RGBA8: .ctex в RGBA8 нужного размера загружается в слой так же напрямую, 2D-текстура
+//    нужного размера (декодированное изображение) копируется glCopyImageSubData, и только слои другого
+//    размера или формата (заглушка асинхронной загрузки, сжатый .ctex) перерисовываются полноэкранным
+//    треугольником с распаковкой и масштабированием. Для .ctex это потеря выгоды приготовления (сжатие,
+//    готовые уровни) - об этом выводится предупреждение: TextureCooker --size и один --format для всех
+//    текстур (make cook, make cook-compressed) дают слои, которые загружаются в массив напрямую.
+// Массив собирается заново, когда меняется исходная текстура (заглушку сменила загруженная) - в остальных
+// кадрах это два сравнения. Когда загружать больше нечего, исходные 2D-текстуры удаляются, а .ctex закрываются:
+// вся память текстур - в самом массиве. ARB_bindless_texture обошелся бы без копии, но доступен не везде.
+const int MATERIAL_LAYERS = 2; // Слой 0 - первая текстура, слой 1 - вторая
+const GLuint MATERIAL_TEXTURE_UNIT = 0;
+
+struct MaterialArray {
+    GLuint texture = 0;
+    GLuint fbo = 0, vao = 0, copyProgram = 0; // Перерисовка исходных текстур в слои
+    CookedTexture cooked[MATERIAL_LAYERS]; // Слои из .ctex (файл открыт, пока массив может пересобираться)
+    GLuint sources[MATERIAL_LAYERS] = {}; // Из каких 2D-текстур собраны слои
+    bool complete = false; // Источники окончательные и уже освобождены - массив больше не пересобирается
+    int width = 0, height = 0;
+};
+
+MaterialArray g_materials;
+
+// Полноэкранный треугольник; v_uv в центрах пикселей слоя попадает в центры текселей исходной текстуры
+// того же размера, поэтому такая текстура копируется без изменений
+const GLchar materialCopyVsh[] =
+"#version 410 core\n" \
+"out vec2 v_uv;\n" \
+"\n" \
+"void main() {\n" \
+"	v_uv = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);\n" \
+"	gl_Position = vec4(v_uv * 2.0 - 1.0, 0.0, 1.0);\n" \
+"}\n";
+
+const GLchar materialCopyFsh[] =
+"#version 410 core\n" \
+"in vec2 v_uv;\n" \
+"out vec4 o_color;\n" \
+"\n" \
+"uniform sampler2D u_source; // Юнит 0\n" \
+"\n" \
+"void main() {\n" \
+"	o_color = texture(u_source, v_uv);\n" \
+"}\n";
+
+bool createMaterials() {
+    MaterialArray& materials = g_materials;
+    ProgramSources sources;
+    sources.vertex = materialCopyVsh;
+    sources.fragment = materialCopyFsh;
+    materials.copyProgram = buildProgram(sources, "material copy");
+    if (materials.copyProgram == 0) {
+        return false;
+    }
+    glGenFramebuffers(1, &materials.fbo);
+    glGenVertexArrays(1, &materials.vao); // Атрибутов нет, но без VAO core profile не рисует
+    return true;
+}
+
+// Слой из .ctex вместо декодирования изображения: false - файла нет или он не подходит
+bool openMaterialLayer(int layer, const std::string& imagePath) {
+    return g_cookedTextures && openCookedTexture(cookedTexturePath(imagePath), g_materials.cooked[layer]);
+}
+
+// Загружает уровни .ctex (первые levelCount) прямо в слой массива, формат массива совпадает с файлом
+static void uploadCookedLayer(const CookedTexture& cooked, int layer, int levelCount) {
+    const CookedTextureHeader& header = cooked.header;
+    for (int i = 0; i < levelCount; ++i) {
+        const CookedTextureLevel& level = cooked.levels[i];
+        const unsigned char* data = cooked.file.data + level.offset;
+        if (cooked.compressed) {
+            glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, i, 0, 0, layer, level.width, level.height, 1, header.internalFormat, (GLsizei)level.size, data);
+        }
+        else {
+            glTexSubImage3D(GL_TEXTURE_2D_ARRAY, i, 0, 0, layer, level.width, level.height, 1, header.format, header.type, data);
+        }
+    }
+}
+
+// Больше ничего не загружается: слои уже в массиве, исходные 2D-текстуры и отображения .ctex не нужны.
+// Заглушку асинхронной загрузки (осталась, если изображение не загрузилось) удаляет destroyTextureStreamer.
+static void releaseMaterialSources() {
+    MaterialArray& materials = g_materials;
+    GLuint* targets[MATERIAL_LAYERS] = { &g_object.texture1, &g_object.texture2 };
+    for (int layer = 0; layer < MATERIAL_LAYERS; ++layer) {
+        GLuint& source = *targets[layer];
+        if (source != 0 && source != g_textureStreamer.placeholder) glDeleteTextures(1, &source);
+        source = 0;
+        materials.sources[layer] = 0;
+        materials.cooked[layer].file.close();
+    }
+    materials.complete = true;
+}
+
+// Собирает массив заново, если исходные текстуры сменились. Вызывается в начале кадра:
+// привязки идут в обход кэша состояния, поэтому в конце он сбрасывается.
+void updateMaterials() {
+    MaterialArray& materials = g_materials;
+    if (materials.complete) return;
+    const GLuint current[MATERIAL_LAYERS] = { g_object.texture1, g_object.texture2 };
+    const bool lastBuild = g_textureStreamer.pending == 0; // Источники больше не сменятся
+    if (materials.texture != 0 && std::equal(current, current + MATERIAL_LAYERS, materials.sources)) {
+        if (lastBuild) releaseMaterialSources(); // Последнее изображение не загрузилось - в слое осталась заглушка
+        return;
+    }
+    auto start = chrono::steady_clock::now();
+
+    // Способ заполнения каждого слоя
+    enum LayerFill { FILL_UPLOAD, FILL_COPY, FILL_RENDER };
+    LayerFill fill[MATERIAL_LAYERS];
+    GLint sourceWidth[MATERIAL_LAYERS] = {}, sourceHeight[MATERIAL_LAYERS] = {};
+    int width = 1, height = 1;
+    glActiveTexture(GL_TEXTURE0 + MATERIAL_TEXTURE_UNIT);
+    for (int layer = 0; layer < MATERIAL_LAYERS; ++layer) {
+        const CookedTexture& cooked = materials.cooked[layer];
+        if (cooked.file.data) {
+            sourceWidth[layer] = (GLint)cooked.header.width;
+            sourceHeight[layer] = (GLint)cooked.header.height;
+        }
+        else if (current[layer] != 0) { // 0 - текстура не загрузилась, слой будет черным
+            glBindTexture(GL_TEXTURE_2D, current[layer]);
+            glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &sourceWidth[layer]);
+            glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &sourceHeight[layer]);
+        }
+        width = std::max(width, (int)sourceWidth[layer]);
+        height = std::max(height, (int)sourceHeight[layer]);
+    }
+
+    // Формат массива: общий формат .ctex, если все слои из них и одного размера, иначе RGBA8
+    const CookedTexture& first = materials.cooked[0];
+    bool cookedFormat = true;
+    for (const CookedTexture& cooked : materials.cooked) {
+        cookedFormat = cookedFormat && cooked.file.data && cooked.header.internalFormat == first.header.internalFormat &&
+            (int)cooked.header.width == width && (int)cooked.header.height == height;
+    }
+    const GLenum internalFormat = cookedFormat ? first.header.internalFormat : GL_RGBA8;
+    int levelCount = 1;
+    while ((std::max(width, height) >> levelCount) > 0) ++levelCount; // Полная цепочка, как у .ctex и glGenerateMipmap
+
+    const bool copyImage = GLEW_VERSION_4_3 || GLEW_ARB_copy_image;
+    bool anyRendered = false;
+    for (int layer = 0; layer < MATERIAL_LAYERS; ++layer) {
+        const CookedTexture& cooked = materials.cooked[layer];
+        const bool sameSize = sourceWidth[layer] == width && sourceHeight[layer] == height;
+        fill[layer] = FILL_RENDER;
+        if (cooked.file.data) {
+            if (sameSize && (cookedFormat || cooked.header.internalFormat == GL_RGBA8)) fill[layer] = FILL_UPLOAD;
+        }
+        else if (current[layer] != 0 && sameSize && copyImage) {
+            // Декодированные текстуры - RGBA8 с полной цепочкой glGenerateMipmap; у заглушки (GL_RGBA без
+            // мипмапов) формат и уровни не те - ее слой перерисовывается
+            GLint format = 0, lastWidth = 0;
+            glBindTexture(GL_TEXTURE_2D, current[layer]);
+            glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_INTERNAL_FORMAT, &format);
+            glGetTexLevelParameteriv(GL_TEXTURE_2D, levelCount - 1, GL_TEXTURE_WIDTH, &lastWidth);
+            if (format == GL_RGBA8 && lastWidth != 0) fill[layer] = FILL_COPY;
+        }
+        anyRendered = anyRendered || fill[layer] == FILL_RENDER;
+    }
+    for (int layer = 0; layer < MATERIAL_LAYERS; ++layer) {
+        const CookedTexture& cooked = materials.cooked[layer];
+        if (!cooked.file.data || fill[layer] == FILL_UPLOAD) continue;
+        const bool rescaled = sourceWidth[layer] != width || sourceHeight[layer] != height;
+        cerr << "Warning: cooked material layer " << layer << " (" << cookedFormatName(cooked.header.internalFormat) << " " << cooked.header.width
+            << "x" << cooked.header.height << ") is " << (cooked.compressed ? (rescaled ? "decompressed and rescaled" : "decompressed") : "rescaled")
+            << " into the RGBA8 " << width << "x" << height << " material array; cook all textures with the same --format and --size" << endl;
+    }
+
+    // Неизменяемое хранилище пересоздается целиком: сборок за запуск не больше двух (с заглушкой и окончательная)
+    if (materials.texture != 0) glDeleteTextures(1, &materials.texture);
+    glGenTextures(1, &materials.texture);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, materials.texture);
+    if (GLEW_VERSION_4_2 || GLEW_ARB_texture_storage) {
+        glTexStorage3D(GL_TEXTURE_2D_ARRAY, levelCount, internalFormat, width, height, MATERIAL_LAYERS);
+    }
+    else {
+        for (int i = 0; i < levelCount; ++i) {
+            const int w = std::max(1, width >> i), h = std::max(1, height >> i);
+            if (cookedFormat && first.compressed) {
+                glCompressedTexImage3D(GL_TEXTURE_2D_ARRAY, i, internalFormat, w, h, MATERIAL_LAYERS, 0, (GLsizei)(first.levels[i].size * MATERIAL_LAYERS), NULL);
+            }
+            else {
+                glTexImage3D(GL_TEXTURE_2D_ARRAY, i, internalFormat, w, h, MATERIAL_LAYERS, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+            }
+        }
+    }
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, levelCount - 1);
+    setTextureSampling(GL_TEXTURE_2D_ARRAY, "materials");
+    materials.width = width;
+    materials.height = height;
+
+    // Если какой-то слой перерисовывается, уровни всего массива потом строит glGenerateMipmap - копируется только нулевой
+    const int copiedLevels = anyRendered ? 1 : levelCount;
+    for (int layer = 0; layer < MATERIAL_LAYERS; ++layer) {
+        if (fill[layer] == FILL_UPLOAD) {
+            uploadCookedLayer(materials.cooked[layer], layer, copiedLevels);
+        }
+        else if (fill[layer] == FILL_COPY) {
+            for (int i = 0; i < copiedLevels; ++i) {
+                glCopyImageSubData(current[layer], GL_TEXTURE_2D, i, 0, 0, 0, materials.texture, GL_TEXTURE_2D_ARRAY, i, 0, 0, layer,
+                    std::max(1, width >> i), std::max(1, height >> i), 1);
+            }
+        }
+        materials.sources[layer] = current[layer];
+    }
+
+    bool failed = false;
+    if (anyRendered) {
+        GLint previousFbo = 0, viewport[4] = {};
+        glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &previousFbo);
+        glGetIntegerv(GL_VIEWPORT, viewport);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, materials.fbo);
+        glViewport(0, 0, width, height);
+        glUseProgram(materials.copyProgram);
+        glBindVertexArray(materials.vao);
+        for (int layer = 0; layer < MATERIAL_LAYERS; ++layer) {
+            if (fill[layer] != FILL_RENDER) continue;
+            glFramebufferTextureLayer(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, materials.texture, 0, layer);
+            GLenum status = glCheckFramebufferStatus(GL_DRAW_FRAMEBUFFER);
+            if (status != GL_FRAMEBUFFER_COMPLETE) {
+                cerr << "Material array framebuffer is incomplete (status 0x" << std::hex << status << std::dec << "), layer " << layer << " is left empty" << endl;
+                failed = true;
+                break; // Вложение для всех слоев одинаковое - остальные слои тоже не нарисовать
+            }
+            // .ctex, не загруженный напрямую (сжатый или другого размера), рисуется из временной 2D-текстуры
+            const CookedTexture& cooked = materials.cooked[layer];
+            GLuint source = cooked.file.data ? createCookedTexture2D(cooked, "material layer " + std::to_string(layer)) : current[layer];
+            glBindTexture(GL_TEXTURE_2D, source);
+            glDrawArrays(GL_TRIANGLES, 0, 3); // Без буфера глубины тест глубины не отбрасывает фрагменты
+            if (source != current[layer]) glDeleteTextures(1, &source);
+        }
+        glFramebufferTextureLayer(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, 0, 0, 0);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, previousFbo);
+        glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, materials.texture);
+        glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+    }
+    invalidateRenderState();
+
+    GLenum err = glGetError();
+    if (err != GL_NO_ERROR) {
+        cerr << "OpenGL error while building the material array: " << err << endl;
+        failed = true;
+    }
+    int uploaded = 0, copied = 0;
+    for (LayerFill layerFill : fill) {
+        uploaded += layerFill == FILL_UPLOAD;
+        copied += layerFill == FILL_COPY;
+    }
+    cout << "Materials: " << MATERIAL_LAYERS << " layers of " << width << "x" << height << " (" << (cookedFormat ? cookedFormatName(internalFormat) : "RGBA8")
+        << ") built in " << chrono::duration<double, std::milli>(chrono::steady_clock::now() - start).count()
+        << " ms: " << uploaded << " uploaded from .ctex, " << copied << " copied, " << MATERIAL_LAYERS - uploaded - copied << " redrawn"
+        << (failed ? " - FAILED, some layers are empty" : "") << endl;
+    if (lastBuild) releaseMaterialSources();
+}
+
+void destroyMaterials() {
+    MaterialArray& materials = g_materials;
+    if (materials.texture != 0) glDeleteTextures(1, &materials.texture);
+    if (materials.fbo != 0) glDeleteFramebuffers(1, &materials.fbo);
+    if (materials.vao != 0) glDeleteVertexArrays(1, &materials.vao);
+    if (materials.copyProgram != 0) glDeleteProgram(materials.copyProgram);
+    materials.texture = materials.fbo = materials.vao = materials.copyProgram = 0;
+    for (int layer = 0; layer < MATERIAL_LAYERS; ++layer) {
+        materials.cooked[layer].file.close();
+        materials.sources[layer] = 0;
+    }
+    materials.complete = false;
+    materials.width = materials.height = 0;
+}
+
+
+// --- Uniform-буферы ---
+// Параметры шейдеров передаются тремя std140-блоками вместо отдельного glUniform* на каждый параметр:
+//  FrameBlock - камера, свет и настройки тесселяции (одни на кадр),
+//  ObjectBlock - преобразование и форма поверхности (на объект),
+//  MaterialBlock - коэффициенты освещения и смешивания текстур (на материал).
+// За кадр все блоки записываются в один слот кольцевого UBO и подключаются через glBindBufferRange -
+// число вызовов GL не зависит от числа параметров. Слот перезаписывается только после того, как GPU
+// закончил кадр, который его читал (fence), поэтому запись не ждет GPU и не требует копии в драйвере.
+const int UNIFORM_RING_FRAMES = 3;
+const GLuint FRAME_BLOCK_BINDING = 0;
+const GLuint OBJECT_BLOCK_BINDING = 1;
+const GLuint MATERIAL_BLOCK_BINDING = 2;
+
+// Объявления блоков; подставляются после #version во все стадии
+const GLchar uniformBlocksGlsl[] =
+"layout(std140) uniform FrameBlock {\n" \
+"	mat4 u_vp;\n" \
+"	vec3 u_viewPos; // Позиция камеры в мировом пространстве\n" \
+"	float u_tessPixelScale; // P[1][1] * высота кадра / 2 / желаемая длина ребра в пикселях\n" \
+"	vec3 u_lightPos; // Позиция источника света в мировом пространстве\n" \
+"	float u_maxTessLevel;\n" \
+"	vec3 u_lightColor;\n" \
+"	float u_TessLevelInner;\n" \
+"	float u_TessLevelOuter;\n" \
+"	bool u_adaptiveTess;\n" \
+"	bool u_cullPatches;\n" \
+"	bool u_backfaceCull;\n" \
+"	bool u_analyticDisplacement;\n" \
+"	float u_nearPlane;\n" \
+"};\n" \
+"\n" \
+"layout(std140) uniform ObjectBlock {\n" \
+"	mat4 u_model;\n" \
+"	mat3 u_normalMatrix;\n" \
+"	float u_sinAmplitude;\n" \
+"	float u_sinFrequency;\n" \
+"	float u_cullZBound; // Поверхность не выходит за |z| <= амплитуды смещения\n" \
+"	float u_planeSize;\n" \
+"	int u_gridSize;\n" \
+"};\n" \
+"\n" \
+"layout(std140) uniform MaterialBlock {\n" \
+"	vec3 u_ambientColor;\n" \
+"	float u_shininess;\n" \
+"	vec3 u_specularColor;\n" \
+"	float u_blendFactor; // 0.0 = texture1, 1.0 = texture2\n" \
+"};\n";
+
+// Те же блоки на стороне CPU в раскладке std140: vec3 + float занимают 16 байт, столбец mat3 - 16 байт, bool - 4 байта
+struct FrameUniforms {
+    glm::mat4 vp;
+    glm::vec3 viewPos; float tessPixelScale;
+    glm::vec3 lightPos; float maxTessLevel;
+    glm::vec3 lightColor; float tessLevelInner;
+    float tessLevelOuter; GLint adaptiveTess, cullPatches, backfaceCull;
+    GLint analyticDisplacement; float nearPlane; float padding[2];
+};
+
+struct ObjectUniforms {
+    glm::mat4 model;
+    glm::vec4 normalMatrix[3];
+    float sinAmplitude, sinFrequency, cullZBound, planeSize;
+    GLint gridSize; float padding[3];
+};
+
+struct MaterialUniforms {
+    glm::vec3 ambientColor; float shininess;
+    glm::vec3 specularColor; float blendFactor;
+};
+
+static_assert(sizeof(FrameUniforms) == 144 && sizeof(ObjectUniforms) == 144 && sizeof(MaterialUniforms) == 32, "std140 layout");
+
+struct UniformRing {
+    GLuint buffer = 0;
+    unsigned char* mapped = nullptr; // Постоянное отображение (только при persistent)
+    bool persistent = false;
+    GLsync fences[UNIFORM_RING_FRAMES] = {};
+    GLintptr objectOffset = 0, materialOffset = 0; // Смещения блоков внутри слота (FrameBlock - в начале)
+    GLsizeiptr slotSize = 0;
+    int slot = 0;
+};
+
+UniformRing g_uniformRing;
+
+static GLintptr alignOffset(GLintptr offset, GLint alignment) {
+    return (offset + alignment - 1) / alignment * alignment;
+}
+
+void createUniformRing() {
+    UniformRing& ring = g_uniformRing;
+    GLint alignment = 256;
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+    ring.objectOffset = alignOffset(sizeof(FrameUniforms), alignment);
+    ring.materialOffset = alignOffset(ring.objectOffset + sizeof(ObjectUniforms), alignment);
+    ring.slotSize = alignOffset(ring.materialOffset + sizeof(MaterialUniforms), alignment);
+    const GLsizeiptr size = ring.slotSize * UNIFORM_RING_FRAMES;
+
+    glGenBuffers(1, &ring.buffer);
+    glBindBuffer(GL_UNIFORM_BUFFER, ring.buffer);
+    ring.persistent = GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage;
+    if (ring.persistent) {
+        const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage(GL_UNIFORM_BUFFER, size, NULL, flags);
+        ring.mapped = (unsigned char*)glMapBufferRange(GL_UNIFORM_BUFFER, 0, size, flags);
+        if (!ring.mapped) {
+            cerr << "Failed to map the uniform ring persistently, mapping it every frame instead" << endl;
+            glDeleteBuffers(1, &ring.buffer);
+            glGenBuffers(1, &ring.buffer);
+            glBindBuffer(GL_UNIFORM_BUFFER, ring.buffer);
+            ring.persistent = false;
+        }
     }
-    return id;
+    if (!ring.persistent) {
+        glBufferData(GL_UNIFORM_BUFFER, size, NULL, GL_DYNAMIC_DRAW);
+    }
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    cout << "Uniform ring: " << UNIFORM_RING_FRAMES << " x " << ring.slotSize << " bytes ("
+        << (ring.persistent ? "persistently mapped" : "mapped per frame") << ")" << endl;
 }
 
-// --- Функция загрузки текстуры ---
-GLuint loadTexture(const std::string& path) {
-    GLuint textureID;
-    glGenTextures(1, &textureID);
+// Записывает блоки кадра в следующий слот кольца и подключает их к точкам привязки.
+// Ждет GPU, только если кадр, читавший этот слот UNIFORM_RING_FRAMES кадров назад, еще не выполнен.
+void uploadFrameUniforms(const FrameUniforms& frame, const ObjectUniforms& object, const MaterialUniforms& material) {
+    UniformRing& ring = g_uniformRing;
+    ring.slot = (ring.slot + 1) % UNIFORM_RING_FRAMES;
+    GLsync& fence = ring.fences[ring.slot];
+    if (fence) {
+        while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000ull) == GL_TIMEOUT_EXPIRED) {}
+        glDeleteSync(fence);
+        fence = 0;
+    }
 
-    int width, height, nrComponents;
-    // Указываем stb_image, что нужно перевернуть изображение по вертикали при загрузке
-    // т.к. OpenGL ожидает координату 0.0 по оси Y внизу текстуры, а изображения обычно имеют 0.0 наверху.
-    stbi_set_flip_vertically_on_load(true);
-    unsigned char* data = stbi_load(path.c_str(), &width, &height, &nrComponents, 0);
-    if (data) {
-        GLenum format;
-        if (nrComponents == 1)
-            format = GL_RED;
-        else if (nrComponents == 3)
-            format = GL_RGB;
-        else if (nrComponents == 4)
-            format = GL_RGBA;
-        else {
-            cerr << "Error loading texture '" << path << "': Unsupported number of components (" << nrComponents << ")" << endl;
-            stbi_image_free(data);
-            glDeleteTextures(1, &textureID);
-            return 0;
-        }
+    const GLintptr base = ring.slot * ring.slotSize;
+    unsigned char* slot = ring.mapped ? ring.mapped + base : nullptr;
+    if (!ring.persistent) {
+        // Слот свободен (fence выше), поэтому синхронизация драйвера не нужна
+        bindBuffer(GL_UNIFORM_BUFFER, ring.buffer);
+        slot = (unsigned char*)glMapBufferRange(GL_UNIFORM_BUFFER, base, ring.slotSize,
+            GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+    }
+    if (slot) {
+        memcpy(slot, &frame, sizeof(frame)); // Отображение когерентное - сброс не нужен
+        memcpy(slot + ring.objectOffset, &object, sizeof(object));
+        memcpy(slot + ring.materialOffset, &material, sizeof(material));
+    }
+    if (!ring.persistent && slot) {
+        glUnmapBuffer(GL_UNIFORM_BUFFER);
+    }
 
-        glBindTexture(GL_TEXTURE_2D, textureID);
-        glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
-        glGenerateMipmap(GL_TEXTURE_2D); // Генерация мипмапов
+    bindBufferRange(GL_UNIFORM_BUFFER, FRAME_BLOCK_BINDING, ring.buffer, base, sizeof(FrameUniforms));
+    bindBufferRange(GL_UNIFORM_BUFFER, OBJECT_BLOCK_BINDING, ring.buffer, base + ring.objectOffset, sizeof(ObjectUniforms));
+    bindBufferRange(GL_UNIFORM_BUFFER, MATERIAL_BLOCK_BINDING, ring.buffer, base + ring.materialOffset, sizeof(MaterialUniforms));
+}
 
-        // Установка параметров текстуры
-        // Трилинейная фильтрация (GL_LINEAR_MIPMAP_LINEAR)
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR); // Трилинейная для минимизации
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR); // Билинейная для увеличения
+// Ставится после последней команды кадра, читающей текущий слот
+void fenceFrameUniforms() {
+    g_uniformRing.fences[g_uniformRing.slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
 
-        // Анизотропная фильтрация (если поддерживается)
-        if (glewIsSupported("GL_EXT_texture_filter_anisotropic")) {
-            GLfloat maxAnisotropy;
-            glGetFloatv(GL_MAX_TEXTURE_MAX_ANISOTROPY_EXT, &maxAnisotropy);
-            glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, maxAnisotropy);
-            cout << "Anisotropic filtering enabled for '" << path << "' with max level: " << maxAnisotropy << endl;
-        }
-        else {
-            cout << "Anisotropic filtering not supported." << endl;
+void destroyUniformRing() {
+    UniformRing& ring = g_uniformRing;
+    for (GLsync& fence : ring.fences) {
+        if (fence) glDeleteSync(fence);
+        fence = 0;
+    }
+    if (ring.buffer != 0) {
+        if (ring.mapped) {
+            glBindBuffer(GL_UNIFORM_BUFFER, ring.buffer);
+            glUnmapBuffer(GL_UNIFORM_BUFFER);
+            glBindBuffer(GL_UNIFORM_BUFFER, 0);
+            ring.mapped = nullptr;
         }
-
-
-        stbi_image_free(data); // Освобождаем память изображения
-        cout << "Texture loaded successfully: '" << path << "' (" << width << "x" << height << ", " << nrComponents << " channels)" << endl;
+        glDeleteBuffers(1, &ring.buffer);
+        ring.buffer = 0;
     }
-    else {
-        cerr << "Texture failed to load at path: " << path << endl;
-        cerr << "STB Error: " << stbi_failure_reason() << endl;
-        glDeleteTextures(1, &textureID);
-        return 0;
+}
+
+// Связывает блоки программы с точками привязки кольца (привязки не входят в двоичный кэш, поэтому каждый раз)
+// и один раз задает текстурный юнит массива материалов - он не меняется от кадра к кадру.
+// Compute-программе (drawProgram = false) нужны только FrameBlock и ObjectBlock, сэмплеров у нее нет.
+bool setupProgramUniforms(GLuint program, const char* name, bool drawProgram = true) {
+    struct { const char* name; GLuint binding; GLint size; } blocks[] = {
+        { "FrameBlock", FRAME_BLOCK_BINDING, (GLint)sizeof(FrameUniforms) },
+        { "ObjectBlock", OBJECT_BLOCK_BINDING, (GLint)sizeof(ObjectUniforms) },
+        { "MaterialBlock", MATERIAL_BLOCK_BINDING, (GLint)sizeof(MaterialUniforms) },
+    };
+    bool blocksOk = true;
+    for (auto& block : blocks) {
+        if (!drawProgram && block.binding == MATERIAL_BLOCK_BINDING) continue;
+        GLuint index = glGetUniformBlockIndex(program, block.name);
+        GLint dataSize = 0;
+        if (index != GL_INVALID_INDEX) glGetActiveUniformBlockiv(program, index, GL_UNIFORM_BLOCK_DATA_SIZE, &dataSize);
+        if (index == GL_INVALID_INDEX || dataSize > block.size) {
+            cerr << "Uniform block '" << block.name << "' of the " << name << " program not found or larger than "
+                << block.size << " bytes!" << endl;
+            blocksOk = false;
+            continue;
+        }
+        glUniformBlockBinding(program, index, block.binding);
     }
+    if (!drawProgram) return blocksOk;
 
-    glBindTexture(GL_TEXTURE_2D, 0); // Отвязываем текстуру
-    return textureID;
+    GLint materialsLocation = glGetUniformLocation(program, "u_materials");
+    if (materialsLocation == -1) { cerr << "Uniform 'u_materials' not found!" << endl; blocksOk = false; }
+    glUseProgram(program);
+    glUniform1i(materialsLocation, MATERIAL_TEXTURE_UNIT);
+    glUseProgram(0);
+    return blocksOk;
 }
 
 
 // --- Шейдеры ---
 
+// Общий для шейдеров код: высота и нормаль синусоидальной поверхности (как calculateSurfaceData на CPU).
+// Подставляется после #version вместе с #define вариантов и uniformBlocksGlsl (параметры - из ObjectBlock).
+const GLchar surfaceGlsl[] =
+"void calculateSurfaceData(vec2 p, out float z, out vec3 normal) {\n" \
+"	float r = length(p);\n" \
+"	z = u_sinAmplitude * sin(u_sinFrequency * r);\n" \
+"	// Градиент (dz/dx, dz/dy); в центре нормаль смотрит строго вверх\n" \
+"	vec2 grad = r > 1e-6 ? (u_sinAmplitude * u_sinFrequency * cos(u_sinFrequency * r) / r) * p : vec2(0.0);\n" \
+"	normal = normalize(vec3(-grad, 1.0));\n" \
+"}\n";
+
 // Вершинный шейдер (Добавлены текстурные координаты)
+// При PACKED_VERTICES x, y и текстурные координаты восстанавливаются из номера вершины регулярной сетки,
+// нормаль - из октаэдрического кодирования, высота приходит как half float.
+// При PROCEDURAL_VERTICES атрибутов нет совсем: высота и нормаль вычисляются через calculateSurfaceData.
 const GLchar vsh[] =
 "#version 410 core\n" \
+"#if defined(PACKED_VERTICES)\n" \
+"layout(location = 0) in vec2 a_octNormal; // snorm16 x 2, нормализуется в [-1, 1]\n" \
+"layout(location = 1) in float a_height; // half float\n" \
+"#elif !defined(PROCEDURAL_VERTICES)\n" \
 "layout(location = 0) in vec3 a_position;\n" \
 "layout(location = 1) in vec3 a_normal;\n" \
 "layout(location = 2) in vec2 a_texCoord;\n" /* Добавлено */ \
+"#endif\n" \
+"layout(location = 3) in vec4 a_instanceOffsetScale; // Атрибуты экземпляра (делитель 1)\n" \
+"layout(location = 4) in float a_instanceBlend;\n" \
+"layout(location = 5) in uvec2 a_instanceLayers; // Слои массива материалов\n" \
 "\n" \
 "out VS_OUT {\n" \
 "	vec3 localPos; // Позиция в локальных координатах модели\n" \
 "	vec3 localNormal; // Нормаль в локальных координатах модели\n" \
 "   vec2 texCoord; // Текстурные координаты \n" /* Добавлено */ \
+"	vec4 instanceOffsetScale;\n" \
+"	float instanceBlend;\n" \
+"	uvec2 instanceLayers;\n" \
 "} vs_out;\n" \
 "\n" \
+"#ifdef PACKED_VERTICES\n" \
+"vec3 octDecode(vec2 e) {\n" \
+"	vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));\n" \
+"	if (n.z < 0.0) n.xy = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);\n" \
+"	return normalize(n);\n" \
+"}\n" \
+"#endif\n" \
+"\n" \
+"// Текстурные координаты вершины регулярной сетки (u_gridSize + 1) x (u_gridSize + 1) по ее номеру\n" \
+"vec2 gridTexCoord() {\n" \
+"	int row = gl_VertexID / (u_gridSize + 1);\n" \
+"	int col = gl_VertexID - row * (u_gridSize + 1);\n" \
+"	return vec2(col, row) / float(u_gridSize);\n" \
+"}\n" \
+"\n" \
 "void main() {\n" \
+"	vs_out.instanceOffsetScale = a_instanceOffsetScale;\n" \
+"	vs_out.instanceBlend = a_instanceBlend;\n" \
+"	vs_out.instanceLayers = a_instanceLayers;\n" \
+"#if defined(PACKED_VERTICES)\n" \
+"	vec2 uv = gridTexCoord();\n" \
+"	vs_out.localPos = vec3((uv - 0.5) * u_planeSize, a_height);\n" \
+"	vs_out.localNormal = octDecode(a_octNormal);\n" \
+"	vs_out.texCoord = uv;\n" \
+"#elif defined(PROCEDURAL_VERTICES)\n" \
+"	vec2 uv = gridTexCoord();\n" \
+"	vec2 p = (uv - 0.5) * u_planeSize;\n" \
+"	float z;\n" \
+"	calculateSurfaceData(p, z, vs_out.localNormal);\n" \
+"	vs_out.localPos = vec3(p, z);\n" \
+"	vs_out.texCoord = uv;\n" \
+"#else\n" \
 "	vs_out.localPos = a_position;\n" \
 "	vs_out.localNormal = a_normal;\n" \
 "   vs_out.texCoord = a_texCoord;\n" /* Добавлено */ \
+"#endif\n" \
 "}\n";
 
 // Тесселяционный контрольный шейдер (Пробрасывает текстурные координаты)
+// При u_adaptiveTess уровень каждого внешнего ребра = его экранная длина / желаемая длина ребра треугольника.
+// Длина оценивается по сфере, описанной вокруг ребра (не зависит от ориентации ребра к камере), и зависит
+// только от концов ребра - соседние патчи получают одинаковый уровень на общем ребре, трещин нет.
+// При u_cullPatches патч, ограничивающий параллелепипед которого (с учетом амплитуды смещения) целиком
+// лежит вне одной из плоскостей пирамиды видимости, получает уровни 0 и отбрасывается до тесселятора.
 const GLchar tcsh[] =
 "#version 410 core\n" \
+"#extension GL_ARB_shader_atomic_counters : enable // Используется только при PATCH_CULL_COUNTER\n" \
+"#ifdef PATCH_CULL_COUNTER\n" \
+"layout(binding = 0, offset = 0) uniform atomic_uint u_culledPatches;\n" \
+"#endif\n" \
 "layout(vertices = 3) out;\n" \
 "\n" \
 "in VS_OUT {\n" \
 "	vec3 localPos;\n" \
 "	vec3 localNormal;\n" \
 "   vec2 texCoord;\n" /* Добавлено */ \
+"	vec4 instanceOffsetScale;\n" \
+"	float instanceBlend;\n" \
+"	uvec2 instanceLayers;\n" \
 "} vs_in[];\n" \
 "\n" \
 "out TCS_OUT {\n" \
 "	vec3 localPos;\n" \
 "	vec3 localNormal;\n" \
 "   vec2 texCoord;\n" /* Добавлено */ \
+"	vec4 instanceOffsetScale;\n" \
+"	float instanceBlend;\n" \
+"	uvec2 instanceLayers;\n" \
 "} tcs_out[];\n" \
 "\n" \
-"// Можно задать через uniform (значения по умолчанию)\n" \
-"uniform float u_TessLevelInner = 16.0;\n" \
-"uniform float u_TessLevelOuter = 16.0;\n" \
+"// Модельная матрица экземпляра: смещение и равномерный масштаб поверх u_model\n" \
+"mat4 instanceModel() {\n" \
+"	vec4 os = vs_in[0].instanceOffsetScale;\n" \
+"	return mat4(vec4(os.w, 0.0, 0.0, 0.0), vec4(0.0, os.w, 0.0, 0.0), vec4(0.0, 0.0, os.w, 0.0), vec4(os.xyz, 1.0)) * u_model;\n" \
+"}\n" \
+"\n" \
+"float edgeTessLevel(vec3 a, vec3 b) {\n" \
+"	mat4 model = instanceModel();\n" \
+"	vec3 worldA = vec3(model * vec4(a, 1.0));\n" \
+"	vec3 worldB = vec3(model * vec4(b, 1.0));\n" \
+"	vec3 worldCenter = 0.5 * (worldA + worldB);\n" \
+"	float depth = (u_vp * vec4(worldCenter, 1.0)).w;\n" \
+"	// Середина ребра у ближней плоскости или за камерой: глубина w там близка к нулю или отрицательна,\n" \
+"	// поэтому ребро проецируется с расстояния до камеры, но не ближе ближней плоскости\n" \
+"	if (depth <= u_nearPlane) depth = max(distance(worldCenter, u_viewPos), u_nearPlane);\n" \
+"	float diameter = distance(worldA, worldB);\n" \
+"	float level = diameter * u_tessPixelScale / depth;\n" \
+"	return clamp(level, 1.0, u_maxTessLevel);\n" \
+"}\n" \
+"\n" \
+"// Все 8 углов параллелепипеда патча снаружи одной и той же плоскости отсечения (в пространстве отсечения)\n" \
+"bool outsideFrustum() {\n" \
+"	vec3 lo = min(vs_in[0].localPos, min(vs_in[1].localPos, vs_in[2].localPos));\n" \
+"	vec3 hi = max(vs_in[0].localPos, max(vs_in[1].localPos, vs_in[2].localPos));\n" \
+"	lo.z = min(lo.z, -u_cullZBound);\n" \
+"	hi.z = max(hi.z, u_cullZBound);\n" \
+"	mat4 mvp = u_vp * instanceModel();\n" \
+"	vec3 allLow = vec3(1.0), allHigh = vec3(1.0); // 1 - пока все углы снаружи плоскости\n" \
+"	for (int i = 0; i < 8; ++i) {\n" \
+"		vec3 corner = vec3((i & 1) != 0 ? hi.x : lo.x, (i & 2) != 0 ? hi.y : lo.y, (i & 4) != 0 ? hi.z : lo.z);\n" \
+"		vec4 clip = mvp * vec4(corner, 1.0);\n" \
+"		allLow *= vec3(lessThan(clip.xyz, vec3(-clip.w)));\n" \
+"		allHigh *= vec3(greaterThan(clip.xyz, vec3(clip.w)));\n" \
+"	}\n" \
+"	return max(max(allLow.x, allLow.y), max(allLow.z, max(allHigh.x, max(allHigh.y, allHigh.z)))) > 0.0;\n" \
+"}\n" \
+"\n" \
+"// Конус нормалей в углах патча целиком отвернут от камеры. Нормали внутри патча не учитываются,\n" \
+"// поэтому на сильно изогнутых патчах тест приблизительный (по умолчанию выключен).\n" \
+"bool backfacing() {\n" \
+"	vec3 n0 = normalize(u_normalMatrix * vs_in[0].localNormal);\n" \
+"	vec3 n1 = normalize(u_normalMatrix * vs_in[1].localNormal);\n" \
+"	vec3 n2 = normalize(u_normalMatrix * vs_in[2].localNormal);\n" \
+"	vec3 axis = normalize(n0 + n1 + n2);\n" \
+"	float cosCone = min(dot(axis, n0), min(dot(axis, n1), dot(axis, n2)));\n" \
+"	if (cosCone <= 0.0) return false;\n" \
+"	float sinCone = sqrt(1.0 - cosCone * cosCone);\n" \
+"	mat4 model = instanceModel();\n" \
+"	for (int i = 0; i < 3; ++i) {\n" \
+"		vec3 toPatch = normalize(vec3(model * vec4(vs_in[i].localPos, 1.0)) - u_viewPos);\n" \
+"		if (dot(axis, toPatch) <= sinCone) return false;\n" \
+"	}\n" \
+"	return true;\n" \
+"}\n" \
 "\n" \
 "void main() {\n" \
 "	tcs_out[gl_InvocationID].localPos = vs_in[gl_InvocationID].localPos;\n" \
 "	tcs_out[gl_InvocationID].localNormal = vs_in[gl_InvocationID].localNormal;\n" \
 "   tcs_out[gl_InvocationID].texCoord = vs_in[gl_InvocationID].texCoord;\n" /* Добавлено */ \
+"	tcs_out[gl_InvocationID].instanceOffsetScale = vs_in[gl_InvocationID].instanceOffsetScale;\n" \
+"	tcs_out[gl_InvocationID].instanceBlend = vs_in[gl_InvocationID].instanceBlend;\n" \
+"	tcs_out[gl_InvocationID].instanceLayers = vs_in[gl_InvocationID].instanceLayers;\n" \
 "\n" \
 "	// Уровни тесселяции устанавливаем только один раз (в вызове 0)\n" \
 "	if (gl_InvocationID == 0) {\n" \
-"		gl_TessLevelInner[0] = u_TessLevelInner;\n" \
-"		gl_TessLevelOuter[0] = u_TessLevelOuter;\n" \
-"		gl_TessLevelOuter[1] = u_TessLevelOuter;\n" \
-"		gl_TessLevelOuter[2] = u_TessLevelOuter;\n" \
+"		if ((u_cullPatches && outsideFrustum()) || (u_backfaceCull && backfacing())) {\n" \
+"			gl_TessLevelInner[0] = 0.0;\n" \
+"			gl_TessLevelOuter[0] = 0.0;\n" \
+"			gl_TessLevelOuter[1] = 0.0;\n" \
+"			gl_TessLevelOuter[2] = 0.0;\n" \
+"#ifdef PATCH_CULL_COUNTER\n" \
+"			atomicCounterIncrement(u_culledPatches);\n" \
+"#endif\n" \
+"		}\n" \
+"		else if (u_adaptiveTess) {\n" \
+"			// Внешний уровень i относится к ребру напротив вершины i\n" \
+"			gl_TessLevelOuter[0] = edgeTessLevel(vs_in[1].localPos, vs_in[2].localPos);\n" \
+"			gl_TessLevelOuter[1] = edgeTessLevel(vs_in[2].localPos, vs_in[0].localPos);\n" \
+"			gl_TessLevelOuter[2] = edgeTessLevel(vs_in[0].localPos, vs_in[1].localPos);\n" \
+"			gl_TessLevelInner[0] = max(gl_TessLevelOuter[0], max(gl_TessLevelOuter[1], gl_TessLevelOuter[2]));\n" \
+"		}\n" \
+"		else {\n" \
+"			gl_TessLevelInner[0] = u_TessLevelInner;\n" \
+"			gl_TessLevelOuter[0] = u_TessLevelOuter;\n" \
+"			gl_TessLevelOuter[1] = u_TessLevelOuter;\n" \
+"			gl_TessLevelOuter[2] = u_TessLevelOuter;\n" \
+"		}\n" \
 "	}\n" \
 "}\n";
 
-// Тесселяционный оценочный шейдер: Интерполирует атрибуты (включая текстурные координаты), вычисляет позицию и нормаль
+// Тесселяционный оценочный шейдер: Интерполирует атрибуты (включая текстурные координаты), вычисляет позицию и нормаль.
+// При u_analyticDisplacement высота и нормаль заново вычисляются по формуле поверхности в каждой сгенерированной вершине,
+// так что тесселяция добавляет реальную геометрию, а не только треугольники в плоскости патча.
 const GLchar tesh[] =
 "#version 410 core\n" \
 "layout(triangles, equal_spacing, ccw) in;\n" \
@@ -302,18 +1943,19 @@ const GLchar tesh[] =
 "	vec3 localPos;\n" \
 "	vec3 localNormal;\n" \
 "   vec2 texCoord;\n" /* Добавлено */ \
+"	vec4 instanceOffsetScale;\n" \
+"	float instanceBlend;\n" \
+"	uvec2 instanceLayers;\n" \
 "} tcs_in[];\n" \
 "\n" \
 "out TES_OUT {\n" \
 "	vec3 worldPos;\n" \
 "	vec3 worldNormal;\n" \
 "   vec2 texCoord;\n" /* Добавлено */ \
+"	flat float blendOffset; // Сдвиг коэффициента смешивания экземпляра\n" \
+"	flat uvec2 layers; // Пара слоев массива материалов\n" \
 "} tes_out;\n" \
 "\n" \
-"uniform mat4 u_model; \n" \
-"uniform mat3 u_normalMatrix; \n" \
-"uniform mat4 u_vp; \n" \
-"\n" \
 "vec3 interpolateVec3(vec3 v0, vec3 v1, vec3 v2) {\n" \
 "	return vec3(gl_TessCoord.x) * v0 + vec3(gl_TessCoord.y) * v1 + vec3(gl_TessCoord.z) * v2;\n" \
 "}\n" \
@@ -324,10 +1966,22 @@ const GLchar tesh[] =
 "\n" \
 "void main() {\n" \
 "	vec3 localPos = interpolateVec3(tcs_in[0].localPos, tcs_in[1].localPos, tcs_in[2].localPos);\n" \
-"	vec3 localNormal = interpolateVec3(tcs_in[0].localNormal, tcs_in[1].localNormal, tcs_in[2].localNormal);\n" \
+"	vec3 localNormal;\n" \
 "   tes_out.texCoord = interpolateVec2(tcs_in[0].texCoord, tcs_in[1].texCoord, tcs_in[2].texCoord);\n" /* Добавлено */ \
 "\n" \
-"	tes_out.worldPos = vec3(u_model * vec4(localPos, 1.0));\n" \
+"	if (u_analyticDisplacement) {\n" \
+"		// Точка на поверхности z = f(x, y) и аналитическая нормаль в ней\n" \
+"		calculateSurfaceData(localPos.xy, localPos.z, localNormal);\n" \
+"	}\n" \
+"	else {\n" \
+"		localNormal = interpolateVec3(tcs_in[0].localNormal, tcs_in[1].localNormal, tcs_in[2].localNormal);\n" \
+"	}\n" \
+"\n" \
+"	vec4 os = tcs_in[0].instanceOffsetScale;\n" \
+"	mat4 instance = mat4(vec4(os.w, 0.0, 0.0, 0.0), vec4(0.0, os.w, 0.0, 0.0), vec4(0.0, 0.0, os.w, 0.0), vec4(os.xyz, 1.0));\n" \
+"	tes_out.worldPos = vec3(instance * u_model * vec4(localPos, 1.0));\n" \
+"	tes_out.blendOffset = tcs_in[0].instanceBlend;\n" \
+"	tes_out.layers = tcs_in[0].instanceLayers;\n" \
 "\n" \
 "	// Нормаль должна быть интерполирована и трансформирована. \n" \
 "   // Важно: нормализация происходит после трансформации, чтобы избежать проблем с масштабированием.\n" \
@@ -344,31 +1998,22 @@ const GLchar fsh[] =
 "   vec3 worldPos;\n" \
 "   vec3 worldNormal;\n" \
 "   vec2 texCoord;\n" /* Добавлено */ \
+"   flat float blendOffset;\n" \
+"   flat uvec2 layers;\n" \
 "} fs_in;\n" \
 "\n" \
 "out vec4 o_color;\n" \
 "\n" \
-"uniform vec3 u_lightPos; // Позиция источника света в мировом пространстве\n" \
-"uniform vec3 u_lightColor; // Цвет света\n" \
-"uniform vec3 u_viewPos; // Позиция камеры в мировом пространстве\n" \
-"\n" \
-"uniform vec3 u_ambientColor;\n" \
-// "uniform vec3 u_diffuseColor;" // Заменено текстурами \n"
-"uniform vec3 u_specularColor;\n" \
-"uniform float u_shininess;\n" \
-"\n" \
-"// Новые uniforms для текстур и смешивания\n" \
-"uniform sampler2D u_texture1;\n" \
-"uniform sampler2D u_texture2;\n" \
-"uniform float u_blendFactor; // 0.0 = texture1, 1.0 = texture2\n" \
+"// Свет, камера и материал приходят из FrameBlock и MaterialBlock\n" \
+"uniform sampler2DArray u_materials; // Все текстуры - слои одного массива\n" \
 "\n" \
 "void main() {\n" \
-"   // Получаем цвета из обеих текстур\n" \
-"   vec4 texColor1 = texture(u_texture1, fs_in.texCoord);\n" \
-"   vec4 texColor2 = texture(u_texture2, fs_in.texCoord);\n" \
+"   // Получаем цвета из обеих текстур пары\n" \
+"   vec4 texColor1 = texture(u_materials, vec3(fs_in.texCoord, float(fs_in.layers.x)));\n" \
+"   vec4 texColor2 = texture(u_materials, vec3(fs_in.texCoord, float(fs_in.layers.y)));\n" \
 "\n" \
 "   // Смешиваем цвета текстур\n" \
-"   vec3 diffuseColor = mix(texColor1.rgb, texColor2.rgb, u_blendFactor);\n" \
+"   vec3 diffuseColor = mix(texColor1.rgb, texColor2.rgb, clamp(u_blendFactor + fs_in.blendOffset, 0.0, 1.0));\n" \
 "\n" \
 "	vec3 N = normalize(fs_in.worldNormal);\n" \
 "	vec3 L = normalize(u_lightPos - fs_in.worldPos); // Направление к свету\n" \
@@ -395,72 +2040,42 @@ const GLchar fsh[] =
 "}\n";
 
 
-bool createShaderProgram() {
-
-    GLuint vS = createShader(vsh, GL_VERTEX_SHADER);
-    GLuint tcS = createShader(tcsh, GL_TESS_CONTROL_SHADER);
-    GLuint teS = createShader(tesh, GL_TESS_EVALUATION_SHADER);
-    GLuint fS = createShader(fsh, GL_FRAGMENT_SHADER);
+// Вставляет строки #define сразу после строки #version и директив #extension (они должны идти до любых объявлений)
+std::string withDefines(const GLchar* source, const std::string& defines) {
+    std::string code = source;
+    size_t lineEnd = code.find('\n');
+    while (lineEnd != std::string::npos && code.compare(lineEnd + 1, 10, "#extension") == 0) {
+        lineEnd = code.find('\n', lineEnd + 1);
+    }
+    if (defines.empty() || lineEnd == std::string::npos) return code;
+    return code.insert(lineEnd + 1, defines);
+}
 
+// Набор #define для вариантов шейдеров в зависимости от текущих настроек
+std::string shaderDefines() {
+    std::string defines;
+    if (g_vertexFormat == VERTEX_FORMAT_PACKED) defines += "#define PACKED_VERTICES\n";
+    if (g_vertexFormat == VERTEX_FORMAT_PROCEDURAL) defines += "#define PROCEDURAL_VERTICES\n";
+    if (g_patchCounterSupported) defines += "#define PATCH_CULL_COUNTER\n";
+    return defines;
+}
 
-    if (vS == 0 || tcS == 0 || teS == 0 || fS == 0) {
-        if (vS) glDeleteShader(vS);
-        if (tcS) glDeleteShader(tcS);
-        if (teS) glDeleteShader(teS);
-        if (fS) glDeleteShader(fS);
-        return false;
-    }
+bool createShaderProgram() {
+    const std::string defines = shaderDefines();
+    ProgramSources sources;
+    sources.vertex = withDefines(vsh, defines + uniformBlocksGlsl + surfaceGlsl);
+    sources.tessControl = withDefines(tcsh, defines + uniformBlocksGlsl);
+    sources.tessEval = withDefines(tesh, defines + uniformBlocksGlsl + surfaceGlsl);
+    sources.fragment = withDefines(fsh, uniformBlocksGlsl);
 
-    g_object.shaderProgram = createProgram(vS, tcS, teS, fS);
+    g_object.shaderProgram = buildProgram(sources, "surface");
 
     if (g_object.shaderProgram == 0) {
         return false;
     }
 
-    // Получение uniform location для старых uniforms
-    g_object.u_Model = glGetUniformLocation(g_object.shaderProgram, "u_model");
-    g_object.u_NormalMatrix = glGetUniformLocation(g_object.shaderProgram, "u_normalMatrix");
-    g_object.u_VP = glGetUniformLocation(g_object.shaderProgram, "u_vp");
-    g_object.u_LightPos = glGetUniformLocation(g_object.shaderProgram, "u_lightPos");
-    g_object.u_ViewPos = glGetUniformLocation(g_object.shaderProgram, "u_viewPos");
-    g_object.u_LightColor = glGetUniformLocation(g_object.shaderProgram, "u_lightColor");
-    g_object.u_AmbientColor = glGetUniformLocation(g_object.shaderProgram, "u_ambientColor");
-    // g_object.u_DiffuseColor = glGetUniformLocation(g_object.shaderProgram, "u_diffuseColor"); // Удалено
-    g_object.u_SpecularColor = glGetUniformLocation(g_object.shaderProgram, "u_specularColor");
-    g_object.u_Shininess = glGetUniformLocation(g_object.shaderProgram, "u_shininess");
-    g_object.u_TessLevelInner = glGetUniformLocation(g_object.shaderProgram, "u_TessLevelInner");
-    g_object.u_TessLevelOuter = glGetUniformLocation(g_object.shaderProgram, "u_TessLevelOuter");
-
-    // Получение uniform location для новых uniforms текстур
-    g_object.u_Texture1 = glGetUniformLocation(g_object.shaderProgram, "u_texture1");
-    g_object.u_Texture2 = glGetUniformLocation(g_object.shaderProgram, "u_texture2");
-    g_object.u_BlendFactor = glGetUniformLocation(g_object.shaderProgram, "u_blendFactor");
-
-
-    // Проверка всех uniforms
-    bool uniforms_ok = true;
-    if (g_object.u_Model == -1) { cerr << "Uniform 'u_model' not found!" << endl; uniforms_ok = false; }
-    if (g_object.u_NormalMatrix == -1) { cerr << "Uniform 'u_normalMatrix' not found!" << endl; uniforms_ok = false; }
-    if (g_object.u_VP == -1) { cerr << "Uniform 'u_vp' not found!" << endl; uniforms_ok = false; }
-    if (g_object.u_LightPos == -1) { cerr << "Uniform 'u_lightPos' not found!" << endl; uniforms_ok = false; }
-    if (g_object.u_ViewPos == -1) { cerr << "Uniform 'u_viewPos' not found!" << endl; uniforms_ok = false; }
-    if (g_object.u_LightColor == -1) { cerr << "Uniform 'u_lightColor' not found!" << endl; uniforms_ok = false; }
-    if (g_object.u_AmbientColor == -1) { cerr << "Uniform 'u_ambientColor' not found!" << endl; uniforms_ok = false; }
-    if (g_object.u_SpecularColor == -1) { cerr << "Uniform 'u_specularColor' not found!" << endl; uniforms_ok = false; }
-    if (g_object.u_Shininess == -1) { cerr << "Uniform 'u_shininess' not found!" << endl; uniforms_ok = false; }
-
-    // Проверка новых uniforms
-    if (g_object.u_Texture1 == -1) { cerr << "Uniform 'u_texture1' not found!" << endl; uniforms_ok = false; }
-    if (g_object.u_Texture2 == -1) { cerr << "Uniform 'u_texture2' not found!" << endl; uniforms_ok = false; }
-    if (g_object.u_BlendFactor == -1) { cerr << "Uniform 'u_blendFactor' not found!" << endl; uniforms_ok = false; }
-
-    // Опциональные uniforms тесселяции
-    if (g_object.u_TessLevelInner == -1) { cout << "Optional uniform 'u_TessLevelInner' not found." << endl; }
-    if (g_object.u_TessLevelOuter == -1) { cout << "Optional uniform 'u_TessLevelOuter' not found." << endl; }
-
-
-    if (!uniforms_ok) {
-        cerr << "Failed to get all required uniform locations." << endl;
+    if (!setupProgramUniforms(g_object.shaderProgram, "surface")) {
+        cerr << "Failed to set up the surface program uniforms." << endl;
         glDeleteProgram(g_object.shaderProgram);
         g_object.shaderProgram = 0;
         return false;
@@ -497,17 +2112,71 @@ void calculateSurfaceData(float x, float y, float& z, glm::vec3& normal) {
 }
 
 
-bool createModel() {
-    vector<float> vertices;
-    vector<unsigned int> indices;
+// --- Генерация сетки поверхности ---
+
+const int SURFACE_VERTEX_FLOATS = 8; // 3 pos + 3 normal + 2 texcoord
+
+// Упакованная вершина: x, y, u, v не хранятся - они восстанавливаются в вершинном шейдере из gl_VertexID
+struct PackedSurfaceVertex {
+    int16_t octNormal[2]; // Октаэдрическое кодирование единичной нормали, snorm16
+    uint16_t height;      // Высота z в формате half float
+    uint16_t padding;     // Выравнивание вершины до 4 байт
+};
+
+size_t vertexStride(VertexFormat format) {
+    switch (format) {
+    case VERTEX_FORMAT_PACKED: return sizeof(PackedSurfaceVertex);
+    case VERTEX_FORMAT_PROCEDURAL: return 0; // Вершинных данных нет
+    default: return SURFACE_VERTEX_FLOATS * sizeof(float);
+    }
+}
+
+const char* vertexFormatName(VertexFormat format) {
+    switch (format) {
+    case VERTEX_FORMAT_PACKED: return "packed";
+    case VERTEX_FORMAT_PROCEDURAL: return "procedural";
+    default: return "float";
+    }
+}
+
+// float -> half (IEEE 754 binary16) с округлением к ближайшему; денормализованные half сбрасываются в 0
+uint16_t floatToHalf(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    uint16_t sign = (uint16_t)((bits >> 16) & 0x8000u);
+    int32_t exponent = (int32_t)((bits >> 23) & 0xFFu) - 127 + 15;
+    uint32_t mantissa = bits & 0x7FFFFFu;
+    if (exponent <= 0) return sign; // Слишком малое значение
+    if (exponent >= 31) return (uint16_t)(sign | 0x7C00u); // Переполнение -> бесконечность
+    uint32_t half = ((uint32_t)exponent << 10) | (mantissa >> 13);
+    if ((mantissa & 0x1FFFu) > 0x1000u || ((mantissa & 0x1FFFu) == 0x1000u && (half & 1u))) ++half;
+    return (uint16_t)(sign | half);
+}
+
+// Октаэдрическое кодирование нормали в два snorm16
+void octEncode(float nx, float ny, float nz, int16_t out[2]) {
+    float invL1 = 1.0f / (std::fabs(nx) + std::fabs(ny) + std::fabs(nz));
+    float px = nx * invL1, py = ny * invL1;
+    if (nz < 0.0f) {
+        float ox = (1.0f - std::fabs(py)) * (px >= 0.0f ? 1.0f : -1.0f);
+        float oy = (1.0f - std::fabs(px)) * (py >= 0.0f ? 1.0f : -1.0f);
+        px = ox;
+        py = oy;
+    }
+    out[0] = (int16_t)std::lround(glm::clamp(px, -1.0f, 1.0f) * 32767.0f);
+    out[1] = (int16_t)std::lround(glm::clamp(py, -1.0f, 1.0f) * 32767.0f);
+}
 
+// Исходный скалярный генератор: по вершине за раз через calculateSurfaceData и push_back.
+// Оставлен как эталон для проверки и замера (--bench-mesh).
+void generateSurfaceMeshScalar(int gridSize, vector<float>& vertices, vector<unsigned int>& indices) {
     const float halfSize = PLANE_SIZE * 0.5f;
-    const float step = PLANE_SIZE / GRID_SIZE;
-    const int numVerticesPerRow = GRID_SIZE + 1;
+    const float step = PLANE_SIZE / gridSize;
+    const int numVerticesPerRow = gridSize + 1;
 
     // Генерируем вершины, нормали и текстурные координаты для сетки (N+1)x(N+1)
-    for (int i = 0; i <= GRID_SIZE; ++i) { // Y (строки)
-        for (int j = 0; j <= GRID_SIZE; ++j) { // X (столбцы)
+    for (int i = 0; i <= gridSize; ++i) { // Y (строки)
+        for (int j = 0; j <= gridSize; ++j) { // X (столбцы)
             float x = -halfSize + j * step;
             float y = -halfSize + i * step;
             float z;
@@ -516,8 +2185,8 @@ bool createModel() {
             calculateSurfaceData(x, y, z, normal);
 
             // Текстурные координаты (u, v) отображаются от 0 до 1 по всей плоскости
-            float u = (float)j / GRID_SIZE;
-            float v = (float)i / GRID_SIZE;
+            float u = (float)j / gridSize;
+            float v = (float)i / gridSize;
 
             // Добавляем данные вершины: позиция (3), нормаль (3), текстурные координаты (2)
             vertices.push_back(x);
@@ -534,8 +2203,8 @@ bool createModel() {
     }
 
     // Генерируем индексы для треугольников (патчи по 3 вершины)
-    for (int i = 0; i < GRID_SIZE; ++i) {
-        for (int j = 0; j < GRID_SIZE; ++j) {
+    for (int i = 0; i < gridSize; ++i) {
+        for (int j = 0; j < gridSize; ++j) {
             unsigned int idx00 = i * numVerticesPerRow + j;       // (i, j)     Bottom-left
             unsigned int idx10 = idx00 + 1;                   // (i, j+1)   Bottom-right
             unsigned int idx01 = idx00 + numVerticesPerRow;     // (i+1, j)   Top-left
@@ -552,6 +2221,320 @@ bool createModel() {
             indices.push_back(idx11);
         }
     }
+}
+
+// Вычисляет высоту и нормаль для строки вершин с общей координатой y (структура массивов).
+typedef void (*SurfaceRowFunc)(const float* xs, float y, int count, float* z, float* nx, float* ny, float* nz);
+
+void evaluateSurfaceRowScalar(const float* xs, float y, int count, float* z, float* nx, float* ny, float* nz) {
+    for (int j = 0; j < count; ++j) {
+        glm::vec3 normal;
+        calculateSurfaceData(xs[j], y, z[j], normal);
+        nx[j] = normal.x;
+        ny[j] = normal.y;
+        nz[j] = normal.z;
+    }
+}
+
+#ifdef MESH_SIMD_X86
+// Приближения sin/cos (как в cephes sinf/cosf): редукция к [-pi/4, pi/4] по квадрантам
+// (pi/2 разбито на три части по Коди-Уэйту) и минимаксные полиномы. Погрешность ~1e-7 для |x| < 1e4.
+const float SINCOS_TWO_OVER_PI = 0.636619772367581343f;
+const float SINCOS_PIO2_1 = 1.5703125f;
+const float SINCOS_PIO2_2 = 4.837512969970703125e-4f;
+const float SINCOS_PIO2_3 = 7.54978995489188216e-8f;
+const float SIN_P0 = -1.9515295891e-4f, SIN_P1 = 8.3321608736e-3f, SIN_P2 = -1.6666654611e-1f;
+const float COS_P0 = 2.443315711809948e-5f, COS_P1 = -1.388731625493765e-3f, COS_P2 = 4.166664568298827e-2f;
+
+static inline void sincos4(__m128 x, __m128& outSin, __m128& outCos) {
+    __m128i q = _mm_cvtps_epi32(_mm_mul_ps(x, _mm_set1_ps(SINCOS_TWO_OVER_PI))); // Номер квадранта (округление к ближайшему)
+    __m128 qf = _mm_cvtepi32_ps(q);
+    __m128 r = _mm_sub_ps(x, _mm_mul_ps(qf, _mm_set1_ps(SINCOS_PIO2_1)));
+    r = _mm_sub_ps(r, _mm_mul_ps(qf, _mm_set1_ps(SINCOS_PIO2_2)));
+    r = _mm_sub_ps(r, _mm_mul_ps(qf, _mm_set1_ps(SINCOS_PIO2_3)));
+
+    __m128 r2 = _mm_mul_ps(r, r);
+    __m128 sp = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(SIN_P0), r2), _mm_set1_ps(SIN_P1));
+    sp = _mm_add_ps(_mm_mul_ps(sp, r2), _mm_set1_ps(SIN_P2));
+    sp = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(sp, r2), r), r);
+    __m128 cp = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(COS_P0), r2), _mm_set1_ps(COS_P1));
+    cp = _mm_add_ps(_mm_mul_ps(cp, r2), _mm_set1_ps(COS_P2));
+    cp = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(cp, r2), r2), _mm_sub_ps(_mm_set1_ps(1.0f), _mm_mul_ps(_mm_set1_ps(0.5f), r2)));
+
+    // Нечетный квадрант - sin и cos меняются местами; знаки определяются битом 1 у q (для sin) и q+1 (для cos)
+    const __m128i one = _mm_set1_epi32(1), two = _mm_set1_epi32(2);
+    __m128 swap = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(q, one), one));
+    __m128 sinSign = _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(q, two), 30));
+    __m128 cosSign = _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(_mm_add_epi32(q, one), two), 30));
+    outSin = _mm_xor_ps(_mm_or_ps(_mm_and_ps(swap, cp), _mm_andnot_ps(swap, sp)), sinSign);
+    outCos = _mm_xor_ps(_mm_or_ps(_mm_and_ps(swap, sp), _mm_andnot_ps(swap, cp)), cosSign);
+}
+
+void evaluateSurfaceRowSSE2(const float* xs, float y, int count, float* z, float* nx, float* ny, float* nz) {
+    const __m128 vy = _mm_set1_ps(y);
+    const __m128 y2 = _mm_mul_ps(vy, vy);
+    const __m128 amplitude = _mm_set1_ps(SIN_AMPLITUDE);
+    const __m128 frequency = _mm_set1_ps(SIN_FREQUENCY);
+    const __m128 slope = _mm_set1_ps(SIN_AMPLITUDE * SIN_FREQUENCY);
+    const __m128 epsilon = _mm_set1_ps(1e-6f);
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 signBit = _mm_set1_ps(-0.0f);
+
+    int j = 0;
+    for (; j + 4 <= count; j += 4) {
+        __m128 x = _mm_loadu_ps(xs + j);
+        __m128 r = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(x, x), y2));
+        __m128 s, c;
+        sincos4(_mm_mul_ps(frequency, r), s, c);
+        _mm_storeu_ps(z + j, _mm_mul_ps(amplitude, s));
+
+        // Градиент A*F*cos(F*r)/r * (x, y); в центре (r ~ 0) он нулевой
+        __m128 common = _mm_and_ps(_mm_div_ps(_mm_mul_ps(slope, c), r), _mm_cmpgt_ps(r, epsilon));
+        __m128 gx = _mm_mul_ps(common, x);
+        __m128 gy = _mm_mul_ps(common, vy);
+        __m128 invLen = _mm_div_ps(one, _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(gx, gx), _mm_mul_ps(gy, gy)), one)));
+        _mm_storeu_ps(nx + j, _mm_xor_ps(_mm_mul_ps(gx, invLen), signBit));
+        _mm_storeu_ps(ny + j, _mm_xor_ps(_mm_mul_ps(gy, invLen), signBit));
+        _mm_storeu_ps(nz + j, invLen);
+    }
+    evaluateSurfaceRowScalar(xs + j, y, count - j, z + j, nx + j, ny + j, nz + j);
+}
+
+TARGET_AVX2 static inline void sincos8(__m256 x, __m256& outSin, __m256& outCos) {
+    __m256i q = _mm256_cvtps_epi32(_mm256_mul_ps(x, _mm256_set1_ps(SINCOS_TWO_OVER_PI)));
+    __m256 qf = _mm256_cvtepi32_ps(q);
+    __m256 r = _mm256_fnmadd_ps(qf, _mm256_set1_ps(SINCOS_PIO2_1), x);
+    r = _mm256_fnmadd_ps(qf, _mm256_set1_ps(SINCOS_PIO2_2), r);
+    r = _mm256_fnmadd_ps(qf, _mm256_set1_ps(SINCOS_PIO2_3), r);
+
+    __m256 r2 = _mm256_mul_ps(r, r);
+    __m256 sp = _mm256_fmadd_ps(_mm256_set1_ps(SIN_P0), r2, _mm256_set1_ps(SIN_P1));
+    sp = _mm256_fmadd_ps(sp, r2, _mm256_set1_ps(SIN_P2));
+    sp = _mm256_fmadd_ps(_mm256_mul_ps(sp, r2), r, r);
+    __m256 cp = _mm256_fmadd_ps(_mm256_set1_ps(COS_P0), r2, _mm256_set1_ps(COS_P1));
+    cp = _mm256_fmadd_ps(cp, r2, _mm256_set1_ps(COS_P2));
+    cp = _mm256_fmadd_ps(_mm256_mul_ps(cp, r2), r2, _mm256_fnmadd_ps(_mm256_set1_ps(0.5f), r2, _mm256_set1_ps(1.0f)));
+
+    const __m256i one = _mm256_set1_epi32(1), two = _mm256_set1_epi32(2);
+    __m256 swap = _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(q, one), one));
+    __m256 sinSign = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_and_si256(q, two), 30));
+    __m256 cosSign = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_and_si256(_mm256_add_epi32(q, one), two), 30));
+    outSin = _mm256_xor_ps(_mm256_blendv_ps(sp, cp, swap), sinSign);
+    outCos = _mm256_xor_ps(_mm256_blendv_ps(cp, sp, swap), cosSign);
+}
+
+TARGET_AVX2 void evaluateSurfaceRowAVX2(const float* xs, float y, int count, float* z, float* nx, float* ny, float* nz) {
+    const __m256 vy = _mm256_set1_ps(y);
+    const __m256 y2 = _mm256_mul_ps(vy, vy);
+    const __m256 amplitude = _mm256_set1_ps(SIN_AMPLITUDE);
+    const __m256 frequency = _mm256_set1_ps(SIN_FREQUENCY);
+    const __m256 slope = _mm256_set1_ps(SIN_AMPLITUDE * SIN_FREQUENCY);
+    const __m256 epsilon = _mm256_set1_ps(1e-6f);
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 signBit = _mm256_set1_ps(-0.0f);
+
+    int j = 0;
+    for (; j + 8 <= count; j += 8) {
+        __m256 x = _mm256_loadu_ps(xs + j);
+        __m256 r = _mm256_sqrt_ps(_mm256_fmadd_ps(x, x, y2));
+        __m256 s, c;
+        sincos8(_mm256_mul_ps(frequency, r), s, c);
+        _mm256_storeu_ps(z + j, _mm256_mul_ps(amplitude, s));
+
+        __m256 common = _mm256_and_ps(_mm256_div_ps(_mm256_mul_ps(slope, c), r), _mm256_cmp_ps(r, epsilon, _CMP_GT_OQ));
+        __m256 gx = _mm256_mul_ps(common, x);
+        __m256 gy = _mm256_mul_ps(common, vy);
+        __m256 invLen = _mm256_div_ps(one, _mm256_sqrt_ps(_mm256_fmadd_ps(gx, gx, _mm256_fmadd_ps(gy, gy, one))));
+        _mm256_storeu_ps(nx + j, _mm256_xor_ps(_mm256_mul_ps(gx, invLen), signBit));
+        _mm256_storeu_ps(ny + j, _mm256_xor_ps(_mm256_mul_ps(gy, invLen), signBit));
+        _mm256_storeu_ps(nz + j, invLen);
+    }
+    evaluateSurfaceRowSSE2(xs + j, y, count - j, z + j, nx + j, ny + j, nz + j);
+}
+
+bool cpuSupportsAVX2() {
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) return false;
+    __cpuid(info, 1);
+    bool fma = (info[2] & (1 << 12)) != 0;
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    if (!fma || !osxsave || (_xgetbv(0) & 6) != 6) return false; // ОС должна сохранять регистры YMM
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+}
+#endif
+
+// Выбор лучшей реализации для текущего процессора
+SurfaceRowFunc selectSurfaceRowFunc(const char** name) {
+#ifdef MESH_SIMD_X86
+    if (cpuSupportsAVX2()) {
+        if (name) *name = "avx2";
+        return evaluateSurfaceRowAVX2;
+    }
+    if (name) *name = "sse2";
+    return evaluateSurfaceRowSSE2;
+#else
+    if (name) *name = "scalar";
+    return evaluateSurfaceRowScalar;
+#endif
+}
+
+// Выполняет rowFunc(first, last) для диапазонов строк [0, rowCount) на нескольких потоках
+template <typename RowRangeFunc>
+void parallelForRows(int rowCount, int threadCount, RowRangeFunc rowFunc) {
+    threadCount = std::max(1, std::min(threadCount, rowCount));
+    if (threadCount == 1) {
+        rowFunc(0, rowCount);
+        return;
+    }
+    std::vector<std::thread> workers;
+    workers.reserve(threadCount - 1);
+    int rowsPerThread = (rowCount + threadCount - 1) / threadCount;
+    for (int t = 1; t < threadCount; ++t) {
+        int first = t * rowsPerThread;
+        int last = std::min(rowCount, first + rowsPerThread);
+        if (first < last) workers.emplace_back(rowFunc, first, last);
+    }
+    rowFunc(0, std::min(rowCount, rowsPerThread)); // Первый диапазон - в текущем потоке
+    for (std::thread& worker : workers) worker.join();
+}
+
+int defaultThreadCount() {
+    unsigned int n = std::thread::hardware_concurrency();
+    return n > 0 ? (int)n : 1;
+}
+
+// Параллельный генератор: буферы выделяются сразу целиком, строки сетки считаются на всех ядрах,
+// высота и нормаль - SIMD по строке, затем данные раскладываются в формат VBO (format).
+void generateSurfaceMesh(int gridSize, VertexFormat format, vector<unsigned char>& vertexData, vector<unsigned int>& indices, int threadCount, SurfaceRowFunc rowFunc) {
+    const float halfSize = PLANE_SIZE * 0.5f;
+    const float step = PLANE_SIZE / gridSize;
+    const int numVerticesPerRow = gridSize + 1;
+    const size_t stride = vertexStride(format);
+
+    vertexData.resize((size_t)numVerticesPerRow * numVerticesPerRow * stride);
+    indices.resize((size_t)gridSize * gridSize * 6);
+
+    // Координаты x одинаковы для всех строк
+    vector<float> xs(numVerticesPerRow);
+    for (int j = 0; j <= gridSize; ++j) xs[j] = -halfSize + j * step;
+
+    parallelForRows(numVerticesPerRow, threadCount, [&](int firstRow, int lastRow) {
+        vector<float> z(numVerticesPerRow), nx(numVerticesPerRow), ny(numVerticesPerRow), nz(numVerticesPerRow);
+        for (int i = firstRow; i < lastRow; ++i) {
+            float y = -halfSize + i * step;
+            float v = (float)i / gridSize;
+            unsigned char* rowData = vertexData.data() + (size_t)i * numVerticesPerRow * stride;
+            if (format != VERTEX_FORMAT_PROCEDURAL) { // В процедурном формате вершины вычисляет шейдер - нужны только индексы
+                rowFunc(xs.data(), y, numVerticesPerRow, z.data(), nx.data(), ny.data(), nz.data());
+            }
+
+            if (format == VERTEX_FORMAT_PACKED) {
+                PackedSurfaceVertex* out = reinterpret_cast<PackedSurfaceVertex*>(rowData);
+                for (int j = 0; j <= gridSize; ++j) {
+                    octEncode(nx[j], ny[j], nz[j], out[j].octNormal);
+                    out[j].height = floatToHalf(z[j]);
+                    out[j].padding = 0;
+                }
+            }
+            else if (format == VERTEX_FORMAT_FLOAT) {
+                float* out = reinterpret_cast<float*>(rowData);
+                for (int j = 0; j <= gridSize; ++j, out += SURFACE_VERTEX_FLOATS) {
+                    out[0] = xs[j]; out[1] = y; out[2] = z[j];
+                    out[3] = nx[j]; out[4] = ny[j]; out[5] = nz[j];
+                    out[6] = (float)j / gridSize; out[7] = v;
+                }
+            }
+
+            // Индексы патчей строки ячеек i (у последней строки вершин ячеек нет)
+            if (i == gridSize) continue;
+            unsigned int* idx = &indices[(size_t)i * gridSize * 6];
+            for (int j = 0; j < gridSize; ++j, idx += 6) {
+                unsigned int idx00 = i * numVerticesPerRow + j;
+                unsigned int idx10 = idx00 + 1;
+                unsigned int idx01 = idx00 + numVerticesPerRow;
+                unsigned int idx11 = idx01 + 1;
+                idx[0] = idx00; idx[1] = idx01; idx[2] = idx10;
+                idx[3] = idx10; idx[4] = idx01; idx[5] = idx11;
+            }
+        }
+    });
+}
+
+// --bench-mesh: сравнение исходного скалярного генератора с SIMD (в один поток и параллельно)
+int runMeshBenchmark(int gridSize) {
+    const int repeats = 3; // Берется лучшее время из нескольких прогонов
+    const char* simdName = "scalar";
+    SurfaceRowFunc rowFunc = selectSurfaceRowFunc(&simdName);
+    const int threads = defaultThreadCount();
+
+    // Каждый прогон пишет в новые буферы, чтобы ни один вариант не получал уже прогретую память
+    // предыдущего, а порядок вариантов сдвигается от прогона к прогону
+    enum { MESH_SCALAR, MESH_SIMD, MESH_PARALLEL, MESH_PACKED, MESH_VARIANTS };
+    double best[MESH_VARIANTS] = { 1e30, 1e30, 1e30, 1e30 };
+    for (int r = 0; r < repeats; ++r) {
+        for (int k = 0; k < MESH_VARIANTS; ++k) {
+            const int variant = (r + k) % MESH_VARIANTS;
+            vector<float> vertices;
+            vector<unsigned char> data;
+            vector<unsigned int> indices;
+            auto start = chrono::steady_clock::now();
+            if (variant == MESH_SCALAR) generateSurfaceMeshScalar(gridSize, vertices, indices);
+            else if (variant == MESH_SIMD) generateSurfaceMesh(gridSize, VERTEX_FORMAT_FLOAT, data, indices, 1, rowFunc);
+            else if (variant == MESH_PARALLEL) generateSurfaceMesh(gridSize, VERTEX_FORMAT_FLOAT, data, indices, threads, rowFunc);
+            else generateSurfaceMesh(gridSize, VERTEX_FORMAT_PACKED, data, indices, threads, rowFunc);
+            best[variant] = std::min(best[variant], chrono::duration<double, std::milli>(chrono::steady_clock::now() - start).count());
+        }
+    }
+    const double scalarMs = best[MESH_SCALAR], simdMs = best[MESH_SIMD], parallelMs = best[MESH_PARALLEL], packedMs = best[MESH_PACKED];
+
+    // Проверка: SIMD-результат должен совпадать с эталоном с точностью приближения sin/cos
+    vector<float> reference, fast;
+    vector<unsigned char> data;
+    vector<unsigned int> referenceIndices, fastIndices;
+    generateSurfaceMeshScalar(gridSize, reference, referenceIndices);
+    generateSurfaceMesh(gridSize, VERTEX_FORMAT_FLOAT, data, fastIndices, threads, rowFunc);
+    fast.resize(data.size() / sizeof(float));
+    memcpy(fast.data(), data.data(), data.size());
+    double maxHeightError = 0.0, maxNormalError = 0.0;
+    for (size_t k = 0; k < reference.size(); k += SURFACE_VERTEX_FLOATS) {
+        maxHeightError = std::max(maxHeightError, (double)std::fabs(reference[k + 2] - fast[k + 2]));
+        for (int c = 3; c < 6; ++c) {
+            maxNormalError = std::max(maxNormalError, (double)std::fabs(reference[k + c] - fast[k + c]));
+        }
+    }
+    bool indicesMatch = referenceIndices == fastIndices;
+
+    cout.precision(6);
+    cout << "{\n";
+    cout << "  \"grid_size\": " << gridSize << ",\n";
+    cout << "  \"vertices\": " << reference.size() / SURFACE_VERTEX_FLOATS << ",\n";
+    cout << "  \"simd\": \"" << simdName << "\",\n";
+    cout << "  \"threads\": " << threads << ",\n";
+    cout << "  \"ms\": { \"scalar_reference\": " << scalarMs << ", \"simd_single_thread\": " << simdMs << ", \"simd_parallel\": " << parallelMs << ", \"simd_parallel_packed\": " << packedMs << " },\n";
+    cout << "  \"speedup\": " << scalarMs / parallelMs << ",\n";
+    cout << "  \"max_abs_error\": { \"height\": " << maxHeightError << ", \"normal\": " << maxNormalError << " },\n";
+    cout << "  \"indices_match\": " << (indicesMatch ? "true" : "false") << "\n";
+    cout << "}\n";
+    return indicesMatch ? 0 : -1;
+}
+
+
+bool createModel() {
+    vector<unsigned char> vertexData;
+    vector<unsigned int> indices;
+
+    const char* simdName = "scalar";
+    SurfaceRowFunc rowFunc = selectSurfaceRowFunc(&simdName);
+    auto generateStart = chrono::steady_clock::now();
+    generateSurfaceMesh(g_gridSize, g_vertexFormat, vertexData, indices, defaultThreadCount(), rowFunc);
+    double generateMs = chrono::duration<double, std::milli>(chrono::steady_clock::now() - generateStart).count();
+    cout << "Surface mesh " << g_gridSize << "x" << g_gridSize << " generated in " << generateMs << " ms (" << simdName << ", " << defaultThreadCount() << " threads)" << endl;
 
 
     g_object.indexCount = static_cast<GLsizei>(indices.size());
@@ -564,53 +2547,612 @@ bool createModel() {
     glGenVertexArrays(1, &g_object.vao);
     glBindVertexArray(g_object.vao);
 
-    glGenBuffers(1, &g_object.vbo);
     glGenBuffers(1, &g_object.ibo);
 
-    // Загружаем данные вершин в VBO
-    glBindBuffer(GL_ARRAY_BUFFER, g_object.vbo);
-    glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(float), vertices.data(), GL_STATIC_DRAW);
+    // Загружаем данные вершин в VBO (в процедурном формате VBO не создается)
+    if (g_vertexFormat != VERTEX_FORMAT_PROCEDURAL) {
+        glGenBuffers(1, &g_object.vbo);
+        glBindBuffer(GL_ARRAY_BUFFER, g_object.vbo);
+        glBufferData(GL_ARRAY_BUFFER, vertexData.size(), vertexData.data(), GL_STATIC_DRAW);
+    }
 
     // Загружаем данные индексов в IBO
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, g_object.ibo);
     glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), indices.data(), GL_STATIC_DRAW);
 
     // Указываем формат вершинных данных (атрибуты)
-    const GLsizei stride = 8 * sizeof(float); // 3 pos + 3 normal + 2 texcoord
+    const GLsizei stride = (GLsizei)vertexStride(g_vertexFormat);
+    if (g_vertexFormat == VERTEX_FORMAT_PACKED) {
+        // Атрибут 0: Октаэдрическая нормаль (2 x snorm16 -> vec2 в [-1, 1])
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 2, GL_SHORT, GL_TRUE, stride, (void*)offsetof(PackedSurfaceVertex, octNormal));
+
+        // Атрибут 1: Высота (half float)
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(1, 1, GL_HALF_FLOAT, GL_FALSE, stride, (void*)offsetof(PackedSurfaceVertex, height));
+    }
+    else if (g_vertexFormat == VERTEX_FORMAT_FLOAT) {
+        // Атрибут 0: Позиция (vec3)
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, (void*)0);
+
+        // Атрибут 1: Нормаль (vec3)
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, stride, (void*)(3 * sizeof(float)));
+
+        // Атрибут 2: Текстурные координаты (vec2)
+        glEnableVertexAttribArray(2);
+        glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, stride, (void*)(6 * sizeof(float)));
+    }
+
+
+    // Отвязываем VAO, VBO, IBO
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+
+    GLenum err;
+    if ((err = glGetError()) != GL_NO_ERROR) {
+        cerr << "OpenGL error after createModel: " << err << endl;
+        // Очистка в случае ошибки
+        if (g_object.vao) glDeleteVertexArrays(1, &g_object.vao);
+        if (g_object.vbo) glDeleteBuffers(1, &g_object.vbo);
+        if (g_object.ibo) glDeleteBuffers(1, &g_object.ibo);
+        g_object.vao = g_object.vbo = g_object.ibo = 0;
+        return false;
+    }
+
+    const size_t vertexCount = (size_t)(g_gridSize + 1) * (g_gridSize + 1);
+    cout << "Vertex buffer: " << vertexData.size() / (1024.0 * 1024.0) << " MB (" << stride << " bytes per vertex, "
+        << vertexFormatName(g_vertexFormat) << ")" << endl;
+    cout << "Model created successfully with " << vertexCount << " vertices and " << indices.size() / 3 << " triangles (" << indices.size() << " indices)." << endl;
+
+    return g_object.vao != 0;
+}
+
+// Равномерное псевдослучайное число в [0, 1) по номеру экземпляра - поле одинаково от запуска к запуску
+static float instanceRandom(uint32_t index, uint32_t salt) {
+    uint32_t h = index * 0x9E3779B1u ^ salt;
+    h ^= h >> 16; h *= 0x7FEB352Du;
+    h ^= h >> 15; h *= 0x846CA68Bu;
+    h ^= h >> 16;
+    return (h >> 8) * (1.0f / 16777216.0f);
+}
+
+// Раскладывает g_instanceCount экземпляров квадратными кольцами вокруг начала координат и добавляет их
+// атрибуты в VAO поверхности. Экземпляр 0 - исходная поверхность без изменений.
+bool createScene() {
+    int half = 0;
+    while ((size_t)(2 * half + 1) * (2 * half + 1) < (size_t)g_instanceCount) ++half;
+    std::vector<glm::ivec2> cells;
+    cells.reserve((size_t)(2 * half + 1) * (2 * half + 1));
+    for (int y = -half; y <= half; ++y)
+        for (int x = -half; x <= half; ++x) cells.push_back(glm::ivec2(x, y));
+    std::stable_sort(cells.begin(), cells.end(), [](const glm::ivec2& a, const glm::ivec2& b) {
+        return std::max(std::abs(a.x), std::abs(a.y)) < std::max(std::abs(b.x), std::abs(b.y));
+    });
+
+    g_scene.instances.resize(g_instanceCount);
+    g_scene.extent = 0.0f;
+    for (int i = 0; i < g_instanceCount; ++i) {
+        SurfaceInstance& instance = g_scene.instances[i];
+        const glm::vec2 offset = glm::vec2(cells[i]) * INSTANCE_SPACING;
+        const float scale = (i == 0) ? 1.0f : 0.6f + 0.4f * instanceRandom(i, 1);
+        instance.offsetScale = glm::vec4(offset, 0.0f, scale);
+        instance.blendOffset = (i == 0) ? 0.0f : instanceRandom(i, 2) - 0.5f;
+        instance.layers[0] = (i == 0) ? 0 : (GLuint)(instanceRandom(i, 3) * MATERIAL_LAYERS);
+        instance.layers[1] = (i == 0) ? 1 : (GLuint)(instanceRandom(i, 4) * MATERIAL_LAYERS);
+        g_scene.extent = std::max(g_scene.extent, std::max(std::abs(offset.x), std::abs(offset.y)));
+    }
+
+    glGenBuffers(1, &g_scene.instanceVbo);
+    glBindVertexArray(g_object.vao);
+    glBindBuffer(GL_ARRAY_BUFFER, g_scene.instanceVbo);
+    glBufferData(GL_ARRAY_BUFFER, g_scene.instances.size() * sizeof(SurfaceInstance), g_scene.instances.data(), GL_STATIC_DRAW);
+    // Атрибут 3: смещение и масштаб (vec4), атрибут 4: сдвиг смешивания - по одному значению на экземпляр
+    glEnableVertexAttribArray(3);
+    glVertexAttribPointer(3, 4, GL_FLOAT, GL_FALSE, sizeof(SurfaceInstance), (void*)offsetof(SurfaceInstance, offsetScale));
+    glVertexAttribDivisor(3, 1);
+    glEnableVertexAttribArray(4);
+    glVertexAttribPointer(4, 1, GL_FLOAT, GL_FALSE, sizeof(SurfaceInstance), (void*)offsetof(SurfaceInstance, blendOffset));
+    glVertexAttribDivisor(4, 1);
+    // Атрибут 5: пара слоев массива материалов (целые)
+    glEnableVertexAttribArray(5);
+    glVertexAttribIPointer(5, 2, GL_UNSIGNED_INT, sizeof(SurfaceInstance), (void*)offsetof(SurfaceInstance, layers));
+    glVertexAttribDivisor(5, 1);
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    GLenum err = glGetError();
+    if (err != GL_NO_ERROR) {
+        cerr << "OpenGL error after createScene: " << err << endl;
+        return false;
+    }
+    cout << "Scene: " << g_instanceCount << " surface instances, " << g_scene.instances.size() * sizeof(SurfaceInstance) / 1024.0
+        << " KB instance buffer, field extent " << g_scene.extent << endl;
+    return true;
+}
+
+
+// --- GPU-отсечение экземпляров ---
+// Compute-шейдер проверяет ограничивающий параллелепипед каждого экземпляра против пирамиды видимости
+// (тот же тест по 8 углам в пространстве отсечения, что и outsideFrustum в TCS) и записывает instanceCount
+// его команды DrawElementsIndirectCommand: 1 - виден, 0 - отсечен. Затем все поле рисуется одним
+// glMultiDrawElementsIndirect; команда i рисует экземпляр i (baseInstance = i), поэтому атрибуты экземпляра
+// выбираются из того же VBO с делителем 1. За кадр CPU не трогает данные экземпляров и не ждет GPU:
+// число видимых экземпляров читается с задержкой через кольцо счетчиков, как число отсеченных патчей.
+const GLuint CULL_WORKGROUP_SIZE = 64;
+const GLuint CULL_INSTANCES_BINDING = 0; // SSBO: SurfaceInstance[] (VBO экземпляров)
+const GLuint CULL_BOUNDS_BINDING = 1; // SSBO: ObjectBounds[]
+const GLuint CULL_COMMANDS_BINDING = 2; // SSBO: DrawElementsIndirectCommand[] (он же GL_DRAW_INDIRECT_BUFFER)
+const GLuint CULL_COUNTER_BINDING = 3; // SSBO: число видимых экземпляров
+
+// Параллелепипед экземпляра в локальных координатах модели (w не используется)
+struct ObjectBounds {
+    glm::vec4 lo, hi;
+};
+
+// Раскладка команды задана glMultiDrawElementsIndirect
+struct DrawElementsIndirectCommand {
+    GLuint count, instanceCount, firstIndex;
+    GLint baseVertex;
+    GLuint baseInstance;
+};
+
+struct InstanceCulling {
+    bool enabled = false; // Включено и поддерживается (GL 4.3)
+    GLuint program = 0;
+    GLuint boundsBuffer = 0, commandBuffer = 0;
+    GLuint counterBuffers[PATCH_COUNTER_RING] = {};
+};
+
+InstanceCulling g_instanceCulling;
+GLint64 g_visibleInstances = -1; // Видимых экземпляров в последнем прочитанном кадре (-1 - нет данных)
+
+const GLchar cullInstancesCsh[] =
+"#version 430 core\n" \
+"layout(local_size_x = 64) in;\n" \
+"\n" \
+"struct SurfaceInstance {\n" \
+"	vec4 offsetScale;\n" \
+"	float blendOffset;\n" \
+"};\n" \
+"\n" \
+"struct ObjectBounds {\n" \
+"	vec4 lo;\n" \
+"	vec4 hi;\n" \
+"};\n" \
+"\n" \
+"struct DrawElementsIndirectCommand {\n" \
+"	uint count;\n" \
+"	uint instanceCount;\n" \
+"	uint firstIndex;\n" \
+"	int baseVertex;\n" \
+"	uint baseInstance;\n" \
+"};\n" \
+"\n" \
+"layout(std430, binding = 0) readonly buffer InstanceBuffer { SurfaceInstance instances[]; };\n" \
+"layout(std430, binding = 1) readonly buffer BoundsBuffer { ObjectBounds bounds[]; };\n" \
+"layout(std430, binding = 2) writeonly buffer CommandBuffer { DrawElementsIndirectCommand commands[]; };\n" \
+"layout(std430, binding = 3) buffer CounterBuffer { uint visibleInstances; };\n" \
+"\n" \
+"// Все 8 углов параллелепипеда снаружи одной и той же плоскости отсечения\n" \
+"bool outsideFrustum(mat4 mvp, vec3 lo, vec3 hi) {\n" \
+"	vec3 allLow = vec3(1.0), allHigh = vec3(1.0);\n" \
+"	for (int i = 0; i < 8; ++i) {\n" \
+"		vec3 corner = vec3((i & 1) != 0 ? hi.x : lo.x, (i & 2) != 0 ? hi.y : lo.y, (i & 4) != 0 ? hi.z : lo.z);\n" \
+"		vec4 clip = mvp * vec4(corner, 1.0);\n" \
+"		allLow *= vec3(lessThan(clip.xyz, vec3(-clip.w)));\n" \
+"		allHigh *= vec3(greaterThan(clip.xyz, vec3(clip.w)));\n" \
+"	}\n" \
+"	return max(max(allLow.x, allLow.y), max(allLow.z, max(allHigh.x, max(allHigh.y, allHigh.z)))) > 0.0;\n" \
+"}\n" \
+"\n" \
+"void main() {\n" \
+"	uint i = gl_GlobalInvocationID.x;\n" \
+"	if (i >= uint(instances.length())) return;\n" \
+"	vec4 os = instances[i].offsetScale;\n" \
+"	mat4 instance = mat4(vec4(os.w, 0.0, 0.0, 0.0), vec4(0.0, os.w, 0.0, 0.0), vec4(0.0, 0.0, os.w, 0.0), vec4(os.xyz, 1.0));\n" \
+"	bool visible = !outsideFrustum(u_vp * instance * u_model, bounds[i].lo.xyz, bounds[i].hi.xyz);\n" \
+"	commands[i].instanceCount = visible ? 1u : 0u;\n" \
+"	if (visible) atomicAdd(visibleInstances, 1u);\n" \
+"}\n";
+
+// Программа отсечения и буферы команд. Без GL 4.3 поле рисуется как раньше, одним glDrawElementsInstanced.
+bool createInstanceCulling() {
+    InstanceCulling& culling = g_instanceCulling;
+    if (!GLEW_VERSION_4_3) {
+        cout << "Compute shaders and multi-draw indirect need OpenGL 4.3, instances are drawn without GPU culling" << endl;
+        return true;
+    }
+
+    ProgramSources sources;
+    sources.compute = withDefines(cullInstancesCsh, uniformBlocksGlsl);
+    culling.program = buildProgram(sources, "instance culling");
+    if (culling.program == 0) {
+        return false;
+    }
+    if (!setupProgramUniforms(culling.program, "instance culling", false)) {
+        cerr << "Failed to set up the instance culling program uniforms." << endl;
+        return false;
+    }
+
+    // Границы поверхности в ее локальных координатах - по z та же граница, что и у отсечения патчей (u_cullZBound)
+    const size_t count = g_scene.instances.size();
+    const ObjectBounds surfaceBounds = {
+        glm::vec4(-0.5f * PLANE_SIZE, -0.5f * PLANE_SIZE, -SURFACE_CULL_Z_BOUND, 0.0f),
+        glm::vec4(0.5f * PLANE_SIZE, 0.5f * PLANE_SIZE, SURFACE_CULL_Z_BOUND, 0.0f)
+    };
+    std::vector<ObjectBounds> bounds(count, surfaceBounds);
+    // Неизменные поля команд задаются один раз, шейдер пишет только instanceCount
+    std::vector<DrawElementsIndirectCommand> commands(count);
+    for (size_t i = 0; i < count; ++i) {
+        commands[i] = { (GLuint)g_object.indexCount, 1, 0, 0, (GLuint)i };
+    }
+
+    glGenBuffers(1, &culling.boundsBuffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, culling.boundsBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, count * sizeof(ObjectBounds), bounds.data(), GL_STATIC_DRAW);
+    glGenBuffers(1, &culling.commandBuffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, culling.commandBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, count * sizeof(DrawElementsIndirectCommand), commands.data(), GL_DYNAMIC_COPY);
+    glGenBuffers(PATCH_COUNTER_RING, culling.counterBuffers);
+    for (GLuint buffer : culling.counterBuffers) {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint), NULL, GL_DYNAMIC_READ);
+    }
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    GLenum err = glGetError();
+    if (err != GL_NO_ERROR) {
+        cerr << "OpenGL error after createInstanceCulling: " << err << endl;
+        return false;
+    }
+    culling.enabled = true;
+    cout << "Instance culling: compute pass over " << count << " instances, " << count * sizeof(DrawElementsIndirectCommand) / 1024.0
+        << " KB of indirect commands" << endl;
+    return true;
+}
+
+// Отсекает экземпляры для кадра, блоки которого уже подключены uploadFrameUniforms.
+// counterSlot - слот кольца, в который пишется число видимых экземпляров этого кадра.
+void cullInstances(unsigned int counterSlot) {
+    InstanceCulling& culling = g_instanceCulling;
+    const GLuint zero = 0;
+    bindBufferBase(GL_SHADER_STORAGE_BUFFER, CULL_COUNTER_BINDING, culling.counterBuffers[counterSlot]);
+    bindBuffer(GL_SHADER_STORAGE_BUFFER, culling.counterBuffers[counterSlot]);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(zero), &zero);
+    bindBufferBase(GL_SHADER_STORAGE_BUFFER, CULL_INSTANCES_BINDING, g_scene.instanceVbo);
+    bindBufferBase(GL_SHADER_STORAGE_BUFFER, CULL_BOUNDS_BINDING, culling.boundsBuffer);
+    bindBufferBase(GL_SHADER_STORAGE_BUFFER, CULL_COMMANDS_BINDING, culling.commandBuffer);
+
+    useProgram(culling.program);
+    const GLuint count = (GLuint)g_scene.instances.size();
+    glDispatchCompute((count + CULL_WORKGROUP_SIZE - 1) / CULL_WORKGROUP_SIZE, 1, 1);
+    // Команды читаются как GL_DRAW_INDIRECT_BUFFER, счетчик - через glGetBufferSubData
+    glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+}
+
+void destroyInstanceCulling() {
+    InstanceCulling& culling = g_instanceCulling;
+    if (culling.program != 0) glDeleteProgram(culling.program);
+    if (culling.boundsBuffer != 0) glDeleteBuffers(1, &culling.boundsBuffer);
+    if (culling.commandBuffer != 0) glDeleteBuffers(1, &culling.commandBuffer);
+    if (culling.counterBuffers[0] != 0) glDeleteBuffers(PATCH_COUNTER_RING, culling.counterBuffers);
+    culling = InstanceCulling();
+}
+
+
+// --- Ландшафт: квадродерево чанков с непрерывным LOD (CDLOD) ---
+// Все чанки рисуются одной общей сеткой TERRAIN_CHUNK_GRID x TERRAIN_CHUNK_GRID, которую вершинный шейдер
+// сдвигает и масштабирует на место узла квадродерева. Уровень узла выбирается по расстоянию до камеры,
+// дальность уровней растет вдвое. Ближе к дальней границе своего диапазона нечетные вершины плавно
+// стягиваются к вершинам вдвое более грубой сетки (геоморфинг), поэтому на границе двух уровней сетки
+// совпадают и нет ни скачков при смене LOD, ни трещин. Юбки по краям чанков закрывают остаточные щели.
+
+// Вершинный шейдер ландшафта. Выход совпадает с выходом TES, поэтому фрагментный шейдер общий.
+const GLchar terrainVsh[] =
+"#version 410 core\n" \
+"layout(location = 0) in vec3 a_grid; // x, y - узел сетки чанка, z = 1 для вершин юбки\n" \
+"\n" \
+"out TES_OUT {\n" \
+"   vec3 worldPos;\n" \
+"   vec3 worldNormal;\n" \
+"   vec2 texCoord;\n" \
+"   flat float blendOffset;\n" \
+"   flat uvec2 layers;\n" \
+"} vs_out;\n" \
+"\n" \
+"uniform vec3 u_cameraLocal; // Камера в локальных координатах ландшафта\n" \
+"uniform vec2 u_chunkOrigin;\n" \
+"uniform float u_chunkSize;\n" \
+"uniform float u_chunkGrid;\n" \
+"uniform vec2 u_morphRange; // Расстояния начала и конца геоморфинга для уровня чанка\n" \
+"uniform float u_skirtDepth;\n" \
+"uniform float u_textureTile;\n" \
+"\n" \
+"void main() {\n" \
+"	vec2 gridPos = a_grid.xy;\n" \
+"	float cell = u_chunkSize / u_chunkGrid;\n" \
+"	vec2 p = u_chunkOrigin + gridPos * cell;\n" \
+"\n" \
+"	// Нечетные узлы сдвигаются к четному соседу: при morph = 1 остается сетка вдвое грубее.\n" \
+"	// Расстояние берется до слоя |z| <= амплитуды, как при выборе узлов на CPU, - высота узла для него\n" \
+"	// не нужна, и поверхность вычисляется один раз, уже в сдвинутом узле\n" \
+"	vec3 nearest = vec3(p, clamp(u_cameraLocal.z, -u_sinAmplitude, u_sinAmplitude));\n" \
+"	float morph = clamp((distance(nearest, u_cameraLocal) - u_morphRange.x) / (u_morphRange.y - u_morphRange.x), 0.0, 1.0);\n" \
+"	gridPos -= fract(gridPos * 0.5) * 2.0 * morph;\n" \
+"	p = u_chunkOrigin + gridPos * cell;\n" \
+"	float z;\n" \
+"	vec3 normal;\n" \
+"	calculateSurfaceData(p, z, normal);\n" \
+"	z -= a_grid.z * u_skirtDepth;\n" \
+"\n" \
+"	vs_out.worldPos = vec3(u_model * vec4(p, z, 1.0));\n" \
+"	vs_out.worldNormal = normalize(u_normalMatrix * normal);\n" \
+"	vs_out.texCoord = p / u_textureTile;\n" \
+"	vs_out.blendOffset = 0.0;\n" \
+"	vs_out.layers = uvec2(0u, 1u);\n" \
+"	gl_Position = u_vp * vec4(vs_out.worldPos, 1.0);\n" \
+"}\n";
+
+// Вершина общей сетки чанка: номер узла и признак юбки
+struct TerrainVertex {
+    uint16_t x, y;
+    uint16_t skirt;
+    uint16_t padding;
+};
+
+// Выбранный для отрисовки узел квадродерева. quadrant = -1 - весь узел, 0..3 - только его четверть
+// (остальные четверти рисуются дочерними узлами более детального уровня).
+struct TerrainChunk {
+    glm::vec2 origin;
+    float size;
+    int lod;
+    int quadrant;
+};
+
+struct Terrain {
+    GLuint vbo = 0, ibo = 0, vao = 0;
+    GLuint shaderProgram = 0;
+    GLsizei quadrantFirst[4] = {}, quadrantCount[4] = {}; // Индексы четвертей идут подряд: 0, 1, 2, 3
+    GLsizei indexCount = 0;
+    int lodCount = 0;
+    float lodRanges[TERRAIN_MAX_LODS] = {};
+    std::vector<TerrainChunk> selection; // Переиспользуется между кадрами
+    size_t triangles = 0; // Треугольников в последнем кадре
+
+    // Общие с поверхностью параметры - в uniform-блоках, здесь только параметры чанков
+    GLint u_CameraLocal = -1, u_ChunkOrigin = -1, u_ChunkSize = -1, u_ChunkGrid = -1, u_MorphRange = -1, u_SkirtDepth = -1, u_TextureTile = -1;
+};
+
+Terrain g_terrain;
+
+bool createTerrainProgram() {
+    ProgramSources sources;
+    sources.vertex = withDefines(terrainVsh, std::string(uniformBlocksGlsl) + surfaceGlsl);
+    sources.fragment = withDefines(fsh, uniformBlocksGlsl);
+    g_terrain.shaderProgram = buildProgram(sources, "terrain");
+    if (g_terrain.shaderProgram == 0) {
+        return false;
+    }
+
+    const GLuint program = g_terrain.shaderProgram;
+    struct { GLint* location; const char* name; } uniforms[] = {
+        { &g_terrain.u_CameraLocal, "u_cameraLocal" }, { &g_terrain.u_ChunkOrigin, "u_chunkOrigin" }, { &g_terrain.u_ChunkSize, "u_chunkSize" },
+        { &g_terrain.u_ChunkGrid, "u_chunkGrid" }, { &g_terrain.u_MorphRange, "u_morphRange" }, { &g_terrain.u_SkirtDepth, "u_skirtDepth" },
+        { &g_terrain.u_TextureTile, "u_textureTile" },
+    };
+    bool uniformsOk = setupProgramUniforms(program, "terrain");
+    for (auto& uniform : uniforms) {
+        *uniform.location = glGetUniformLocation(program, uniform.name);
+        if (*uniform.location == -1) { cerr << "Uniform '" << uniform.name << "' not found!" << endl; uniformsOk = false; }
+    }
+    if (!uniformsOk) {
+        cerr << "Failed to get all required terrain uniform locations." << endl;
+        glDeleteProgram(g_terrain.shaderProgram);
+        g_terrain.shaderProgram = 0;
+        return false;
+    }
+    // Не меняются от кадра к кадру
+    glUseProgram(program);
+    glUniform1f(g_terrain.u_ChunkGrid, (float)TERRAIN_CHUNK_GRID);
+    glUniform1f(g_terrain.u_TextureTile, TERRAIN_TEXTURE_TILE);
+    glUseProgram(0);
+    return true;
+}
+
+// Общая сетка чанка: (N+1)^2 узлов плюс столько же вершин юбки. Индексы сгруппированы по четвертям,
+// чтобы узел можно было нарисовать как целиком (одним вызовом), так и любую его четверть.
+bool createTerrain() {
+    if (!createTerrainProgram()) {
+        return false;
+    }
+
+    const int n = TERRAIN_CHUNK_GRID;
+    const int half = n / 2;
+    const unsigned int row = n + 1;
+    const unsigned int skirtBase = row * row;
+
+    vector<TerrainVertex> vertices(2 * (size_t)skirtBase);
+    for (unsigned int y = 0; y <= (unsigned int)n; ++y) {
+        for (unsigned int x = 0; x <= (unsigned int)n; ++x) {
+            vertices[y * row + x] = { (uint16_t)x, (uint16_t)y, 0, 0 };
+            vertices[skirtBase + y * row + x] = { (uint16_t)x, (uint16_t)y, 1, 0 };
+        }
+    }
+
+    vector<unsigned int> indices;
+    indices.reserve((size_t)n * n * 6 + (size_t)n * 4 * 12);
+    // Юбка под ребром a-b: две стороны, чтобы не зависеть от направления обхода на разных краях
+    auto addSkirt = [&](unsigned int a, unsigned int b) {
+        unsigned int sa = skirtBase + a, sb = skirtBase + b;
+        unsigned int quad[12] = { a, b, sb, a, sb, sa, a, sb, b, a, sa, sb };
+        indices.insert(indices.end(), quad, quad + 12);
+    };
+    for (int q = 0; q < 4; ++q) {
+        g_terrain.quadrantFirst[q] = (GLsizei)indices.size();
+        const int x0 = (q & 1) * half, y0 = (q >> 1) * half;
+        for (int y = y0; y < y0 + half; ++y) {
+            for (int x = x0; x < x0 + half; ++x) {
+                unsigned int i00 = y * row + x, i10 = i00 + 1, i01 = i00 + row, i11 = i01 + 1;
+                // Против часовой стрелки, если смотреть со стороны +Z (сверху)
+                unsigned int cell[6] = { i00, i10, i11, i00, i11, i01 };
+                indices.insert(indices.end(), cell, cell + 6);
+            }
+        }
+        for (int i = 0; i < half; ++i) {
+            if (y0 == 0) addSkirt(x0 + i, x0 + i + 1);
+            if (y0 + half == n) addSkirt(n * row + x0 + i, n * row + x0 + i + 1);
+            if (x0 == 0) addSkirt((y0 + i) * row, (y0 + i + 1) * row);
+            if (x0 + half == n) addSkirt((y0 + i) * row + n, (y0 + i + 1) * row + n);
+        }
+        g_terrain.quadrantCount[q] = (GLsizei)indices.size() - g_terrain.quadrantFirst[q];
+    }
+    g_terrain.indexCount = (GLsizei)indices.size();
 
-    // Атрибут 0: Позиция (vec3)
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, (void*)0);
+    glGenVertexArrays(1, &g_terrain.vao);
+    glBindVertexArray(g_terrain.vao);
 
-    // Атрибут 1: Нормаль (vec3)
-    glEnableVertexAttribArray(1);
-    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, stride, (void*)(3 * sizeof(float)));
+    glGenBuffers(1, &g_terrain.vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, g_terrain.vbo);
+    glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(TerrainVertex), vertices.data(), GL_STATIC_DRAW);
 
-    // Атрибут 2: Текстурные координаты (vec2)
-    glEnableVertexAttribArray(2);
-    glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, stride, (void*)(6 * sizeof(float)));
+    glGenBuffers(1, &g_terrain.ibo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, g_terrain.ibo);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), indices.data(), GL_STATIC_DRAW);
 
+    // Атрибут 0: узел сетки и признак юбки (uint16 -> float без нормализации)
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_UNSIGNED_SHORT, GL_FALSE, sizeof(TerrainVertex), (void*)offsetof(TerrainVertex, x));
 
-    // Отвязываем VAO, VBO, IBO
     glBindVertexArray(0);
     glBindBuffer(GL_ARRAY_BUFFER, 0);
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 
+    // Уровни: корень покрывает весь ландшафт, чанки самого детального уровня - около TERRAIN_LEAF_SIZE
+    g_terrain.lodCount = 1;
+    while (g_terrain.lodCount < TERRAIN_MAX_LODS && g_terrainSize / (float)(1 << (g_terrain.lodCount - 1)) > TERRAIN_LEAF_SIZE) {
+        ++g_terrain.lodCount;
+    }
+    const float leafSize = g_terrainSize / (float)(1 << (g_terrain.lodCount - 1));
+    for (int lod = 0; lod < g_terrain.lodCount; ++lod) {
+        g_terrain.lodRanges[lod] = leafSize * (float)(1 << lod) * TERRAIN_LOD_RANGE_FACTOR;
+    }
 
     GLenum err;
     if ((err = glGetError()) != GL_NO_ERROR) {
-        cerr << "OpenGL error after createModel: " << err << endl;
-        // Очистка в случае ошибки
-        if (g_object.vao) glDeleteVertexArrays(1, &g_object.vao);
-        if (g_object.vbo) glDeleteBuffers(1, &g_object.vbo);
-        if (g_object.ibo) glDeleteBuffers(1, &g_object.ibo);
-        g_object.vao = g_object.vbo = g_object.ibo = 0;
+        cerr << "OpenGL error after createTerrain: " << err << endl;
         return false;
     }
 
-    cout << "Model created successfully with " << vertices.size() / 8 << " vertices and " << indices.size() / 3 << " triangles (" << indices.size() << " indices)." << endl;
+    cout << "Terrain " << g_terrainSize << "x" << g_terrainSize << ": " << g_terrain.lodCount << " LOD levels, leaf chunk "
+        << leafSize << " units, " << n << "x" << n << " cells per chunk (" << indices.size() / 3 << " triangles with skirts)" << endl;
+    return true;
+}
+
+// Плоскости пирамиды видимости из матрицы MVP (Gribb-Hartmann): точка внутри, если dot(plane.xyz, p) + plane.w >= 0
+static void extractFrustumPlanes(const glm::mat4& mvp, glm::vec4 planes[6]) {
+    glm::vec4 rows[4];
+    for (int i = 0; i < 4; ++i) rows[i] = glm::vec4(mvp[0][i], mvp[1][i], mvp[2][i], mvp[3][i]);
+    for (int i = 0; i < 3; ++i) {
+        planes[i * 2] = rows[3] + rows[i];
+        planes[i * 2 + 1] = rows[3] - rows[i];
+    }
+}
+
+static bool boxInFrustum(const glm::vec3& lo, const glm::vec3& hi, const glm::vec4 planes[6]) {
+    for (int i = 0; i < 6; ++i) {
+        const glm::vec4& pl = planes[i];
+        // Угол параллелепипеда, наиболее удаленный в сторону нормали плоскости
+        glm::vec3 p(pl.x >= 0.0f ? hi.x : lo.x, pl.y >= 0.0f ? hi.y : lo.y, pl.z >= 0.0f ? hi.z : lo.z);
+        if (pl.x * p.x + pl.y * p.y + pl.z * p.z + pl.w < 0.0f) return false;
+    }
+    return true;
+}
 
-    return g_object.vao != 0;
+static bool boxIntersectsSphere(const glm::vec3& lo, const glm::vec3& hi, const glm::vec3& center, float radius) {
+    glm::vec3 d = glm::clamp(center, lo, hi) - center;
+    return glm::dot(d, d) <= radius * radius;
+}
+
+// Выбор узлов по схеме CDLOD. Возвращает false, если узел целиком дальше дальности своего уровня -
+// тогда его область рисует родитель (четвертью своей сетки).
+static bool selectTerrainNode(const glm::vec2& origin, float size, int lod, const glm::vec3& camera, const glm::vec4 planes[6], bool root) {
+    const glm::vec3 lo(origin.x, origin.y, -TERRAIN_SIN_AMPLITUDE);
+    const glm::vec3 hi(origin.x + size, origin.y + size, TERRAIN_SIN_AMPLITUDE);
+    if (!root && !boxIntersectsSphere(lo, hi, camera, g_terrain.lodRanges[lod])) return false;
+    if (!boxInFrustum(lo, hi, planes)) return true; // Вне кадра: узел обработан, но не рисуется
+
+    if (lod == 0 || !boxIntersectsSphere(lo, hi, camera, g_terrain.lodRanges[lod - 1])) {
+        g_terrain.selection.push_back({ origin, size, lod, -1 });
+        return true;
+    }
+    const float half = size * 0.5f;
+    for (int q = 0; q < 4; ++q) {
+        glm::vec2 childOrigin(origin.x + (q & 1) * half, origin.y + (q >> 1) * half);
+        if (!selectTerrainNode(childOrigin, half, lod - 1, camera, planes, false)) {
+            g_terrain.selection.push_back({ origin, size, lod, q });
+        }
+    }
+    return true;
+}
+
+void drawTerrain(const glm::mat4& vp) {
+    // Ландшафт лежит в плоскости XY с высотой по Z; поворачиваем его так, чтобы высота шла вверх по Y
+    const glm::mat4 model = glm::rotate(glm::mat4(1.0f), glm::radians(-90.0f), glm::vec3(1.0f, 0.0f, 0.0f));
+    const glm::mat3 normalMatrix = glm::transpose(glm::inverse(glm::mat3(model)));
+    const glm::vec3 cameraLocal = glm::vec3(glm::inverse(model) * glm::vec4(cameraPos, 1.0f));
+    const glm::vec3 lightPos = glm::vec3(0.3f, 1.0f, 0.2f) * g_terrainSize; // Почти направленный свет сверху
+
+    glm::vec4 planes[6];
+    extractFrustumPlanes(vp * model, planes);
+    g_terrain.selection.clear();
+    const float halfSize = g_terrainSize * 0.5f;
+    selectTerrainNode(glm::vec2(-halfSize, -halfSize), g_terrainSize, g_terrain.lodCount - 1, cameraLocal, planes, true);
+
+    FrameUniforms frame{};
+    frame.vp = vp;
+    frame.viewPos = cameraPos;
+    frame.lightPos = lightPos;
+    frame.lightColor = LIGHT_COLOR;
+    frame.nearPlane = TERRAIN_NEAR_PLANE;
+    ObjectUniforms object{};
+    object.model = model;
+    for (int i = 0; i < 3; ++i) object.normalMatrix[i] = glm::vec4(normalMatrix[i], 0.0f);
+    object.sinAmplitude = TERRAIN_SIN_AMPLITUDE;
+    object.sinFrequency = TERRAIN_SIN_FREQUENCY;
+    MaterialUniforms material{};
+    material.ambientColor = MATERIAL_AMBIENT;
+    material.specularColor = TERRAIN_SPECULAR;
+    material.shininess = TERRAIN_SHININESS;
+    material.blendFactor = g_blendFactor;
+    uploadFrameUniforms(frame, object, material);
+
+    useProgram(g_terrain.shaderProgram);
+    bindTexture(MATERIAL_TEXTURE_UNIT, GL_TEXTURE_2D_ARRAY, g_materials.texture);
+
+    glUniform3fv(g_terrain.u_CameraLocal, 1, glm::value_ptr(cameraLocal));
+
+    bindVertexArray(g_terrain.vao);
+    g_terrain.triangles = 0;
+    for (const TerrainChunk& chunk : g_terrain.selection) {
+        const float rangeEnd = g_terrain.lodRanges[chunk.lod];
+        const float rangeStart = (chunk.lod > 0) ? g_terrain.lodRanges[chunk.lod - 1] : 0.0f;
+        const float cell = chunk.size / TERRAIN_CHUNK_GRID;
+        glUniform2f(g_terrain.u_ChunkOrigin, chunk.origin.x, chunk.origin.y);
+        glUniform1f(g_terrain.u_ChunkSize, chunk.size);
+        glUniform2f(g_terrain.u_MorphRange, rangeStart + (rangeEnd - rangeStart) * TERRAIN_MORPH_START, rangeEnd);
+        glUniform1f(g_terrain.u_SkirtDepth, std::min(cell, 2.0f * TERRAIN_SIN_AMPLITUDE));
+
+        GLsizei first = (chunk.quadrant < 0) ? 0 : g_terrain.quadrantFirst[chunk.quadrant];
+        GLsizei count = (chunk.quadrant < 0) ? g_terrain.indexCount : g_terrain.quadrantCount[chunk.quadrant];
+        glDrawElements(GL_TRIANGLES, count, GL_UNSIGNED_INT, (void*)(first * sizeof(unsigned int)));
+        g_terrain.triangles += count / 3;
+    }
+    fenceFrameUniforms();
+    // Привязки остаются до следующего кадра (см. "Кэш состояния GL")
 }
 
 
@@ -624,6 +3166,18 @@ void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods
             cout << "Rotation DISABLED" << endl;
         }
     }
+    if (key == GLFW_KEY_T && action == GLFW_PRESS) {
+        g_adaptiveTess = !g_adaptiveTess;
+        cout << "Tessellation: " << (g_adaptiveTess ? "ADAPTIVE" : "FIXED") << endl;
+    }
+    if (key == GLFW_KEY_C && action == GLFW_PRESS) {
+        g_cullPatches = !g_cullPatches;
+        cout << "Frustum patch culling: " << (g_cullPatches ? "ON" : "OFF") << endl;
+    }
+    if (key == GLFW_KEY_B && action == GLFW_PRESS) {
+        g_backfaceCullPatches = !g_backfaceCullPatches;
+        cout << "Backface patch culling: " << (g_backfaceCullPatches ? "ON" : "OFF") << endl;
+    }
     if (key == GLFW_KEY_ESCAPE && action == GLFW_PRESS) {
         glfwSetWindowShouldClose(window, GLFW_TRUE);
     }
@@ -638,39 +3192,102 @@ bool initApp() {
     glEnable(GL_CULL_FACE); // Включаем отсечение граней
     glCullFace(GL_BACK); // Отбрасываем задние грани
 
-    glfwSetKeyCallback(g_window, keyCallback); // Установка callback для однократных нажатий (F, ESC)
-
-    // Загрузка текстур
-    g_object.texture1 = loadTexture(TEXTURE_PATH_1);
-    g_object.texture2 = loadTexture(TEXTURE_PATH_2);
-    if (g_object.texture1 == 0 || g_object.texture2 == 0) {
-        cerr << "Failed to load one or more textures. Ensure the image files exist at the specified paths." << endl;
-        // Можно решить, продолжать ли без текстур или выходить
-        // return false; // Раскомментировать, если текстуры обязательны
+    if (g_window) {
+        glfwSetKeyCallback(g_window, keyCallback); // Установка callback для однократных нажатий (F, ESC)
     }
 
+    // Загрузка текстур: приготовленные (.ctex) только открываются - их уровни при сборке массива материалов
+    // загружаются прямо в слои. Остальные декодируются, асинхронно - параллельно со сборкой шейдеров и сетки ниже
+    const TextureRequest textures[MATERIAL_LAYERS] = { { g_texturePath1, &g_object.texture1 }, { g_texturePath2, &g_object.texture2 } };
+    std::vector<TextureRequest> decoded;
+    for (int layer = 0; layer < MATERIAL_LAYERS; ++layer) {
+        if (!openMaterialLayer(layer, textures[layer].path)) decoded.push_back(textures[layer]);
+    }
+    if (g_asyncTextures) {
+        if (!decoded.empty()) startTextureLoads(decoded);
+    }
+    else {
+        auto loadStart = chrono::steady_clock::now();
+        bool failed = false;
+        for (const TextureRequest& request : decoded) {
+            *request.target = loadTexture(request.path);
+            failed = failed || *request.target == 0;
+        }
+        cout << "Textures: " << decoded.size() << " decoded in " << chrono::duration<double, std::milli>(chrono::steady_clock::now() - loadStart).count() << " ms (sync)" << endl;
+        imagePoolTrim();
+        if (failed) {
+            cerr << "Failed to load one or more textures. Ensure the image files exist at the specified paths." << endl;
+            // Можно решить, продолжать ли без текстур или выходить
+            // return false; // Раскомментировать, если текстуры обязательны
+        }
+    }
 
-    if (!createShaderProgram()) {
-        cerr << "Failed to create shader program!" << endl;
-        return false;
+    // Счетчик отсеченных патчей: атомарные счетчики должны быть доступны именно в TCS
+    GLint tcsAtomicCounters = 0;
+    if (GLEW_VERSION_4_2 || GLEW_ARB_shader_atomic_counters) {
+        glGetIntegerv(GL_MAX_TESS_CONTROL_ATOMIC_COUNTERS, &tcsAtomicCounters);
+    }
+    g_patchCounterSupported = tcsAtomicCounters > 0;
+    g_memoryBarrierSupported = GLEW_VERSION_4_2 || GLEW_ARB_shader_image_load_store;
+    if (g_patchCounterSupported) {
+        glGenBuffers(PATCH_COUNTER_RING, g_patchCounterBuffers);
+        for (GLuint buffer : g_patchCounterBuffers) {
+            glBindBuffer(GL_ATOMIC_COUNTER_BUFFER, buffer);
+            glBufferData(GL_ATOMIC_COUNTER_BUFFER, sizeof(GLuint), NULL, GL_DYNAMIC_READ);
+        }
+        glBindBuffer(GL_ATOMIC_COUNTER_BUFFER, 0);
+    }
+    else {
+        cout << "Atomic counters are not available in the tessellation control shader, culled patch count disabled" << endl;
     }
-    if (!createModel()) {
-        cerr << "Failed to create model!" << endl;
+    createUniformRing();
+    if (!createMaterials()) {
+        cerr << "Failed to create the material array!" << endl;
         return false;
     }
 
-    // Указываем OpenGL, что мы будем рендерить патчи из 3 вершин
-    glPatchParameteri(GL_PATCH_VERTICES, 3);
+
+    if (g_terrainSize > 0.0f) {
+        if (!createTerrain()) {
+            cerr << "Failed to create terrain!" << endl;
+            return false;
+        }
+    }
+    else {
+        if (!createShaderProgram()) {
+            cerr << "Failed to create shader program!" << endl;
+            return false;
+        }
+        if (!createModel()) {
+            cerr << "Failed to create model!" << endl;
+            return false;
+        }
+        if (!createScene()) {
+            cerr << "Failed to create scene!" << endl;
+            return false;
+        }
+        if (g_gpuCulling && !createInstanceCulling()) {
+            cerr << "Failed to create instance culling!" << endl;
+            return false;
+        }
+
+        // Указываем OpenGL, что мы будем рендерить патчи из 3 вершин
+        glPatchParameteri(GL_PATCH_VERTICES, 3);
+        glGetIntegerv(GL_MAX_TESS_GEN_LEVEL, &g_maxTessLevel);
+    }
 
     // Включить MSAA если было запрошено при создании окна
     glEnable(GL_MULTISAMPLE);
 
+    // Ресурсы выше создавались с прямыми привязками
+    invalidateRenderState();
 
     return true;
 }
 
 
 void draw() {
+    updateMaterials(); // Пересобирает массив материалов, если исходная текстура сменилась
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
     // --- Модельная матрица ---
@@ -683,66 +3300,122 @@ void draw() {
     glm::mat4 view = glm::lookAt(cameraPos, cameraPos + cameraFront, cameraUp);
 
     // --- Матрица проекции ---
-    int width, height;
-    glfwGetFramebufferSize(g_window, &width, &height);
+    int width = g_framebufferWidth, height = g_framebufferHeight;
     float aspect = (height > 0) ? (float)width / (float)height : 1.0f;
-    glm::mat4 projection = glm::perspective(glm::radians(45.0f), aspect, 0.1f, 100.0f);
+    // Ландшафт виден до противоположного края, поэтому дальняя плоскость отодвигается на его размер
+    glm::mat4 projection = (g_terrainSize > 0.0f)
+        ? glm::perspective(glm::radians(45.0f), aspect, TERRAIN_NEAR_PLANE, g_terrainSize * 1.5f)
+        : glm::perspective(glm::radians(45.0f), aspect, CAMERA_NEAR_PLANE, CAMERA_FAR_PLANE + 4.0f * g_scene.extent);
 
     // --- Комбинированные матрицы ---
     glm::mat4 vp = projection * view; // View-Projection для TES
     glm::mat3 normalMatrix = glm::transpose(glm::inverse(glm::mat3(model))); // Для трансформации нормалей
 
-    // --- Активация шейдера ---
-    glUseProgram(g_object.shaderProgram);
-
-    // --- Привязка текстур к текстурным юнитам ---
-    glActiveTexture(GL_TEXTURE0); // Активируем текстурный юнит 0
-    glBindTexture(GL_TEXTURE_2D, g_object.texture1); // Привязываем текстуру 1
-    glUniform1i(g_object.u_Texture1, 0); // Говорим шейдеру использовать юнит 0 для u_texture1
-
-    glActiveTexture(GL_TEXTURE1); // Активируем текстурный юнит 1
-    glBindTexture(GL_TEXTURE_2D, g_object.texture2); // Привязываем текстуру 2
-    glUniform1i(g_object.u_Texture2, 1); // Говорим шейдеру использовать юнит 1 для u_texture2
-
-
-    // --- Передача Uniforms ---
-    // Матрицы
-    glUniformMatrix4fv(g_object.u_Model, 1, GL_FALSE, glm::value_ptr(model));
-    glUniformMatrix3fv(g_object.u_NormalMatrix, 1, GL_FALSE, glm::value_ptr(normalMatrix));
-    glUniformMatrix4fv(g_object.u_VP, 1, GL_FALSE, glm::value_ptr(vp));
+    if (g_terrainSize > 0.0f) {
+        drawTerrain(vp);
+        return;
+    }
 
-    // Параметры освещения
-    glUniform3fv(g_object.u_LightPos, 1, glm::value_ptr(LIGHT_POS));
-    glUniform3fv(g_object.u_ViewPos, 1, glm::value_ptr(cameraPos));
-    glUniform3fv(g_object.u_LightColor, 1, glm::value_ptr(LIGHT_COLOR));
-    glUniform3fv(g_object.u_AmbientColor, 1, glm::value_ptr(MATERIAL_AMBIENT));
-    // glUniform3fv(g_object.u_DiffuseColor, 1, glm::value_ptr(MATERIAL_DIFFUSE)); // Удалено
-    glUniform3fv(g_object.u_SpecularColor, 1, glm::value_ptr(MATERIAL_SPECULAR));
-    glUniform1f(g_object.u_Shininess, MATERIAL_SHININESS);
+    // --- Uniform-блоки (один слот кольцевого UBO на кадр) ---
+    // Камера, свет и настройки тесселяции
+    FrameUniforms frame{};
+    frame.vp = vp;
+    frame.viewPos = cameraPos;
+    frame.lightPos = LIGHT_POS;
+    frame.lightColor = LIGHT_COLOR;
+    frame.tessLevelInner = TESS_LEVEL_INNER;
+    frame.tessLevelOuter = TESS_LEVEL_OUTER;
+    frame.adaptiveTess = g_adaptiveTess ? 1 : 0;
+    frame.tessPixelScale = projection[1][1] * 0.5f * height / g_tessTargetPixels;
+    frame.maxTessLevel = (float)g_maxTessLevel;
+    frame.cullPatches = g_cullPatches ? 1 : 0;
+    frame.backfaceCull = g_backfaceCullPatches ? 1 : 0;
+    frame.analyticDisplacement = g_analyticDisplacement ? 1 : 0;
+    frame.nearPlane = CAMERA_NEAR_PLANE;
+
+    // Преобразование и форма поверхности (параметры сетки нужны упакованному и процедурному форматам вершин)
+    ObjectUniforms object{};
+    object.model = model;
+    for (int i = 0; i < 3; ++i) object.normalMatrix[i] = glm::vec4(normalMatrix[i], 0.0f);
+    object.sinAmplitude = SIN_AMPLITUDE;
+    object.sinFrequency = SIN_FREQUENCY;
+    object.cullZBound = SURFACE_CULL_Z_BOUND;
+    object.planeSize = PLANE_SIZE;
+    object.gridSize = g_gridSize;
+
+    // Освещение материала и смешивание текстур
+    MaterialUniforms material{};
+    material.ambientColor = MATERIAL_AMBIENT;
+    material.specularColor = MATERIAL_SPECULAR;
+    material.shininess = MATERIAL_SHININESS;
+    material.blendFactor = g_blendFactor;
+    uploadFrameUniforms(frame, object, material);
+
+    // --- Отсечение экземпляров (compute) ---
+    unsigned int counterSlot = g_frameIndex % PATCH_COUNTER_RING;
+    if (g_instanceCulling.enabled) {
+        cullInstances(counterSlot);
+    }
 
-    // Параметр смешивания текстур
-    glUniform1f(g_object.u_BlendFactor, g_blendFactor);
+    // --- Активация шейдера ---
+    useProgram(g_object.shaderProgram);
 
-    // Уровни тесселяции
-    if (g_object.u_TessLevelInner != -1) glUniform1f(g_object.u_TessLevelInner, TESS_LEVEL_INNER);
-    if (g_object.u_TessLevelOuter != -1) glUniform1f(g_object.u_TessLevelOuter, TESS_LEVEL_OUTER);
+    // --- Массив материалов: одна привязка на все пары текстур (юнит задан в setupProgramUniforms) ---
+    bindTexture(MATERIAL_TEXTURE_UNIT, GL_TEXTURE_2D_ARRAY, g_materials.texture);
 
     // --- Отрисовка ---
-    glBindVertexArray(g_object.vao);
+    bindVertexArray(g_object.vao);
     // Используем GL_PATCHES вместо GL_TRIANGLES, т.к. используем тесселяцию
-    glDrawElements(GL_PATCHES, g_object.indexCount, GL_UNSIGNED_INT, NULL);
-
-    // --- Отвязка ресурсов ---
-    glBindVertexArray(0);
-    glUseProgram(0);
-    glActiveTexture(GL_TEXTURE0); // Можно сбросить активный юнит
-    glBindTexture(GL_TEXTURE_2D, 0); // Отвязать текстуру от юнита 0
-    glActiveTexture(GL_TEXTURE1);
-    glBindTexture(GL_TEXTURE_2D, 0); // Отвязать текстуру от юнита 1
+    if (g_patchCounterSupported) {
+        // Обнуляем счетчик этого кадра и подключаем его к точке привязки 0
+        const GLuint zero = 0;
+        bindBufferBase(GL_ATOMIC_COUNTER_BUFFER, 0, g_patchCounterBuffers[counterSlot]);
+        bindBuffer(GL_ATOMIC_COUNTER_BUFFER, g_patchCounterBuffers[counterSlot]);
+        glBufferSubData(GL_ATOMIC_COUNTER_BUFFER, 0, sizeof(zero), &zero);
+    }
+    if (g_instanceCulling.enabled) {
+        // По команде на экземпляр; отсеченные имеют instanceCount 0
+        bindBuffer(GL_DRAW_INDIRECT_BUFFER, g_instanceCulling.commandBuffer);
+        glMultiDrawElementsIndirect(GL_PATCHES, GL_UNSIGNED_INT, NULL, (GLsizei)g_scene.instances.size(), 0);
+    }
+    else {
+        glDrawElementsInstanced(GL_PATCHES, g_object.indexCount, GL_UNSIGNED_INT, NULL, (GLsizei)g_scene.instances.size());
+    }
+    // Атомарные счетчики пишутся шейдером в обход обычной синхронизации буферов: без барьера
+    // glGetBufferSubData может прочитать значение, которое еще не видно
+    if (g_patchCounterSupported && g_memoryBarrierSupported) glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    fenceFrameUniforms();
+    if (g_patchCounterSupported && g_frameIndex + 1 >= PATCH_COUNTER_RING) {
+        // Самый старый счетчик в кольце записан PATCH_COUNTER_RING - 1 кадров назад
+        GLuint culled = 0;
+        bindBuffer(GL_ATOMIC_COUNTER_BUFFER, g_patchCounterBuffers[(g_frameIndex + 1) % PATCH_COUNTER_RING]);
+        glGetBufferSubData(GL_ATOMIC_COUNTER_BUFFER, 0, sizeof(culled), &culled);
+        g_culledPatches = culled;
+    }
+    if (g_instanceCulling.enabled && g_frameIndex + 1 >= PATCH_COUNTER_RING) {
+        GLuint visible = 0;
+        bindBuffer(GL_SHADER_STORAGE_BUFFER, g_instanceCulling.counterBuffers[(g_frameIndex + 1) % PATCH_COUNTER_RING]);
+        glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(visible), &visible);
+        g_visibleInstances = visible;
+    }
+    ++g_frameIndex;
+    // Ресурсы не отвязываются: следующий кадр привязывает те же, и кэш состояния пропускает эти вызовы
 }
 
 
 void cleanupApp() {
+    if (g_terrain.shaderProgram != 0) {
+        glDeleteProgram(g_terrain.shaderProgram);
+        g_terrain.shaderProgram = 0;
+    }
+    if (g_terrain.vbo != 0) glDeleteBuffers(1, &g_terrain.vbo);
+    if (g_terrain.ibo != 0) glDeleteBuffers(1, &g_terrain.ibo);
+    if (g_terrain.vao != 0) glDeleteVertexArrays(1, &g_terrain.vao);
+    g_terrain.vbo = g_terrain.ibo = g_terrain.vao = 0;
+    if (g_patchCounterBuffers[0] != 0) {
+        glDeleteBuffers(PATCH_COUNTER_RING, g_patchCounterBuffers);
+        for (GLuint& buffer : g_patchCounterBuffers) buffer = 0;
+    }
     // Удаляем шейдерную программу
     if (g_object.shaderProgram != 0) {
         glDeleteProgram(g_object.shaderProgram);
@@ -757,20 +3430,32 @@ void cleanupApp() {
         glDeleteBuffers(1, &g_object.ibo);
         g_object.ibo = 0;
     }
+    if (g_scene.instanceVbo != 0) {
+        glDeleteBuffers(1, &g_scene.instanceVbo);
+        g_scene.instanceVbo = 0;
+    }
+    g_scene.instances.clear();
+    destroyInstanceCulling();
     // Удаляем VAO
     if (g_object.vao != 0) {
         glDeleteVertexArrays(1, &g_object.vao);
         g_object.vao = 0;
     }
-    // Удаляем текстуры
-    if (g_object.texture1 != 0) {
+    // Удаляем текстуры (заглушку асинхронной загрузки удаляет destroyTextureStreamer)
+    if (g_object.texture1 != 0 && g_object.texture1 != g_textureStreamer.placeholder) {
         glDeleteTextures(1, &g_object.texture1);
-        g_object.texture1 = 0;
     }
-    if (g_object.texture2 != 0) {
+    if (g_object.texture2 != 0 && g_object.texture2 != g_textureStreamer.placeholder) {
         glDeleteTextures(1, &g_object.texture2);
-        g_object.texture2 = 0;
     }
+    g_object.texture1 = g_object.texture2 = 0;
+    if (g_texturePbo != 0) {
+        glDeleteBuffers(1, &g_texturePbo);
+        g_texturePbo = 0;
+    }
+    destroyUniformRing();
+    destroyMaterials();
+    destroyTextureStreamer();
 }
 
 
@@ -811,8 +3496,8 @@ bool initOpenGL() {
     cout << "OpenGL Version: " << glGetString(GL_VERSION) << endl;
     cout << "GLSL Version: " << glGetString(GL_SHADING_LANGUAGE_VERSION) << endl;
 
-    // Включаем VSync (вертикальную синхронизацию)
-    glfwSwapInterval(1);
+    // Включаем VSync (вертикальную синхронизацию); при замере он только мешает
+    glfwSwapInterval(g_benchFrames > 0 ? 0 : 1);
 
     // Включаем "залипание" клавиш, чтобы можно было проверять их состояние каждый кадр
     glfwSetInputMode(g_window, GLFW_STICKY_KEYS, GL_TRUE);
@@ -820,11 +3505,230 @@ bool initOpenGL() {
     return true;
 }
 
+// --- Безоконный режим ---
+
+void tearDownOpenGL();
+
+#ifdef HEADLESS_EGL_SUPPORTED
+static bool hasEGLExtension(const char* extensions, const char* name) {
+    if (extensions == nullptr) return false;
+    size_t len = strlen(name);
+    for (const char* p = strstr(extensions, name); p != nullptr; p = strstr(p + len, name)) {
+        if ((p == extensions || p[-1] == ' ') && (p[len] == ' ' || p[len] == '\0')) return true;
+    }
+    return false;
+}
+#endif
+
+// Создает контекст OpenGL 4.1 Core без окна и без дисплейного сервера.
+// Предпочитается платформа EGL_MESA_platform_surfaceless; если ее нет - дисплей по умолчанию и pbuffer 1x1.
+bool createHeadlessContext() {
+#ifdef HEADLESS_EGL_SUPPORTED
+    const char* clientExtensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+    if (hasEGLExtension(clientExtensions, "EGL_MESA_platform_surfaceless")) {
+        PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+        if (getPlatformDisplay) {
+            g_eglDisplay = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+        }
+    }
+    if (g_eglDisplay == EGL_NO_DISPLAY) {
+        g_eglDisplay = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    }
+
+    EGLint major = 0, minor = 0;
+    if (g_eglDisplay == EGL_NO_DISPLAY || !eglInitialize(g_eglDisplay, &major, &minor)) {
+        cerr << "Failed to initialize EGL display (error 0x" << hex << eglGetError() << dec << ")" << endl;
+        g_eglDisplay = EGL_NO_DISPLAY;
+        return false;
+    }
+    cout << "EGL Version: " << major << "." << minor << " (" << eglQueryString(g_eglDisplay, EGL_VENDOR) << ")" << endl;
+
+    if (!eglBindAPI(EGL_OPENGL_API)) {
+        cerr << "EGL: desktop OpenGL API is not available" << endl;
+        return false;
+    }
+
+    const char* displayExtensions = eglQueryString(g_eglDisplay, EGL_EXTENSIONS);
+    bool surfaceless = hasEGLExtension(displayExtensions, "EGL_KHR_surfaceless_context");
+
+    const EGLint configAttribs[] = {
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8,
+        EGL_NONE
+    };
+    EGLConfig config = (EGLConfig)0;
+    EGLint numConfigs = 0;
+    if (!eglChooseConfig(g_eglDisplay, configAttribs, &config, 1, &numConfigs) || numConfigs == 0) {
+        if (!surfaceless || !hasEGLExtension(displayExtensions, "EGL_KHR_no_config_context")) {
+            cerr << "EGL: no suitable config found" << endl;
+            return false;
+        }
+        config = (EGLConfig)0; // EGL_NO_CONFIG_KHR - рисуем только в FBO
+    }
+
+    // Запрашиваем OpenGL 4.1 Core Profile, как и для окна
+    const EGLint contextAttribs[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 4,
+        EGL_CONTEXT_MINOR_VERSION, 1,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE
+    };
+    g_eglContext = eglCreateContext(g_eglDisplay, config, EGL_NO_CONTEXT, contextAttribs);
+    if (g_eglContext == EGL_NO_CONTEXT) {
+        cerr << "Failed to create EGL context (error 0x" << hex << eglGetError() << dec << "). Check OpenGL version support (4.1 Core required)." << endl;
+        return false;
+    }
+
+    if (!surfaceless) {
+        const EGLint pbufferAttribs[] = { EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE };
+        g_eglSurface = eglCreatePbufferSurface(g_eglDisplay, config, pbufferAttribs);
+        if (g_eglSurface == EGL_NO_SURFACE) {
+            cerr << "Failed to create EGL pbuffer surface" << endl;
+            return false;
+        }
+    }
+
+    if (!eglMakeCurrent(g_eglDisplay, g_eglSurface, g_eglSurface, g_eglContext)) {
+        cerr << "Failed to make EGL context current" << endl;
+        return false;
+    }
+    return true;
+#else
+    cerr << "Headless mode is not supported on this platform" << endl;
+    return false;
+#endif
+}
+
+void destroyOffscreenTarget() {
+    if (g_offscreen.fbo) glDeleteFramebuffers(1, &g_offscreen.fbo);
+    if (g_offscreen.resolveFbo) glDeleteFramebuffers(1, &g_offscreen.resolveFbo);
+    if (g_offscreen.colorRbo) glDeleteRenderbuffers(1, &g_offscreen.colorRbo);
+    if (g_offscreen.depthRbo) glDeleteRenderbuffers(1, &g_offscreen.depthRbo);
+    if (g_offscreen.resolveRbo) glDeleteRenderbuffers(1, &g_offscreen.resolveRbo);
+    g_offscreen = OffscreenTarget();
+}
+
+// FBO, в который draw() рисует вместо окна: MSAA цвет + глубина и буфер для разрешения MSAA
+bool createOffscreenTarget(int width, int height) {
+    g_offscreen.width = width;
+    g_offscreen.height = height;
+
+    glGenRenderbuffers(1, &g_offscreen.colorRbo);
+    glBindRenderbuffer(GL_RENDERBUFFER, g_offscreen.colorRbo);
+    glRenderbufferStorageMultisample(GL_RENDERBUFFER, HEADLESS_SAMPLES, GL_RGBA8, width, height);
+
+    glGenRenderbuffers(1, &g_offscreen.depthRbo);
+    glBindRenderbuffer(GL_RENDERBUFFER, g_offscreen.depthRbo);
+    glRenderbufferStorageMultisample(GL_RENDERBUFFER, HEADLESS_SAMPLES, GL_DEPTH_COMPONENT24, width, height);
+
+    glGenFramebuffers(1, &g_offscreen.fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, g_offscreen.fbo);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, g_offscreen.colorRbo);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, g_offscreen.depthRbo);
+    bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+
+    glGenRenderbuffers(1, &g_offscreen.resolveRbo);
+    glBindRenderbuffer(GL_RENDERBUFFER, g_offscreen.resolveRbo);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+
+    glGenFramebuffers(1, &g_offscreen.resolveFbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, g_offscreen.resolveFbo);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, g_offscreen.resolveRbo);
+    complete = complete && glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+    if (!complete) {
+        cerr << "Offscreen framebuffer is incomplete" << endl;
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        destroyOffscreenTarget();
+        return false;
+    }
+
+    // Дальше вся отрисовка идет в мультисемпловый FBO
+    glBindFramebuffer(GL_FRAMEBUFFER, g_offscreen.fbo);
+    glViewport(0, 0, width, height);
+    return true;
+}
+
+bool initOpenGLHeadless() {
+    if (!createHeadlessContext()) {
+        tearDownOpenGL();
+        return false;
+    }
+
+    // GLEW, собранный под GLX, не находит X-дисплей, но указатели на функции GL к этому моменту уже загружены
+    glewExperimental = true;
+    GLenum glewStatus = glewInit();
+#ifdef GLEW_ERROR_NO_GLX_DISPLAY
+    if (glewStatus == GLEW_ERROR_NO_GLX_DISPLAY) glewStatus = GLEW_OK;
+#endif
+    if (glewStatus != GLEW_OK) {
+        cerr << "Failed to initialize GLEW" << endl;
+        tearDownOpenGL();
+        return false;
+    }
+    glGetError(); // Сбрасываем возможную ошибку GL_INVALID_ENUM от GLEW в Core Profile
+
+    cout << "OpenGL Vendor: " << glGetString(GL_VENDOR) << endl;
+    cout << "OpenGL Renderer: " << glGetString(GL_RENDERER) << endl;
+    cout << "OpenGL Version: " << glGetString(GL_VERSION) << endl;
+    cout << "GLSL Version: " << glGetString(GL_SHADING_LANGUAGE_VERSION) << endl;
+
+    if (!createOffscreenTarget(g_framebufferWidth, g_framebufferHeight)) {
+        tearDownOpenGL();
+        return false;
+    }
+    return true;
+}
+
+// Разрешает MSAA и сохраняет текущий кадр в бинарный PPM (P6)
+bool writeFramePPM(const std::string& path) {
+    const int width = g_offscreen.width, height = g_offscreen.height;
+
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, g_offscreen.fbo);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, g_offscreen.resolveFbo);
+    glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+
+    std::vector<unsigned char> pixels((size_t)width * height * 3);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, g_offscreen.resolveFbo);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, pixels.data());
+    glBindFramebuffer(GL_FRAMEBUFFER, g_offscreen.fbo);
+
+    std::ofstream file(path, std::ios::binary);
+    if (!file) {
+        cerr << "Failed to open '" << path << "' for writing" << endl;
+        return false;
+    }
+    file << "P6\n" << width << " " << height << "\n255\n";
+    // glReadPixels возвращает строки снизу вверх, PPM хранит сверху вниз
+    for (int y = height - 1; y >= 0; --y) {
+        file.write((const char*)&pixels[(size_t)y * width * 3], (std::streamsize)width * 3);
+    }
+    return (bool)file;
+}
+
 void tearDownOpenGL() {
     if (g_window) {
         glfwDestroyWindow(g_window);
         g_window = nullptr;
     }
+    destroyOffscreenTarget();
+#ifdef HEADLESS_EGL_SUPPORTED
+    if (g_eglDisplay != EGL_NO_DISPLAY) {
+        eglMakeCurrent(g_eglDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+        if (g_eglSurface != EGL_NO_SURFACE) eglDestroySurface(g_eglDisplay, g_eglSurface);
+        if (g_eglContext != EGL_NO_CONTEXT) eglDestroyContext(g_eglDisplay, g_eglContext);
+        eglTerminate(g_eglDisplay);
+        g_eglSurface = EGL_NO_SURFACE;
+        g_eglContext = EGL_NO_CONTEXT;
+        g_eglDisplay = EGL_NO_DISPLAY;
+    }
+#endif
+    if (g_headless) {
+        return; // GLFW в безоконном режиме не инициализировался
+    }
     glfwTerminate();
 }
 
@@ -882,18 +3786,500 @@ void processInput()
 }
 
 
-int main() {
-    if (!initOpenGL()) {
+// Обновление анимации модели (общая часть оконного и безоконного циклов)
+void updateScene() {
+    // Обновление угла вращения модели для анимации
+    if (g_rotate) {
+        g_rotationAngleZ += g_objectRotationSpeedRad * g_deltaTime;
+        // Ограничение угла, чтобы избежать слишком больших значений (не обязательно)
+        if (g_rotationAngleZ > glm::two_pi<float>())
+            g_rotationAngleZ -= glm::two_pi<float>();
+        else if (g_rotationAngleZ < 0.0f)
+            g_rotationAngleZ += glm::two_pi<float>();
+    }
+}
+
+// Безоконный цикл: фиксированное число кадров с фиксированным шагом времени, кадры пишутся в PPM
+int runHeadless() {
+    g_deltaTime = HEADLESS_FRAME_TIME;
+
+    double totalRenderTime = 0.0;
+    for (int frame = 0; frame < g_headlessFrames; ++frame) {
+        updateScene();
+
+        auto frameStart = chrono::steady_clock::now();
+        draw();
+        glFinish(); // Ждем GPU, чтобы время кадра было честным
+        totalRenderTime += chrono::duration<double>(chrono::steady_clock::now() - frameStart).count();
+
+        if (!g_headlessOutputDir.empty()) {
+            char name[32];
+            snprintf(name, sizeof(name), "/frame_%04d.ppm", frame);
+            if (!writeFramePPM(g_headlessOutputDir + name)) {
+                return -1;
+            }
+        }
+    }
+
+    GLenum err = glGetError();
+    if (err != GL_NO_ERROR) {
+        cerr << "OpenGL error during headless rendering: " << err << endl;
+        return -1;
+    }
+
+    cout << "Rendered " << g_headlessFrames << " frames (" << g_framebufferWidth << "x" << g_framebufferHeight << ") in "
+        << totalRenderTime * 1000.0 << " ms, " << (totalRenderTime > 0.0 ? g_headlessFrames / totalRenderTime : 0.0) << " FPS" << endl;
+    return 0;
+}
+
+// --- Замер производительности ---
+
+// Детерминированная траектория камеры: облет вокруг поверхности с покачиванием по высоте.
+// Положение зависит только от номера кадра, поэтому прогоны разных сборок сравнимы.
+void setBenchCamera(int frame, int totalFrames) {
+    float t = (float)frame / (float)std::max(totalFrames, 1);
+    float angle = glm::two_pi<float>() * t;
+    if (g_terrainSize > 0.0f) {
+        // Пролет над ландшафтом через центр с поворотами вправо-влево
+        cameraPos = glm::vec3(0.1f * g_terrainSize * sin(angle), TERRAIN_CAMERA_HEIGHT + 5.0f * sin(2.0f * angle), g_terrainSize * (0.8f * t - 0.4f));
+        cameraFront = glm::normalize(glm::vec3(0.5f * cos(angle), -0.25f, 1.0f));
+        return;
+    }
+    // Поле экземпляров облетается на соответственно большем расстоянии
+    const float radius = BENCH_CAMERA_RADIUS + 1.5f * g_scene.extent;
+    const float height = 2.0f + 0.5f * g_scene.extent;
+    cameraPos = glm::vec3(radius * sin(angle), height * sin(2.0f * angle), -radius * cos(angle));
+    cameraFront = glm::normalize(-cameraPos); // Смотрим в центр поверхности
+    g_rotationAngleZ = angle;
+}
+
+struct FrameStats {
+    double min = 0.0, median = 0.0, p95 = 0.0, p99 = 0.0, mean = 0.0;
+};
+
+FrameStats computeFrameStats(std::vector<double> samples) {
+    FrameStats stats;
+    if (samples.empty()) return stats;
+    std::sort(samples.begin(), samples.end());
+    // Перцентиль по ближайшему рангу
+    auto percentile = [&samples](double p) {
+        size_t rank = (size_t)std::ceil(p / 100.0 * samples.size());
+        return samples[std::min(std::max(rank, (size_t)1), samples.size()) - 1];
+    };
+    stats.min = samples.front();
+    stats.median = percentile(50.0);
+    stats.p95 = percentile(95.0);
+    stats.p99 = percentile(99.0);
+    double sum = 0.0;
+    for (double v : samples) sum += v;
+    stats.mean = sum / samples.size();
+    return stats;
+}
+
+static void writeStatsJson(std::ostream& out, const char* name, const FrameStats& stats, bool last = false) {
+    out << "    \"" << name << "\": { \"min\": " << stats.min << ", \"median\": " << stats.median
+        << ", \"p95\": " << stats.p95 << ", \"p99\": " << stats.p99 << ", \"mean\": " << stats.mean << " }" << (last ? "\n" : ",\n");
+}
+
+// Прогон g_benchFrames кадров. Каждый draw() обернут в запросы GL_TIME_ELAPSED и GL_PRIMITIVES_GENERATED
+// (число примитивов после тесселяции), плюс замер времени CPU на отправку команд и на весь кадр.
+int runBenchmark() {
+    GLuint timeQueries[BENCH_QUERY_LATENCY], primitiveQueries[BENCH_QUERY_LATENCY];
+    glGenQueries(BENCH_QUERY_LATENCY, timeQueries);
+    glGenQueries(BENCH_QUERY_LATENCY, primitiveQueries);
+
+    std::vector<double> cpuFrameMs, cpuDrawMs, gpuMs;
+    std::vector<double> primitives, culledPatches, terrainChunks, terrainTriangles, visibleInstances, culledInstances;
+    std::vector<double> stateCallsRequested, stateCallsIssued;
+    const int totalFrames = BENCH_WARMUP_FRAMES + g_benchFrames;
+    cpuFrameMs.reserve(g_benchFrames);
+    cpuDrawMs.reserve(g_benchFrames);
+    gpuMs.reserve(g_benchFrames);
+    primitives.reserve(g_benchFrames);
+
+    // Забирает результаты запросов кадра frame (блокируется, только если GPU отстал больше чем на BENCH_QUERY_LATENCY кадров)
+    auto collectQueries = [&](int frame) {
+        int slot = frame % BENCH_QUERY_LATENCY;
+        GLuint64 elapsedNs = 0, generated = 0;
+        glGetQueryObjectui64v(timeQueries[slot], GL_QUERY_RESULT, &elapsedNs);
+        glGetQueryObjectui64v(primitiveQueries[slot], GL_QUERY_RESULT, &generated);
+        if (frame >= BENCH_WARMUP_FRAMES) {
+            gpuMs.push_back(elapsedNs / 1.0e6);
+            primitives.push_back((double)generated);
+        }
+    };
+
+    g_deltaTime = HEADLESS_FRAME_TIME;
+    auto benchStart = chrono::steady_clock::now();
+    auto frameStart = benchStart;
+    for (int frame = 0; frame < totalFrames; ++frame) {
+        if (frame >= BENCH_QUERY_LATENCY) {
+            collectQueries(frame - BENCH_QUERY_LATENCY);
+        }
+        if (g_window) {
+            glfwPollEvents();
+            glfwGetFramebufferSize(g_window, &g_framebufferWidth, &g_framebufferHeight);
+        }
+        setBenchCamera(frame, totalFrames);
+
+        int slot = frame % BENCH_QUERY_LATENCY;
+        const uint64_t requestedBefore = g_renderState.requested, issuedBefore = g_renderState.issued;
+        auto drawStart = chrono::steady_clock::now();
+        glBeginQuery(GL_TIME_ELAPSED, timeQueries[slot]);
+        glBeginQuery(GL_PRIMITIVES_GENERATED, primitiveQueries[slot]);
+        draw();
+        glEndQuery(GL_PRIMITIVES_GENERATED);
+        glEndQuery(GL_TIME_ELAPSED);
+        auto drawEnd = chrono::steady_clock::now();
+        if (frame >= BENCH_WARMUP_FRAMES) {
+            stateCallsRequested.push_back((double)(g_renderState.requested - requestedBefore));
+            stateCallsIssued.push_back((double)(g_renderState.issued - issuedBefore));
+        }
+        if (frame >= BENCH_WARMUP_FRAMES && g_terrainSize > 0.0f) {
+            terrainChunks.push_back((double)g_terrain.selection.size());
+            terrainTriangles.push_back((double)g_terrain.triangles);
+        }
+        if (frame >= BENCH_WARMUP_FRAMES + PATCH_COUNTER_RING && g_culledPatches >= 0) {
+            culledPatches.push_back((double)g_culledPatches); // Значение кадра frame - (PATCH_COUNTER_RING - 1)
+        }
+        if (frame >= BENCH_WARMUP_FRAMES + PATCH_COUNTER_RING && g_visibleInstances >= 0) {
+            visibleInstances.push_back((double)g_visibleInstances);
+            culledInstances.push_back((double)(g_scene.instances.size() - g_visibleInstances));
+        }
+
+        if (g_window) glfwSwapBuffers(g_window);
+        else glFlush();
+
+        auto frameEnd = chrono::steady_clock::now();
+        if (frame >= BENCH_WARMUP_FRAMES) {
+            cpuDrawMs.push_back(chrono::duration<double, std::milli>(drawEnd - drawStart).count());
+            cpuFrameMs.push_back(chrono::duration<double, std::milli>(frameEnd - frameStart).count());
+        }
+        frameStart = frameEnd;
+    }
+    for (int frame = std::max(totalFrames - BENCH_QUERY_LATENCY, 0); frame < totalFrames; ++frame) {
+        collectQueries(frame);
+    }
+    double totalSeconds = chrono::duration<double>(chrono::steady_clock::now() - benchStart).count();
+
+    glDeleteQueries(BENCH_QUERY_LATENCY, timeQueries);
+    glDeleteQueries(BENCH_QUERY_LATENCY, primitiveQueries);
+
+    GLenum err = glGetError();
+    if (err != GL_NO_ERROR) {
+        cerr << "OpenGL error during benchmark: " << err << endl;
+        return -1;
+    }
+
+    std::ostringstream json;
+    json.precision(10); // Число примитивов выводим целиком, без экспоненты
+    json << "{\n";
+    json << "  \"renderer\": " << jsonString((const char*)glGetString(GL_RENDERER)) << ",\n";
+    json << "  \"version\": " << jsonString((const char*)glGetString(GL_VERSION)) << ",\n";
+    json << "  \"headless\": " << (g_headless ? "true" : "false") << ",\n";
+    json << "  \"width\": " << g_framebufferWidth << ",\n";
+    json << "  \"height\": " << g_framebufferHeight << ",\n";
+    json << "  \"frames\": " << g_benchFrames << ",\n";
+    json << "  \"warmup_frames\": " << BENCH_WARMUP_FRAMES << ",\n";
+    json << "  \"grid_size\": " << g_gridSize << ",\n";
+    json << "  \"vertex_format\": \"" << vertexFormatName(g_vertexFormat) << "\",\n";
+    json << "  \"displacement\": \"" << (g_analyticDisplacement ? "analytic" : "interpolated") << "\",\n";
+    json << "  \"tessellation\": \"" << (g_adaptiveTess ? "adaptive" : "fixed") << "\",\n";
+    if (g_adaptiveTess) json << "  \"tess_target_pixels\": " << g_tessTargetPixels << ",\n";
+    if (g_terrainSize > 0.0f) {
+        json << "  \"terrain_size\": " << g_terrainSize << ",\n";
+        json << "  \"terrain_lods\": " << g_terrain.lodCount << ",\n";
+    }
+    if (g_terrainSize <= 0.0f) {
+        // Ландшафт рисуется треугольниками без тесселяции - его число треугольников за кадр в "terrain_triangles"
+        json << "  \"patches_per_instance\": " << g_object.indexCount / 3 << ",\n";
+        json << "  \"instances\": " << g_scene.instances.size() << ",\n";
+        json << "  \"instance_culling\": \"" << (g_instanceCulling.enabled ? "gpu" : "off") << "\",\n";
+    }
+    json << "  \"patch_culling\": \"" << (g_cullPatches ? (g_backfaceCullPatches ? "frustum+backface" : "frustum") : (g_backfaceCullPatches ? "backface" : "off")) << "\",\n";
+    json << "  \"state_cache\": \"" << (g_renderStateCache ? "on" : "off") << "\",\n";
+    json << "  \"total_seconds\": " << totalSeconds << ",\n";
+    json << "  \"ms\": {\n";
+    writeStatsJson(json, "cpu_frame", computeFrameStats(cpuFrameMs));
+    writeStatsJson(json, "cpu_draw", computeFrameStats(cpuDrawMs));
+    writeStatsJson(json, "gpu", computeFrameStats(gpuMs), true);
+    json << "  },\n";
+    if (g_terrainSize <= 0.0f) {
+        // Экземпляров в секунду при средней длительности кадра (CPU) и среднем времени GPU
+        const double instances = (double)g_scene.instances.size();
+        const FrameStats cpuFrame = computeFrameStats(cpuFrameMs), gpu = computeFrameStats(gpuMs);
+        json << "  \"instances_per_second\": { \"cpu_frame\": " << (cpuFrame.mean > 0.0 ? instances * 1000.0 / cpuFrame.mean : 0.0)
+            << ", \"gpu\": " << (gpu.mean > 0.0 ? instances * 1000.0 / gpu.mean : 0.0) << " },\n";
+    }
+    json << "  \"tessellated_primitives\": {\n";
+    writeStatsJson(json, "per_frame", computeFrameStats(primitives), true);
+    json << "  },\n";
+    // Вызовы привязки за кадр: requested - без кэша состояния, issued - дошедшие до драйвера
+    json << "  \"gl_state_calls\": {\n";
+    writeStatsJson(json, "requested", computeFrameStats(stateCallsRequested));
+    writeStatsJson(json, "issued", computeFrameStats(stateCallsIssued), true);
+    json << "  }";
+    if (!terrainChunks.empty()) {
+        json << ",\n  \"terrain_chunks\": {\n";
+        writeStatsJson(json, "per_frame", computeFrameStats(terrainChunks), true);
+        json << "  },\n  \"terrain_triangles\": {\n";
+        writeStatsJson(json, "per_frame", computeFrameStats(terrainTriangles), true);
+        json << "  }";
+    }
+    if (!culledPatches.empty()) {
+        json << ",\n  \"culled_patches\": {\n";
+        writeStatsJson(json, "per_frame", computeFrameStats(culledPatches), true);
+        json << "  }";
+    }
+    if (!visibleInstances.empty()) {
+        json << ",\n  \"visible_instances\": {\n";
+        writeStatsJson(json, "per_frame", computeFrameStats(visibleInstances), true);
+        json << "  },\n  \"culled_instances\": {\n";
+        writeStatsJson(json, "per_frame", computeFrameStats(culledInstances), true);
+        json << "  }";
+    }
+    json << "\n";
+    json << "}\n";
+
+    if (g_benchOutputPath.empty()) {
+        cout << json.str();
+    }
+    else {
+        std::ofstream file(g_benchOutputPath);
+        if (!file) {
+            cerr << "Failed to open '" << g_benchOutputPath << "' for writing" << endl;
+            return -1;
+        }
+        file << json.str();
+        cout << "Benchmark report written to '" << g_benchOutputPath << "'" << endl;
+    }
+    return 0;
+}
+
+bool parseArguments(int argc, char** argv) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--headless") {
+            g_headless = true;
+        }
+        else if (arg == "--frames" && hasValue) {
+            g_headlessFrames = atoi(argv[++i]);
+            if (g_headlessFrames < 1) g_headlessFrames = 1;
+        }
+        else if (arg == "--output" && hasValue) {
+            g_headlessOutputDir = argv[++i];
+        }
+        else if (arg == "--bench" && hasValue) {
+            g_benchFrames = atoi(argv[++i]);
+            if (g_benchFrames < 1) {
+                cerr << "Invalid --bench value, expected a positive frame count" << endl;
+                return false;
+            }
+        }
+        else if (arg == "--bench-output" && hasValue) {
+            g_benchOutputPath = argv[++i];
+        }
+        else if (arg == "--grid" && hasValue) {
+            g_gridSize = atoi(argv[++i]);
+            if (g_gridSize < 1) {
+                cerr << "Invalid --grid value, expected a positive size" << endl;
+                return false;
+            }
+        }
+        else if (arg == "--bench-mesh" && hasValue) {
+            g_benchMeshGridSize = atoi(argv[++i]);
+            if (g_benchMeshGridSize < 1) {
+                cerr << "Invalid --bench-mesh value, expected a positive grid size" << endl;
+                return false;
+            }
+        }
+        else if (arg == "--vertex-format" && hasValue) {
+            std::string format = argv[++i];
+            if (format == "float") g_vertexFormat = VERTEX_FORMAT_FLOAT;
+            else if (format == "packed") g_vertexFormat = VERTEX_FORMAT_PACKED;
+            else if (format == "procedural") g_vertexFormat = VERTEX_FORMAT_PROCEDURAL;
+            else {
+                cerr << "Invalid --vertex-format value, expected float, packed or procedural" << endl;
+                return false;
+            }
+        }
+        else if (arg == "--displacement" && hasValue) {
+            std::string mode = argv[++i];
+            if (mode == "analytic") g_analyticDisplacement = true;
+            else if (mode == "interpolated") g_analyticDisplacement = false;
+            else {
+                cerr << "Invalid --displacement value, expected analytic or interpolated" << endl;
+                return false;
+            }
+        }
+        else if (arg == "--tess" && hasValue) {
+            std::string mode = argv[++i];
+            if (mode == "adaptive") g_adaptiveTess = true;
+            else if (mode == "fixed") g_adaptiveTess = false;
+            else {
+                cerr << "Invalid --tess value, expected fixed or adaptive" << endl;
+                return false;
+            }
+        }
+        else if (arg == "--tess-pixels" && hasValue) {
+            g_tessTargetPixels = (float)atof(argv[++i]);
+            if (g_tessTargetPixels <= 0.0f) {
+                cerr << "Invalid --tess-pixels value, expected a positive number" << endl;
+                return false;
+            }
+        }
+        else if (arg == "--cull" && hasValue) {
+            std::string mode = argv[++i];
+            if (mode == "on") g_cullPatches = true;
+            else if (mode == "off") g_cullPatches = false;
+            else {
+                cerr << "Invalid --cull value, expected on or off" << endl;
+                return false;
+            }
+        }
+        else if (arg == "--backface-cull") {
+            g_backfaceCullPatches = true;
+        }
+        else if (arg == "--instances" && hasValue) {
+            g_instanceCount = atoi(argv[++i]);
+            if (g_instanceCount < 1) {
+                cerr << "Invalid --instances value, expected a positive count" << endl;
+                return false;
+            }
+        }
+        else if (arg == "--gpu-culling" && hasValue) {
+            std::string mode = argv[++i];
+            if (mode == "on") g_gpuCulling = true;
+            else if (mode == "off") g_gpuCulling = false;
+            else {
+                cerr << "Invalid --gpu-culling value, expected on or off" << endl;
+                return false;
+            }
+        }
+        else if (arg == "--state-cache" && hasValue) {
+            std::string mode = argv[++i];
+            if (mode == "on") g_renderStateCache = true;
+            else if (mode == "off") g_renderStateCache = false;
+            else {
+                cerr << "Invalid --state-cache value, expected on or off" << endl;
+                return false;
+            }
+        }
+        else if (arg == "--terrain" && hasValue) {
+            g_terrainSize = (float)atof(argv[++i]);
+            if (g_terrainSize < TERRAIN_LEAF_SIZE) {
+                cerr << "Invalid --terrain value, expected a size of at least " << TERRAIN_LEAF_SIZE << endl;
+                return false;
+            }
+        }
+        else if (arg == "--shader-cache" && hasValue) {
+            std::string mode = argv[++i];
+            if (mode == "on") g_shaderCache = true;
+            else if (mode == "off") g_shaderCache = false;
+            else {
+                cerr << "Invalid --shader-cache value, expected on or off" << endl;
+                return false;
+            }
+        }
+        else if (arg == "--textures" && hasValue) {
+            std::string mode = argv[++i];
+            if (mode == "async") g_asyncTextures = true;
+            else if (mode == "sync") g_asyncTextures = false;
+            else {
+                cerr << "Invalid --textures value, expected async or sync" << endl;
+                return false;
+            }
+        }
+        else if (arg == "--cooked-textures" && hasValue) {
+            std::string mode = argv[++i];
+            if (mode == "on") g_cookedTextures = true;
+            else if (mode == "off") g_cookedTextures = false;
+            else {
+                cerr << "Invalid --cooked-textures value, expected on or off" << endl;
+                return false;
+            }
+        }
+        else if (arg == "--texture-io" && hasValue) {
+            std::string mode = argv[++i];
+            if (mode == "mmap") g_mappedTextureIO = true;
+            else if (mode == "stdio") g_mappedTextureIO = false;
+            else {
+                cerr << "Invalid --texture-io value, expected mmap or stdio" << endl;
+                return false;
+            }
+        }
+        else if (arg == "--texture-dir" && hasValue) {
+            g_textureDir = argv[++i];
+        }
+        else if (arg == "--size" && hasValue) {
+            int width = 0, height = 0;
+            if (sscanf(argv[++i], "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0) {
+                cerr << "Invalid --size value, expected WxH" << endl;
+                return false;
+            }
+            g_framebufferWidth = width;
+            g_framebufferHeight = height;
+        }
+        else {
+            cerr << "Unknown argument: " << arg << endl;
+            cerr << "Usage: " << argv[0] << " [--headless] [--frames N] [--output DIR] [--size WxH] [--bench N] [--bench-output FILE] [--grid N] [--bench-mesh N] [--vertex-format float|packed|procedural] [--displacement analytic|interpolated] [--tess fixed|adaptive] [--tess-pixels P] [--cull on|off] [--backface-cull] [--instances N] [--gpu-culling on|off] [--state-cache on|off] [--terrain SIZE] [--shader-cache on|off] [--textures async|sync] [--cooked-textures on|off] [--texture-dir DIR] [--texture-io mmap|stdio]" << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+
+// Путь к файлу текстуры: в каталоге --texture-dir, иначе в рабочем каталоге, иначе рядом с исполняемым файлом.
+// .ctex ищется рядом с найденным изображением, поэтому "make cook" в каталоге с изображениями подходит в обоих случаях.
+std::string resolveTexturePath(const char* file, const char* executable) {
+    namespace fs = std::filesystem;
+    if (!g_textureDir.empty()) return (fs::path(g_textureDir) / file).string();
+    std::error_code ec;
+    if (fs::exists(file, ec)) return file;
+    const fs::path besideExecutable = fs::path(executable).parent_path() / file;
+    if (fs::exists(besideExecutable, ec)) return besideExecutable.string();
+    return file; // Ошибка загрузки сообщит путь относительно рабочего каталога
+}
+
+int main(int argc, char** argv) {
+    if (!parseArguments(argc, argv)) {
         return -1;
     }
+    g_texturePath1 = resolveTexturePath(TEXTURE_FILE_1, argv[0]);
+    g_texturePath2 = resolveTexturePath(TEXTURE_FILE_2, argv[0]);
+    if (g_benchMeshGridSize > 0) {
+        return runMeshBenchmark(g_benchMeshGridSize); // Контекст OpenGL не нужен
+    }
+    // Интервалы перезапуска JPEG и преобразование цвета - на всех ядрах (stb_image, STBI_JPEG_THREADS);
+    // асинхронная загрузка делит ядра между своими потоками (startTextureLoads)
+    stbi_set_jpeg_thread_count(defaultThreadCount());
+    auto startupBegin = chrono::steady_clock::now();
+    if (!(g_headless ? initOpenGLHeadless() : initOpenGL())) {
+        return -1;
+    }
+    auto contextReady = chrono::steady_clock::now();
     if (!initApp()) {
         cerr << "Failed to initialize application!" << endl;
         cleanupApp();
         tearDownOpenGL();
         return -1;
     }
-
-    g_lastTime = glfwGetTime();
+    if (g_headless || g_benchFrames > 0) {
+        finishTextureLoads(); // Кадры с заглушкой вместо текстур не сравнимы между прогонами
+    }
+    auto appReady = chrono::steady_clock::now();
+    cout << "Startup: " << chrono::duration<double, std::milli>(appReady - startupBegin).count() << " ms (context "
+        << chrono::duration<double, std::milli>(contextReady - startupBegin).count() << " ms, resources "
+        << chrono::duration<double, std::milli>(appReady - contextReady).count() << " ms)" << endl;
+
+    if (g_terrainSize > 0.0f) {
+        // Над центром ландшафта, взгляд вдоль поверхности с небольшим наклоном вниз
+        cameraPos = glm::vec3(0.0f, TERRAIN_CAMERA_HEIGHT, 0.0f);
+        pitch = -15.0f;
+        cameraSpeed = TERRAIN_CAMERA_SPEED;
+    }
 
     // Рассчитаем начальный cameraFront на основе установленных yaw/pitch
     glm::vec3 front;
@@ -902,6 +4288,17 @@ int main() {
     front.z = sin(glm::radians(yaw)) * cos(glm::radians(pitch));
     cameraFront = glm::normalize(front);
 
+    if (g_benchFrames > 0 || g_headless) {
+        int result = (g_benchFrames > 0) ? runBenchmark() : runHeadless();
+        cleanupApp();
+        tearDownOpenGL();
+        return result;
+    }
+
+    g_lastTime = glfwGetTime();
+    double lastCullReport = g_lastTime;
+    double lastInstanceReport = g_lastTime;
+
     // Главный цикл рендеринга
     while (!glfwWindowShouldClose(g_window)) {
         // Расчет deltaTime
@@ -914,19 +4311,25 @@ int main() {
         // Обработка событий окна (включая однократные нажатия F и ESC из keyCallback)
         glfwPollEvents();
 
-        // Обновление угла вращения модели для анимации
-        if (g_rotate) {
-            g_rotationAngleZ += g_objectRotationSpeedRad * g_deltaTime;
-            // Ограничение угла, чтобы избежать слишком больших значений (не обязательно)
-            if (g_rotationAngleZ > glm::two_pi<float>())
-                g_rotationAngleZ -= glm::two_pi<float>();
-            else if (g_rotationAngleZ < 0.0f)
-                g_rotationAngleZ += glm::two_pi<float>();
-        }
+        updateScene();
+
+        // Подмена заглушек готовыми текстурами
+        pumpTextureUploads();
 
         // Отрисовка сцены
+        glfwGetFramebufferSize(g_window, &g_framebufferWidth, &g_framebufferHeight);
         draw();
 
+        // Раз в секунду выводим число отсеченных в TCS патчей и видимых после GPU-отсечения экземпляров
+        if (g_patchCounterSupported && currentTime - lastCullReport >= 1.0 && g_culledPatches >= 0) {
+            cout << "Culled patches: " << g_culledPatches << " / " << g_object.indexCount / 3 << endl;
+            lastCullReport = currentTime;
+        }
+        if (g_instanceCulling.enabled && currentTime - lastInstanceReport >= 1.0 && g_visibleInstances >= 0) {
+            cout << "Visible instances: " << g_visibleInstances << " / " << g_scene.instances.size() << endl;
+            lastInstanceReport = currentTime;
+        }
+
         // Обмен буферов (показ отрисованного кадра)
         glfwSwapBuffers(g_window);
     }
@@ -935,4 +4338,4 @@ int main() {
     cleanupApp();
     tearDownOpenGL();
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,179 @@
+﻿// Контейнер "приготовленной" текстуры (.ctex): готовая цепочка мип-уровней в том виде,
+// в котором ее принимает glTexImage2D / glTexSubImage2D. Пишется утилитой TextureCooker,
+// читается OpenGL1 через отображение файла в память - без декодирования и glGenerateMipmap.
+//
+// Раскладка файла:
+//   CookedTextureHeader
+//   CookedTextureLevel[levelCount]   (уровень 0 - полный размер)
+//   данные уровней, каждый начинается с границы COOKED_TEXTURE_ALIGNMENT
+// Несжатые уровни - RGBA8, как и текстуры, которые декодирует OpenGL1 (строки кратны 4 байтам), изображение
+// уже перевернуто по вертикали (первая строка - нижняя), все числа - little-endian.
+// С флагом COOKED_TEXTURE_COMPRESSED уровни хранят блоки 4x4 (BlockCompression.h) для
+// glCompressedTexImage2D: internalFormat - сжатый формат, format и type равны 0.
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+const char COOKED_TEXTURE_MAGIC[4] = { 'C', 'T', 'E', 'X' };
+const uint32_t COOKED_TEXTURE_VERSION = 1;
+const uint32_t COOKED_TEXTURE_ALIGNMENT = 16;
+const uint32_t COOKED_TEXTURE_MAX_LEVELS = 32;
+const uint32_t COOKED_TEXTURE_MAX_SIZE = 1u << 15; // Больше GL_MAX_TEXTURE_SIZE любых реализаций; размеры помещаются в GLsizei
+const uint32_t COOKED_TEXTURE_FLIPPED_Y = 1u << 0;
+const uint32_t COOKED_TEXTURE_COMPRESSED = 1u << 1;
+const char* const COOKED_TEXTURE_EXTENSION = ".ctex";
+
+// Значения перечислений OpenGL, чтобы утилите не нужны были заголовки GL
+const uint32_t COOKED_GL_UNSIGNED_BYTE = 0x1401;
+const uint32_t COOKED_GL_RGBA = 0x1908;
+const uint32_t COOKED_GL_RGBA8 = 0x8058;
+const uint32_t COOKED_GL_COMPRESSED_RGB_S3TC_DXT1 = 0x83F0;  // BC1
+const uint32_t COOKED_GL_COMPRESSED_RGBA_S3TC_DXT5 = 0x83F3; // BC3
+const uint32_t COOKED_GL_COMPRESSED_RGBA_BPTC_UNORM = 0x8E8C; // BC7
+
+// Байт на блок 4x4 для сжатых форматов, 0 - формат не сжатый или неизвестный
+inline uint32_t cookedBlockBytes(uint32_t internalFormat) {
+    switch (internalFormat) {
+    case COOKED_GL_COMPRESSED_RGB_S3TC_DXT1: return 8;
+    case COOKED_GL_COMPRESSED_RGBA_S3TC_DXT5:
+    case COOKED_GL_COMPRESSED_RGBA_BPTC_UNORM: return 16;
+    default: return 0;
+    }
+}
+
+struct CookedTextureHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t internalFormat; // Для glTexStorage2D (sized)
+    uint32_t format;         // Для glTexImage2D / glTexSubImage2D
+    uint32_t type;
+    uint32_t width, height;
+    uint32_t channels;
+    uint32_t levelCount;
+    uint32_t flags;
+};
+
+struct CookedTextureLevel {
+    uint64_t offset; // От начала файла
+    uint64_t size;
+    uint32_t width, height;
+};
+
+static_assert(sizeof(CookedTextureHeader) == 40, "CookedTextureHeader layout changed");
+static_assert(sizeof(CookedTextureLevel) == 24, "CookedTextureLevel layout changed");
+
+// Проверяет заголовок, форматы, размеры мип-цепочки и то, что все уровни лежат внутри файла:
+// загрузчик передает эти значения в glTexStorage2D / glTexSubImage2D как есть. Возвращает nullptr, если ошибок нет.
+inline const char* validateCookedTexture(const unsigned char* data, size_t size) {
+    if (size < sizeof(CookedTextureHeader)) return "file too small";
+    CookedTextureHeader header;
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, COOKED_TEXTURE_MAGIC, 4) != 0) return "bad magic";
+    if (header.version != COOKED_TEXTURE_VERSION) return "unsupported version";
+    if (header.levelCount == 0 || header.levelCount > COOKED_TEXTURE_MAX_LEVELS) return "bad level count";
+    if (header.channels < 1 || header.channels > 4 || header.width == 0 || header.height == 0 ||
+        header.width > COOKED_TEXTURE_MAX_SIZE || header.height > COOKED_TEXTURE_MAX_SIZE) return "bad dimensions";
+    if (size < sizeof(CookedTextureHeader) + header.levelCount * sizeof(CookedTextureLevel)) return "truncated level table";
+    uint32_t blockBytes = cookedBlockBytes(header.internalFormat);
+    bool compressed = (header.flags & COOKED_TEXTURE_COMPRESSED) != 0;
+    if (compressed) {
+        if (blockBytes == 0) return "unknown compressed format";
+        if (header.format != 0 || header.type != 0) return "format and type must be 0 for compressed levels";
+    }
+    else {
+        // Файлы прежних версий утилиты с уровнями R8/RGB8 отвергаются - их нужно приготовить заново
+        if (header.channels != 4 || header.internalFormat != COOKED_GL_RGBA8 || header.format != COOKED_GL_RGBA ||
+            header.type != COOKED_GL_UNSIGNED_BYTE) return "uncompressed levels must be RGBA8 (re-cook the texture)";
+    }
+    // Цепочка как у glTexStorage2D: уровень 0 - полный размер, каждый следующий - max(1, n / 2), после 1x1 уровней нет
+    uint32_t expectedWidth = header.width, expectedHeight = header.height;
+    for (uint32_t i = 0; i < header.levelCount; ++i) {
+        CookedTextureLevel level;
+        memcpy(&level, data + sizeof(CookedTextureHeader) + i * sizeof(CookedTextureLevel), sizeof(level));
+        if (i > 0) {
+            if (expectedWidth == 1 && expectedHeight == 1) return "too many levels";
+            expectedWidth = expectedWidth > 1 ? expectedWidth >> 1 : 1;
+            expectedHeight = expectedHeight > 1 ? expectedHeight >> 1 : 1;
+        }
+        if (level.width != expectedWidth || level.height != expectedHeight) return "bad level dimensions";
+        uint64_t expected = compressed
+            ? ((uint64_t)level.width + 3) / 4 * (((uint64_t)level.height + 3) / 4) * blockBytes
+            : (uint64_t)level.width * level.height * header.channels;
+        if (level.size != expected) return "bad level size";
+        if (level.offset > size || level.size > size - level.offset) return "level outside file";
+    }
+    return nullptr;
+}
+
+// Файл, отображенный в память только для чтения
+struct MappedFile {
+    const unsigned char* data = nullptr;
+    size_t size = 0;
+#if defined(_WIN32)
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = NULL;
+#endif
+
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool open(const char* path) {
+        close();
+#if defined(_WIN32)
+        file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (file == INVALID_HANDLE_VALUE) return false;
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) { close(); return false; }
+        mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping == NULL) { close(); return false; }
+        data = (const unsigned char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        if (!data) { close(); return false; }
+        size = (size_t)fileSize.QuadPart;
+#else
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) { ::close(fd); return false; }
+        void* mapped = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd); // Отображение остается действительным и после закрытия дескриптора
+        if (mapped == MAP_FAILED) return false;
+        data = (const unsigned char*)mapped;
+        size = (size_t)st.st_size;
+#endif
+        return true;
+    }
+
+    void close() {
+#if defined(_WIN32)
+        if (data) UnmapViewOfFile(data);
+        if (mapping != NULL) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+        mapping = NULL;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (data) munmap((void*)data, size);
+#endif
+        data = nullptr;
+        size = 0;
+    }
+
+    ~MappedFile() { close(); }
+};
@@ -0,0 +1,732 @@
+﻿// Утилита подготовки текстур: декодирует изображение (stb_image), переворачивает его по вертикали,
+// строит цепочку мип-уровней (фильтр 2x2, как glGenerateMipmap) и пишет контейнер .ctex (TextureContainer.h).
+// По желанию уровни сжимаются в BC1/BC3/BC7 (BlockCompression.h) - в 4-8 раз меньше видеопамяти.
+//
+// Использование:
+//   TextureCooker [--format rgba8|bc1|bc3|bc7] [--size WxH] <вход> <выход.ctex> [[--format ...] <вход> <выход.ctex> ...]
+//   TextureCooker --selftest                                  - сжатие и распаковка известных блоков с допуском ошибки
+//   TextureCooker --bench <изображение> [<изображение> ...]   - скорость и качество (PSNR) сжатия
+//   TextureCooker --bench-decode <изображение> [...]          - скорость декодирования stb_image (JPEG/PNG) по путям
+//   TextureCooker --bench-io <изображение> [...]              - чтение файла: stdio (stbi_load) против mmap
+//   TextureCooker --bench-alloc <изображение> [...]           - обращения декодера к куче: malloc, пул, свой буфер
+// --format и --size действуют на все следующие пары файлов. --size приводит изображения к общему размеру: OpenGL1
+// хранит все текстуры в одном массиве, и только слои одного размера и формата загружаются в него без распаковки.
+#define STB_IMAGE_IMPLEMENTATION
+#define STBI_JPEG_THREADS
+#define STBI_FAST_INFLATE
+#include "ImagePool.h"
+#define STBI_MALLOC(size) imagePoolAlloc(size)
+#define STBI_REALLOC(p, size) imagePoolRealloc(p, size)
+#define STBI_FREE(p) imagePoolFree(p)
+#include "stb_image.h"
+#include "TextureContainer.h"
+#include "BlockCompression.h"
+#include "JsonString.h"
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <algorithm>
+#include <thread>
+#include <cmath>
+#include <cstdio>
+
+using namespace std;
+
+// Формат уровней .ctex: без сжатия или один из блочных, и размер уровня 0
+struct CookFormat {
+    bool compressed = false;
+    BlockFormat block = BLOCK_BC1;
+    uint32_t width = 0, height = 0; // --size; 0 - размер исходного изображения
+};
+
+static unsigned compressionThreads() {
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+static uint32_t blockFormatGL(BlockFormat format) {
+    if (format == BLOCK_BC1) return COOKED_GL_COMPRESSED_RGB_S3TC_DXT1;
+    if (format == BLOCK_BC3) return COOKED_GL_COMPRESSED_RGBA_S3TC_DXT5;
+    return COOKED_GL_COMPRESSED_RGBA_BPTC_UNORM;
+}
+
+struct MipLevel {
+    uint32_t width, height;
+    vector<unsigned char> pixels;
+};
+
+// Следующий уровень: каждый пиксель - среднее блока 2x2. У нечетной стороны последний
+// столбец/строка берутся повторно, поэтому размер уровня - max(1, n / 2), как в OpenGL.
+static MipLevel downsample(const MipLevel& src, int channels) {
+    MipLevel dst;
+    dst.width = std::max(1u, src.width / 2);
+    dst.height = std::max(1u, src.height / 2);
+    dst.pixels.resize((size_t)dst.width * dst.height * channels);
+    for (uint32_t y = 0; y < dst.height; ++y) {
+        uint32_t y0 = std::min(y * 2, src.height - 1), y1 = std::min(y * 2 + 1, src.height - 1);
+        for (uint32_t x = 0; x < dst.width; ++x) {
+            uint32_t x0 = std::min(x * 2, src.width - 1), x1 = std::min(x * 2 + 1, src.width - 1);
+            for (int c = 0; c < channels; ++c) {
+                unsigned sum = src.pixels[((size_t)y0 * src.width + x0) * channels + c]
+                    + src.pixels[((size_t)y0 * src.width + x1) * channels + c]
+                    + src.pixels[((size_t)y1 * src.width + x0) * channels + c]
+                    + src.pixels[((size_t)y1 * src.width + x1) * channels + c];
+                dst.pixels[((size_t)y * dst.width + x) * channels + c] = (unsigned char)((sum + 2) / 4);
+            }
+        }
+    }
+    return dst;
+}
+
+// Масштабирование вдоль одной оси (step - шаг между соседними отсчетами, lineStep - между линиями).
+// Треугольный фильтр шириной не меньше пикселя источника: при уменьшении усредняет все покрытые пиксели,
+// при увеличении сводится к линейной интерполяции. За краем повторяется крайний пиксель.
+static void resampleAxis(const float* src, float* dst, uint32_t srcLength, uint32_t dstLength, uint32_t lines,
+    size_t srcStep, size_t dstStep, size_t srcLineStep, size_t dstLineStep, int channels) {
+    const double scale = (double)srcLength / dstLength;
+    const double radius = std::max(1.0, scale);
+    for (uint32_t i = 0; i < dstLength; ++i) {
+        const double center = (i + 0.5) * scale - 0.5;
+        const int first = (int)ceil(center - radius), last = (int)floor(center + radius);
+        for (uint32_t line = 0; line < lines; ++line) {
+            float* out = dst + line * dstLineStep + i * dstStep;
+            double sum[4] = {}, weightSum = 0.0;
+            for (int j = first; j <= last; ++j) {
+                const double weight = 1.0 - fabs(j - center) / radius;
+                if (weight <= 0.0) continue;
+                const int clamped = std::min(std::max(j, 0), (int)srcLength - 1);
+                const float* in = src + line * srcLineStep + clamped * srcStep;
+                for (int c = 0; c < channels; ++c) sum[c] += weight * in[c];
+                weightSum += weight;
+            }
+            for (int c = 0; c < channels; ++c) out[c] = (float)(sum[c] / weightSum);
+        }
+    }
+}
+
+// Уровень 0 другого размера (--size): сначала по строкам, затем по столбцам
+static MipLevel resample(const MipLevel& src, uint32_t width, uint32_t height, int channels) {
+    vector<float> source(src.pixels.begin(), src.pixels.end());
+    vector<float> rows((size_t)width * src.height * channels);
+    resampleAxis(source.data(), rows.data(), src.width, width, src.height, channels, channels,
+        (size_t)src.width * channels, (size_t)width * channels, channels);
+    vector<float> result((size_t)width * height * channels);
+    resampleAxis(rows.data(), result.data(), src.height, height, width, (size_t)width * channels, (size_t)width * channels,
+        channels, channels, channels);
+
+    MipLevel dst;
+    dst.width = width;
+    dst.height = height;
+    dst.pixels.resize(result.size());
+    for (size_t i = 0; i < result.size(); ++i) dst.pixels[i] = (unsigned char)std::min(255.0f, std::max(0.0f, result[i] + 0.5f));
+    return dst;
+}
+
+static bool cookTexture(const string& inputPath, const string& outputPath, const CookFormat& format) {
+    auto start = chrono::steady_clock::now();
+
+    // Та же ориентация, что и при загрузке в OpenGL1: первая строка - нижняя.
+    // Уровни всегда RGBA8, как у декодированных в OpenGL1 текстур, - "--format rgba8" означает именно это.
+    stbi_set_flip_vertically_on_load(true);
+    int width, height, fileChannels;
+    const int channels = 4;
+    unsigned char* data = stbi_load(inputPath.c_str(), &width, &height, &fileChannels, channels);
+    if (!data) {
+        cerr << "Failed to load '" << inputPath << "': " << stbi_failure_reason() << endl;
+        return false;
+    }
+
+    CookedTextureHeader header = {};
+    memcpy(header.magic, COOKED_TEXTURE_MAGIC, 4);
+    header.version = COOKED_TEXTURE_VERSION;
+    header.internalFormat = COOKED_GL_RGBA8;
+    header.format = COOKED_GL_RGBA;
+    header.type = COOKED_GL_UNSIGNED_BYTE;
+    header.width = format.width != 0 ? format.width : (uint32_t)width;
+    header.height = format.height != 0 ? format.height : (uint32_t)height;
+    header.channels = (uint32_t)channels;
+    header.flags = COOKED_TEXTURE_FLIPPED_Y;
+
+    vector<MipLevel> levels(1);
+    levels[0].width = (uint32_t)width;
+    levels[0].height = (uint32_t)height;
+    levels[0].pixels.assign(data, data + (size_t)width * height * channels);
+    stbi_image_free(data);
+    if (header.width != levels[0].width || header.height != levels[0].height) {
+        levels[0] = resample(levels[0], header.width, header.height, channels);
+    }
+    while (levels.back().width > 1 || levels.back().height > 1) {
+        levels.push_back(downsample(levels.back(), channels));
+    }
+    header.levelCount = (uint32_t)levels.size();
+
+    // Сжатие: пиксели уровня заменяются блоками 4x4
+    double compressMs = 0.0;
+    if (format.compressed) {
+        if (format.block == BLOCK_BC1 && (fileChannels == 2 || fileChannels == 4)) {
+            cout << "Warning: '" << inputPath << "' has alpha, BC1 drops it (use bc3 or bc7)" << endl;
+        }
+        auto compressStart = chrono::steady_clock::now();
+        for (MipLevel& level : levels) {
+            level.pixels = compressImage(format.block, level.pixels.data(), (int)level.width, (int)level.height, channels, (int)compressionThreads());
+        }
+        compressMs = chrono::duration<double, std::milli>(chrono::steady_clock::now() - compressStart).count();
+        header.internalFormat = blockFormatGL(format.block);
+        header.format = 0;
+        header.type = 0;
+        header.flags |= COOKED_TEXTURE_COMPRESSED;
+    }
+
+    // Таблица уровней, затем данные с выравниванием
+    vector<CookedTextureLevel> table(levels.size());
+    uint64_t offset = sizeof(CookedTextureHeader) + table.size() * sizeof(CookedTextureLevel);
+    for (size_t i = 0; i < levels.size(); ++i) {
+        offset = (offset + COOKED_TEXTURE_ALIGNMENT - 1) / COOKED_TEXTURE_ALIGNMENT * COOKED_TEXTURE_ALIGNMENT;
+        table[i].offset = offset;
+        table[i].size = levels[i].pixels.size();
+        table[i].width = levels[i].width;
+        table[i].height = levels[i].height;
+        offset += table[i].size;
+    }
+
+    ofstream file(outputPath, ios::binary | ios::trunc);
+    if (!file) {
+        cerr << "Failed to open '" << outputPath << "' for writing" << endl;
+        return false;
+    }
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(table.data()), table.size() * sizeof(CookedTextureLevel));
+    const char padding[COOKED_TEXTURE_ALIGNMENT] = {};
+    for (size_t i = 0; i < levels.size(); ++i) {
+        uint64_t position = (uint64_t)file.tellp();
+        file.write(padding, (std::streamsize)(table[i].offset - position));
+        file.write(reinterpret_cast<const char*>(levels[i].pixels.data()), levels[i].pixels.size());
+    }
+    if (!file) {
+        cerr << "Failed to write '" << outputPath << "'" << endl;
+        return false;
+    }
+
+    double ms = chrono::duration<double, std::milli>(chrono::steady_clock::now() - start).count();
+    cout << inputPath << " -> " << outputPath << ": " << header.width << "x" << header.height;
+    if (header.width != (uint32_t)width || header.height != (uint32_t)height) cout << " (resized from " << width << "x" << height << ")";
+    cout << ", " << channels << " channels, "
+        << levels.size() << " levels, " << (format.compressed ? blockFormatName(format.block) : "uncompressed") << ", "
+        << offset / (1024.0 * 1024.0) << " MB in " << ms << " ms";
+    if (format.compressed) cout << " (compression " << compressMs << " ms, " << compressionThreads() << " threads)";
+    cout << endl;
+    return true;
+}
+
+// PSNR по каналам [first, first + count) двух изображений RGBA8
+static double psnr(const vector<unsigned char>& a, const vector<unsigned char>& b, int first, int count) {
+    double sum = 0.0;
+    size_t samples = 0;
+    for (size_t i = 0; i < a.size(); i += 4) {
+        for (int c = first; c < first + count; ++c) {
+            double d = (double)a[i + c] - (double)b[i + c];
+            sum += d * d;
+        }
+        samples += count;
+    }
+    if (sum == 0.0) return 99.0; // Без потерь
+    return 10.0 * log10(255.0 * 255.0 / (sum / samples));
+}
+
+// Проверка кодировщиков на известных блоках 4x4: сжатие скалярным кодом и SSE2 должно давать одни и те же байты,
+// а распакованный блок - отличаться от исходного не больше чем на maxError в любом канале. Непрозрачный блок
+// обязан распаковаться с альфой ровно 255 (иначе края текстуры станут полупрозрачными).
+static bool selfTestCompression() {
+    struct TestBlock { const char* name; uint8_t rgba[64]; };
+    TestBlock tests[3] = { { "solid", {} }, { "gradient", {} }, { "alpha_ramp", {} } };
+    for (int i = 0; i < 16; ++i) {
+        const int x = i % 4;
+        const uint8_t solid[4] = { 200, 100, 50, 255 };
+        const uint8_t gradient[4] = { (uint8_t)(48 + 48 * x), (uint8_t)(192 - 32 * x), (uint8_t)(100 + 16 * x), 255 };
+        const uint8_t ramp[4] = { (uint8_t)(60 + 8 * i), (uint8_t)(60 + 8 * i), (uint8_t)(60 + 8 * i), (uint8_t)(17 * i) };
+        memcpy(tests[0].rgba + i * 4, solid, 4);
+        memcpy(tests[1].rgba + i * 4, gradient, 4);
+        memcpy(tests[2].rgba + i * 4, ramp, 4);
+    }
+    // Допуски: сплошной цвет и 4 цвета на одной прямой (gradient) теряют только квантование конечных точек
+    // (BC1 - 5:6:5, BC7 - 7 бит + p-бит); плавная рампа из 16 значений ложится на 4 (BC1), 8 (альфа BC3)
+    // или 16 (BC7) уровней палитры - ошибка до половины шага
+    struct Limit { BlockFormat format; int maxError[3]; };
+    const Limit limits[] = { { BLOCK_BC1, { 4, 6, 20 } }, { BLOCK_BC3, { 4, 6, 20 } }, { BLOCK_BC7, { 1, 2, 4 } } };
+
+    bool ok = true;
+    cout << "{\n  \"selftest\": {\n";
+    for (size_t f = 0; f < 3; ++f) {
+        const BlockFormat format = limits[f].format;
+        cout << "    \"" << blockFormatName(format) << "\": {";
+        for (int t = 0; t < 3; ++t) {
+            blockCompressionSimd() = false;
+            vector<uint8_t> scalar = compressImage(format, tests[t].rgba, 4, 4, 4, 1);
+            blockCompressionSimd() = true;
+            vector<uint8_t> simd = compressImage(format, tests[t].rgba, 4, 4, 4, 1);
+            vector<uint8_t> decoded = decompressImage(format, simd.data(), 4, 4);
+            // BC1 альфу не хранит: для нее проверяются только цветовые каналы
+            const int channels = (format == BLOCK_BC1) ? 3 : 4;
+            int maxError = 0;
+            bool opaque = true, decodedOpaque = true;
+            for (int i = 0; i < 16; ++i) {
+                for (int c = 0; c < channels; ++c) maxError = std::max(maxError, std::abs((int)decoded[i * 4 + c] - (int)tests[t].rgba[i * 4 + c]));
+                opaque = opaque && tests[t].rgba[i * 4 + 3] == 255;
+                decodedOpaque = decodedOpaque && decoded[i * 4 + 3] == 255;
+            }
+            const bool passed = scalar == simd && maxError <= limits[f].maxError[t] && (!opaque || decodedOpaque);
+            ok = ok && passed;
+            cout << (t ? ", " : " ") << "\"" << tests[t].name << "\": { \"max_error\": " << maxError << ", \"limit\": " << limits[f].maxError[t]
+                << ", \"simd_matches_scalar\": " << (scalar == simd ? "true" : "false");
+            if (opaque) cout << ", \"alpha_255\": " << (decodedOpaque ? "true" : "false");
+            cout << ", \"passed\": " << (passed ? "true" : "false") << " }";
+        }
+        cout << " }" << (f + 1 < 3 ? "," : "") << "\n";
+    }
+    cout << "  },\n  \"passed\": " << (ok ? "true" : "false") << "\n}\n";
+    return ok;
+}
+
+// Замер сжатия уровня 0: скалярный код в 1 потоке, SSE2 в 1 потоке и SSE2 во всех потоках,
+// лучшее время из нескольких прогонов; качество - PSNR после распаковки
+static bool benchCompression(const string& inputPath) {
+    int width, height, channels;
+    unsigned char* data = stbi_load(inputPath.c_str(), &width, &height, &channels, 0);
+    if (!data) {
+        cerr << "Failed to load '" << inputPath << "': " << stbi_failure_reason() << endl;
+        return false;
+    }
+    vector<unsigned char> reference((size_t)width * height * 4);
+    for (size_t i = 0; i < (size_t)width * height; ++i) {
+        const unsigned char* p = data + i * channels;
+        reference[i * 4 + 0] = p[0];
+        reference[i * 4 + 1] = channels >= 3 ? p[1] : p[0];
+        reference[i * 4 + 2] = channels >= 3 ? p[2] : p[0];
+        reference[i * 4 + 3] = channels == 4 ? p[3] : (channels == 2 ? p[1] : 255);
+    }
+    const double megapixels = (double)width * height / 1e6;
+    const unsigned threads = compressionThreads();
+    const int RUNS = 3;
+
+    struct Variant { const char* name; bool simd; unsigned threads; };
+    const Variant variants[] = { { "scalar", false, 1 }, { "sse2", true, 1 }, { "sse2_parallel", true, threads } };
+
+    cout.precision(4);
+    cout << "{\n";
+    cout << "  \"image\": " << jsonString(inputPath) << ",\n";
+    cout << "  \"size\": [" << width << ", " << height << "], \"channels\": " << channels << ",\n";
+    cout << "  \"threads\": " << threads << ",\n";
+#if !defined(BC_SIMD_SSE2)
+    cout << "  \"note\": \"built without SSE2, simd variants run the scalar code\",\n";
+#endif
+    cout << "  \"formats\": {\n";
+    const BlockFormat formats[] = { BLOCK_BC1, BLOCK_BC3, BLOCK_BC7 };
+    for (size_t f = 0; f < 3; ++f) {
+        BlockFormat format = formats[f];
+        vector<uint8_t> blocks;
+        cout << "    \"" << blockFormatName(format) << "\": {";
+        for (const Variant& variant : variants) {
+            blockCompressionSimd() = variant.simd;
+            double best = 1e30;
+            for (int run = 0; run < RUNS; ++run) {
+                auto start = chrono::steady_clock::now();
+                blocks = compressImage(format, data, width, height, channels, (int)variant.threads);
+                best = std::min(best, chrono::duration<double, std::milli>(chrono::steady_clock::now() - start).count());
+            }
+            cout << " \"" << variant.name << "\": { \"ms\": " << best << ", \"mpix_per_s\": " << megapixels / (best / 1000.0) << " },";
+        }
+        blockCompressionSimd() = true;
+        vector<unsigned char> decoded = decompressImage(format, blocks.data(), width, height);
+        cout << " \"psnr_rgb\": " << psnr(reference, decoded, 0, 3);
+        if (format != BLOCK_BC1) cout << ", \"psnr_alpha\": " << psnr(reference, decoded, 3, 1);
+        cout << ", \"ratio_vs_source\": " << (double)width * height * channels / blocks.size() << " }" << (f + 1 < 3 ? "," : "") << "\n";
+    }
+    cout << "  }\n";
+    cout << "}\n";
+    stbi_image_free(data);
+    return true;
+}
+
+// Декодирование из памяти (без диска) по всем путям stb_image. JPEG: ограничения SIMD scalar, sse2, avx2
+// в один поток, затем лучший путь на всех ядрах. PNG: обычный inflate и широкий (STBI_FAST_INFLATE),
+// затем снятие фильтров строк scalar, sse2, avx2.
+// Пути, недоступные на этом CPU, пропускаются; результаты всех путей должны совпадать побайтно.
+static bool benchDecode(const string& inputPath) {
+    ifstream file(inputPath, ios::binary);
+    vector<unsigned char> encoded((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+    int width, height, channels;
+    if (encoded.empty() || !stbi_info_from_memory(encoded.data(), (int)encoded.size(), &width, &height, &channels)) {
+        cerr << "Failed to read '" << inputPath << "'" << endl;
+        return false;
+    }
+    stbi_set_flip_vertically_on_load(true); // Как при загрузке текстур
+    const double megapixels = (double)width * height / 1e6;
+    const double megabytes = megapixels * channels;
+    const double MIN_TOTAL_MS = 1000.0;
+    const int MIN_RUNS = 3;
+
+    cout.precision(4);
+    cout << "{\n";
+    cout << "  \"image\": " << jsonString(inputPath) << ",\n";
+    cout << "  \"size\": [" << width << ", " << height << "], \"channels\": " << channels << ", \"file_bytes\": " << encoded.size() << ",\n";
+    cout << "  \"paths\": {";
+
+    struct DecodeVariant { int simdLimit; int threads; int fastInflate; };
+    const int threads = (int)compressionThreads();
+    const DecodeVariant jpegVariants[] = {
+        { STBI_SIMD_NONE, 1, 1 }, { STBI_SIMD_SSE2, 1, 1 }, { STBI_SIMD_AVX2, 1, 1 }, { STBI_SIMD_BEST, threads, 1 }
+    };
+    const DecodeVariant pngVariants[] = {
+        { STBI_SIMD_NONE, 1, 0 }, { STBI_SIMD_NONE, 1, 1 }, { STBI_SIMD_SSE2, 1, 1 }, { STBI_SIMD_AVX2, 1, 1 }
+    };
+    const bool png = encoded.size() >= 8 && memcmp(encoded.data(), "\x89PNG", 4) == 0;
+    vector<DecodeVariant> variants = png
+        ? vector<DecodeVariant>(begin(pngVariants), end(pngVariants))
+        : vector<DecodeVariant>(begin(jpegVariants), end(jpegVariants));
+    vector<unsigned char> reference;
+    string previousPath;
+    double scalarMs = 0.0, bestMs = 0.0;
+    bool identical = true, first = true;
+    for (const DecodeVariant& variant : variants) {
+        stbi_set_simd_limit(variant.simdLimit);
+        stbi_set_jpeg_thread_count(variant.threads);
+        stbi_set_fast_inflate(variant.fastInflate);
+        string path = png ? string(variant.fastInflate ? "fast_inflate_" : "inflate_") + stbi_png_simd_path() : stbi_jpeg_simd_path();
+        if (variant.threads > 1) path += "_threads_" + to_string(variant.threads);
+        if (path == previousPath) continue; // Ограничение выше возможностей CPU (или одно ядро) - тот же путь
+        previousPath = path;
+
+        double best = 1e30, total = 0.0;
+        int runs = 0;
+        while (runs < MIN_RUNS || total < MIN_TOTAL_MS) {
+            int w, h, c;
+            auto start = chrono::steady_clock::now();
+            unsigned char* data = stbi_load_from_memory(encoded.data(), (int)encoded.size(), &w, &h, &c, 0);
+            double ms = chrono::duration<double, std::milli>(chrono::steady_clock::now() - start).count();
+            if (!data) {
+                cerr << "Failed to decode '" << inputPath << "': " << stbi_failure_reason() << endl;
+                stbi_set_simd_limit(STBI_SIMD_BEST);
+                stbi_set_jpeg_thread_count(1);
+                stbi_set_fast_inflate(1);
+                return false;
+            }
+            if (runs == 0) {
+                if (reference.empty()) reference.assign(data, data + (size_t)w * h * c);
+                else identical = identical && memcmp(reference.data(), data, reference.size()) == 0;
+            }
+            stbi_image_free(data);
+            best = std::min(best, ms);
+            total += ms;
+            ++runs;
+        }
+        if (scalarMs == 0.0) scalarMs = best;
+        bestMs = best;
+        cout << (first ? "" : ",") << "\n    \"" << path << "\": { \"ms\": " << best << ", \"mpix_per_s\": " << megapixels / (best / 1000.0)
+            << ", \"mb_per_s\": " << megabytes / (best / 1000.0) << ", \"runs\": " << runs << " }";
+        first = false;
+    }
+    stbi_set_simd_limit(STBI_SIMD_BEST);
+    stbi_set_jpeg_thread_count(1);
+    stbi_set_fast_inflate(1);
+    cout << "\n  },\n";
+    cout << "  \"speedup\": " << scalarMs / bestMs << ",\n";
+    cout << "  \"identical\": " << (identical ? "true" : "false") << "\n";
+    cout << "}\n";
+    return identical;
+}
+
+// Обратные вызовы как у stbi_load (stbi__stdio_callbacks), но со счетчиком обращений к fread
+struct CountingFile {
+    FILE* file;
+    size_t reads = 0, bytes = 0, skips = 0;
+};
+
+static int countingRead(void* user, char* data, int size) {
+    CountingFile* counting = (CountingFile*)user;
+    size_t got = fread(data, 1, (size_t)size, counting->file);
+    ++counting->reads;
+    counting->bytes += got;
+    return (int)got;
+}
+
+static void countingSkip(void* user, int n) {
+    CountingFile* counting = (CountingFile*)user;
+    ++counting->skips;
+    fseek(counting->file, n, SEEK_CUR);
+    int ch = fgetc(counting->file);
+    if (ch != EOF) ungetc(ch, counting->file);
+}
+
+static int countingEof(void* user) {
+    CountingFile* counting = (CountingFile*)user;
+    return feof(counting->file) || ferror(counting->file);
+}
+
+// Только доступ к байтам файла так, как это делает каждый способ загрузки: stdio - fread по 128 байт
+// (размер буфера stb_image), mmap - отображение и касание каждой страницы
+static double fileAccessMs(const string& inputPath, bool mapped) {
+    static volatile unsigned checksum; // Чтобы чтение не выбросил оптимизатор
+    auto start = chrono::steady_clock::now();
+    if (mapped) {
+        MappedFile file;
+        if (file.open(inputPath.c_str())) {
+            for (size_t i = 0; i < file.size; i += 4096) checksum += file.data[i];
+        }
+    }
+    else if (FILE* file = fopen(inputPath.c_str(), "rb")) {
+        unsigned char buffer[128];
+        size_t got;
+        while ((got = fread(buffer, 1, sizeof(buffer), file)) > 0) checksum += buffer[0];
+        fclose(file);
+    }
+    return chrono::duration<double, std::milli>(chrono::steady_clock::now() - start).count();
+}
+
+// Загрузка с диска (файл в кэше ОС) тремя способами: stbi_load через FILE* (буфер stb_image - 128 байт,
+// на каждое его опустошение - fread), отображение файла + stbi_load_from_memory (декодер читает прямо из
+// отображения) и декодирование из уже прочитанного буфера - оценка чистого декодирования. Способы
+// чередуются по кругу, чтобы дрейф частоты CPU не попадал в разницу между ними. Отдельно замеряется
+// только доступ к файлу (file_ms). Результаты всех способов должны совпадать побайтно.
+static bool benchFileIO(const string& inputPath) {
+    ifstream file(inputPath, ios::binary);
+    vector<unsigned char> encoded((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+    int width, height, channels;
+    if (encoded.empty() || !stbi_info_from_memory(encoded.data(), (int)encoded.size(), &width, &height, &channels)) {
+        cerr << "Failed to read '" << inputPath << "'" << endl;
+        return false;
+    }
+    stbi_set_flip_vertically_on_load(true); // Как при загрузке текстур
+
+    // Сколько раз stbi_load обращается к fread (отдельный проход, в замер не входит)
+    CountingFile counting;
+    counting.file = fopen(inputPath.c_str(), "rb");
+    if (!counting.file) {
+        cerr << "Failed to open '" << inputPath << "'" << endl;
+        return false;
+    }
+    const stbi_io_callbacks callbacks = { countingRead, countingSkip, countingEof };
+    int w, h, c;
+    unsigned char* reference = stbi_load_from_callbacks(&callbacks, &counting, &w, &h, &c, 0);
+    fclose(counting.file);
+    if (!reference) {
+        cerr << "Failed to decode '" << inputPath << "': " << stbi_failure_reason() << endl;
+        return false;
+    }
+    const size_t referenceSize = (size_t)w * h * c;
+
+    enum Method { METHOD_MEMORY, METHOD_STDIO, METHOD_MMAP };
+    const char* const methodNames[] = { "memory", "stdio", "mmap" };
+    const double MIN_TOTAL_MS = 3000.0;
+    const int MIN_RUNS = 5;
+    double bestMs[3] = { 1e30, 1e30, 1e30 }, fileMs[3] = { 0.0, 1e30, 1e30 };
+    double total = 0.0;
+    bool identical = true;
+    for (int runs = 0; runs < MIN_RUNS || total < MIN_TOTAL_MS; ++runs) {
+        for (int method = METHOD_MEMORY; method <= METHOD_MMAP; ++method) {
+            if (method != METHOD_MEMORY) {
+                fileMs[method] = std::min(fileMs[method], fileAccessMs(inputPath, method == METHOD_MMAP));
+            }
+            auto start = chrono::steady_clock::now();
+            unsigned char* data = nullptr;
+            if (method == METHOD_MEMORY) {
+                data = stbi_load_from_memory(encoded.data(), (int)encoded.size(), &w, &h, &c, 0);
+            }
+            else if (method == METHOD_STDIO) {
+                data = stbi_load(inputPath.c_str(), &w, &h, &c, 0);
+            }
+            else {
+                MappedFile mapped;
+                if (mapped.open(inputPath.c_str())) {
+                    data = stbi_load_from_memory(mapped.data, (int)mapped.size, &w, &h, &c, 0);
+                }
+            }
+            double ms = chrono::duration<double, std::milli>(chrono::steady_clock::now() - start).count();
+            if (!data) {
+                cerr << "Failed to load '" << inputPath << "' (" << methodNames[method] << "): " << stbi_failure_reason() << endl;
+                stbi_image_free(reference);
+                return false;
+            }
+            if (runs == 0) identical = identical && memcmp(reference, data, referenceSize) == 0;
+            stbi_image_free(data);
+            bestMs[method] = std::min(bestMs[method], ms);
+            total += ms;
+        }
+    }
+    stbi_image_free(reference);
+
+    cout.precision(4);
+    cout << "{\n";
+    cout << "  \"image\": " << jsonString(inputPath) << ",\n";
+    cout << "  \"size\": [" << width << ", " << height << "], \"channels\": " << channels << ", \"file_bytes\": " << encoded.size() << ",\n";
+    cout << "  \"stdio_freads\": " << counting.reads << ", \"stdio_bytes_per_fread\": " << (counting.reads ? counting.bytes / counting.reads : 0)
+        << ", \"stdio_skips\": " << counting.skips << ",\n";
+    cout << "  \"paths\": {";
+    for (int method = METHOD_MEMORY; method <= METHOD_MMAP; ++method) {
+        cout << (method == METHOD_MEMORY ? "" : ",") << "\n    \"" << methodNames[method] << "\": { \"ms\": " << bestMs[method]
+            << ", \"file_ms\": " << fileMs[method] << " }";
+    }
+    cout << "\n  },\n";
+    cout << "  \"speedup\": " << bestMs[METHOD_STDIO] / bestMs[METHOD_MMAP] << ", \"file_speedup\": " << fileMs[METHOD_STDIO] / fileMs[METHOD_MMAP] << ",\n";
+    cout << "  \"identical\": " << (identical ? "true" : "false") << "\n";
+    cout << "}\n";
+    return identical;
+}
+
+// Обращения декодера к куче на одно изображение после прогрева: stbi_load_from_memory с выключенным
+// пулом (каждый запрос доходит до malloc), то же с ImagePool и stbi_load_from_memory_into в один и тот же
+// буфер с ImagePool. Изображение переворачивается, как при загрузке текстур. Результаты должны совпадать.
+static bool benchAllocations(const string& inputPath) {
+    ifstream file(inputPath, ios::binary);
+    vector<unsigned char> encoded((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+    int width, height, channels;
+    if (encoded.empty() || !stbi_info_from_memory(encoded.data(), (int)encoded.size(), &width, &height, &channels)) {
+        cerr << "Failed to read '" << inputPath << "'" << endl;
+        return false;
+    }
+    stbi_set_flip_vertically_on_load(true);
+    const size_t imageSize = (size_t)width * height * channels;
+    vector<unsigned char> reference, target(imageSize);
+
+    enum Method { METHOD_HEAP, METHOD_POOL, METHOD_POOL_INTO };
+    const char* const methodNames[] = { "heap", "pool", "pool_into" };
+    const int WARMUP_RUNS = 2;
+    const int MIN_RUNS = 5;
+    const double MIN_TOTAL_MS = 1000.0;
+
+    cout.precision(4);
+    cout << "{\n";
+    cout << "  \"image\": " << jsonString(inputPath) << ",\n";
+    cout << "  \"size\": [" << width << ", " << height << "], \"channels\": " << channels << ",\n";
+    cout << "  \"paths\": {";
+    bool identical = true;
+    for (int method = METHOD_HEAP; method <= METHOD_POOL_INTO; ++method) {
+        imagePoolSetEnabled(method != METHOD_HEAP);
+        ImagePoolStats before{};
+        double best = 1e30, total = 0.0;
+        int runs = 0;
+        for (int run = 0; run < WARMUP_RUNS + MIN_RUNS || total < MIN_TOTAL_MS; ++run) {
+            if (run == WARMUP_RUNS) before = imagePoolStats();
+            int w, h, c;
+            auto start = chrono::steady_clock::now();
+            const unsigned char* pixels = nullptr;
+            unsigned char* data = nullptr;
+            if (method == METHOD_POOL_INTO) {
+                if (stbi_load_from_memory_into(encoded.data(), (int)encoded.size(), target.data(), target.size(), &w, &h, &c, 0)) pixels = target.data();
+            }
+            else {
+                pixels = data = stbi_load_from_memory(encoded.data(), (int)encoded.size(), &w, &h, &c, 0);
+            }
+            double ms = chrono::duration<double, std::milli>(chrono::steady_clock::now() - start).count();
+            if (!pixels) {
+                cerr << "Failed to decode '" << inputPath << "': " << stbi_failure_reason() << endl;
+                imagePoolSetEnabled(true);
+                return false;
+            }
+            if (run == 0) {
+                if (reference.empty()) reference.assign(pixels, pixels + imageSize);
+                else identical = identical && memcmp(reference.data(), pixels, imageSize) == 0;
+            }
+            stbi_image_free(data);
+            if (run >= WARMUP_RUNS) {
+                best = std::min(best, ms);
+                total += ms;
+                ++runs;
+            }
+        }
+        ImagePoolStats after = imagePoolStats();
+        cout << (method == METHOD_HEAP ? "" : ",") << "\n    \"" << methodNames[method] << "\": { \"ms\": " << best
+            << ", \"heap_allocations_per_image\": " << (double)(after.heapAllocations - before.heapAllocations) / runs
+            << ", \"allocation_requests_per_image\": " << (double)(after.requests - before.requests) / runs << ", \"runs\": " << runs << " }";
+    }
+    imagePoolSetEnabled(true);
+    cout << "\n  },\n";
+    cout << "  \"identical\": " << (identical ? "true" : "false") << "\n";
+    cout << "}\n";
+    return identical;
+}
+
+static void printUsage(const char* program) {
+    cerr << "Usage: " << program << " [--format rgba8|bc1|bc3|bc7] [--size WxH] <input> <output" << COOKED_TEXTURE_EXTENSION << "> [[--format ...] <input> <output" << COOKED_TEXTURE_EXTENSION << "> ...]\n"
+        << "       " << program << " --selftest\n"
+        << "       " << program << " --bench <image> [<image> ...]\n"
+        << "       " << program << " --bench-decode <image> [<image> ...]\n"
+        << "       " << program << " --bench-io <image> [<image> ...]\n"
+        << "       " << program << " --bench-alloc <image> [<image> ...]" << endl;
+}
+
+int main(int argc, char** argv) {
+    if (argc == 2 && string(argv[1]) == "--selftest") {
+        return selfTestCompression() ? 0 : 1;
+    }
+    if (argc >= 3 && string(argv[1]) == "--bench") {
+        bool ok = true;
+        for (int i = 2; i < argc; ++i) ok = benchCompression(argv[i]) && ok;
+        return ok ? 0 : 1;
+    }
+    if (argc >= 3 && string(argv[1]) == "--bench-decode") {
+        bool ok = true;
+        for (int i = 2; i < argc; ++i) ok = benchDecode(argv[i]) && ok;
+        return ok ? 0 : 1;
+    }
+    if (argc >= 3 && string(argv[1]) == "--bench-io") {
+        bool ok = true;
+        for (int i = 2; i < argc; ++i) ok = benchFileIO(argv[i]) && ok;
+        return ok ? 0 : 1;
+    }
+    if (argc >= 3 && string(argv[1]) == "--bench-alloc") {
+        bool ok = true;
+        for (int i = 2; i < argc; ++i) ok = benchAllocations(argv[i]) && ok;
+        return ok ? 0 : 1;
+    }
+
+    CookFormat format;
+    vector<pair<string, CookFormat>> jobs;
+    vector<string> outputs;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--format" && i + 1 < argc) {
+            string name = argv[++i];
+            if (name == "rgba8") format.compressed = false;
+            else if (name == "bc1") { format.compressed = true; format.block = BLOCK_BC1; }
+            else if (name == "bc3") { format.compressed = true; format.block = BLOCK_BC3; }
+            else if (name == "bc7") { format.compressed = true; format.block = BLOCK_BC7; }
+            else {
+                cerr << "Unknown format '" << name << "'" << endl;
+                printUsage(argv[0]);
+                return 1;
+            }
+        }
+        else if (arg == "--size" && i + 1 < argc) {
+            const char* size = argv[++i];
+            unsigned w = 0, h = 0;
+            char tail = 0;
+            if (sscanf(size, "%ux%u%c", &w, &h, &tail) != 2 || w == 0 || h == 0 || w > COOKED_TEXTURE_MAX_SIZE || h > COOKED_TEXTURE_MAX_SIZE) {
+                cerr << "Invalid size '" << size << "', expected WxH" << endl;
+                printUsage(argv[0]);
+                return 1;
+            }
+            format.width = w;
+            format.height = h;
+        }
+        else if (i + 1 < argc) {
+            jobs.push_back({ arg, format });
+            outputs.push_back(argv[++i]);
+        }
+        else {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+    if (jobs.empty()) {
+        printUsage(argv[0]);
+        return 1;
+    }
+    stbi_set_jpeg_thread_count((int)compressionThreads());
+    bool ok = true;
+    for (size_t i = 0; i < jobs.size(); ++i) {
+        ok = cookTexture(jobs[i].first, outputs[i], jobs[i].second) && ok;
+    }
+    return ok ? 0 : 1;
+}
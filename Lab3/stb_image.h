@@ -265,7 +265,14 @@ RECENT REVISION HISTORY:
 // code.)
 //
 // On x86, SSE2 will automatically be used when available based on a run-time
-// test; if not, the generic C versions are used as a fall-back. On ARM targets,
+// test; if not, the generic C versions are used as a fall-back. On x64 with
+// GCC 5+/Clang/MSVC 2015+, AVX2 versions of the JPEG kernels (IDCT, YCbCr->RGB
+// including the 3-component case, 2x2 upsampling) are compiled in as well and
+// picked at run-time via CPUID; define STBI_NO_AVX2 to leave them out. PNG
+// row unfiltering of 8-bit RGB/RGBA images has SSE2 loops for all filter types
+// and AVX2 ones for Up and 4-channel Sub (the other filters depend on the pixel
+// to the left, so wider registers don't help them). The
+// choice can be capped with stbi_set_simd_limit(), e.g. to compare paths. On ARM targets,
 // the typical path is to have separate builds for NEON and non-NEON devices
 // (at least this is true for iOS and Android). Therefore, the NEON support is
 // toggled by a build flag: define STBI_NEON to get NEON loops.
@@ -276,6 +283,55 @@ RECENT REVISION HISTORY:
 //
 // ===========================================================================
 //
+// Multithreaded JPEG decoding (enable by defining STBI_JPEG_THREADS)
+//
+// With STBI_JPEG_THREADS defined before the implementation (links against
+// pthreads, or the Win32 thread API on Windows) and stbi_set_jpeg_thread_count(n)
+// with n > 1, baseline JPEGs are decoded on up to n threads:
+//   - if the file has restart markers (DRI), the entropy-coded segments
+//     between them are independent, so they are indexed and decoded
+//     (Huffman + IDCT) concurrently;
+//   - upsampling and color conversion run on bands of output rows.
+// Progressive JPEGs only get the second part. Output of valid files is
+// identical to the single-threaded decoder. Threads are started per image,
+// so this pays off for multi-megapixel images rather than thumbnails.
+//
+// ===========================================================================
+//
+// Faster inflate for PNG (enable by defining STBI_FAST_INFLATE)
+//
+// With STBI_FAST_INFLATE defined before the implementation, the zlib decoder
+// uses a 64-bit bit buffer refilled up to 7 bytes at a time, 11-bit Huffman
+// lookup tables plus a table that decodes two literals with one lookup, and
+// 8-byte match copies. That loop runs while enough input and output remain
+// to skip bounds checks; the ends of the buffers go through the regular
+// checked loop with the same validation. stbi_set_fast_inflate(0) selects the
+// regular loop at run time, e.g. to compare speed.
+//
+// ===========================================================================
+//
+// Decoding into a caller-provided buffer
+//
+// stbi_load_from_memory_into() writes the image into memory owned by the
+// caller (a mapped pixel buffer, a buffer reused across images) instead of
+// returning a new allocation. Get the size from stbi_info_from_memory() first:
+// the buffer must hold x * y * n bytes, where n is desired_channels, or
+// channels_in_file if desired_channels is 0. 'out' must not be NULL (the call
+// fails with "bad buffer"); use stbi_load_from_memory() to get a new allocation. JPEGs and 8-bit PNGs that need no
+// channel conversion afterwards are decoded straight into it; other images are
+// decoded as usual and copied in once.
+//
+// With stbi_set_flip_vertically_on_load, the JPEG, PNG, BMP and TGA decoders
+// place each row bottom-up as they produce it (for every load function), so
+// there is no separate flip pass over the finished image. Likewise JPEGs and
+// 8-bit PNGs without palette or tRNS produce desired_channels in the same pass
+// (e.g. RGB -> RGBA for GL uploads) instead of converting the image afterwards.
+//
+// The decoders' working memory still comes from STBI_MALLOC; defining it to an
+// allocator that keeps freed blocks makes repeated loads allocation-free.
+//
+// ===========================================================================
+//
 // HDR image support   (disable by defining STBI_NO_HDR)
 //
 // stb_image supports loading HDR images in general, and currently the Radiance
@@ -423,6 +479,9 @@ typedef struct
 STBIDEF stbi_uc *stbi_load_from_memory   (stbi_uc           const *buffer, int len   , int *x, int *y, int *channels_in_file, int desired_channels);
 STBIDEF stbi_uc *stbi_load_from_callbacks(stbi_io_callbacks const *clbk  , void *user, int *x, int *y, int *channels_in_file, int desired_channels);
 
+// decodes into 'out' (out_size bytes, not NULL) instead of a new allocation; returns 1 on success
+STBIDEF int      stbi_load_from_memory_into(stbi_uc const *buffer, int len, stbi_uc *out, size_t out_size, int *x, int *y, int *channels_in_file, int desired_channels);
+
 #ifndef STBI_NO_STDIO
 STBIDEF stbi_uc *stbi_load            (char const *filename, int *x, int *y, int *channels_in_file, int desired_channels);
 STBIDEF stbi_uc *stbi_load_from_file  (FILE *f, int *x, int *y, int *channels_in_file, int desired_channels);
@@ -517,6 +576,37 @@ STBIDEF void stbi_convert_iphone_png_to_rgb(int flag_true_if_should_convert);
 // flip the image vertically, so the first pixel in the output array is the bottom left
 STBIDEF void stbi_set_flip_vertically_on_load(int flag_true_if_should_flip);
 
+// cap the SIMD kernels used by the JPEG decoder (default STBI_SIMD_BEST: the best
+// one the CPU supports). STBI_SIMD_SSE2 also covers NEON. results are bit-identical
+// across paths, so this is only useful for benchmarking and debugging. not thread-safe
+// with respect to decodes running at the same time.
+enum
+{
+   STBI_SIMD_NONE = 0,
+   STBI_SIMD_SSE2 = 1,
+   STBI_SIMD_AVX2 = 2,
+   STBI_SIMD_BEST = STBI_SIMD_AVX2
+};
+STBIDEF void stbi_set_simd_limit(int max_level);
+
+// name of the kernels the JPEG decoder picks with the current limit:
+// "avx2", "sse2", "neon" or "scalar"
+STBIDEF const char *stbi_jpeg_simd_path(void);
+
+// same for PNG unfiltering: "avx2", "sse2" or "scalar"
+STBIDEF const char *stbi_png_simd_path(void);
+
+// number of threads a JPEG decode may use (default 1). only has an effect
+// when the implementation is compiled with STBI_JPEG_THREADS; not thread-safe
+// with respect to decodes running at the same time.
+STBIDEF void stbi_set_jpeg_thread_count(int count);
+
+// with STBI_FAST_INFLATE compiled in, 0 decodes zlib streams (PNG) with the
+// regular one-symbol-at-a-time loop instead of the wide one (default 1).
+// output is the same either way; not thread-safe with respect to decodes
+// running at the same time.
+STBIDEF void stbi_set_fast_inflate(int flag_true_if_should_use);
+
 // as above, but only applies to images loaded on the thread that calls the function
 // this function is only available if your compiler supports thread-local variables;
 // calling it will fail to link if your compiler doesn't
@@ -603,6 +693,22 @@ STBIDEF int   stbi_zlib_decode_noheader_buffer(char *obuffer, int olen, const ch
 #define STBI_ASSERT(x) assert(x)
 #endif
 
+#if defined(STBI_JPEG_THREADS) && !defined(STBI_NO_JPEG)
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+#else
+#undef STBI_JPEG_THREADS
+#endif
+
 #ifdef __cplusplus
 #define STBI_EXTERN extern "C"
 #else
@@ -750,7 +856,7 @@ static int stbi__cpuid3(void)
 
 #define STBI_SIMD_ALIGN(type, name) __declspec(align(16)) type name
 
-#if !defined(STBI_NO_JPEG) && defined(STBI_SSE2)
+#if !(defined(STBI_NO_JPEG) && defined(STBI_NO_PNG)) && defined(STBI_SSE2)
 static int stbi__sse2_available(void)
 {
    int info3 = stbi__cpuid3();
@@ -761,7 +867,7 @@ static int stbi__sse2_available(void)
 #else // assume GCC-style if not VC++
 #define STBI_SIMD_ALIGN(type, name) type name __attribute__((aligned(16)))
 
-#if !defined(STBI_NO_JPEG) && defined(STBI_SSE2)
+#if !(defined(STBI_NO_JPEG) && defined(STBI_NO_PNG)) && defined(STBI_SSE2)
 static int stbi__sse2_available(void)
 {
    // If we're even attempting to compile this on GCC/Clang, that means
@@ -774,6 +880,61 @@ static int stbi__sse2_available(void)
 #endif
 #endif
 
+// AVX2 kernels are compiled per function (no -mavx2 needed) and selected at run-time
+#if defined(STBI_SSE2) && defined(STBI__X64_TARGET) && !defined(STBI_NO_AVX2) && !(defined(STBI_NO_JPEG) && defined(STBI_NO_PNG))
+#if defined(_MSC_VER) && _MSC_VER >= 1900
+#define STBI_AVX2
+#define STBI__AVX2_TARGET
+#elif defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5)
+#define STBI_AVX2
+#define STBI__AVX2_TARGET __attribute__((target("avx2")))
+#endif
+#endif
+
+#ifdef STBI_AVX2
+#include <immintrin.h>
+
+static int stbi__avx2_available(void)
+{
+   // AVX2 needs the CPU feature bit and the OS saving YMM state (XCR0 bits 1-2)
+   static int cached = -1;
+   int result;
+   if (cached >= 0) return cached;
+#ifdef _MSC_VER
+   {
+      int info[4];
+      __cpuid(info, 0);
+      result = 0;
+      if (info[0] >= 7) {
+         __cpuid(info, 1);
+         if (((info[2] >> 27) & 1) && ((info[2] >> 28) & 1) && (_xgetbv(0) & 6) == 6) {
+            __cpuidex(info, 7, 0);
+            result = (info[1] >> 5) & 1;
+         }
+      }
+   }
+#else
+   {
+      unsigned int a, b, c, d;
+      __asm__ __volatile__("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "a"(0), "c"(0));
+      result = 0;
+      if (a >= 7) {
+         __asm__ __volatile__("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "a"(1), "c"(0));
+         if (((c >> 27) & 1) && ((c >> 28) & 1)) {
+            __asm__ __volatile__("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
+            if ((a & 6) == 6) {
+               __asm__ __volatile__("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "a"(7), "c"(0));
+               result = (b >> 5) & 1;
+            }
+         }
+      }
+   }
+#endif
+   cached = result;
+   return result;
+}
+#endif
+
 // ARM NEON
 #if defined(STBI_NO_SIMD) && defined(STBI_NEON)
 #undef STBI_NEON
@@ -817,6 +978,10 @@ typedef struct
 
    stbi_uc *img_buffer, *img_buffer_end;
    stbi_uc *img_buffer_original, *img_buffer_original_end;
+
+   stbi_uc *out_buffer; // caller's buffer for the result (stbi_load_from_memory_into), or NULL
+   size_t out_buffer_size;
+   int flip_rows;       // decoders that can should write rows bottom-up
 } stbi__context;
 
 
@@ -830,6 +995,9 @@ static void stbi__start_mem(stbi__context *s, stbi_uc const *buffer, int len)
    s->callback_already_read = 0;
    s->img_buffer = s->img_buffer_original = (stbi_uc *) buffer;
    s->img_buffer_end = s->img_buffer_original_end = (stbi_uc *) buffer+len;
+   s->out_buffer = NULL;
+   s->out_buffer_size = 0;
+   s->flip_rows = 0;
 }
 
 // initialize a callback-based context
@@ -843,6 +1011,9 @@ static void stbi__start_callbacks(stbi__context *s, stbi_io_callbacks *c, void *
    s->img_buffer = s->img_buffer_original = s->buffer_start;
    stbi__refill_buffer(s);
    s->img_buffer_original_end = s->img_buffer_end;
+   s->out_buffer = NULL;
+   s->out_buffer_size = 0;
+   s->flip_rows = 0;
 }
 
 #ifndef STBI_NO_STDIO
@@ -903,6 +1074,7 @@ typedef struct
    int bits_per_channel;
    int num_channels;
    int channel_order;
+   int flipped; // the decoder already honored flip_rows
 } stbi__result_info;
 
 #ifndef STBI_NO_JPEG
@@ -1103,6 +1275,33 @@ STBIDEF void stbi_image_free(void *retval_from_stbi_load)
    STBI_FREE(retval_from_stbi_load);
 }
 
+// row j of an image with h rows; flipped, the first row goes to the bottom
+static stbi_uc *stbi__output_row(stbi_uc *image, size_t row_bytes, stbi__uint32 h, stbi__uint32 j, int flip)
+{
+   return image + row_bytes * (flip ? h - 1 - j : j);
+}
+
+#if !defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG)
+// frees an image unless it is the caller's output buffer
+static void stbi__free_output(stbi__context *s, void *p)
+{
+   if (p != s->out_buffer) STBI_FREE(p);
+}
+
+// the final image for a decoder that writes it directly: the caller's buffer
+// when there is one, otherwise a new allocation with 'add' spare bytes
+static stbi_uc *stbi__output_image(stbi__context *s, int a, int b, int c, int add)
+{
+   if (!s->out_buffer) {
+      stbi_uc *image = (stbi_uc *) stbi__malloc_mad3(a, b, c, add);
+      return image ? image : stbi__errpuc("outofmem", "Out of memory");
+   }
+   if (!stbi__mad3sizes_valid(a, b, c, 0) || (size_t) a*b*c > s->out_buffer_size)
+      return stbi__errpuc("buffer too small", "Output buffer too small for the image");
+   return s->out_buffer;
+}
+#endif
+
 #ifndef STBI_NO_LINEAR
 static float   *stbi__ldr_to_hdr(stbi_uc *data, int x, int y, int comp);
 #endif
@@ -1111,6 +1310,43 @@ static float   *stbi__ldr_to_hdr(stbi_uc *data, int x, int y, int comp);
 static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp);
 #endif
 
+static int stbi__simd_limit = STBI_SIMD_BEST;
+
+STBIDEF void stbi_set_simd_limit(int max_level)
+{
+   stbi__simd_limit = max_level;
+}
+
+#ifdef STBI_NO_JPEG
+STBIDEF const char *stbi_jpeg_simd_path(void)
+{
+   return "scalar";
+}
+#endif
+
+#ifdef STBI_NO_PNG
+STBIDEF const char *stbi_png_simd_path(void)
+{
+   return "scalar";
+}
+#endif
+
+#define STBI__MAX_THREADS 64
+
+static int stbi__jpeg_thread_count = 1;
+
+STBIDEF void stbi_set_jpeg_thread_count(int count)
+{
+   stbi__jpeg_thread_count = count < 1 ? 1 : count > STBI__MAX_THREADS ? STBI__MAX_THREADS : count;
+}
+
+static int stbi__fast_inflate = 1;
+
+STBIDEF void stbi_set_fast_inflate(int flag_true_if_should_use)
+{
+   stbi__fast_inflate = flag_true_if_should_use;
+}
+
 static int stbi__vertically_flip_on_load_global = 0;
 
 STBIDEF void stbi_set_flip_vertically_on_load(int flag_true_if_should_flip)
@@ -1257,11 +1493,28 @@ static void stbi__vertical_flip_slices(void *image, int w, int h, int z, int byt
 }
 #endif
 
+// copies an image the decoder allocated itself into the caller's buffer, flipping on the way
+static stbi_uc *stbi__copy_to_output(stbi__context *s, stbi_uc *image, int w, int h, int channels, int flip)
+{
+   size_t row_bytes = (size_t) w * channels;
+   int j;
+   if (row_bytes * h > s->out_buffer_size) {
+      STBI_FREE(image);
+      return stbi__errpuc("buffer too small", "Output buffer too small for the image");
+   }
+   for (j=0; j < h; ++j)
+      memcpy(stbi__output_row(s->out_buffer, row_bytes, h, j, flip), image + row_bytes * j, row_bytes);
+   STBI_FREE(image);
+   return s->out_buffer;
+}
+
 static unsigned char *stbi__load_and_postprocess_8bit(stbi__context *s, int *x, int *y, int *comp, int req_comp)
 {
    stbi__result_info ri;
-   void *result = stbi__load_main(s, x, y, comp, req_comp, &ri, 8);
+   void *result;
 
+   s->flip_rows = stbi__vertically_flip_on_load != 0;
+   result = stbi__load_main(s, x, y, comp, req_comp, &ri, 8);
    if (result == NULL)
       return NULL;
 
@@ -1275,7 +1528,10 @@ static unsigned char *stbi__load_and_postprocess_8bit(stbi__context *s, int *x,
 
    // @TODO: move stbi__convert_format to here
 
-   if (stbi__vertically_flip_on_load) {
+   if (s->out_buffer && result != s->out_buffer) {
+      int channels = req_comp ? req_comp : *comp;
+      result = stbi__copy_to_output(s, (stbi_uc *) result, *x, *y, channels, s->flip_rows && !ri.flipped);
+   } else if (s->flip_rows && !ri.flipped) {
       int channels = req_comp ? req_comp : *comp;
       stbi__vertical_flip(result, *x, *y, channels * sizeof(stbi_uc));
    }
@@ -1286,8 +1542,10 @@ static unsigned char *stbi__load_and_postprocess_8bit(stbi__context *s, int *x,
 static stbi__uint16 *stbi__load_and_postprocess_16bit(stbi__context *s, int *x, int *y, int *comp, int req_comp)
 {
    stbi__result_info ri;
-   void *result = stbi__load_main(s, x, y, comp, req_comp, &ri, 16);
+   void *result;
 
+   s->flip_rows = stbi__vertically_flip_on_load != 0;
+   result = stbi__load_main(s, x, y, comp, req_comp, &ri, 16);
    if (result == NULL)
       return NULL;
 
@@ -1302,7 +1560,7 @@ static stbi__uint16 *stbi__load_and_postprocess_16bit(stbi__context *s, int *x,
    // @TODO: move stbi__convert_format16 to here
    // @TODO: special case RGB-to-Y (and RGBA-to-YA) for 8-bit-to-16-bit case to keep more precision
 
-   if (stbi__vertically_flip_on_load) {
+   if (s->flip_rows && !ri.flipped) {
       int channels = req_comp ? req_comp : *comp;
       stbi__vertical_flip(result, *x, *y, channels * sizeof(stbi__uint16));
    }
@@ -1440,6 +1698,19 @@ STBIDEF stbi_uc *stbi_load_from_callbacks(stbi_io_callbacks const *clbk, void *u
    return stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
 }
 
+STBIDEF int stbi_load_from_memory_into(stbi_uc const *buffer, int len, stbi_uc *out, size_t out_size, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__context s;
+   int file_comp;
+   if (!comp) comp = &file_comp; // needed to size the copy of images decoded elsewhere
+   // a NULL out_buffer means "allocate the result" to the decoders: the image would leak
+   if (!out) return stbi__err("bad buffer", "Output buffer is NULL");
+   stbi__start_mem(&s,buffer,len);
+   s.out_buffer = out;
+   s.out_buffer_size = out_size;
+   return stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp) != NULL;
+}
+
 #ifndef STBI_NO_GIF
 STBIDEF stbi_uc *stbi_load_gif_from_memory(stbi_uc const *buffer, int len, int **delays, int *x, int *y, int *z, int *comp, int req_comp)
 {
@@ -1752,9 +2023,37 @@ static stbi_uc stbi__compute_y(int r, int g, int b)
 #if defined(STBI_NO_PNG) && defined(STBI_NO_BMP) && defined(STBI_NO_PSD) && defined(STBI_NO_TGA) && defined(STBI_NO_GIF) && defined(STBI_NO_PIC) && defined(STBI_NO_PNM)
 // nothing
 #else
+// converts one row of x pixels; dest != src. Returns 0 for unsupported combos
+static int stbi__convert_row(unsigned char *dest, unsigned char *src, int img_n, int req_comp, unsigned int x)
+{
+   int i;
+   #define STBI__COMBO(a,b)  ((a)*8+(b))
+   #define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
+   // convert source image with img_n components to one with req_comp components;
+   // avoid switch per pixel, so use switch per scanline and massive macros
+   switch (STBI__COMBO(img_n, req_comp)) {
+      STBI__CASE(1,2) { dest[0]=src[0]; dest[1]=255;                                     } break;
+      STBI__CASE(1,3) { dest[0]=dest[1]=dest[2]=src[0];                                  } break;
+      STBI__CASE(1,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=255;                     } break;
+      STBI__CASE(2,1) { dest[0]=src[0];                                                  } break;
+      STBI__CASE(2,3) { dest[0]=dest[1]=dest[2]=src[0];                                  } break;
+      STBI__CASE(2,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=src[1];                  } break;
+      STBI__CASE(3,4) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];dest[3]=255;        } break;
+      STBI__CASE(3,1) { dest[0]=stbi__compute_y(src[0],src[1],src[2]);                   } break;
+      STBI__CASE(3,2) { dest[0]=stbi__compute_y(src[0],src[1],src[2]); dest[1] = 255;    } break;
+      STBI__CASE(4,1) { dest[0]=stbi__compute_y(src[0],src[1],src[2]);                   } break;
+      STBI__CASE(4,2) { dest[0]=stbi__compute_y(src[0],src[1],src[2]); dest[1] = src[3]; } break;
+      STBI__CASE(4,3) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];                    } break;
+      default: return 0;
+   }
+   #undef STBI__CASE
+   #undef STBI__COMBO
+   return 1;
+}
+
 static unsigned char *stbi__convert_format(unsigned char *data, int img_n, int req_comp, unsigned int x, unsigned int y)
 {
-   int i,j;
+   int j;
    unsigned char *good;
 
    if (req_comp == img_n) return data;
@@ -1769,27 +2068,9 @@ static unsigned char *stbi__convert_format(unsigned char *data, int img_n, int r
    for (j=0; j < (int) y; ++j) {
       unsigned char *src  = data + j * x * img_n   ;
       unsigned char *dest = good + j * x * req_comp;
-
-      #define STBI__COMBO(a,b)  ((a)*8+(b))
-      #define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
-      // convert source image with img_n components to one with req_comp components;
-      // avoid switch per pixel, so use switch per scanline and massive macros
-      switch (STBI__COMBO(img_n, req_comp)) {
-         STBI__CASE(1,2) { dest[0]=src[0]; dest[1]=255;                                     } break;
-         STBI__CASE(1,3) { dest[0]=dest[1]=dest[2]=src[0];                                  } break;
-         STBI__CASE(1,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=255;                     } break;
-         STBI__CASE(2,1) { dest[0]=src[0];                                                  } break;
-         STBI__CASE(2,3) { dest[0]=dest[1]=dest[2]=src[0];                                  } break;
-         STBI__CASE(2,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=src[1];                  } break;
-         STBI__CASE(3,4) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];dest[3]=255;        } break;
-         STBI__CASE(3,1) { dest[0]=stbi__compute_y(src[0],src[1],src[2]);                   } break;
-         STBI__CASE(3,2) { dest[0]=stbi__compute_y(src[0],src[1],src[2]); dest[1] = 255;    } break;
-         STBI__CASE(4,1) { dest[0]=stbi__compute_y(src[0],src[1],src[2]);                   } break;
-         STBI__CASE(4,2) { dest[0]=stbi__compute_y(src[0],src[1],src[2]); dest[1] = src[3]; } break;
-         STBI__CASE(4,3) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];                    } break;
-         default: STBI_ASSERT(0); STBI_FREE(data); STBI_FREE(good); return stbi__errpuc("unsupported", "Unsupported format conversion");
+      if (!stbi__convert_row(dest, src, img_n, req_comp, x)) {
+         STBI_ASSERT(0); STBI_FREE(data); STBI_FREE(good); return stbi__errpuc("unsupported", "Unsupported format conversion");
       }
-      #undef STBI__CASE
    }
 
    STBI_FREE(data);
@@ -2704,6 +2985,176 @@ static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64])
 
 #endif // STBI_SSE2
 
+#ifdef STBI_AVX2
+// avx2 integer IDCT. same structure as the sse2 version, but the 32-bit
+// intermediates of all 8 columns fit in one register, which halves the
+// multiply-adds and butterflies. bit-identical to the generic C version.
+static STBI__AVX2_TARGET void stbi__idct_avx2(stbi_uc *out, int out_stride, short data[64])
+{
+   __m128i row0, row1, row2, row3, row4, row5, row6, row7;
+   __m128i tmp;
+
+   // dot product constant: even elems=x, odd elems=y
+   #define dct_const(x,y)  _mm256_setr_epi16((x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y))
+
+   // out(0) = c0[even]*x + c0[odd]*y   (c0, x, y 16-bit, out 32-bit, 8 columns)
+   // out(1) = c1[even]*x + c1[odd]*y
+   #define dct_rot(out0,out1, x,y,c0,c1) \
+      __m256i c0##xy = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_unpacklo_epi16((x),(y))), _mm_unpackhi_epi16((x),(y)), 1); \
+      __m256i out0 = _mm256_madd_epi16(c0##xy, c0); \
+      __m256i out1 = _mm256_madd_epi16(c0##xy, c1)
+
+   // out = in << 12  (in 16-bit, out 32-bit)
+   #define dct_widen(out, in) \
+      __m256i out = _mm256_slli_epi32(_mm256_cvtepi16_epi32(in), 12)
+
+   // wide add / sub
+   #define dct_wadd(out, a, b)  __m256i out = _mm256_add_epi32(a, b)
+   #define dct_wsub(out, a, b)  __m256i out = _mm256_sub_epi32(a, b)
+
+   // 8 x 32-bit -> 8 x 16-bit with signed saturation
+   #define dct_pack(v) _mm_packs_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1))
+
+   // butterfly a/b, add bias, then shift by "s" and pack
+   #define dct_bfly32o(out0, out1, a,b,bias,s) \
+      { \
+         __m256i abiased = _mm256_add_epi32(a, bias); \
+         out0 = dct_pack(_mm256_srai_epi32(_mm256_add_epi32(abiased, b), s)); \
+         out1 = dct_pack(_mm256_srai_epi32(_mm256_sub_epi32(abiased, b), s)); \
+      }
+
+   // 8-bit interleave step (for transposes)
+   #define dct_interleave8(a, b) \
+      tmp = a; \
+      a = _mm_unpacklo_epi8(a, b); \
+      b = _mm_unpackhi_epi8(tmp, b)
+
+   // 16-bit interleave step (for transposes)
+   #define dct_interleave16(a, b) \
+      tmp = a; \
+      a = _mm_unpacklo_epi16(a, b); \
+      b = _mm_unpackhi_epi16(tmp, b)
+
+   #define dct_pass(bias,shift) \
+      { \
+         /* even part */ \
+         dct_rot(t2e,t3e, row2,row6, rot0_0,rot0_1); \
+         __m128i sum04 = _mm_add_epi16(row0, row4); \
+         __m128i dif04 = _mm_sub_epi16(row0, row4); \
+         dct_widen(t0e, sum04); \
+         dct_widen(t1e, dif04); \
+         dct_wadd(x0, t0e, t3e); \
+         dct_wsub(x3, t0e, t3e); \
+         dct_wadd(x1, t1e, t2e); \
+         dct_wsub(x2, t1e, t2e); \
+         /* odd part */ \
+         dct_rot(y0o,y2o, row7,row3, rot2_0,rot2_1); \
+         dct_rot(y1o,y3o, row5,row1, rot3_0,rot3_1); \
+         __m128i sum17 = _mm_add_epi16(row1, row7); \
+         __m128i sum35 = _mm_add_epi16(row3, row5); \
+         dct_rot(y4o,y5o, sum17,sum35, rot1_0,rot1_1); \
+         dct_wadd(x4, y0o, y4o); \
+         dct_wadd(x5, y1o, y5o); \
+         dct_wadd(x6, y2o, y5o); \
+         dct_wadd(x7, y3o, y4o); \
+         dct_bfly32o(row0,row7, x0,x7,bias,shift); \
+         dct_bfly32o(row1,row6, x1,x6,bias,shift); \
+         dct_bfly32o(row2,row5, x2,x5,bias,shift); \
+         dct_bfly32o(row3,row4, x3,x4,bias,shift); \
+      }
+
+   __m256i rot0_0 = dct_const(stbi__f2f(0.5411961f), stbi__f2f(0.5411961f) + stbi__f2f(-1.847759065f));
+   __m256i rot0_1 = dct_const(stbi__f2f(0.5411961f) + stbi__f2f( 0.765366865f), stbi__f2f(0.5411961f));
+   __m256i rot1_0 = dct_const(stbi__f2f(1.175875602f) + stbi__f2f(-0.899976223f), stbi__f2f(1.175875602f));
+   __m256i rot1_1 = dct_const(stbi__f2f(1.175875602f), stbi__f2f(1.175875602f) + stbi__f2f(-2.562915447f));
+   __m256i rot2_0 = dct_const(stbi__f2f(-1.961570560f) + stbi__f2f( 0.298631336f), stbi__f2f(-1.961570560f));
+   __m256i rot2_1 = dct_const(stbi__f2f(-1.961570560f), stbi__f2f(-1.961570560f) + stbi__f2f( 3.072711026f));
+   __m256i rot3_0 = dct_const(stbi__f2f(-0.390180644f) + stbi__f2f( 2.053119869f), stbi__f2f(-0.390180644f));
+   __m256i rot3_1 = dct_const(stbi__f2f(-0.390180644f), stbi__f2f(-0.390180644f) + stbi__f2f( 1.501321110f));
+
+   // rounding biases in column/row passes, see stbi__idct_block for explanation.
+   __m256i bias_0 = _mm256_set1_epi32(512);
+   __m256i bias_1 = _mm256_set1_epi32(65536 + (128<<17));
+
+   // load
+   row0 = _mm_load_si128((const __m128i *) (data + 0*8));
+   row1 = _mm_load_si128((const __m128i *) (data + 1*8));
+   row2 = _mm_load_si128((const __m128i *) (data + 2*8));
+   row3 = _mm_load_si128((const __m128i *) (data + 3*8));
+   row4 = _mm_load_si128((const __m128i *) (data + 4*8));
+   row5 = _mm_load_si128((const __m128i *) (data + 5*8));
+   row6 = _mm_load_si128((const __m128i *) (data + 6*8));
+   row7 = _mm_load_si128((const __m128i *) (data + 7*8));
+
+   // column pass
+   dct_pass(bias_0, 10);
+
+   {
+      // 16bit 8x8 transpose pass 1
+      dct_interleave16(row0, row4);
+      dct_interleave16(row1, row5);
+      dct_interleave16(row2, row6);
+      dct_interleave16(row3, row7);
+
+      // transpose pass 2
+      dct_interleave16(row0, row2);
+      dct_interleave16(row1, row3);
+      dct_interleave16(row4, row6);
+      dct_interleave16(row5, row7);
+
+      // transpose pass 3
+      dct_interleave16(row0, row1);
+      dct_interleave16(row2, row3);
+      dct_interleave16(row4, row5);
+      dct_interleave16(row6, row7);
+   }
+
+   // row pass
+   dct_pass(bias_1, 17);
+
+   {
+      // pack
+      __m128i p0 = _mm_packus_epi16(row0, row1); // a0a1a2a3...a7b0b1b2b3...b7
+      __m128i p1 = _mm_packus_epi16(row2, row3);
+      __m128i p2 = _mm_packus_epi16(row4, row5);
+      __m128i p3 = _mm_packus_epi16(row6, row7);
+
+      // 8bit 8x8 transpose pass 1
+      dct_interleave8(p0, p2); // a0e0a1e1...
+      dct_interleave8(p1, p3); // c0g0c1g1...
+
+      // transpose pass 2
+      dct_interleave8(p0, p1); // a0c0e0g0...
+      dct_interleave8(p2, p3); // b0d0f0h0...
+
+      // transpose pass 3
+      dct_interleave8(p0, p2); // a0b0c0d0...
+      dct_interleave8(p1, p3); // a4b4c4d4...
+
+      // store
+      _mm_storel_epi64((__m128i *) out, p0); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p0, 0x4e)); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, p2); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p2, 0x4e)); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, p1); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p1, 0x4e)); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, p3); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p3, 0x4e));
+   }
+
+#undef dct_const
+#undef dct_rot
+#undef dct_widen
+#undef dct_wadd
+#undef dct_wsub
+#undef dct_pack
+#undef dct_bfly32o
+#undef dct_interleave8
+#undef dct_interleave16
+#undef dct_pass
+}
+#endif // STBI_AVX2
+
 #ifdef STBI_NEON
 
 // NEON integer IDCT. should produce bit-identical
@@ -3070,10 +3521,255 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
    }
 }
 
-static void stbi__jpeg_dequantize(short *data, stbi__uint16 *dequant)
+#ifdef STBI_JPEG_THREADS
+// minimal fork/join: runs func(arg, i) for i in [0, count), index 0 on the
+// calling thread. if a thread can't be started, its index runs on the
+// calling thread afterwards.
+typedef void (*stbi__parallel_func)(void *arg, int index);
+
+typedef struct
 {
-   int i;
-   for (i=0; i < 64; ++i)
+   stbi__parallel_func func;
+   void *arg;
+   int index;
+} stbi__parallel_task;
+
+#ifdef _WIN32
+static DWORD WINAPI stbi__parallel_entry(LPVOID param)
+{
+   stbi__parallel_task *t = (stbi__parallel_task *) param;
+   t->func(t->arg, t->index);
+   return 0;
+}
+#else
+static void *stbi__parallel_entry(void *param)
+{
+   stbi__parallel_task *t = (stbi__parallel_task *) param;
+   t->func(t->arg, t->index);
+   return NULL;
+}
+#endif
+
+static void stbi__parallel_for(int count, stbi__parallel_func func, void *arg)
+{
+   stbi__parallel_task task[STBI__MAX_THREADS];
+   int started[STBI__MAX_THREADS];
+#ifdef _WIN32
+   HANDLE thread[STBI__MAX_THREADS];
+#else
+   pthread_t thread[STBI__MAX_THREADS];
+#endif
+   int i;
+   STBI_ASSERT(count <= STBI__MAX_THREADS);
+   for (i=1; i < count; ++i) {
+      task[i].func = func;
+      task[i].arg = arg;
+      task[i].index = i;
+#ifdef _WIN32
+      thread[i] = CreateThread(NULL, 0, stbi__parallel_entry, &task[i], 0, NULL);
+      started[i] = thread[i] != NULL;
+#else
+      started[i] = pthread_create(&thread[i], NULL, stbi__parallel_entry, &task[i]) == 0;
+#endif
+   }
+   func(arg, 0);
+   for (i=1; i < count; ++i) {
+      if (started[i]) {
+#ifdef _WIN32
+         WaitForSingleObject(thread[i], INFINITE);
+         CloseHandle(thread[i]);
+#else
+         pthread_join(thread[i], NULL);
+#endif
+      } else {
+         func(arg, i);
+      }
+   }
+}
+
+// decode MCUs [first, end) of a baseline scan in the same block order as
+// stbi__parse_entropy_coded_data; the caller handles restart intervals
+static int stbi__jpeg_decode_mcu_range(stbi__jpeg *z, int first, int end)
+{
+   STBI_SIMD_ALIGN(short, data[64]);
+   int m,k,x,y;
+   for (m=first; m < end; ++m) {
+      if (z->scan_n == 1) {
+         int n = z->order[0];
+         int w = (z->img_comp[n].x+7) >> 3;
+         int i = m % w, j = m / w;
+         int ha = z->img_comp[n].ha;
+         if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+         z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
+      } else {
+         int i = m % z->img_mcu_x, j = m / z->img_mcu_x;
+         for (k=0; k < z->scan_n; ++k) {
+            int n = z->order[k];
+            for (y=0; y < z->img_comp[n].v; ++y) {
+               for (x=0; x < z->img_comp[n].h; ++x) {
+                  int x2 = (i*z->img_comp[n].h + x)*8;
+                  int y2 = (j*z->img_comp[n].v + y)*8;
+                  int ha = z->img_comp[n].ha;
+                  if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+                  z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data);
+               }
+            }
+         }
+      }
+   }
+   return 1;
+}
+
+typedef struct
+{
+   stbi__jpeg *z;
+   stbi_uc const *data;   // entropy-coded data of the scan, including the marker that ends it
+   int *segment;          // offset of each restart interval in data, segment[segment_count] = end
+   int segment_count;
+   int mcu_count;
+   int thread_count;
+   int ok[STBI__MAX_THREADS];
+} stbi__jpeg_scan_job;
+
+static void stbi__jpeg_scan_worker(void *arg, int index)
+{
+   stbi__jpeg_scan_job *job = (stbi__jpeg_scan_job *) arg;
+   // private decoder state: bit buffer, DC predictors and the input position
+   stbi__jpeg *local = (stbi__jpeg *) stbi__malloc(sizeof(stbi__jpeg));
+   stbi__context s;
+   int k;
+   job->ok[index] = local != NULL;
+   if (!local) return;
+   memcpy(local, job->z, sizeof(stbi__jpeg));
+   local->s = &s;
+   // segments are dealt round-robin; all but the last are restart_interval MCUs
+   for (k=index; k < job->segment_count; k += job->thread_count) {
+      int first = k * job->z->restart_interval;
+      int end = first + job->z->restart_interval;
+      if (end > job->mcu_count) end = job->mcu_count;
+      stbi__start_mem(&s, job->data + job->segment[k], job->segment[k+1] - job->segment[k]);
+      stbi__jpeg_reset(local);
+      if (!stbi__jpeg_decode_mcu_range(local, first, end)) { job->ok[index] = 0; break; }
+      // the serial decoder ends the scan early when an interval is not
+      // followed by its RSTn; leave such data to it
+      if (k+1 < job->segment_count) {
+         if (local->code_bits < 24) stbi__grow_buffer_unsafe(local);
+         if (!STBI__RESTART(local->marker)) { job->ok[index] = 0; break; }
+      }
+   }
+   STBI_FREE(local);
+}
+
+// scans entropy-coded data for the marker that ends it (not a stuffed 0xff00,
+// fill byte or RSTn). records the offset just past each RSTn in restart[] (up
+// to max_restarts) and returns the length up to and including the end marker.
+static int stbi__jpeg_index_scan(stbi_uc const *data, int n, int *restart, int max_restarts, int *restart_count, stbi_uc *marker)
+{
+   int i = 0, count = 0;
+   *marker = STBI__MARKER_none;
+   while (i < n) {
+      if (data[i++] != 0xff) continue;
+      while (i < n && data[i] == 0xff) ++i; // fill bytes
+      if (i == n) break;
+      if (data[i] == 0) { ++i; continue; }  // stuffed 0xff
+      if (STBI__RESTART(data[i])) {
+         if (count < max_restarts) restart[count] = i + 1;
+         ++count;
+         ++i;
+         continue;
+      }
+      *marker = data[i];
+      ++i;
+      break;
+   }
+   *restart_count = count;
+   return i;
+}
+
+// stbi__parse_entropy_coded_data, but for baseline scans with restart markers
+// the independent segments between them are decoded on several threads
+static int stbi__parse_entropy_coded_data_threaded(stbi__jpeg *z)
+{
+   stbi__context *source = z->s, mem;
+   stbi__jpeg_scan_job job;
+   stbi_uc *copy = NULL;
+   stbi_uc const *data;
+   stbi_uc marker;
+   int n, restart_count, i, ok;
+
+   if (stbi__jpeg_thread_count <= 1 || z->progressive || z->restart_interval <= 0)
+      return stbi__parse_entropy_coded_data(z);
+   if (z->scan_n == 1) {
+      int c = z->order[0];
+      job.mcu_count = ((z->img_comp[c].x+7) >> 3) * ((z->img_comp[c].y+7) >> 3);
+   } else {
+      job.mcu_count = z->img_mcu_x * z->img_mcu_y;
+   }
+   job.segment_count = (job.mcu_count + z->restart_interval - 1) / z->restart_interval;
+   if (job.segment_count < 2)
+      return stbi__parse_entropy_coded_data(z);
+
+   // all of the scan's data is needed up front to find the segments
+   if (!source->read_from_callbacks) {
+      data = source->img_buffer;
+      n = (int) (source->img_buffer_end - source->img_buffer);
+   } else {
+      int capacity = 1 << 16, prev_ff = 0;
+      n = 0;
+      copy = (stbi_uc *) stbi__malloc(capacity);
+      if (!copy) return stbi__err("outofmem", "Out of memory");
+      // same end condition as stbi__jpeg_index_scan; stops after the end marker
+      while (source->read_from_callbacks || source->img_buffer < source->img_buffer_end) {
+         stbi_uc c = stbi__get8(source);
+         if (n == capacity) {
+            stbi_uc *grown = (stbi_uc *) STBI_REALLOC_SIZED(copy, capacity, capacity * 2);
+            if (!grown) { STBI_FREE(copy); return stbi__err("outofmem", "Out of memory"); }
+            copy = grown;
+            capacity *= 2;
+         }
+         copy[n++] = c;
+         if (prev_ff && c != 0xff && c != 0 && !STBI__RESTART(c)) break;
+         prev_ff = c == 0xff;
+      }
+      data = copy;
+   }
+
+   job.segment = (int *) stbi__malloc_mad2(job.segment_count + 1, sizeof(int), 0);
+   if (!job.segment) { STBI_FREE(copy); return stbi__err("outofmem", "Out of memory"); }
+   n = stbi__jpeg_index_scan(data, n, job.segment + 1, job.segment_count - 1, &restart_count, &marker);
+   if (!copy) source->img_buffer += n;
+   job.segment[0] = 0;
+   job.segment[job.segment_count] = n;
+
+   ok = 0;
+   if (restart_count == job.segment_count - 1) {
+      job.z = z;
+      job.data = data;
+      job.thread_count = stbi__jpeg_thread_count < job.segment_count ? stbi__jpeg_thread_count : job.segment_count;
+      stbi__parallel_for(job.thread_count, stbi__jpeg_scan_worker, &job);
+      ok = 1;
+      for (i=0; i < job.thread_count; ++i) ok = ok && job.ok[i];
+   }
+   if (!ok) {
+      // unexpected restart markers or a bad segment: decode serially so
+      // corrupt files are handled exactly like in the single-threaded path
+      // (pixels past the point where it gives up are unspecified in both)
+      stbi__start_mem(&mem, data, n);
+      z->s = &mem;
+      ok = stbi__parse_entropy_coded_data(z);
+      z->s = source;
+   }
+   z->marker = marker;
+   STBI_FREE(job.segment);
+   STBI_FREE(copy);
+   return ok;
+}
+#endif // STBI_JPEG_THREADS
+
+static void stbi__jpeg_dequantize(short *data, stbi__uint16 *dequant)
+{
+   int i;
+   for (i=0; i < 64; ++i)
       data[i] *= dequant[i];
 }
 
@@ -3422,7 +4118,11 @@ static int stbi__decode_jpeg_image(stbi__jpeg *j)
    while (!stbi__EOI(m)) {
       if (stbi__SOS(m)) {
          if (!stbi__process_scan_header(j)) return 0;
+#ifdef STBI_JPEG_THREADS
+         if (!stbi__parse_entropy_coded_data_threaded(j)) return 0;
+#else
          if (!stbi__parse_entropy_coded_data(j)) return 0;
+#endif
          if (j->marker == STBI__MARKER_none ) {
          j->marker = stbi__skip_jpeg_junk_at_end(j);
             // if we reach eof without hitting a marker, stbi__get_marker() below will fail and we'll eventually return 0
@@ -3643,6 +4343,76 @@ static stbi_uc *stbi__resample_row_hv_2_simd(stbi_uc *out, stbi_uc *in_near, stb
 }
 #endif
 
+#ifdef STBI_AVX2
+// same filter as stbi__resample_row_hv_2_simd, 16 input pixels per iteration
+static STBI__AVX2_TARGET stbi_uc *stbi__resample_row_hv_2_avx2(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs)
+{
+   // need to generate 2x2 samples for every one in input
+   int i=0,t0,t1;
+
+   if (w == 1) {
+      out[0] = out[1] = stbi__div4(3*in_near[0] + in_far[0] + 2);
+      return out;
+   }
+
+   t1 = 3*in_near[0] + in_far[0];
+   // process groups of 16 pixels for as long as we can, leaving the
+   // last pixel in a row for the boundary code below.
+   for (; i < ((w-1) & ~15); i += 16) {
+      // vertical filtering pass: 3*x + y = 4*x + (y - x)
+      __m256i farw  = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) (in_far + i)));
+      __m256i nearw = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) (in_near + i)));
+      __m256i diff  = _mm256_sub_epi16(farw, nearw);
+      __m256i nears = _mm256_slli_epi16(nearw, 2);
+      __m256i curr  = _mm256_add_epi16(nears, diff); // current row
+
+      // "prev"/"next" are the current row shifted by one pixel. byte shifts
+      // only work within 128-bit lanes, so the neighbouring lane is brought
+      // in with a permute and stitched on with alignr.
+      __m256i lo0  = _mm256_permute2x128_si256(curr, curr, 0x08); // (zero, curr.lo)
+      __m256i hi0  = _mm256_permute2x128_si256(curr, curr, 0x81); // (curr.hi, zero)
+      __m256i prev = _mm256_insert_epi16(_mm256_alignr_epi8(curr, lo0, 14), t1, 0);
+      __m256i next = _mm256_insert_epi16(_mm256_alignr_epi8(hi0, curr, 2), 3*in_near[i+16] + in_far[i+16], 15);
+
+      // horizontal filter, polyphase:
+      // even pixels = 3*cur + prev = cur*4 + (prev - cur)
+      // odd  pixels = 3*cur + next = cur*4 + (next - cur)
+      __m256i bias = _mm256_set1_epi16(8);
+      __m256i curs = _mm256_slli_epi16(curr, 2);
+      __m256i prvd = _mm256_sub_epi16(prev, curr);
+      __m256i nxtd = _mm256_sub_epi16(next, curr);
+      __m256i curb = _mm256_add_epi16(curs, bias);
+      __m256i even = _mm256_add_epi16(prvd, curb);
+      __m256i odd  = _mm256_add_epi16(nxtd, curb);
+
+      // interleave even and odd pixels, undo scaling; per lane this yields
+      // output pixels 0-15 (low lane) and 16-31 (high lane) in order.
+      __m256i de0  = _mm256_srli_epi16(_mm256_unpacklo_epi16(even, odd), 4);
+      __m256i de1  = _mm256_srli_epi16(_mm256_unpackhi_epi16(even, odd), 4);
+      _mm256_storeu_si256((__m256i *) (out + i*2), _mm256_packus_epi16(de0, de1));
+
+      // "previous" value for next iter
+      t1 = 3*in_near[i+15] + in_far[i+15];
+   }
+
+   t0 = t1;
+   t1 = 3*in_near[i] + in_far[i];
+   out[i*2] = stbi__div16(3*t1 + t0 + 8);
+
+   for (++i; i < w; ++i) {
+      t0 = t1;
+      t1 = 3*in_near[i]+in_far[i];
+      out[i*2-1] = stbi__div16(3*t0 + t1 + 8);
+      out[i*2  ] = stbi__div16(3*t1 + t0 + 8);
+   }
+   out[w*2-1] = stbi__div4(t1+2);
+
+   STBI_NOTUSED(hs);
+
+   return out;
+}
+#endif
+
 static stbi_uc *stbi__resample_row_generic(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs)
 {
    // resample with nearest-neighbor
@@ -3677,7 +4447,7 @@ static void stbi__YCbCr_to_RGB_row(stbi_uc *out, const stbi_uc *y, const stbi_uc
       out[0] = (stbi_uc)r;
       out[1] = (stbi_uc)g;
       out[2] = (stbi_uc)b;
-      out[3] = 255;
+      if (step == 4) out[3] = 255;
       out += step;
    }
 }
@@ -3811,7 +4581,111 @@ static void stbi__YCbCr_to_RGB_simd(stbi_uc *out, stbi_uc const *y, stbi_uc cons
       out[0] = (stbi_uc)r;
       out[1] = (stbi_uc)g;
       out[2] = (stbi_uc)b;
-      out[3] = 255;
+      if (step == 4) out[3] = 255;
+      out += step;
+   }
+}
+#endif
+
+#ifdef STBI_AVX2
+// avx2 color conversion: 16 pixels per iteration with the fixed-point math of
+// stbi__YCbCr_to_RGB_simd. unlike the sse2 path this also covers step == 3,
+// which is what loading a color JPEG with 0 or 3 requested components uses.
+static STBI__AVX2_TARGET void stbi__YCbCr_to_RGB_avx2(stbi_uc *out, stbi_uc const *y, stbi_uc const *pcb, stbi_uc const *pcr, int count, int step)
+{
+   int i = 0;
+
+   if (step == 3 || step == 4) {
+      // a step == 3 iteration stores 4 bytes past its 16 pixels (see below),
+      // so it stops while at least 2 more pixels remain to overwrite them.
+      int end = (step == 4) ? count - 16 : count - 18;
+      __m128i signflip  = _mm_set1_epi8(-0x80);
+      __m256i cr_const0 = _mm256_set1_epi16(   (short) ( 1.40200f*4096.0f+0.5f));
+      __m256i cr_const1 = _mm256_set1_epi16( - (short) ( 0.71414f*4096.0f+0.5f));
+      __m256i cb_const0 = _mm256_set1_epi16( - (short) ( 0.34414f*4096.0f+0.5f));
+      __m256i cb_const1 = _mm256_set1_epi16(   (short) ( 1.77200f*4096.0f+0.5f));
+      __m256i y_bias = _mm256_set1_epi16(8); // ((y << 8) + 128) >> 4, as in the sse2 path
+      __m256i xw = _mm256_set1_epi16(255); // alpha channel
+      // per 128-bit lane: RGBX RGBX RGBX RGBX -> RGBRGBRGBRGB + 4 unused bytes
+      __m256i rgb_pack = _mm256_setr_epi8(0,1,2,4,5,6,8,9,10,12,13,14,-1,-1,-1,-1,
+                                          0,1,2,4,5,6,8,9,10,12,13,14,-1,-1,-1,-1);
+
+      for (; i <= end; i += 16) {
+         // load
+         __m128i y_bytes  = _mm_loadu_si128((__m128i *) (y+i));
+         __m128i cr_bytes = _mm_loadu_si128((__m128i *) (pcr+i));
+         __m128i cb_bytes = _mm_loadu_si128((__m128i *) (pcb+i));
+         __m128i cr_biased = _mm_xor_si128(cr_bytes, signflip); // -128
+         __m128i cb_biased = _mm_xor_si128(cb_bytes, signflip); // -128
+
+         // widen to short (and left-shift cr, cb by 8)
+         __m256i yws = _mm256_add_epi16(_mm256_slli_epi16(_mm256_cvtepu8_epi16(y_bytes), 4), y_bias);
+         __m256i crw = _mm256_slli_epi16(_mm256_cvtepi8_epi16(cr_biased), 8);
+         __m256i cbw = _mm256_slli_epi16(_mm256_cvtepi8_epi16(cb_biased), 8);
+
+         // color transform
+         __m256i cr0 = _mm256_mulhi_epi16(cr_const0, crw);
+         __m256i cb0 = _mm256_mulhi_epi16(cb_const0, cbw);
+         __m256i cb1 = _mm256_mulhi_epi16(cbw, cb_const1);
+         __m256i cr1 = _mm256_mulhi_epi16(crw, cr_const1);
+         __m256i rws = _mm256_add_epi16(cr0, yws);
+         __m256i gwt = _mm256_add_epi16(cb0, yws);
+         __m256i bws = _mm256_add_epi16(yws, cb1);
+         __m256i gws = _mm256_add_epi16(gwt, cr1);
+
+         // descale
+         __m256i rw = _mm256_srai_epi16(rws, 4);
+         __m256i bw = _mm256_srai_epi16(bws, 4);
+         __m256i gw = _mm256_srai_epi16(gws, 4);
+
+         // back to byte, set up for transpose (pixels 0-7 in the low lane, 8-15 in the high one)
+         __m256i brb = _mm256_packus_epi16(rw, bw);
+         __m256i gxb = _mm256_packus_epi16(gw, xw);
+
+         // transpose to interleave channels, then put the pixels back in order
+         __m256i t0 = _mm256_unpacklo_epi8(brb, gxb);
+         __m256i t1 = _mm256_unpackhi_epi8(brb, gxb);
+         __m256i o0 = _mm256_unpacklo_epi16(t0, t1); // pixels 0-3 | 8-11
+         __m256i o1 = _mm256_unpackhi_epi16(t0, t1); // pixels 4-7 | 12-15
+         __m256i p0 = _mm256_permute2x128_si256(o0, o1, 0x20); // pixels 0-7
+         __m256i p1 = _mm256_permute2x128_si256(o0, o1, 0x31); // pixels 8-15
+
+         // store
+         if (step == 4) {
+            _mm256_storeu_si256((__m256i *) (out + 0), p0);
+            _mm256_storeu_si256((__m256i *) (out + 32), p1);
+            out += 64;
+         } else {
+            // 12 useful bytes per 16-byte store; each store's tail is overwritten by the next one
+            p0 = _mm256_shuffle_epi8(p0, rgb_pack);
+            p1 = _mm256_shuffle_epi8(p1, rgb_pack);
+            _mm_storeu_si128((__m128i *) (out + 0), _mm256_castsi256_si128(p0));
+            _mm_storeu_si128((__m128i *) (out + 12), _mm256_extracti128_si256(p0, 1));
+            _mm_storeu_si128((__m128i *) (out + 24), _mm256_castsi256_si128(p1));
+            _mm_storeu_si128((__m128i *) (out + 36), _mm256_extracti128_si256(p1, 1));
+            out += 48;
+         }
+      }
+   }
+
+   for (; i < count; ++i) {
+      int y_fixed = (y[i] << 20) + (1<<19); // rounding
+      int r,g,b;
+      int cr = pcr[i] - 128;
+      int cb = pcb[i] - 128;
+      r = y_fixed + cr* stbi__float2fixed(1.40200f);
+      g = y_fixed + cr*-stbi__float2fixed(0.71414f) + ((cb*-stbi__float2fixed(0.34414f)) & 0xffff0000);
+      b = y_fixed                                   +   cb* stbi__float2fixed(1.77200f);
+      r >>= 20;
+      g >>= 20;
+      b >>= 20;
+      if ((unsigned) r > 255) { if (r < 0) r = 0; else r = 255; }
+      if ((unsigned) g > 255) { if (g < 0) g = 0; else g = 255; }
+      if ((unsigned) b > 255) { if (b < 0) b = 0; else b = 255; }
+      out[0] = (stbi_uc)r;
+      out[1] = (stbi_uc)g;
+      out[2] = (stbi_uc)b;
+      if (step == 4) out[3] = 255;
       out += step;
    }
 }
@@ -3825,18 +4699,42 @@ static void stbi__setup_jpeg(stbi__jpeg *j)
    j->resample_row_hv_2_kernel = stbi__resample_row_hv_2;
 
 #ifdef STBI_SSE2
-   if (stbi__sse2_available()) {
+   if (stbi__simd_limit >= STBI_SIMD_SSE2 && stbi__sse2_available()) {
       j->idct_block_kernel = stbi__idct_simd;
       j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_simd;
       j->resample_row_hv_2_kernel = stbi__resample_row_hv_2_simd;
    }
 #endif
 
+#ifdef STBI_AVX2
+   if (stbi__simd_limit >= STBI_SIMD_AVX2 && stbi__avx2_available()) {
+      j->idct_block_kernel = stbi__idct_avx2;
+      j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_avx2;
+      j->resample_row_hv_2_kernel = stbi__resample_row_hv_2_avx2;
+   }
+#endif
+
+#ifdef STBI_NEON
+   if (stbi__simd_limit >= STBI_SIMD_SSE2) {
+      j->idct_block_kernel = stbi__idct_simd;
+      j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_simd;
+      j->resample_row_hv_2_kernel = stbi__resample_row_hv_2_simd;
+   }
+#endif
+}
+
+STBIDEF const char *stbi_jpeg_simd_path(void)
+{
+#ifdef STBI_AVX2
+   if (stbi__simd_limit >= STBI_SIMD_AVX2 && stbi__avx2_available()) return "avx2";
+#endif
+#ifdef STBI_SSE2
+   if (stbi__simd_limit >= STBI_SIMD_SSE2 && stbi__sse2_available()) return "sse2";
+#endif
 #ifdef STBI_NEON
-   j->idct_block_kernel = stbi__idct_simd;
-   j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_simd;
-   j->resample_row_hv_2_kernel = stbi__resample_row_hv_2_simd;
+   if (stbi__simd_limit >= STBI_SIMD_SSE2) return "neon";
 #endif
+   return "scalar";
 }
 
 // clean up the temporary component buffers
@@ -3862,6 +4760,159 @@ static stbi_uc stbi__blinn_8x8(stbi_uc x, stbi_uc y)
    return (stbi_uc) ((t + (t >>8)) >> 8);
 }
 
+// resample and color-convert output rows [j_begin, j_end). res_template is
+// the resampler state at row 0; linebuf[k] are scratch lines of img_x+3 bytes.
+// nothing is written past the end of a row, so rows can go to any position
+// (bottom-up with flip_rows) and bands can't overwrite each other.
+static void stbi__jpeg_convert_rows(stbi__jpeg *z, stbi__resample const *res_template, stbi_uc **linebuf, stbi_uc *output,
+                                    int n, int decode_n, int is_rgb, unsigned int j_begin, unsigned int j_end)
+{
+   stbi__resample res_comp[4];
+   stbi_uc *coutput[4] = { NULL, NULL, NULL, NULL };
+   unsigned int i,j;
+   int k;
+
+   // advance the resamplers to the first row of the band
+   for (k=0; k < decode_n; ++k) {
+      stbi__resample *r = &res_comp[k];
+      *r = res_template[k];
+      for (j=0; j < j_begin; ++j) {
+         if (++r->ystep >= r->vs) {
+            r->ystep = 0;
+            r->line0 = r->line1;
+            if (++r->ypos < z->img_comp[k].y)
+               r->line1 += z->img_comp[k].w2;
+         }
+      }
+   }
+
+   for (j=j_begin; j < j_end; ++j) {
+      stbi_uc *out = stbi__output_row(output, (size_t) n * z->s->img_x, z->s->img_y, j, z->s->flip_rows);
+      for (k=0; k < decode_n; ++k) {
+         stbi__resample *r = &res_comp[k];
+         int y_bot = r->ystep >= (r->vs >> 1);
+         coutput[k] = r->resample(linebuf[k],
+                                  y_bot ? r->line1 : r->line0,
+                                  y_bot ? r->line0 : r->line1,
+                                  r->w_lores, r->hs);
+         if (++r->ystep >= r->vs) {
+            r->ystep = 0;
+            r->line0 = r->line1;
+            if (++r->ypos < z->img_comp[k].y)
+               r->line1 += z->img_comp[k].w2;
+         }
+      }
+      if (n >= 3) {
+         stbi_uc *y = coutput[0];
+         if (z->s->img_n == 3) {
+            if (is_rgb) {
+               for (i=0; i < z->s->img_x; ++i) {
+                  out[0] = y[i];
+                  out[1] = coutput[1][i];
+                  out[2] = coutput[2][i];
+                  if (n == 4) out[3] = 255;
+                  out += n;
+               }
+            } else {
+               z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
+            }
+         } else if (z->s->img_n == 4) {
+            if (z->app14_color_transform == 0) { // CMYK
+               for (i=0; i < z->s->img_x; ++i) {
+                  stbi_uc m = coutput[3][i];
+                  out[0] = stbi__blinn_8x8(coutput[0][i], m);
+                  out[1] = stbi__blinn_8x8(coutput[1][i], m);
+                  out[2] = stbi__blinn_8x8(coutput[2][i], m);
+                  if (n == 4) out[3] = 255;
+                  out += n;
+               }
+            } else if (z->app14_color_transform == 2) { // YCCK
+               z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
+               for (i=0; i < z->s->img_x; ++i) {
+                  stbi_uc m = coutput[3][i];
+                  out[0] = stbi__blinn_8x8(255 - out[0], m);
+                  out[1] = stbi__blinn_8x8(255 - out[1], m);
+                  out[2] = stbi__blinn_8x8(255 - out[2], m);
+                  out += n;
+               }
+            } else { // YCbCr + alpha?  Ignore the fourth channel for now
+               z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
+            }
+         } else
+            for (i=0; i < z->s->img_x; ++i) {
+               out[0] = out[1] = out[2] = y[i];
+               if (n == 4) out[3] = 255;
+               out += n;
+            }
+      } else {
+         if (is_rgb) {
+            if (n == 1)
+               for (i=0; i < z->s->img_x; ++i)
+                  *out++ = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
+            else {
+               for (i=0; i < z->s->img_x; ++i, out += 2) {
+                  out[0] = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
+                  out[1] = 255;
+               }
+            }
+         } else if (z->s->img_n == 4 && z->app14_color_transform == 0) {
+            for (i=0; i < z->s->img_x; ++i) {
+               stbi_uc m = coutput[3][i];
+               stbi_uc r = stbi__blinn_8x8(coutput[0][i], m);
+               stbi_uc g = stbi__blinn_8x8(coutput[1][i], m);
+               stbi_uc b = stbi__blinn_8x8(coutput[2][i], m);
+               out[0] = stbi__compute_y(r, g, b);
+               out[1] = 255;
+               out += n;
+            }
+         } else if (z->s->img_n == 4 && z->app14_color_transform == 2) {
+            for (i=0; i < z->s->img_x; ++i) {
+               out[0] = stbi__blinn_8x8(255 - coutput[0][i], coutput[3][i]);
+               out[1] = 255;
+               out += n;
+            }
+         } else {
+            stbi_uc *y = coutput[0];
+            if (n == 1)
+               for (i=0; i < z->s->img_x; ++i) out[i] = y[i];
+            else
+               for (i=0; i < z->s->img_x; ++i) { *out++ = y[i]; *out++ = 255; }
+         }
+      }
+   }
+}
+
+#ifdef STBI_JPEG_THREADS
+#define STBI__JPEG_MIN_BAND_ROWS 64
+
+typedef struct
+{
+   stbi__jpeg *z;
+   stbi__resample const *res_comp;
+   stbi_uc *output;
+   int n, decode_n, is_rgb, band_count;
+   int ok[STBI__MAX_THREADS];
+} stbi__jpeg_convert_job;
+
+static void stbi__jpeg_convert_worker(void *arg, int index)
+{
+   stbi__jpeg_convert_job *job = (stbi__jpeg_convert_job *) arg;
+   stbi__jpeg *z = job->z;
+   unsigned int j_begin = z->s->img_y * index / job->band_count;
+   unsigned int j_end = z->s->img_y * (index+1) / job->band_count;
+   // per band: its own line buffers
+   size_t line_size = z->s->img_x + 3;
+   stbi_uc *scratch = (stbi_uc *) stbi__malloc(line_size * job->decode_n);
+   stbi_uc *linebuf[4];
+   int k;
+   job->ok[index] = scratch != NULL;
+   if (!scratch) return;
+   for (k=0; k < job->decode_n; ++k) linebuf[k] = scratch + line_size * k;
+   stbi__jpeg_convert_rows(z, job->res_comp, linebuf, job->output, job->n, job->decode_n, job->is_rgb, j_begin, j_end);
+   STBI_FREE(scratch);
+}
+#endif
+
 static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp, int req_comp)
 {
    int n, decode_n, is_rgb;
@@ -3890,9 +4941,7 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
    // resample and color-convert
    {
       int k;
-      unsigned int i,j;
       stbi_uc *output;
-      stbi_uc *coutput[4] = { NULL, NULL, NULL, NULL };
 
       stbi__resample res_comp[4];
 
@@ -3919,103 +4968,32 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
       }
 
       // can't error after this so, this is safe
-      output = (stbi_uc *) stbi__malloc_mad3(n, z->s->img_x, z->s->img_y, 1);
-      if (!output) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
+      output = stbi__output_image(z->s, n, z->s->img_x, z->s->img_y, 0);
+      if (!output) { stbi__cleanup_jpeg(z); return NULL; } // error already set
 
       // now go ahead and resample
-      for (j=0; j < z->s->img_y; ++j) {
-         stbi_uc *out = output + n * z->s->img_x * j;
-         for (k=0; k < decode_n; ++k) {
-            stbi__resample *r = &res_comp[k];
-            int y_bot = r->ystep >= (r->vs >> 1);
-            coutput[k] = r->resample(z->img_comp[k].linebuf,
-                                     y_bot ? r->line1 : r->line0,
-                                     y_bot ? r->line0 : r->line1,
-                                     r->w_lores, r->hs);
-            if (++r->ystep >= r->vs) {
-               r->ystep = 0;
-               r->line0 = r->line1;
-               if (++r->ypos < z->img_comp[k].y)
-                  r->line1 += z->img_comp[k].w2;
-            }
-         }
-         if (n >= 3) {
-            stbi_uc *y = coutput[0];
-            if (z->s->img_n == 3) {
-               if (is_rgb) {
-                  for (i=0; i < z->s->img_x; ++i) {
-                     out[0] = y[i];
-                     out[1] = coutput[1][i];
-                     out[2] = coutput[2][i];
-                     out[3] = 255;
-                     out += n;
-                  }
-               } else {
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-               }
-            } else if (z->s->img_n == 4) {
-               if (z->app14_color_transform == 0) { // CMYK
-                  for (i=0; i < z->s->img_x; ++i) {
-                     stbi_uc m = coutput[3][i];
-                     out[0] = stbi__blinn_8x8(coutput[0][i], m);
-                     out[1] = stbi__blinn_8x8(coutput[1][i], m);
-                     out[2] = stbi__blinn_8x8(coutput[2][i], m);
-                     out[3] = 255;
-                     out += n;
-                  }
-               } else if (z->app14_color_transform == 2) { // YCCK
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-                  for (i=0; i < z->s->img_x; ++i) {
-                     stbi_uc m = coutput[3][i];
-                     out[0] = stbi__blinn_8x8(255 - out[0], m);
-                     out[1] = stbi__blinn_8x8(255 - out[1], m);
-                     out[2] = stbi__blinn_8x8(255 - out[2], m);
-                     out += n;
-                  }
-               } else { // YCbCr + alpha?  Ignore the fourth channel for now
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-               }
-            } else
-               for (i=0; i < z->s->img_x; ++i) {
-                  out[0] = out[1] = out[2] = y[i];
-                  out[3] = 255; // not used if n==3
-                  out += n;
-               }
-         } else {
-            if (is_rgb) {
-               if (n == 1)
-                  for (i=0; i < z->s->img_x; ++i)
-                     *out++ = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
-               else {
-                  for (i=0; i < z->s->img_x; ++i, out += 2) {
-                     out[0] = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
-                     out[1] = 255;
-                  }
-               }
-            } else if (z->s->img_n == 4 && z->app14_color_transform == 0) {
-               for (i=0; i < z->s->img_x; ++i) {
-                  stbi_uc m = coutput[3][i];
-                  stbi_uc r = stbi__blinn_8x8(coutput[0][i], m);
-                  stbi_uc g = stbi__blinn_8x8(coutput[1][i], m);
-                  stbi_uc b = stbi__blinn_8x8(coutput[2][i], m);
-                  out[0] = stbi__compute_y(r, g, b);
-                  out[1] = 255;
-                  out += n;
-               }
-            } else if (z->s->img_n == 4 && z->app14_color_transform == 2) {
-               for (i=0; i < z->s->img_x; ++i) {
-                  out[0] = stbi__blinn_8x8(255 - coutput[0][i], coutput[3][i]);
-                  out[1] = 255;
-                  out += n;
-               }
-            } else {
-               stbi_uc *y = coutput[0];
-               if (n == 1)
-                  for (i=0; i < z->s->img_x; ++i) out[i] = y[i];
-               else
-                  for (i=0; i < z->s->img_x; ++i) { *out++ = y[i]; *out++ = 255; }
-            }
+#ifdef STBI_JPEG_THREADS
+      if (stbi__jpeg_thread_count > 1 && z->s->img_y >= 2 * STBI__JPEG_MIN_BAND_ROWS) {
+         stbi__jpeg_convert_job job;
+         int band;
+         job.z = z;
+         job.res_comp = res_comp;
+         job.output = output;
+         job.n = n;
+         job.decode_n = decode_n;
+         job.is_rgb = is_rgb;
+         job.band_count = (int) (z->s->img_y / STBI__JPEG_MIN_BAND_ROWS);
+         if (job.band_count > stbi__jpeg_thread_count) job.band_count = stbi__jpeg_thread_count;
+         stbi__parallel_for(job.band_count, stbi__jpeg_convert_worker, &job);
+         for (band=0; band < job.band_count; ++band) {
+            if (!job.ok[band]) { stbi__free_output(z->s, output); stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
          }
+      } else
+#endif
+      {
+         stbi_uc *linebuf[4];
+         for (k=0; k < decode_n; ++k) linebuf[k] = z->img_comp[k].linebuf;
+         stbi__jpeg_convert_rows(z, res_comp, linebuf, output, n, decode_n, is_rgb, 0, z->s->img_y);
       }
       stbi__cleanup_jpeg(z);
       *out_x = z->s->img_x;
@@ -4031,10 +5009,10 @@ static void *stbi__jpeg_load(stbi__context *s, int *x, int *y, int *comp, int re
    stbi__jpeg* j = (stbi__jpeg*) stbi__malloc(sizeof(stbi__jpeg));
    if (!j) return stbi__errpuc("outofmem", "Out of memory");
    memset(j, 0, sizeof(stbi__jpeg));
-   STBI_NOTUSED(ri);
    j->s = s;
    stbi__setup_jpeg(j);
    result = load_jpeg_image(j, x,y,comp,req_comp);
+   ri->flipped = s->flip_rows;
    STBI_FREE(j);
    return result;
 }
@@ -4088,7 +5066,11 @@ static int stbi__jpeg_info(stbi__context *s, int *x, int *y, int *comp)
 #ifndef STBI_NO_ZLIB
 
 // fast-way is faster to check than jpeg huffman, but slow way is slower
+#ifdef STBI_FAST_INFLATE
+#define STBI__ZFAST_BITS  11 // also most codes of dynamic tables
+#else
 #define STBI__ZFAST_BITS  9 // accelerate all cases in default tables
+#endif
 #define STBI__ZFAST_MASK  ((1 << STBI__ZFAST_BITS) - 1)
 #define STBI__ZNSYMS 288 // number of symbols in literal/length alphabet
 
@@ -4174,12 +5156,18 @@ static int stbi__zbuild_huffman(stbi__zhuffman *z, const stbi_uc *sizelist, int
 //    we require PNG read all the IDATs and combine them into a single
 //    memory buffer
 
+#ifdef STBI_FAST_INFLATE
+typedef unsigned long long stbi__zbits;
+#else
+typedef stbi__uint32 stbi__zbits;
+#endif
+
 typedef struct
 {
    stbi_uc *zbuffer, *zbuffer_end;
    int num_bits;
    int hit_zeof_once;
-   stbi__uint32 code_buffer;
+   stbi__zbits code_buffer;
 
    char *zout;
    char *zout_start;
@@ -4187,6 +5175,10 @@ typedef struct
    int   z_expandable;
 
    stbi__zhuffman z_length, z_distance;
+#ifdef STBI_FAST_INFLATE
+   // two literals per lookup: lit0 | lit1 << 8 | total code bits << 16, 0 if none
+   stbi__uint32 z_pairs[1 << STBI__ZFAST_BITS];
+#endif
 } stbi__zbuf;
 
 stbi_inline static int stbi__zeof(stbi__zbuf *z)
@@ -4202,11 +5194,11 @@ stbi_inline static stbi_uc stbi__zget8(stbi__zbuf *z)
 static void stbi__fill_bits(stbi__zbuf *z)
 {
    do {
-      if (z->code_buffer >= (1U << z->num_bits)) {
+      if (z->code_buffer >= ((stbi__zbits) 1 << z->num_bits)) {
         z->zbuffer = z->zbuffer_end;  /* treat this as EOF so we fail. */
         return;
       }
-      z->code_buffer |= (unsigned int) stbi__zget8(z) << z->num_bits;
+      z->code_buffer |= (stbi__zbits) stbi__zget8(z) << z->num_bits;
       z->num_bits += 8;
    } while (z->num_bits <= 24);
 }
@@ -4215,7 +5207,7 @@ stbi_inline static unsigned int stbi__zreceive(stbi__zbuf *z, int n)
 {
    unsigned int k;
    if (z->num_bits < n) stbi__fill_bits(z);
-   k = z->code_buffer & ((1 << n) - 1);
+   k = (unsigned int) (z->code_buffer & ((1 << n) - 1));
    z->code_buffer >>= n;
    z->num_bits -= n;
    return k;
@@ -4226,7 +5218,7 @@ static int stbi__zhuffman_decode_slowpath(stbi__zbuf *a, stbi__zhuffman *z)
    int b,s,k;
    // not resolved by fast table, so compute it the slow way
    // use jpeg approach, which requires MSbits at top
-   k = stbi__bit_reverse(a->code_buffer, 16);
+   k = stbi__bit_reverse((int) (a->code_buffer & 0xffff), 16);
    for (s=STBI__ZFAST_BITS+1; ; ++s)
       if (k < z->maxcode[s])
          break;
@@ -4306,11 +5298,181 @@ static const int stbi__zdist_base[32] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129
 static const int stbi__zdist_extra[32] =
 { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
 
+#ifdef STBI_FAST_INFLATE
+#define STBI__ZFAST_MIN_INPUT   16       // two refills of 8 bytes per iteration
+#define STBI__ZFAST_MIN_OUTPUT  (258+16) // longest match plus chunk over-copy
+
+// little-endian 8-byte load for the bit buffer refill
+stbi_inline static stbi__zbits stbi__zload64(const stbi_uc *p)
+{
+#if (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__) || defined(_M_IX86) || defined(_M_X64) || defined(_M_ARM64)
+   stbi__zbits v;
+   memcpy(&v, p, 8);
+   return v;
+#else
+   return (stbi__zbits) p[0]         | ((stbi__zbits) p[1] <<  8) | ((stbi__zbits) p[2] << 16) | ((stbi__zbits) p[3] << 24) |
+         ((stbi__zbits) p[4] << 32) | ((stbi__zbits) p[5] << 40) | ((stbi__zbits) p[6] << 48) | ((stbi__zbits) p[7] << 56);
+#endif
+}
+
+// tops the bit buffer up to 56..63 bits with whole bytes; keeps the bits
+// above num_bits zero like stbi__fill_bits
+#define STBI__ZREFILL(bits, num_bits, in) \
+   do { \
+      int bytes_ = (63 - (num_bits)) >> 3; \
+      (bits) |= (stbi__zload64(in) & (((stbi__zbits) 1 << (bytes_ << 3)) - 1)) << (num_bits); \
+      (in) += bytes_; \
+      (num_bits) += bytes_ << 3; \
+   } while (0)
+
+static void stbi__zbuild_pairs(stbi__zbuf *a)
+{
+   int i;
+   for (i=0; i < (1 << STBI__ZFAST_BITS); ++i) {
+      int b0 = a->z_length.fast[i], b1, s0;
+      a->z_pairs[i] = 0;
+      if (!b0 || (b0 & 511) >= 256) continue;
+      s0 = b0 >> 9;
+      // the second code is read from the bits left after the first one
+      b1 = a->z_length.fast[i >> s0];
+      if (!b1 || (b1 & 511) >= 256 || s0 + (b1 >> 9) > STBI__ZFAST_BITS) continue;
+      a->z_pairs[i] = (stbi__uint32) ((b0 & 255) | ((b1 & 255) << 8) | ((s0 + (b1 >> 9)) << 16));
+   }
+}
+
+// stbi__zhuffman_decode for the wide loop: at least 16 bits are buffered
+stbi_inline static int stbi__zhuffman_decode_wide(stbi__zbuf *a, stbi__zhuffman *z, stbi__zbits *bits, int *num_bits)
+{
+   int b = z->fast[*bits & STBI__ZFAST_MASK];
+   if (b) {
+      int s = b >> 9;
+      *bits >>= s;
+      *num_bits -= s;
+      return b & 511;
+   }
+   a->code_buffer = *bits;
+   a->num_bits = *num_bits;
+   b = stbi__zhuffman_decode_slowpath(a, z);
+   *bits = a->code_buffer;
+   *num_bits = a->num_bits;
+   return b;
+}
+
+// the bulk of a huffman block, while at least STBI__ZFAST_MIN_INPUT input and
+// STBI__ZFAST_MIN_OUTPUT output bytes remain, so refills and match copies need
+// no bounds checks. returns 1 at the end of the block, 0 on error and 2 when
+// the checked loop has to take over near the end of a buffer.
+static int stbi__parse_huffman_block_wide(stbi__zbuf *a)
+{
+   // locals, since stores through zout could alias the fields of a
+   stbi_uc *in = a->zbuffer, *in_end = a->zbuffer_end;
+   char *zout = a->zout, *zout_start = a->zout_start, *zout_end = a->zout_end;
+   const stbi__uint32 *pairs = a->z_pairs;
+   stbi__zbits bits = a->code_buffer;
+   int num_bits = a->num_bits;
+   int result = 2;
+   while (in_end - in >= STBI__ZFAST_MIN_INPUT && zout_end - zout >= STBI__ZFAST_MIN_OUTPUT) {
+      stbi__uint32 pair;
+      stbi_uc *p;
+      int z,len,dist;
+      STBI__ZREFILL(bits, num_bits, in);
+      pair = pairs[bits & STBI__ZFAST_MASK];
+      if (pair) {
+         zout[0] = (char) (pair & 255);
+         zout[1] = (char) ((pair >> 8) & 255);
+         zout += 2;
+         bits >>= pair >> 16;
+         num_bits -= (int) (pair >> 16);
+         continue;
+      }
+      z = stbi__zhuffman_decode_wide(a, &a->z_length, &bits, &num_bits);
+      if (z < 256) {
+         if (z < 0) { result = stbi__err("bad huffman code","Corrupt PNG"); break; }
+         *zout++ = (char) z;
+         continue;
+      }
+      if (z == 256) { result = 1; break; }
+      if (z >= 286) { result = stbi__err("bad huffman code","Corrupt PNG"); break; }
+      // length extra (5) + distance code (15) + distance extra (13) bits
+      STBI__ZREFILL(bits, num_bits, in);
+      z -= 257;
+      len = stbi__zlength_base[z];
+      if (stbi__zlength_extra[z]) {
+         len += (int) (bits & ((1 << stbi__zlength_extra[z]) - 1));
+         bits >>= stbi__zlength_extra[z];
+         num_bits -= stbi__zlength_extra[z];
+      }
+      z = stbi__zhuffman_decode_wide(a, &a->z_distance, &bits, &num_bits);
+      if (z < 0 || z >= 30) { result = stbi__err("bad huffman code","Corrupt PNG"); break; }
+      dist = stbi__zdist_base[z];
+      if (stbi__zdist_extra[z]) {
+         dist += (int) (bits & ((1 << stbi__zdist_extra[z]) - 1));
+         bits >>= stbi__zdist_extra[z];
+         num_bits -= stbi__zdist_extra[z];
+      }
+      if (zout - zout_start < dist) { result = stbi__err("bad dist","Corrupt PNG"); break; }
+      p = (stbi_uc *) (zout - dist);
+      if (dist >= 8) {
+         // chunks never overlap their source; the last one may write up to
+         // 7 bytes past the match, which later output overwrites
+         char *end = zout + len;
+         if (dist >= 16) {
+            do {
+               memcpy(zout, p, 16);
+               zout += 16;
+               p += 16;
+            } while (zout < end);
+         } else {
+            do {
+               memcpy(zout, p, 8);
+               zout += 8;
+               p += 8;
+            } while (zout < end);
+         }
+         zout = end;
+      } else if (dist == 1) {
+         memset(zout, *p, len);
+         zout += len;
+      } else {
+         // short period (e.g. a repeated pixel): 8 bytes of the pattern,
+         // stored at steps of the largest multiple of dist that fits
+         stbi_uc pattern[8];
+         char *end = zout + len;
+         int i, step = 8 - 8 % dist;
+         for (i=0; i < 8; ++i) pattern[i] = p[i % dist];
+         do {
+            memcpy(zout, pattern, 8);
+            zout += step;
+         } while (zout < end);
+         zout = end;
+      }
+   }
+   a->zbuffer = in;
+   a->zout = zout;
+   a->code_buffer = bits;
+   a->num_bits = num_bits;
+   return result;
+}
+#endif // STBI_FAST_INFLATE
+
 static int stbi__parse_huffman_block(stbi__zbuf *a)
 {
    char *zout = a->zout;
+#ifdef STBI_FAST_INFLATE
+   int wide = stbi__fast_inflate;
+#endif
    for(;;) {
-      int z = stbi__zhuffman_decode(a, &a->z_length);
+      int z;
+#ifdef STBI_FAST_INFLATE
+      if (wide && a->zbuffer_end - a->zbuffer >= STBI__ZFAST_MIN_INPUT && a->zout_end - zout >= STBI__ZFAST_MIN_OUTPUT) {
+         int r;
+         a->zout = zout;
+         r = stbi__parse_huffman_block_wide(a);
+         if (r != 2) return r;
+         zout = a->zout;
+      }
+#endif
+      z = stbi__zhuffman_decode(a, &a->z_length);
       if (z < 256) {
          if (z < 0) return stbi__err("bad huffman code","Corrupt PNG"); // error in huffman codes
          if (zout >= a->zout_end) {
@@ -4412,6 +5574,16 @@ static int stbi__parse_uncompressed_block(stbi__zbuf *a)
    int len,nlen,k;
    if (a->num_bits & 7)
       stbi__zreceive(a, a->num_bits & 7); // discard
+#ifdef STBI_FAST_INFLATE
+   // the 64-bit buffer may already hold bytes past the 4-byte header; they
+   // came straight from zbuffer, so hand them back
+   if (a->num_bits > 32) {
+      if (a->hit_zeof_once) return stbi__err("zlib corrupt","Corrupt PNG");
+      a->zbuffer -= (a->num_bits - 32) >> 3;
+      a->code_buffer &= 0xffffffffu;
+      a->num_bits = 32;
+   }
+#endif
    // drain the bit-packed data into header
    k = 0;
    while (a->num_bits > 0) {
@@ -4501,6 +5673,9 @@ static int stbi__parse_zlib(stbi__zbuf *a, int parse_header)
          } else {
             if (!stbi__compute_huffman_codes(a)) return 0;
          }
+#ifdef STBI_FAST_INFLATE
+         if (stbi__fast_inflate) stbi__zbuild_pairs(a);
+#endif
          if (!stbi__parse_huffman_block(a)) return 0;
       }
    } while (!final);
@@ -4632,6 +5807,7 @@ typedef struct
    stbi__context *s;
    stbi_uc *idata, *expanded, *out;
    int depth;
+   int out_direct; // the unfiltered (or de-interlaced) image goes straight to s->out_buffer
 } stbi__png;
 
 
@@ -4667,6 +5843,229 @@ static int stbi__paeth(int a, int b, int c)
    return t1;
 }
 
+#ifdef STBI_SSE2
+// SIMD unfiltering of one row of 8-bit RGB or RGBA pixels (bpp = 3 or 4),
+// bit-exact with the scalar loops in stbi__create_png_image_raw. Sub is a
+// prefix sum over 4 pixels per register; Avg and Paeth depend on the
+// previous output pixel, so they go one pixel per step in vector lanes.
+
+// finishes a Sub row from byte k on; cur[k-bpp] is already final
+static void stbi__png_sub_tail(stbi_uc *cur, stbi_uc const *raw, int k, int nk, int bpp)
+{
+   for (; k < nk; ++k)
+      cur[k] = STBI__BYTECAST(raw[k] + (k >= bpp ? cur[k-bpp] : 0));
+}
+
+static void stbi__png_sub_sse2(stbi_uc *cur, stbi_uc const *raw, int nk, int bpp)
+{
+   __m128i carry = _mm_setzero_si128(); // previous pixel in every pixel slot
+   int k = 0;
+   if (bpp == 4) {
+      for (; k + 16 <= nk; k += 16) {
+         __m128i x = _mm_loadu_si128((__m128i const *) (raw + k));
+         x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+         x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+         x = _mm_add_epi8(x, carry);
+         _mm_storeu_si128((__m128i *) (cur + k), x);
+         carry = _mm_shuffle_epi32(x, 0xff);
+      }
+   } else {
+      // 4 pixels in the low 12 bytes; the top 4 bytes are overwritten by the next step
+      __m128i mask = _mm_cvtsi32_si128(0xffffff);
+      for (; k + 16 <= nk; k += 12) {
+         __m128i x = _mm_loadu_si128((__m128i const *) (raw + k));
+         x = _mm_add_epi8(x, _mm_slli_si128(x, 3));
+         x = _mm_add_epi8(x, _mm_slli_si128(x, 6));
+         x = _mm_add_epi8(x, carry);
+         _mm_storeu_si128((__m128i *) (cur + k), x);
+         carry = _mm_and_si128(_mm_srli_si128(x, 9), mask);
+         carry = _mm_or_si128(carry, _mm_slli_si128(carry, 3));
+         carry = _mm_or_si128(carry, _mm_slli_si128(carry, 6));
+      }
+   }
+   stbi__png_sub_tail(cur, raw, k, nk, bpp);
+}
+
+static void stbi__png_up_sse2(stbi_uc *cur, stbi_uc const *raw, stbi_uc const *prior, int nk)
+{
+   int k = 0;
+   for (; k + 16 <= nk; k += 16) {
+      __m128i x = _mm_loadu_si128((__m128i const *) (raw + k));
+      __m128i b = _mm_loadu_si128((__m128i const *) (prior + k));
+      _mm_storeu_si128((__m128i *) (cur + k), _mm_add_epi8(x, b));
+   }
+   for (; k < nk; ++k)
+      cur[k] = STBI__BYTECAST(raw[k] + prior[k]);
+}
+
+// pixel loads/stores; 4 bytes are used whenever they stay inside the row
+stbi_inline static __m128i stbi__png_load_px(stbi_uc const *p, int n)
+{
+   int v = 0;
+   if (n == 4) memcpy(&v, p, 4);
+   else v = p[0] | (p[1] << 8) | (p[2] << 16);
+   return _mm_cvtsi32_si128(v);
+}
+
+stbi_inline static void stbi__png_store_px(stbi_uc *p, __m128i x, int n)
+{
+   int v = _mm_cvtsi128_si32(x);
+   if (n == 4) memcpy(p, &v, 4);
+   else { p[0] = (stbi_uc) v; p[1] = (stbi_uc) (v >> 8); p[2] = (stbi_uc) (v >> 16); }
+}
+
+// avg = floor((left + up) / 2); prior == NULL is the first row (up = 0)
+static void stbi__png_avg_sse2(stbi_uc *cur, stbi_uc const *raw, stbi_uc const *prior, int nk, int bpp)
+{
+   __m128i a = _mm_setzero_si128(), b = _mm_setzero_si128(), one = _mm_set1_epi8(1);
+   int k, n;
+   for (k=0; k < nk; k += bpp) {
+      __m128i avg;
+      n = k + 4 <= nk ? 4 : bpp;
+      if (prior) b = stbi__png_load_px(prior + k, n);
+      // _mm_avg_epu8 rounds up; take the carried-out low bit back off
+      avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+      a = _mm_add_epi8(stbi__png_load_px(raw + k, n), avg);
+      stbi__png_store_px(cur + k, a, n);
+   }
+}
+
+// Paeth in 16-bit lanes with the spec's tie order (a, then b, then c).
+// with p = a + b - c: pa = |b - c| doesn't depend on the left pixel a, and
+// pc = |a - (2c - b)|, so only a few operations per pixel wait for a
+static void stbi__png_paeth_sse2(stbi_uc *cur, stbi_uc const *raw, stbi_uc const *prior, int nk, int bpp)
+{
+   __m128i zero = _mm_setzero_si128();
+   __m128i a = zero, c = zero; // left and upper-left, widened to 16 bits
+   int k, n;
+   for (k=0; k < nk; k += bpp) {
+      __m128i b, x, pa, pb, pc, d, not_a, not_b, bc, pred;
+      n = k + 4 <= nk ? 4 : bpp;
+      b = _mm_unpacklo_epi8(stbi__png_load_px(prior + k, n), zero);
+      x = _mm_unpacklo_epi8(stbi__png_load_px(raw + k, n), zero);
+      pa = _mm_max_epi16(_mm_sub_epi16(b, c), _mm_sub_epi16(c, b));
+      d = _mm_sub_epi16(_mm_add_epi16(c, c), b);
+      pb = _mm_max_epi16(_mm_sub_epi16(a, c), _mm_sub_epi16(c, a));
+      pc = _mm_max_epi16(_mm_sub_epi16(a, d), _mm_sub_epi16(d, a));
+      not_a = _mm_cmpgt_epi16(pa, _mm_min_epi16(pb, pc));
+      not_b = _mm_cmpgt_epi16(pb, pc);
+      bc = _mm_or_si128(_mm_and_si128(not_b, c), _mm_andnot_si128(not_b, b));
+      pred = _mm_or_si128(_mm_and_si128(not_a, bc), _mm_andnot_si128(not_a, a));
+      a = _mm_add_epi8(x, pred); // wraps within the low byte; the high bytes stay 0
+      stbi__png_store_px(cur + k, _mm_packus_epi16(a, a), n);
+      c = b;
+   }
+}
+#endif // STBI_SSE2
+
+#ifdef STBI_AVX2
+static STBI__AVX2_TARGET void stbi__png_up_avx2(stbi_uc *cur, stbi_uc const *raw, stbi_uc const *prior, int nk)
+{
+   int k = 0;
+   for (; k + 32 <= nk; k += 32) {
+      __m256i x = _mm256_loadu_si256((__m256i const *) (raw + k));
+      __m256i b = _mm256_loadu_si256((__m256i const *) (prior + k));
+      _mm256_storeu_si256((__m256i *) (cur + k), _mm256_add_epi8(x, b));
+   }
+   for (; k < nk; ++k)
+      cur[k] = STBI__BYTECAST(raw[k] + prior[k]);
+}
+
+// 8 RGBA pixels per step: prefix sum in each 128-bit lane, then lane 0's
+// total is added to lane 1
+static STBI__AVX2_TARGET void stbi__png_sub4_avx2(stbi_uc *cur, stbi_uc const *raw, int nk)
+{
+   __m256i carry = _mm256_setzero_si256(), last = _mm256_set1_epi32(7);
+   int k = 0;
+   for (; k + 32 <= nk; k += 32) {
+      __m256i x = _mm256_loadu_si256((__m256i const *) (raw + k));
+      x = _mm256_add_epi8(x, _mm256_slli_si256(x, 4));
+      x = _mm256_add_epi8(x, _mm256_slli_si256(x, 8));
+      x = _mm256_add_epi8(x, _mm256_shuffle_epi32(_mm256_permute2x128_si256(x, x, 0x08), 0xff));
+      x = _mm256_add_epi8(x, carry);
+      _mm256_storeu_si256((__m256i *) (cur + k), x);
+      carry = _mm256_permutevar8x32_epi32(x, last);
+   }
+   stbi__png_sub_tail(cur, raw, k, nk, 4);
+}
+
+// stbi__png_paeth_sse2 with the SSSE3/SSE4.1 instructions AVX2 implies
+// (abs, blend), which shortens the per-pixel chain further
+static STBI__AVX2_TARGET void stbi__png_paeth_avx2(stbi_uc *cur, stbi_uc const *raw, stbi_uc const *prior, int nk, int bpp)
+{
+   __m128i zero = _mm_setzero_si128();
+   __m128i a = zero, c = zero;
+   int k, n;
+   for (k=0; k < nk; k += bpp) {
+      __m128i b, x, pa, pb, pc, d, bc, pred;
+      n = k + 4 <= nk ? 4 : bpp;
+      b = _mm_cvtepu8_epi16(stbi__png_load_px(prior + k, n));
+      x = _mm_cvtepu8_epi16(stbi__png_load_px(raw + k, n));
+      pa = _mm_abs_epi16(_mm_sub_epi16(b, c));
+      d = _mm_sub_epi16(_mm_add_epi16(c, c), b);
+      pb = _mm_abs_epi16(_mm_sub_epi16(a, c));
+      pc = _mm_abs_epi16(_mm_sub_epi16(a, d));
+      bc = _mm_blendv_epi8(b, c, _mm_cmpgt_epi16(pb, pc));
+      pred = _mm_blendv_epi8(a, bc, _mm_cmpgt_epi16(pa, _mm_min_epi16(pb, pc)));
+      a = _mm_add_epi8(x, pred);
+      stbi__png_store_px(cur + k, _mm_packus_epi16(a, a), n);
+      c = b;
+   }
+}
+#endif // STBI_AVX2
+
+#ifdef STBI_SSE2
+static void stbi__png_unfilter_simd(int simd, int filter, stbi_uc *cur, stbi_uc const *raw, stbi_uc const *prior, int nk, int bpp)
+{
+   switch (filter) {
+   case STBI__F_sub:
+#ifdef STBI_AVX2
+      if (simd == STBI_SIMD_AVX2 && bpp == 4) { stbi__png_sub4_avx2(cur, raw, nk); break; }
+#endif
+      stbi__png_sub_sse2(cur, raw, nk, bpp);
+      break;
+   case STBI__F_up:
+#ifdef STBI_AVX2
+      if (simd == STBI_SIMD_AVX2) { stbi__png_up_avx2(cur, raw, prior, nk); break; }
+#endif
+      stbi__png_up_sse2(cur, raw, prior, nk);
+      break;
+   case STBI__F_avg:
+      stbi__png_avg_sse2(cur, raw, prior, nk, bpp);
+      break;
+   case STBI__F_paeth:
+#ifdef STBI_AVX2
+      if (simd == STBI_SIMD_AVX2) { stbi__png_paeth_avx2(cur, raw, prior, nk, bpp); break; }
+#endif
+      stbi__png_paeth_sse2(cur, raw, prior, nk, bpp);
+      break;
+   case STBI__F_avg_first:
+      stbi__png_avg_sse2(cur, raw, NULL, nk, bpp);
+      break;
+   }
+   STBI_NOTUSED(simd);
+}
+#endif
+
+// SIMD level for unfiltering 8-bit rows with filter_bytes per pixel: 0 = scalar
+static int stbi__png_simd_level(int filter_bytes)
+{
+   if (filter_bytes != 3 && filter_bytes != 4) return 0;
+#ifdef STBI_AVX2
+   if (stbi__simd_limit >= STBI_SIMD_AVX2 && stbi__avx2_available()) return STBI_SIMD_AVX2;
+#endif
+#ifdef STBI_SSE2
+   if (stbi__simd_limit >= STBI_SIMD_SSE2 && stbi__sse2_available()) return STBI_SIMD_SSE2;
+#endif
+   return 0;
+}
+
+STBIDEF const char *stbi_png_simd_path(void)
+{
+   int level = stbi__png_simd_level(4);
+   return level == STBI_SIMD_AVX2 ? "avx2" : level == STBI_SIMD_SSE2 ? "sse2" : "scalar";
+}
+
 static const stbi_uc stbi__depth_scale_table[9] = { 0, 0xff, 0x55, 0, 0x11, 0,0,0, 0x01 };
 
 // adds an extra all-255 alpha channel
@@ -4693,7 +6092,9 @@ static void stbi__create_png_alpha_expand8(stbi_uc *dest, stbi_uc *src, stbi__ui
 }
 
 // create the png data from post-deflated data
-static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 raw_len, int out_n, stbi__uint32 x, stbi__uint32 y, int depth, int color)
+// whole_image: this is the final image rather than an interlace pass, so its
+// rows may go bottom-up and into the caller's buffer
+static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 raw_len, int out_n, stbi__uint32 x, stbi__uint32 y, int depth, int color, int whole_image)
 {
    int bytes = (depth == 16 ? 2 : 1);
    stbi__context *s = a->s;
@@ -4707,10 +6108,19 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
    int output_bytes = out_n*bytes;
    int filter_bytes = img_n*bytes;
    int width = x;
-
-   STBI_ASSERT(out_n == s->img_n || out_n == s->img_n+1);
-   a->out = (stbi_uc *) stbi__malloc_mad3(x, y, output_bytes, 0); // extra bytes to write off the end into
-   if (!a->out) return stbi__err("outofmem", "Out of memory");
+   int simd = depth == 8 ? stbi__png_simd_level(filter_bytes) : 0;
+   int flip = whole_image && s->flip_rows;
+
+   // 8-bit rows may also be converted to any channel count while they're copied out
+   STBI_ASSERT(out_n == s->img_n || out_n == s->img_n+1 || depth == 8);
+   STBI_NOTUSED(simd); // without STBI_SSE2 every row takes the scalar loops
+   if (whole_image && a->out_direct) {
+      a->out = stbi__output_image(s, x, y, output_bytes, 0);
+      if (!a->out) return 0; // error already set
+   } else {
+      a->out = (stbi_uc *) stbi__malloc_mad3(x, y, output_bytes, 0); // extra bytes to write off the end into
+      if (!a->out) return stbi__err("outofmem", "Out of memory");
+   }
 
    // note: error exits here don't need to clean up a->out individually,
    // stbi__do_png always does on error.
@@ -4738,7 +6148,7 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
       // cur/prior filter buffers alternate
       stbi_uc *cur = filter_buf + (j & 1)*img_width_bytes;
       stbi_uc *prior = filter_buf + (~j & 1)*img_width_bytes;
-      stbi_uc *dest = a->out + stride*j;
+      stbi_uc *dest = stbi__output_row(a->out, stride, y, j, flip);
       int nk = width * filter_bytes;
       int filter = *raw++;
 
@@ -4751,6 +6161,11 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
       // if first row, use special filter that doesn't sample previous row
       if (j == 0) filter = first_row_filter[filter];
 
+#ifdef STBI_SSE2
+      if (simd && filter != STBI__F_none)
+         stbi__png_unfilter_simd(simd, filter, cur, raw, prior, nk, filter_bytes);
+      else
+#endif
       // perform actual filtering
       switch (filter) {
       case STBI__F_none:
@@ -4822,8 +6237,12 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
       } else if (depth == 8) {
          if (img_n == out_n)
             memcpy(dest, cur, x*img_n);
-         else
+         else if (out_n == img_n+1 && img_n != 2)
             stbi__create_png_alpha_expand8(dest, cur, x, img_n);
+         else if (!stbi__convert_row(dest, cur, img_n, out_n, x)) {
+            all_ok = stbi__err("unsupported", "Unsupported format conversion");
+            break;
+         }
       } else if (depth == 16) {
          // convert the image data from big-endian to platform-native
          stbi__uint16 *dest16 = (stbi__uint16*)dest;
@@ -4865,11 +6284,16 @@ static int stbi__create_png_image(stbi__png *a, stbi_uc *image_data, stbi__uint3
    stbi_uc *final;
    int p;
    if (!interlaced)
-      return stbi__create_png_image_raw(a, image_data, image_data_len, out_n, a->s->img_x, a->s->img_y, depth, color);
+      return stbi__create_png_image_raw(a, image_data, image_data_len, out_n, a->s->img_x, a->s->img_y, depth, color, 1);
 
    // de-interlacing
-   final = (stbi_uc *) stbi__malloc_mad3(a->s->img_x, a->s->img_y, out_bytes, 0);
-   if (!final) return stbi__err("outofmem", "Out of memory");
+   if (a->out_direct) {
+      final = stbi__output_image(a->s, a->s->img_x, a->s->img_y, out_bytes, 0);
+      if (!final) return 0; // error already set
+   } else {
+      final = (stbi_uc *) stbi__malloc_mad3(a->s->img_x, a->s->img_y, out_bytes, 0);
+      if (!final) return stbi__err("outofmem", "Out of memory");
+   }
    for (p=0; p < 7; ++p) {
       int xorig[] = { 0,4,0,2,0,1,0 };
       int yorig[] = { 0,0,4,0,2,0,1 };
@@ -4881,13 +6305,14 @@ static int stbi__create_png_image(stbi__png *a, stbi_uc *image_data, stbi__uint3
       y = (a->s->img_y - yorig[p] + yspc[p]-1) / yspc[p];
       if (x && y) {
          stbi__uint32 img_len = ((((a->s->img_n * x * depth) + 7) >> 3) + 1) * y;
-         if (!stbi__create_png_image_raw(a, image_data, image_data_len, out_n, x, y, depth, color)) {
-            STBI_FREE(final);
+         if (!stbi__create_png_image_raw(a, image_data, image_data_len, out_n, x, y, depth, color, 0)) {
+            stbi__free_output(a->s, final);
             return 0;
          }
          for (j=0; j < y; ++j) {
             for (i=0; i < x; ++i) {
                int out_y = j*yspc[p]+yorig[p];
+               if (a->s->flip_rows) out_y = a->s->img_y - 1 - out_y;
                int out_x = i*xspc[p]+xorig[p];
                memcpy(final + out_y*a->s->img_x*out_bytes + out_x*out_bytes,
                       a->out + (j*x+i)*out_bytes, out_bytes);
@@ -4953,13 +6378,19 @@ static int stbi__compute_transparency16(stbi__png *z, stbi__uint16 tc[3], int ou
    return 1;
 }
 
-static int stbi__expand_png_palette(stbi__png *a, stbi_uc *palette, int len, int pal_img_n)
+// direct: the expanded image is the final one and goes to the caller's buffer
+static int stbi__expand_png_palette(stbi__png *a, stbi_uc *palette, int len, int pal_img_n, int direct)
 {
    stbi__uint32 i, pixel_count = a->s->img_x * a->s->img_y;
    stbi_uc *p, *temp_out, *orig = a->out;
 
-   p = (stbi_uc *) stbi__malloc_mad2(pixel_count, pal_img_n, 0);
-   if (p == NULL) return stbi__err("outofmem", "Out of memory");
+   if (direct) {
+      p = stbi__output_image(a->s, a->s->img_x, a->s->img_y, pal_img_n, 0);
+      if (p == NULL) return 0; // error already set
+   } else {
+      p = (stbi_uc *) stbi__malloc_mad2(pixel_count, pal_img_n, 0);
+      if (p == NULL) return stbi__err("outofmem", "Out of memory");
+   }
 
    // between here and free(out) below, exitting would leak
    temp_out = p;
@@ -5087,6 +6518,7 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
    z->expanded = NULL;
    z->idata = NULL;
    z->out = NULL;
+   z->out_direct = 0;
 
    if (!stbi__check_png_header(s)) return 0;
 
@@ -5198,6 +6630,7 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
 
          case STBI__PNG_TYPE('I','E','N','D'): {
             stbi__uint32 raw_len, bpl;
+            int final_n, direct;
             if (first) return stbi__err("first not IHDR", "Corrupt PNG");
             if (scan != STBI__SCAN_load) return 1;
             if (z->idata == NULL) return stbi__err("no IDAT","Corrupt PNG");
@@ -5209,8 +6642,15 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
             STBI_FREE(z->idata); z->idata = NULL;
             if ((req_comp == s->img_n+1 && req_comp != 3 && !pal_img_n) || has_trans)
                s->img_out_n = s->img_n+1;
+            else if (req_comp && z->depth == 8 && !pal_img_n && !(is_iphone && stbi__de_iphone_flag))
+               s->img_out_n = req_comp; // convert while unfiltering, not in a second pass
             else
                s->img_out_n = s->img_n;
+            // the caller's buffer can take the image from the step that produces the
+            // final format: palette expansion, or unfiltering if there's no palette
+            final_n = pal_img_n ? (req_comp >= 3 ? req_comp : pal_img_n) : s->img_out_n;
+            direct = s->out_buffer && z->depth != 16 && (req_comp == 0 || req_comp == final_n);
+            z->out_direct = direct && !pal_img_n;
             if (!stbi__create_png_image(z, z->expanded, raw_len, s->img_out_n, z->depth, color, interlace)) return 0;
             if (has_trans) {
                if (z->depth == 16) {
@@ -5226,7 +6666,7 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
                s->img_n = pal_img_n; // record the actual colors we had
                s->img_out_n = pal_img_n;
                if (req_comp >= 3) s->img_out_n = req_comp;
-               if (!stbi__expand_png_palette(z, palette, pal_len, s->img_out_n))
+               if (!stbi__expand_png_palette(z, palette, pal_len, s->img_out_n, direct))
                   return 0;
             } else if (has_trans) {
                // non-paletted image with tRNS -> source image has (constant) alpha
@@ -5284,8 +6724,9 @@ static void *stbi__do_png(stbi__png *p, int *x, int *y, int *n, int req_comp, st
       *x = p->s->img_x;
       *y = p->s->img_y;
       if (n) *n = p->s->img_n;
+      ri->flipped = p->s->flip_rows;
    }
-   STBI_FREE(p->out);      p->out      = NULL;
+   stbi__free_output(p->s, p->out); p->out = NULL;
    STBI_FREE(p->expanded); p->expanded = NULL;
    STBI_FREE(p->idata);    p->idata    = NULL;
 
@@ -5536,13 +6977,14 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
    int psize=0,i,j,width;
    int flip_vertically, pad, target;
    stbi__bmp_data info;
-   STBI_NOTUSED(ri);
 
    info.all_a = 255;
    if (stbi__bmp_parse_header(s, &info) == NULL)
       return NULL; // error code already set
 
-   flip_vertically = ((int) s->img_y) > 0;
+   // bottom-up files already are in flipped order
+   flip_vertically = (((int) s->img_y) > 0) != s->flip_rows;
+   ri->flipped = s->flip_rows;
    s->img_y = abs((int) s->img_y);
 
    if (s->img_y > STBI_MAX_DIMENSIONS) return stbi__errpuc("too large","Very large image (corrupt?)");
@@ -5894,7 +7336,6 @@ static void *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req
    int RLE_count = 0;
    int RLE_repeating = 0;
    int read_next_pixel = 1;
-   STBI_NOTUSED(ri);
    STBI_NOTUSED(tga_x_origin); // @TODO
    STBI_NOTUSED(tga_y_origin); // @TODO
 
@@ -5908,6 +7349,9 @@ static void *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req
       tga_is_RLE = 1;
    }
    tga_inverted = 1 - ((tga_inverted >> 5) & 1);
+   // the requested flip just cancels or adds the file's own
+   tga_inverted ^= s->flip_rows;
+   ri->flipped = s->flip_rows;
 
    //   If I'm paletted, then I'll use the number of bits from the palette
    if ( tga_indexed ) tga_comp = stbi__tga_get_comp(tga_palette_bits, 0, &tga_rgb16);